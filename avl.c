@@ -23,26 +23,59 @@
 #include "avl.h"
 
 #include <stdlib.h>     /* for malloc(), free() */
-#include <stdint.h>     /* for int8_t */
+#include <stdint.h>     /* for int16_t */
 #include <stdbool.h>    /* for bool */
+#include <string.h>     /* for memset() */
+#include <errno.h>      /* for errno, EINTR */
+#include <unistd.h>     /* for read(), write(), pread(), pwrite() */
+#include <sys/mman.h>   /* for mmap(), munmap() */
+#include <sys/stat.h>   /* for fstat() */
+#include <sys/wait.h>   /* for waitpid() */
+#ifdef __GLIBC__
+#include <malloc.h>     /* for malloc_usable_size() */
+#endif
+#ifdef RUMATI_AVL_THREADS
+#include <pthread.h>    /* for pthread_create(), pthread_join() */
+#endif
+#ifdef RUMATI_AVL_USDT
+/* each probe gets a semaphore, counting the tracers attached to it */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>    /* for DTRACE_PROBE*() */
+#endif
 
 /*
- * The maximum height for this tree. This is the maximum height a tree can be
- * BEFORE balancing. Make this 1 more than the worst case height for the amount
- * of nodes you want. For perfectly balanced trees, the tree will hold
- * (2^(RUMATI_AVL_MAX_HEIGHT - 1)) - 1 nodes. Add one for AVL imbalance
- * tolerance. RUMATI_AVL_MAX_HEIGHT 40 will hold all the nodes 1 terbyte of ram
- * can handle.
- *
- * Also, for each rumati_avl_put() and rumati_avl_delete() operation, a stack
- * allocation of about RUMATI_AVL_MAX_HEIGHT * 8 will be made. For small values
- * this is fine (you can afford ~300 bytes, trust me), but if you make
- * RUMATI_AVL_MAX_HEIGHT something stupid like 102400, dont be surprised if
- * you waste some memory. Think about it: each node takes about 12-16 bytes
- * of ram before your data, say 20 bytes conservatively. Does your computer
- * really have ((2^RUMATI_AVL_MAX_HEIGHT)-1)*20 bytes of RAM? Didn't think so.
+ * The maximum height of an AVL tree. The single pass AVL updates record the
+ * directions taken down the tree in a bitmask of this many bits. An AVL tree
+ * of height h holds at least F(h + 2) - 1 nodes, where F(n) is the n'th
+ * Fibonacci number, so a tree of height 128 would need about 10^27 nodes,
+ * far more than fit in a 64 bit address space. The height of an AVL tree
+ * can therefore never reach this limit.
+ */
+#define RUMATI_AVL_MAX_HEIGHT   128
+
+/*
+ * The number of nodes a path recorded by weak AVL, red-black or relaxed mode
+ * updates can hold without allocating memory. Each level costs a pointer and
+ * a bit of stack. Weak AVL and red-black trees are at most 2 * log2(n) high,
+ * so this covers the worst case for trees of up to 16 million nodes, and the
+ * typical case for much larger ones. Longer paths are moved to the heap.
+ */
+#ifndef RUMATI_AVL_PATH_INLINE
+#define RUMATI_AVL_PATH_INLINE  48
+#endif
+
+/*
+ * Colours stored in the balance field of nodes in red-black trees.
+ */
+#define RUMATI_AVL_BLACK        0
+#define RUMATI_AVL_RED          1
+
+/*
+ * Flags stored in the flags field of nodes.
  */
-#define RUMATI_AVL_MAX_HEIGHT   40
+#define RUMATI_AVL_NODE_TOMBSTONE   0x01    /* deleted, see lazy delete */
+#define RUMATI_AVL_NODE_DIRTY       0x02    /* under a relaxed mode update */
+#define RUMATI_AVL_NODE_NEW         0x04    /* not in the last snapshot */
 
 /*
  * Tree type
@@ -56,6 +89,113 @@ struct rumati_avl_tree {
      * User provided pointer
      */
     void *udata;
+    /*
+     * Balancing scheme, selects how the balance field of the nodes is
+     * interpreted and how the tree is rebalanced after updates.
+     */
+    RUMATI_AVL_BALANCE balance;
+    /*
+     * true if the tree is in relaxed mode, see rumati_avl_set_relaxed().
+     */
+    bool relaxed;
+    /*
+     * true if relaxed mode updates have been made since the last call to
+     * rumati_avl_rebalance(), so balance fields are stale.
+     */
+    bool unbalanced;
+    /*
+     * Destructor for the values of tombstones, or NULL if lazy delete is
+     * off. See rumati_avl_set_lazy_delete().
+     */
+    RUMATI_AVL_NODE_DESTRUCTOR lazy_destructor;
+    /*
+     * Percentage of nodes which may be tombstones before they are purged
+     * automatically, or 0 to only purge them in rumati_avl_purge().
+     */
+    unsigned int purge_percent;
+    /*
+     * Number of nodes in the tree, including tombstones
+     */
+    size_t size;
+    /*
+     * Number of tombstones in the tree
+     */
+    size_t tombstones;
+    /*
+     * Hash function for the lookup cache, or NULL if there is no cache. See
+     * rumati_avl_set_cache().
+     */
+    RUMATI_AVL_HASH cache_hash;
+    /*
+     * Lookup cache, cache_mask + 1 slots each holding the node last found by
+     * rumati_avl_get() for a key hashing to the slot, or NULL.
+     */
+    struct rumati_avl_node **cache;
+    size_t cache_mask;
+    /*
+     * Hash function for the hash index, or NULL if there is no index. See
+     * rumati_avl_set_index().
+     */
+    RUMATI_AVL_HASH index_hash;
+    /*
+     * Hash index, an open addressing table of index_mask + 1 entries, with
+     * linear probing. Holds an entry for every node in the tree, including
+     * tombstones, and is kept at most half full.
+     */
+    struct rumati_avl_index_entry *index;
+    size_t index_mask;
+    size_t index_count;
+    /*
+     * Hash function for the negative lookup filter, or NULL if there is no
+     * filter. See rumati_avl_set_filter().
+     */
+    RUMATI_AVL_HASH filter_hash;
+    /*
+     * Counting Bloom filter, filter_mask + 1 counters, of which
+     * filter_probes are incremented for each node. Counters which reach
+     * UINT8_MAX stick there, since the count they lost is unknown.
+     */
+    uint8_t *filter;
+    size_t filter_mask;
+    unsigned int filter_probes;
+    /*
+     * Lookups which reached the filter, and the ones it rejected, and the
+     * ones it let through which found no entry.
+     */
+    size_t filter_lookups;
+    size_t filter_rejected;
+    size_t filter_false_positives;
+    /*
+     * Operation counters, only updated when built with
+     * RUMATI_AVL_COUNTERS. See rumati_avl_get_stats().
+     */
+    RUMATI_AVL_STATS stats;
+    /*
+     * Mapping of the image file holding the tree's nodes and values, or
+     * NULL. See rumati_avl_open_image().
+     */
+    void *image;
+    size_t image_size;
+    /*
+     * true if rumati_avl_track_changes() has been called, and the number of
+     * snapshots and deltas written since. Nodes changed since the last one
+     * have this generation.
+     */
+    bool track_changes;
+    uint32_t generation;
+    /*
+     * The number of entries of the last snapshot removed just before each
+     * changed node since, in an open addressing table kept at most half
+     * full, and the number removed after the last node. removed_lost is set
+     * if the table could not grow. See rumati_avl_removed_add().
+     */
+    struct rumati_avl_removed_entry *removed;
+    size_t removed_mask;
+    size_t removed_count;
+    size_t removed_last;
+    bool removed_lost;
+    /* the number of entries in the last snapshot */
+    size_t snapshot_size;
     /*
      * Root node in tree, NULL initially
      */
@@ -81,8 +221,26 @@ struct rumati_avl_node {
      * that one subtree may not be more than one layer higher than the other
      * subtree. However, during double rotations, it is possible for the first
      * node to have a balance >= +2 or <= -2.
+     *
+     * Trees using RUMATI_AVL_BALANCE_WAVL store the rank of the node here
+     * instead (0 for leaves, missing children have rank -1), and trees using
+     * RUMATI_AVL_BALANCE_RB store the colour of the node, RUMATI_AVL_RED or
+     * RUMATI_AVL_BLACK.
+     *
+     * 16 bits wide, so that ranks, which grow to twice the height of the
+     * tree, cannot wrap however deep it is, while still sharing the padding
+     * before data with flags and generation.
      */
-    int8_t balance;
+    int16_t balance;
+    /*
+     * RUMATI_AVL_NODE_* flags. Shares the padding after balance.
+     */
+    uint8_t flags;
+    /*
+     * The tree's generation when the node's data or flags last changed, see
+     * rumati_avl_track_changes(). Shares the padding before data.
+     */
+    uint32_t generation;
     /*
      * The data held by this node.
      */
@@ -90,34 +248,236 @@ struct rumati_avl_node {
 };
 
 /*
- * A structure representing an update needing to happen on the balance of a
- * node beneath which a change (insert or delete) has been made.
+ * An entry in the table of removed entries counts. Empty entries have a NULL
+ * node.
  */
-struct rumati_avl_update {
-    /*
-     * A pointer to the pointer to the node. We need pointer to pointer
-     * because the pointer to the node needs to be updated when we rotate
-     * the node to rebalance it.
-     */
-    struct rumati_avl_node **node_ptr;
-    /*
-     * A boolean indicating if the inserted/deleted node is in the left subtree
-     * of the node, or not. If false, the inserted/deleted node is in the right
-     * subtree.
-     */
-    bool left;
+struct rumati_avl_removed_entry {
+    struct rumati_avl_node *node;
+    size_t count;
+};
+
+/*
+ * An entry in the hash index. Empty entries have a NULL node.
+ */
+struct rumati_avl_index_entry {
+    /* the hash of the node's data, so probes rarely call the comparator */
+    size_t hash;
+    struct rumati_avl_node *node;
+};
+
+/*
+ * A path taken down the tree by weak AVL and red-black updates, recording
+ * every node on the path and the direction taken at each of them, so that
+ * balance can be restored walking back up.
+ */
+struct rumati_avl_path {
+    /* the link to the first node of the path, ie. the tree's root link */
+    struct rumati_avl_node **root;
+    /* the number of nodes on the path */
+    unsigned int depth;
+    /* the number of nodes node and left can hold */
+    unsigned int capacity;
+    /* the nodes on the path, either inline_node, or a heap allocation */
+    struct rumati_avl_node **node;
+    /* bit n is set if the path goes left at node n, same storage as node */
+    uint64_t *left;
+    /* storage for paths of up to RUMATI_AVL_PATH_INLINE nodes */
+    struct rumati_avl_node *inline_node[RUMATI_AVL_PATH_INLINE];
+    uint64_t inline_left[(RUMATI_AVL_PATH_INLINE + 63) / 64];
 };
 
 /*
- * A list of updates, representing a path taken down the tree.
+ * A path taken down the tree, recorded as one bit per level. Used by the
+ * single pass AVL updates, which only need to know the way down from one
+ * node, not the nodes themselves.
  */
-struct rumati_avl_update_list {
-    /* the number of updates in the list */
-    unsigned int number_of_updates;
-    /* an array holding the updates */
-    struct rumati_avl_update update[RUMATI_AVL_MAX_HEIGHT];
+struct rumati_avl_directions {
+    /* the number of levels recorded */
+    unsigned int count;
+    /* bit n is set if the path goes left at level n */
+    uint64_t left[(RUMATI_AVL_MAX_HEIGHT + 63) / 64];
 };
 
+/*
+ * rumati_avl_link() - returns the node a child link of a node of the tree
+ * leads to, or NULL. Nodes of an image hold the offsets of their children
+ * from the start of its mapping, see rumati_avl_open_image(), which the
+ * address of the mapping is added to here. Other trees hold pointers, and
+ * have no mapping to add. Every read of a link by code which may run on an
+ * image goes through this. The test for NULL merges with the one ending a
+ * descent, so a step down costs one add more than following a pointer.
+ */
+static struct rumati_avl_node *rumati_avl_link(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *link)
+{
+    return link == NULL ? NULL : (struct rumati_avl_node *)
+            ((uintptr_t)link + (uintptr_t)tree->image);
+}
+
+/*
+ * rumati_avl_data() - returns the data of a node of the tree. The data of
+ * a node of an image is an offset from the start of its mapping, as links
+ * are, and is never 0.
+ */
+static void *rumati_avl_data(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n)
+{
+    return (void *)((uintptr_t)n->data + (uintptr_t)tree->image);
+}
+
+/*
+ * rumati_avl_prefetch_node() - starts loading the data of the node a descent
+ * has just reached, and both its children, into the cache, before the node
+ * is compared. Only one of the children is needed, but by the time the
+ * comparison has decided which, a tree much larger than the cache would
+ * have missed on both. Only the node's own fields are read, which the
+ * descent needs anyway, so no load here waits on memory; the data of the
+ * child taken is prefetched when the descent reaches it.
+ *
+ * Only built with RUMATI_AVL_PREFETCH defined, and only with compilers which
+ * have __builtin_prefetch().
+ */
+#if defined(RUMATI_AVL_PREFETCH) && defined(__GNUC__)
+static void rumati_avl_prefetch_node(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n)
+{
+    __builtin_prefetch(rumati_avl_data(tree, n));
+    if (n->left != NULL){
+        __builtin_prefetch(rumati_avl_link(tree, n->left));
+    }
+    if (n->right != NULL){
+        __builtin_prefetch(rumati_avl_link(tree, n->right));
+    }
+}
+#else
+#define rumati_avl_prefetch_node(tree, n)  ((void)0)
+#endif
+
+/*
+ * RUMATI_AVL_LOAD() and RUMATI_AVL_STORE() - relaxed atomic loads and stores,
+ * for the few fields rumati_avl_get() writes, so that concurrent gets on a
+ * shared tree do not race. They compile to plain moves, so counts kept with
+ * them may lose increments made at the same time.
+ */
+#ifdef __GNUC__
+#define RUMATI_AVL_LOAD(x)      __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define RUMATI_AVL_STORE(x, v)  __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#else
+#define RUMATI_AVL_LOAD(x)      (x)
+#define RUMATI_AVL_STORE(x, v)  ((x) = (v))
+#endif
+
+/*
+ * RUMATI_AVL_COUNT() - adds to one of the operation counters of a tree, and
+ * RUMATI_AVL_COUNT_MAX() raises one to a new high, when built with
+ * RUMATI_AVL_COUNTERS. Otherwise they compile to nothing.
+ *
+ * Updates are relaxed atomic loads and stores rather than read-modify-write
+ * operations, so they are as cheap as plain increments, and only risk losing
+ * a count when readers of a shared tree (such as concurrent gets) race.
+ */
+#ifdef RUMATI_AVL_COUNTERS
+#define RUMATI_AVL_COUNT(tree, field, n) \
+        RUMATI_AVL_STORE((tree)->stats.field, \
+                RUMATI_AVL_LOAD((tree)->stats.field) + (n))
+#define RUMATI_AVL_COUNT_MAX(tree, field, v) \
+        do { \
+            if ((v) > RUMATI_AVL_LOAD((tree)->stats.field)){ \
+                RUMATI_AVL_STORE((tree)->stats.field, (v)); \
+            } \
+        } while (0)
+#else
+#define RUMATI_AVL_COUNT(tree, field, n)        ((void)(tree))
+#define RUMATI_AVL_COUNT_MAX(tree, field, v)    ((void)(tree))
+#endif
+
+/*
+ * RUMATI_AVL_PROBE*() - static tracepoints, when built with RUMATI_AVL_USDT.
+ * Each is a single nop instruction, noted in the .note.stapsdt section of
+ * the binary, until a tracer such as bpftrace or perf attaches to it. The
+ * probes of provider rumati_avl are:
+ *
+ *      put__entry      tree, value
+ *      put__return     tree, error, depth, comparisons
+ *      get__entry      tree, key
+ *      get__return     tree, value found or NULL, depth, comparisons
+ *      delete__entry   tree, key
+ *      delete__return  tree, error, depth, comparisons
+ *      rotate          tree, kind: "insert_single", "insert_double",
+ *                      "delete_single" or "delete_double"
+ *
+ * depth is the depth of the node found, added or deleted, or of the empty
+ * link where a search for a missing key ended (the root has depth 0), and
+ * comparisons is the number of comparator calls the operation made. Both
+ * are counted in local variables by each operation, so the probes do not
+ * need RUMATI_AVL_COUNTERS. A get answered by the hash index, filter or
+ * lookup cache has depth 0. For example:
+ *
+ *      bpftrace -e 'usdt:./prog:rumati_avl:get__return
+ *              { @depth = hist(arg2); }'
+ *
+ * RUMATI_AVL_PROBE_ENABLED() is true while a tracer is attached to a probe,
+ * so that arguments which cost anything are only worked out when someone
+ * is listening.
+ *
+ * Otherwise the probes compile to nothing.
+ */
+#ifdef RUMATI_AVL_USDT
+#define RUMATI_AVL_PROBE_SEMAPHORE(name) \
+        volatile unsigned short rumati_avl_##name##_semaphore \
+        __attribute__((unused, section(".probes")))
+#define RUMATI_AVL_PROBE_ENABLED(name) \
+        __builtin_expect(rumati_avl_##name##_semaphore != 0, 0)
+#define RUMATI_AVL_PROBE2(name, a, b) \
+        DTRACE_PROBE2(rumati_avl, name, a, b)
+#define RUMATI_AVL_PROBE4(name, a, b, c, d) \
+        DTRACE_PROBE4(rumati_avl, name, a, b, c, d)
+
+RUMATI_AVL_PROBE_SEMAPHORE(put__entry);
+RUMATI_AVL_PROBE_SEMAPHORE(put__return);
+RUMATI_AVL_PROBE_SEMAPHORE(get__entry);
+RUMATI_AVL_PROBE_SEMAPHORE(get__return);
+RUMATI_AVL_PROBE_SEMAPHORE(delete__entry);
+RUMATI_AVL_PROBE_SEMAPHORE(delete__return);
+RUMATI_AVL_PROBE_SEMAPHORE(rotate);
+#else
+#define RUMATI_AVL_PROBE_ENABLED(name)          0
+#define RUMATI_AVL_PROBE2(name, a, b)           ((void)(a), (void)(b))
+#define RUMATI_AVL_PROBE4(name, a, b, c, d) \
+        ((void)(a), (void)(b), (void)(c), (void)(d))
+#endif
+
+/*
+ * RUMATI_AVL_ROTATION() - counts a rotation, and fires the rotate probe.
+ * kind is one of insert_single, insert_double, delete_single and
+ * delete_double.
+ */
+#define RUMATI_AVL_ROTATION(tree, kind) \
+        do { \
+            RUMATI_AVL_COUNT(tree, kind##_rotations, 1); \
+            RUMATI_AVL_PROBE2(rotate, tree, #kind); \
+        } while (0)
+
+/*
+ * rumati_avl_compare() - compares a key with the data of a node, as every
+ * step of a descent down the tree does.
+ *
+ * Returns:
+ *      The tree's comparator's result for key and the node's data.
+ */
+static int rumati_avl_compare(
+        RUMATI_AVL_TREE *tree,
+        void *key,
+        struct rumati_avl_node *n)
+{
+    rumati_avl_prefetch_node(tree, n);
+    RUMATI_AVL_COUNT(tree, comparisons, 1);
+    return tree->comparator(tree->udata, key, rumati_avl_data(tree, n));
+}
+
 /*
  * rumati_avl_new() - creates a new AVL tree.
  *
@@ -138,6 +498,35 @@ RUMATI_AVL_ERROR rumati_avl_new(
         RUMATI_AVL_TREE **tree,
         RUMATI_AVL_COMPARATOR comparator,
         void *udata)
+{
+    return rumati_avl_new_balanced(tree, comparator, udata,
+            RUMATI_AVL_BALANCE_AVL);
+}
+
+/*
+ * rumati_avl_new_balanced() - creates a new tree using the given balancing
+ * scheme.
+ *
+ * Parameters:
+ *      tree -  a pointer to a pointer to an AVL tree. This will be populated
+ *              with a pointer to the new tree if create successfully.
+ *      comparator -    a function that compares node values, for sorting.
+ *      udata - a user defined pointer to be passed to the comparator and
+ *              other user callback functions.
+ *      balance -   the balancing scheme to use for the tree.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success
+ *      RUMATI_AVL_EINVAL   If comparator is NULL, tree is NULL, or balance is
+ *                          not a known balancing scheme.
+ *      RUMATI_AVL_ENOMEM   If there was a memory allocation error.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_new_balanced(
+        RUMATI_AVL_TREE **tree,
+        RUMATI_AVL_COMPARATOR comparator,
+        void *udata,
+        RUMATI_AVL_BALANCE balance)
 {
     RUMATI_AVL_TREE *retv;
 
@@ -150,6 +539,12 @@ RUMATI_AVL_ERROR rumati_avl_new(
         return RUMATI_AVL_EINVAL;
     }
 
+    if (balance != RUMATI_AVL_BALANCE_AVL &&
+            balance != RUMATI_AVL_BALANCE_WAVL &&
+            balance != RUMATI_AVL_BALANCE_RB){
+        return RUMATI_AVL_EINVAL;
+    }
+
     retv = malloc(sizeof(*retv));
     if (retv == NULL){
         return RUMATI_AVL_ENOMEM;
@@ -157,6 +552,38 @@ RUMATI_AVL_ERROR rumati_avl_new(
 
     retv->comparator = comparator;
     retv->udata = udata;
+    retv->balance = balance;
+    retv->relaxed = false;
+    retv->unbalanced = false;
+    retv->lazy_destructor = NULL;
+    retv->purge_percent = 0;
+    retv->size = 0;
+    retv->tombstones = 0;
+    retv->cache_hash = NULL;
+    retv->cache = NULL;
+    retv->cache_mask = 0;
+    retv->index_hash = NULL;
+    retv->index = NULL;
+    retv->index_mask = 0;
+    retv->index_count = 0;
+    retv->filter_hash = NULL;
+    retv->filter = NULL;
+    retv->filter_mask = 0;
+    retv->filter_probes = 0;
+    retv->filter_lookups = 0;
+    retv->filter_rejected = 0;
+    retv->filter_false_positives = 0;
+    memset(&retv->stats, 0, sizeof(retv->stats));
+    retv->image = NULL;
+    retv->image_size = 0;
+    retv->track_changes = false;
+    retv->generation = 0;
+    retv->removed = NULL;
+    retv->removed_mask = 0;
+    retv->removed_count = 0;
+    retv->removed_last = 0;
+    retv->removed_lost = false;
+    retv->snapshot_size = 0;
     retv->root = NULL;
 
     *tree = retv;
@@ -182,909 +609,5310 @@ static void rumati_avl_destroy_node(
 }
 
 /*
- * rumati_avl_destroy_node_recursive() - recursively destroys a node, and all
- * its children using rumati_avl_node_destroy().
+ * rumati_avl_index_home() - returns the first entry of the hash index to
+ * probe for a hash. The hash is mixed first, since user hashes of integers
+ * or pointers often have poor low bits.
+ */
+static size_t rumati_avl_index_home(RUMATI_AVL_TREE *tree, size_t hash)
+{
+    hash *= (size_t)0x9e3779b97f4a7c15ULL;
+    return (hash ^ (hash >> (sizeof(hash) * 4))) & tree->index_mask;
+}
+
+/*
+ * rumati_avl_index_add() - adds an entry for a node to the hash index, which
+ * must have room for it.
+ */
+static void rumati_avl_index_add(
+        RUMATI_AVL_TREE *tree,
+        size_t hash,
+        struct rumati_avl_node *n)
+{
+    size_t i = rumati_avl_index_home(tree, hash);
+
+    while (tree->index[i].node != NULL){
+        i = (i + 1) & tree->index_mask;
+    }
+    tree->index[i].hash = hash;
+    tree->index[i].node = n;
+    tree->index_count++;
+}
+
+/*
+ * rumati_avl_index_resize() - moves the hash index to a new table.
  *
  * Parameters:
- *      n -     the node to destroy, along with all its children
- *      destructor -    the destrctor to use to destroy the nodes data
- *      udata - the user supplied pointer associated with the tree
+ *      tree -      the tree, which must have an index
+ *      capacity -  the number of entries in the new table, a power of two
+ *
+ * Returns:
+ *      true on success, or false if there was an error allocating memory, in
+ *      which case the index is unchanged.
  */
-static void rumati_avl_destroy_node_recursive (
-        struct rumati_avl_node *n,
-        RUMATI_AVL_NODE_DESTRUCTOR destructor,
-        void *udata)
+static bool rumati_avl_index_resize(RUMATI_AVL_TREE *tree, size_t capacity)
 {
-    if (n->left != NULL){
-        rumati_avl_destroy_node_recursive(n->left, destructor, udata);
+    struct rumati_avl_index_entry *old = tree->index;
+    size_t old_capacity = tree->index_mask + 1;
+    size_t i;
+
+    tree->index = calloc(capacity, sizeof(*tree->index));
+    if (tree->index == NULL){
+        tree->index = old;
+        return false;
     }
-    if (n->right != NULL){
-        rumati_avl_destroy_node_recursive(n->right, destructor, udata);
+    tree->index_mask = capacity - 1;
+    tree->index_count = 0;
+
+    for (i = 0; i < old_capacity; i++){
+        if (old[i].node != NULL){
+            rumati_avl_index_add(tree, old[i].hash, old[i].node);
+        }
     }
-    rumati_avl_destroy_node(n, destructor, udata);
-} 
+    free(old);
+    return true;
+}
 
 /*
- * rumati_avl_clear() - removes all nodes from the tree, using the destructor
- * provided.
- *
- * Parameters:
- *      tree -  the tree to clear
- *      destructor -    the destructor to use when destroying each node's data
+ * rumati_avl_index_find() - returns the hash index entry for a node, which
+ * holds data with the given hash, or NULL if there is none.
  */
-RUMATI_AVL_API
-void rumati_avl_clear(
+static struct rumati_avl_index_entry *rumati_avl_index_find(
         RUMATI_AVL_TREE *tree,
-        RUMATI_AVL_NODE_DESTRUCTOR destructor)
+        size_t hash,
+        struct rumati_avl_node *n)
 {
-    if (tree->root != NULL){
-        rumati_avl_destroy_node_recursive(tree->root, destructor, tree->udata);
+    size_t i = rumati_avl_index_home(tree, hash);
+
+    while (tree->index[i].node != NULL){
+        if (tree->index[i].node == n){
+            return &tree->index[i];
+        }
+        i = (i + 1) & tree->index_mask;
     }
+    return NULL;
 }
 
 /*
- * rumati_avl_destroy() - destroys a tree, freeing all memory used by the tree,
- * and cleanly destrying node data using a destructor.
- * provided.
- *
- * Parameters:
- *      tree -  the tree to destroy
- *      destructor -    the destructor to use when destroying each node's data
+ * rumati_avl_index_remove() - removes the hash index entry for a node, if it
+ * has one. The node's data must still be valid, since it is hashed to find
+ * the entry.
  */
-RUMATI_AVL_API
-void rumati_avl_destroy(
+static void rumati_avl_index_remove(
         RUMATI_AVL_TREE *tree,
-        RUMATI_AVL_NODE_DESTRUCTOR destructor)
+        struct rumati_avl_node *n)
 {
-    rumati_avl_clear(tree, destructor);
-    free(tree);
+    struct rumati_avl_index_entry *e;
+    size_t i, j;
+
+    e = rumati_avl_index_find(tree, tree->index_hash(tree->udata, n->data), n);
+    if (e == NULL){
+        return;
+    }
+
+    /*
+     * Move later entries of the probe sequence back into the hole, unless
+     * their home is after the hole, so that no probe stops short of them.
+     */
+    i = e - tree->index;
+    j = i;
+    while (1){
+        size_t home;
+
+        j = (j + 1) & tree->index_mask;
+        if (tree->index[j].node == NULL){
+            break;
+        }
+        home = rumati_avl_index_home(tree, tree->index[j].hash);
+        if (((j - home) & tree->index_mask) >= ((j - i) & tree->index_mask)){
+            tree->index[i] = tree->index[j];
+            i = j;
+        }
+    }
+    tree->index[i].node = NULL;
+    tree->index_count--;
 }
 
 /*
- * rumati_avl_rotate_right() - rotates a subtree to the right/clock wise
+ * rumati_avl_index_get() - returns the node matching key, found with the
+ * hash index, or NULL if there is none. The node may be a tombstone.
+ */
+static struct rumati_avl_node *rumati_avl_index_get(
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    size_t hash = tree->index_hash(tree->udata, key);
+    size_t i = rumati_avl_index_home(tree, hash);
+
+    while (tree->index[i].node != NULL){
+        struct rumati_avl_node *n = tree->index[i].node;
+
+        if (tree->index[i].hash == hash){
+            RUMATI_AVL_COUNT(tree, comparisons, 1);
+            if (tree->comparator(tree->udata, key,
+                        rumati_avl_data(tree, n)) == 0){
+                return n;
+            }
+        }
+        i = (i + 1) & tree->index_mask;
+    }
+    return NULL;
+}
+
+/*
+ * rumati_avl_filter_update() - adds a key to or removes a key from the
+ * negative lookup filter, which the tree must have.
  *
  * Parameters:
- *      node_ptr -  A pointer to the pointer to the root of this subtree
- *                  this will be updated to point to the new root, after
- *                  rotation.
+ *      tree -  the tree
+ *      key -   the key
+ *      add -   true to add the key, false to remove it
  */
-static void rumati_avl_rotate_right(struct rumati_avl_node **node_ptr)
+static void rumati_avl_filter_update(RUMATI_AVL_TREE *tree, void *key, bool add)
 {
-    /*
-     * In this function, we will rotate a tree clockwise. See the following
-     * diagram:
-     *
-     *      D           B
-     *     / \         / \
-     *    B   E  =>   A   D
-     *   / \             / \
-     *  A   C           C   E
-     *
-     * The tree rooted at D is rotated clockwise so that the new root is B.
-     * D takes the right child of B (ie. C) as its left child, while B takes
-     * D as its right child.
-     */
-    int8_t nrb;
+    size_t hash = tree->filter_hash(tree->udata, key);
+    size_t step;
+    unsigned int i;
 
-    /* keep reference to old root (D) */
-    struct rumati_avl_node *old_root = *node_ptr;
+    /* double hashing, probe i looks at counter hash + i * step */
+    hash *= (size_t)0x9e3779b97f4a7c15ULL;
+    step = (hash >> (sizeof(hash) * 4)) | 1;
+    for (i = 0; i < tree->filter_probes; i++){
+        uint8_t *counter;
 
-    /* make root pointer point to new root, old root (D)'s left child (B) */
-    *node_ptr = old_root->left;
+        counter = &tree->filter[(hash + i * step) & tree->filter_mask];
 
-    /* 
-     * old root (D) inherits new root (B)'s right child (C) as it's left child.
-     * remember, its previous left child (B) is now it's (D's) parent
-     */
-    old_root->left = (*node_ptr)->right;
+        if (*counter != UINT8_MAX){
+            if (add){
+                (*counter)++;
+            }else{
+                (*counter)--;
+            }
+        }
+    }
+}
 
-    /* new root (B)'s right child is the old root (D) */
-    (*node_ptr)->right = old_root;
+/*
+ * rumati_avl_filter_contains() - checks if a key may be in the tree, using
+ * the negative lookup filter, which the tree must have.
+ *
+ * Returns:
+ *      false if the key is certainly not in the tree, or true if it may be.
+ */
+static bool rumati_avl_filter_contains(RUMATI_AVL_TREE *tree, void *key)
+{
+    size_t hash = tree->filter_hash(tree->udata, key);
+    size_t step;
+    unsigned int i;
 
-    /* new root balance pre rotate (balance of B pre-rotate) */
-    nrb = (*node_ptr)->balance;
+    hash *= (size_t)0x9e3779b97f4a7c15ULL;
+    step = (hash >> (sizeof(hash) * 4)) | 1;
+    for (i = 0; i < tree->filter_probes; i++){
+        if (tree->filter[(hash + i * step) & tree->filter_mask] == 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * rumati_avl_removed_home() - returns the first entry of the table of
+ * removed entries counts to probe for a node.
+ */
+static size_t rumati_avl_removed_home(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n)
+{
+    size_t hash = (size_t)(uintptr_t)n;
+
+    hash *= (size_t)0x9e3779b97f4a7c15ULL;
+    return (hash ^ (hash >> (sizeof(hash) * 4))) & tree->removed_mask;
+}
+
+/*
+ * rumati_avl_removed_find() - returns the entry of the table of removed
+ * entries counts for a node, or NULL if there is none.
+ */
+static struct rumati_avl_removed_entry *rumati_avl_removed_find(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n)
+{
+    size_t i;
+
+    if (tree->removed == NULL){
+        return NULL;
+    }
+    i = rumati_avl_removed_home(tree, n);
+    while (tree->removed[i].node != NULL){
+        if (tree->removed[i].node == n){
+            return &tree->removed[i];
+        }
+        i = (i + 1) & tree->removed_mask;
+    }
+    return NULL;
+}
+
+/*
+ * rumati_avl_removed_take() - removes the count of entries removed just
+ * before a node from the table, for a node being removed in turn.
+ *
+ * Returns:
+ *      The count, or 0 if the node had none.
+ */
+static size_t rumati_avl_removed_take(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n)
+{
+    struct rumati_avl_removed_entry *e = rumati_avl_removed_find(tree, n);
+    size_t count;
+    size_t i, j;
+
+    if (e == NULL){
+        return 0;
+    }
+    count = e->count;
+
+    /* see rumati_avl_index_remove() */
+    i = e - tree->removed;
+    j = i;
+    while (1){
+        size_t home;
+
+        j = (j + 1) & tree->removed_mask;
+        if (tree->removed[j].node == NULL){
+            break;
+        }
+        home = rumati_avl_removed_home(tree, tree->removed[j].node);
+        if (((j - home) & tree->removed_mask) >=
+                ((j - i) & tree->removed_mask)){
+            tree->removed[i] = tree->removed[j];
+            i = j;
+        }
+    }
+    tree->removed[i].node = NULL;
+    tree->removed_count--;
+    return count;
+}
+
+/*
+ * rumati_avl_removed_add() - counts entries of the last snapshot removed
+ * just before a node, or after the last node if it is NULL. If the table
+ * cannot grow to hold the node, the count is lost, and the next delta
+ * fails, see rumati_avl_save_delta().
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      n -     the node the entries were removed before, or NULL
+ *      count - the number of entries removed
+ */
+static void rumati_avl_removed_add(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n,
+        size_t count)
+{
+    struct rumati_avl_removed_entry *e;
+    size_t i;
+
+    if (count == 0){
+        return;
+    }
+    if (n == NULL){
+        tree->removed_last += count;
+        return;
+    }
+    e = rumati_avl_removed_find(tree, n);
+    if (e != NULL){
+        e->count += count;
+        return;
+    }
+
+    if ((tree->removed_count + 1) * 2 > tree->removed_mask + 1 ||
+            tree->removed == NULL){
+        struct rumati_avl_removed_entry *old = tree->removed;
+        size_t old_capacity = old == NULL ? 0 : tree->removed_mask + 1;
+        size_t capacity = old == NULL ? 16 : old_capacity * 2;
+
+        tree->removed = calloc(capacity, sizeof(*tree->removed));
+        if (tree->removed == NULL){
+            tree->removed = old;
+            tree->removed_lost = true;
+            return;
+        }
+        tree->removed_mask = capacity - 1;
+        for (i = 0; i < old_capacity; i++){
+            if (old[i].node != NULL){
+                size_t j = rumati_avl_removed_home(tree, old[i].node);
+
+                while (tree->removed[j].node != NULL){
+                    j = (j + 1) & tree->removed_mask;
+                }
+                tree->removed[j] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    i = rumati_avl_removed_home(tree, n);
+    while (tree->removed[i].node != NULL){
+        i = (i + 1) & tree->removed_mask;
+    }
+    tree->removed[i].node = n;
+    tree->removed[i].count = count;
+    tree->removed_count++;
+}
+
+/*
+ * rumati_avl_in_snapshot() - returns true if the entry a node held when the
+ * last snapshot or delta was written is in it. Nodes that have not changed
+ * since are in it unless they are tombstones, and rumati_avl_touch()
+ * records the same for nodes that have.
+ */
+static bool rumati_avl_in_snapshot(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n)
+{
+    if (n->generation != tree->generation){
+        return !(n->flags & RUMATI_AVL_NODE_TOMBSTONE);
+    }
+    return !(n->flags & RUMATI_AVL_NODE_NEW);
+}
+
+/*
+ * rumati_avl_touch() - marks a node changed since the last snapshot or
+ * delta, before its data or flags change.
+ */
+static void rumati_avl_touch(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n)
+{
+    if (n->generation != tree->generation){
+        if (n->flags & RUMATI_AVL_NODE_TOMBSTONE){
+            n->flags |= RUMATI_AVL_NODE_NEW;
+        }else{
+            n->flags &= ~RUMATI_AVL_NODE_NEW;
+        }
+        n->generation = tree->generation;
+    }
+}
+
+/*
+ * rumati_avl_next_generation() - starts a new generation, once a snapshot
+ * or delta holding the tree as it is now has been written. No node has
+ * changed since, and no entry has been removed.
+ */
+static void rumati_avl_next_generation(RUMATI_AVL_TREE *tree)
+{
+    tree->generation++;
+    free(tree->removed);
+    tree->removed = NULL;
+    tree->removed_mask = 0;
+    tree->removed_count = 0;
+    tree->removed_last = 0;
+    tree->removed_lost = false;
+    tree->snapshot_size = tree->size - tree->tombstones;
+}
+
+/*
+ * rumati_avl_new_node() - allocates a new leaf node for a tree.
+ *
+ * Parameters:
+ *      tree -      the tree the node is for
+ *      object -    the data for the node
+ *
+ * Returns:
+ *      The new node, or NULL if there was an error allocating memory.
+ */
+static struct rumati_avl_node *rumati_avl_new_node(
+        RUMATI_AVL_TREE *tree,
+        void *object)
+{
+    struct rumati_avl_node *n;
 
+    /* make room for the node in the hash index first, it is easy to undo */
+    if (tree->index != NULL &&
+            (tree->index_count + 1) * 2 > tree->index_mask + 1 &&
+            !rumati_avl_index_resize(tree, (tree->index_mask + 1) * 2)){
+        return NULL;
+    }
+
+    n = malloc(sizeof(*n));
+    if (n == NULL){
+        return NULL;
+    }
+    RUMATI_AVL_COUNT(tree, allocations, 1);
+    if (tree->index != NULL){
+        rumati_avl_index_add(tree, tree->index_hash(tree->udata, object), n);
+    }
+    if (tree->filter != NULL){
+        rumati_avl_filter_update(tree, object, true);
+    }
+    n->left = NULL;
+    n->right = NULL;
     /*
-     * Now, we increment the balance of the old root (D), ie. Make it heavier
-     * by one on the right side. This is not because the right side became
-     * heavier, but because the left side became lighter.
-     *
-     * Proof:
-     *      Situation 1, trees rooted at A and C are of equal height (balance
-     *      of B is 0), or tree C is heavier than tree A (balance of B is > 0):
-     *          The left tree of D has lost a layer by D adopting its granchild
-     *          (C) in place of B. So, A's left tree is one layer lighter.
-     *      Situation 2, tree rooted at A is heavier than tree rooted at C
-     *      (balance of B is < 0):
-     *          The rule for Situation 1 still applies, because D has still
-     *          adopted its granchild C, thereby losing a layer. Additionally
-     *          D is lighter on the left side by the amount that tree A is
-     *          heavier than tree C, since D is no longer an ancestor of tree
-     *          A. We know the difference in height between tree A and tree C,
-     *          it is the balance of node B.
+     * New leaves have a balance of 0 in AVL trees and a rank of 0 in weak AVL
+     * trees. In red-black trees they are red.
      */
-    old_root->balance++;
-    if (nrb < 0){
+    n->balance = 0;
+    if (tree->balance == RUMATI_AVL_BALANCE_RB){
+        n->balance = RUMATI_AVL_RED;
+    }
+    n->flags = RUMATI_AVL_NODE_NEW;
+    n->generation = tree->generation;
+    n->data = object;
+    tree->size++;
+    return n;
+}
+
+/*
+ * rumati_avl_cache_slot() - returns the lookup cache slot for a key. The tree
+ * must have a cache.
+ */
+static struct rumati_avl_node **rumati_avl_cache_slot(
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    return &tree->cache[tree->cache_hash(tree->udata, key) & tree->cache_mask];
+}
+
+/*
+ * rumati_avl_free_node() - frees a node which has been unlinked from a tree.
+ * The node's data is not destroyed, and must still be valid, since it is
+ * used to find the node's lookup cache slot and hash index entry.
+ */
+static void rumati_avl_free_node(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n)
+{
+    if (tree->index != NULL){
+        rumati_avl_index_remove(tree, n);
+    }
+    if (tree->filter != NULL){
+        rumati_avl_filter_update(tree, n->data, false);
+    }
+    if (tree->cache != NULL){
+        struct rumati_avl_node **slot = rumati_avl_cache_slot(tree, n->data);
+        if (*slot == n){
+            *slot = NULL;
+        }
+    }
+    RUMATI_AVL_COUNT(tree, frees, 1);
+    free(n);
+    tree->size--;
+}
+
+/*
+ * rumati_avl_move_data() - moves the data of a node about to be freed into
+ * the node whose data is being deleted, as deletes of nodes with two children
+ * do. The hash index entry of the deleted data is removed, and the entry of
+ * the moved data points to its new node. The deleted key leaves the filter
+ * now, and the moved key is counted twice until the other node is freed. A
+ * lookup cache slot holding the node for the deleted key is cleared.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      to -    the node holding the data being deleted
+ *      from -  the node whose data takes its place, the entry just before
+ *              or after to, which must still be linked below to
+ */
+static void rumati_avl_move_data(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *to,
+        struct rumati_avl_node *from)
+{
+    if (to == from){
+        return;
+    }
+
+    if (tree->index != NULL){
+        struct rumati_avl_index_entry *e;
+
+        rumati_avl_index_remove(tree, to);
+        e = rumati_avl_index_find(tree,
+                tree->index_hash(tree->udata, from->data), from);
+        if (e != NULL){
+            e->node = to;
+        }
+    }
+    if (tree->filter != NULL){
+        rumati_avl_filter_update(tree, to->data, false);
+        rumati_avl_filter_update(tree, from->data, true);
+    }
+    if (tree->cache != NULL){
         /*
-         * For situation 2 above, tree D is additionally lighter on the left
-         * by the amount by which tree A is heavier than tree C (ie, balance
-         * of node B). (-= negative number...)
+         * The deleted key's slot would otherwise keep pointing at the node
+         * after it takes other data, and after it is freed in turn.
          */
-        old_root->balance -= nrb;
+        struct rumati_avl_node **slot = rumati_avl_cache_slot(tree, to->data);
+        if (*slot == to){
+            *slot = NULL;
+        }
     }
+    if (tree->track_changes){
+        /*
+         * to's entry is removed, and the moved entry is written again from
+         * to. Nothing lies between to and from, so the entries removed
+         * before either end up before to, unless from comes before to, in
+         * which case those before to go to the entry after it.
+         */
+        size_t carry = rumati_avl_removed_take(tree, to) +
+                rumati_avl_in_snapshot(tree, to);
+        size_t moved = rumati_avl_removed_take(tree, from);
+        struct rumati_avl_node *next;
 
-    /*
-     * Similarly, node B is now heavier on the right side, since it has gained
-     * a layer. Previously, Node C was the direct child of node B, but it is
-     * now the the left child of D, which is the child of B - C is now the
-     * granchild of B. We make B heavier by one level on the right side.
-     */
-    (*node_ptr)->balance++;
-    if (old_root->balance > 0){
+        for (next = to->right; next->left != NULL; next = next->left){
+        }
+        rumati_avl_touch(tree, to);
+        to->flags |= RUMATI_AVL_NODE_NEW;
+        if (rumati_avl_in_snapshot(tree, from)){
+            to->flags &= ~RUMATI_AVL_NODE_NEW;
+        }
+        if (next == from){
+            rumati_avl_removed_add(tree, to, carry + moved);
+        }else{
+            rumati_avl_removed_add(tree, to, moved);
+            rumati_avl_removed_add(tree, next, carry);
+        }
+    }
+    to->data = from->data;
+}
+
+/*
+ * rumati_avl_replace() - replaces the data of a node matching a value being
+ * put into the tree.
+ *
+ * Parameters:
+ *      tree -      the tree
+ *      n -         the matching node
+ *      object -    the new data for the node
+ *      old_value - See rumati_avl_put().
+ */
+static void rumati_avl_replace(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n,
+        void *object,
+        void **old_value)
+{
+    rumati_avl_touch(tree, n);
+    if (n->flags & RUMATI_AVL_NODE_TOMBSTONE){
         /*
-         * B was never an ancestor of the tree rooted at E. If the tree rooted
-         * E is heavier than the tree rooted at C, then B is additionally
-         * heavier on the right side by the amount by which tree E is heavier
-         * than tree C (new balance of node D).
+         * Revive the tombstone in place. There was no entry for the value
+         * as far as the user is concerned, and the tree still owns the
+         * deleted value, unless it is the value being put back.
          */
-        (*node_ptr)->balance += old_root->balance;
+        if (n->data != object){
+            tree->lazy_destructor(tree->udata, n->data);
+        }
+        n->flags &= ~RUMATI_AVL_NODE_TOMBSTONE;
+        tree->tombstones--;
+        if (old_value != NULL){
+            *old_value = NULL;
+        }
+    }else if (old_value != NULL){
+        *old_value = n->data;
+    }
+    n->data = object;
+}
+
+/*
+ * rumati_avl_destroy_node_iterative() - destroys a node, and all its children
+ * using rumati_avl_node_destroy().
+ *
+ * The subtree is walked without recursion, by rotating left children up until
+ * the node at the top has no left child, and can be destroyed. This uses no
+ * extra memory, so subtrees of any height (which trees built in relaxed mode
+ * can have) are destroyed safely.
+ *
+ * Parameters:
+ *      n -     the node to destroy, along with all its children
+ *      destructor -    the destrctor to use to destroy the nodes data
+ *      udata - the user supplied pointer associated with the tree
+ */
+static void rumati_avl_destroy_node_iterative(
+        struct rumati_avl_node *n,
+        RUMATI_AVL_NODE_DESTRUCTOR destructor,
+        void *udata)
+{
+    while (n != NULL){
+        struct rumati_avl_node *next;
+
+        if (n->left != NULL){
+            next = n->left;
+            n->left = next->right;
+            next->right = n;
+        }else{
+            next = n->right;
+            rumati_avl_destroy_node(n, destructor, udata);
+        }
+        n = next;
+    }
+}
+
+/*
+ * rumati_avl_clear() - removes all nodes from the tree, using the destructor
+ * provided.
+ *
+ * Parameters:
+ *      tree -  the tree to clear
+ *      destructor -    the destructor to use when destroying each node's data
+ */
+RUMATI_AVL_API
+void rumati_avl_clear(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_NODE_DESTRUCTOR destructor)
+{
+    if (tree->image != NULL){
+        /* the nodes and values belong to the image */
+        munmap(tree->image, tree->image_size);
+        tree->image = NULL;
+        tree->image_size = 0;
+    }else{
+        rumati_avl_destroy_node_iterative(tree->root, destructor, tree->udata);
+    }
+    tree->root = NULL;
+    tree->unbalanced = false;
+    tree->size = 0;
+    tree->tombstones = 0;
+    if (tree->track_changes){
+        /* every entry of the last snapshot is gone */
+        free(tree->removed);
+        tree->removed = NULL;
+        tree->removed_mask = 0;
+        tree->removed_count = 0;
+        tree->removed_last = tree->snapshot_size;
     }
+    if (tree->cache != NULL){
+        memset(tree->cache, 0, (tree->cache_mask + 1) * sizeof(*tree->cache));
+    }
+    if (tree->index != NULL){
+        memset(tree->index, 0, (tree->index_mask + 1) * sizeof(*tree->index));
+        tree->index_count = 0;
+    }
+    if (tree->filter != NULL){
+        memset(tree->filter, 0, tree->filter_mask + 1);
+    }
+}
+
+/*
+ * rumati_avl_destroy() - destroys a tree, freeing all memory used by the tree,
+ * and cleanly destrying node data using a destructor.
+ * provided.
+ *
+ * Parameters:
+ *      tree -  the tree to destroy
+ *      destructor -    the destructor to use when destroying each node's data
+ */
+RUMATI_AVL_API
+void rumati_avl_destroy(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_NODE_DESTRUCTOR destructor)
+{
+    rumati_avl_clear(tree, destructor);
+    free(tree->cache);
+    free(tree->index);
+    free(tree->filter);
+    free(tree->removed);
+    free(tree);
+}
+
+/*
+ * rumati_avl_rotate_right() - rotates a subtree to the right/clock wise
+ *
+ * Parameters:
+ *      node_ptr -  A pointer to the pointer to the root of this subtree
+ *                  this will be updated to point to the new root, after
+ *                  rotation.
+ */
+static void rumati_avl_rotate_right(struct rumati_avl_node **node_ptr)
+{
+    /*
+     * In this function, we will rotate a tree clockwise. See the following
+     * diagram:
+     *
+     *      D           B
+     *     / \         / \
+     *    B   E  =>   A   D
+     *   / \             / \
+     *  A   C           C   E
+     *
+     * The tree rooted at D is rotated clockwise so that the new root is B.
+     * D takes the right child of B (ie. C) as its left child, while B takes
+     * D as its right child.
+     */
+    int16_t nrb;
+
+    /* keep reference to old root (D) */
+    struct rumati_avl_node *old_root = *node_ptr;
+
+    /* make root pointer point to new root, old root (D)'s left child (B) */
+    *node_ptr = old_root->left;
+
+    /* 
+     * old root (D) inherits new root (B)'s right child (C) as it's left child.
+     * remember, its previous left child (B) is now it's (D's) parent
+     */
+    old_root->left = (*node_ptr)->right;
+
+    /* new root (B)'s right child is the old root (D) */
+    (*node_ptr)->right = old_root;
+
+    /* new root balance pre rotate (balance of B pre-rotate) */
+    nrb = (*node_ptr)->balance;
+
+    /*
+     * Now, we increment the balance of the old root (D), ie. Make it heavier
+     * by one on the right side. This is not because the right side became
+     * heavier, but because the left side became lighter.
+     *
+     * Proof:
+     *      Situation 1, trees rooted at A and C are of equal height (balance
+     *      of B is 0), or tree C is heavier than tree A (balance of B is > 0):
+     *          The left tree of D has lost a layer by D adopting its granchild
+     *          (C) in place of B. So, A's left tree is one layer lighter.
+     *      Situation 2, tree rooted at A is heavier than tree rooted at C
+     *      (balance of B is < 0):
+     *          The rule for Situation 1 still applies, because D has still
+     *          adopted its granchild C, thereby losing a layer. Additionally
+     *          D is lighter on the left side by the amount that tree A is
+     *          heavier than tree C, since D is no longer an ancestor of tree
+     *          A. We know the difference in height between tree A and tree C,
+     *          it is the balance of node B.
+     */
+    old_root->balance++;
+    if (nrb < 0){
+        /*
+         * For situation 2 above, tree D is additionally lighter on the left
+         * by the amount by which tree A is heavier than tree C (ie, balance
+         * of node B). (-= negative number...)
+         */
+        old_root->balance -= nrb;
+    }
+
+    /*
+     * Similarly, node B is now heavier on the right side, since it has gained
+     * a layer. Previously, Node C was the direct child of node B, but it is
+     * now the the left child of D, which is the child of B - C is now the
+     * granchild of B. We make B heavier by one level on the right side.
+     */
+    (*node_ptr)->balance++;
+    if (old_root->balance > 0){
+        /*
+         * B was never an ancestor of the tree rooted at E. If the tree rooted
+         * E is heavier than the tree rooted at C, then B is additionally
+         * heavier on the right side by the amount by which tree E is heavier
+         * than tree C (new balance of node D).
+         */
+        (*node_ptr)->balance += old_root->balance;
+    }
+}
+
+/*
+ * rumati_avl_rotate_left() - rotates a subtree to the left/anti-clock wise
+ *
+ * Parameters:
+ *      node_ptr -  A pointer to the pointer to the root of this subtree
+ *                  this will be updated to point to the new root, after
+ *                  rotation.
+ */
+static void rumati_avl_rotate_left(struct rumati_avl_node **node_ptr)
+{
+    /*
+     * The implementation of this function is identical to the implementation
+     * of rumati_avl_rotate_right(), please see comments there.
+     */
+    int16_t nrb;
+    struct rumati_avl_node *old_root = *node_ptr;
+
+    *node_ptr = old_root->right;
+    old_root->right = (*node_ptr)->left;
+    (*node_ptr)->left = old_root;
+
+    nrb = (*node_ptr)->balance;
+
+    old_root->balance--;
+    if (nrb > 0){
+        old_root->balance -= nrb;
+    }
+
+    (*node_ptr)->balance--;
+    if (old_root->balance < 0){
+        (*node_ptr)->balance += old_root->balance;
+    }
+}
+
+/*
+ * rumati_avl_path_init() - initialises an empty path.
+ *
+ * Parameters:
+ *      path -  the path
+ *      root -  the link to the root of the tree
+ */
+static void rumati_avl_path_init(
+        struct rumati_avl_path *path,
+        struct rumati_avl_node **root)
+{
+    path->root = root;
+    path->depth = 0;
+    path->capacity = RUMATI_AVL_PATH_INLINE;
+    path->node = path->inline_node;
+    path->left = path->inline_left;
+}
+
+/*
+ * rumati_avl_path_release() - frees any memory allocated by a path.
+ */
+static void rumati_avl_path_release(struct rumati_avl_path *path)
+{
+    if (path->node != path->inline_node){
+        free(path->node);
+    }
+}
+
+/*
+ * rumati_avl_path_push() - adds a node to the end of a path, moving the path
+ * to the heap if it does not fit in the inline storage.
+ *
+ * Parameters:
+ *      path -  the path
+ *      n -     the node
+ *      left -  true if the path continues to the left child of the node,
+ *              false if it continues to the right child.
+ *
+ * Returns:
+ *      true    On success.
+ *      false   If there was an error allocating memory.
+ */
+static bool rumati_avl_path_push(
+        struct rumati_avl_path *path,
+        struct rumati_avl_node *n,
+        bool left)
+{
+    if (path->depth == path->capacity){
+        unsigned int capacity = path->capacity * 2;
+        struct rumati_avl_node **node;
+        uint64_t *bits;
+        unsigned int i;
+
+        node = malloc(capacity * sizeof(*node) +
+                (capacity / 64 + 1) * sizeof(*bits));
+        if (node == NULL){
+            return false;
+        }
+        bits = (uint64_t*)(node + capacity);
+        for (i = 0; i < path->depth; i++){
+            node[i] = path->node[i];
+        }
+        for (i = 0; i < (path->depth + 63) / 64; i++){
+            bits[i] = path->left[i];
+        }
+        rumati_avl_path_release(path);
+        path->node = node;
+        path->left = bits;
+        path->capacity = capacity;
+    }
+
+    if (path->depth % 64 == 0){
+        path->left[path->depth / 64] = 0;
+    }
+    /* the bit may be left over from a node popped off the path */
+    path->left[path->depth / 64] &= ~((uint64_t)1 << (path->depth % 64));
+    path->left[path->depth / 64] |= (uint64_t)left << (path->depth % 64);
+    path->node[path->depth] = n;
+    path->depth++;
+    return true;
+}
+
+/*
+ * rumati_avl_path_left() - checks the direction the path takes at a node.
+ *
+ * Returns:
+ *      true if the path goes to the left child of node i, false if it goes
+ *      to the right child.
+ */
+static bool rumati_avl_path_left(struct rumati_avl_path *path, unsigned int i)
+{
+    return (path->left[i / 64] >> (i % 64)) & 1;
+}
+
+/*
+ * rumati_avl_child() - returns a pointer to the left or right child link of
+ * a node.
+ *
+ * Parameters:
+ *      n -     the node
+ *      left -  true for the left child link, false for the right child link
+ *
+ * Returns:
+ *      A pointer to the requested child link of the node.
+ */
+static struct rumati_avl_node **rumati_avl_child(
+        struct rumati_avl_node *n,
+        bool left)
+{
+    return left ? &n->left : &n->right;
+}
+
+/*
+ * rumati_avl_path_link() - returns the link pointing to node i of a path,
+ * which is the link that must be updated when the node is rotated.
+ */
+static struct rumati_avl_node **rumati_avl_path_link(
+        struct rumati_avl_path *path,
+        unsigned int i)
+{
+    if (i == 0){
+        return path->root;
+    }
+    return rumati_avl_child(path->node[i - 1], rumati_avl_path_left(path, i - 1));
+}
+
+/*
+ * rumati_avl_lift() - rotates a subtree so that one of the children of the
+ * subtree root becomes the new root. Unlike rumati_avl_rotate_left() and
+ * rumati_avl_rotate_right(), the balance fields are not touched, the weak AVL
+ * and red-black schemes maintain those themselves.
+ *
+ * Parameters:
+ *      node_ptr -  A pointer to the pointer to the root of this subtree
+ *                  this will be updated to point to the new root, after
+ *                  rotation.
+ *      left -      true to lift the left child (a clockwise rotation), false
+ *                  to lift the right child (an anti-clockwise rotation).
+ */
+static void rumati_avl_lift(struct rumati_avl_node **node_ptr, bool left)
+{
+    struct rumati_avl_node *old_root = *node_ptr;
+    struct rumati_avl_node *new_root = *rumati_avl_child(old_root, left);
+
+    *rumati_avl_child(old_root, left) = *rumati_avl_child(new_root, !left);
+    *rumati_avl_child(new_root, !left) = old_root;
+    *node_ptr = new_root;
+}
+
+/*
+ * rumati_avl_rank() - returns the rank of a node in a weak AVL tree. Missing
+ * nodes have a rank of -1.
+ */
+static int rumati_avl_rank(struct rumati_avl_node *n)
+{
+    return n == NULL ? -1 : n->balance;
+}
+
+/*
+ * rumati_avl_is_red() - checks if a node in a red-black tree is red. Missing
+ * nodes are black.
+ */
+static bool rumati_avl_is_red(struct rumati_avl_node *n)
+{
+    return n != NULL && n->balance == RUMATI_AVL_RED;
+}
+
+/*
+ * rumati_avl_put_wavl() - restores weak AVL rank rules after a new leaf has
+ * been inserted at the end of the path recorded in path.
+ *
+ * The rank difference between a node and its parent must be 1 or 2, and
+ * leaves must have rank 0. A new leaf has rank 0, so it may be a 0-child of
+ * its parent. We promote parents while the parent's other child is a
+ * 1-child, which moves the problem one level up, and finish with at most two
+ * rotations once the other child is a 2-child.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      path -  the path taken down the tree to the new leaf
+ *      x -         the new leaf
+ */
+static void rumati_avl_put_wavl(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_path *path,
+        struct rumati_avl_node *x)
+{
+    while (path->depth > 0){
+        struct rumati_avl_node *p;
+        struct rumati_avl_node *y;
+        bool left;
+
+        path->depth--;
+        p = path->node[path->depth];
+        left = rumati_avl_path_left(path, path->depth);
+
+        if (rumati_avl_rank(p) != rumati_avl_rank(x)){
+            /* x is not a 0-child, the tree is valid */
+            return;
+        }
+
+        if (rumati_avl_rank(p) -
+                rumati_avl_rank(*rumati_avl_child(p, !left)) == 1){
+            /* p is a 0,1 node, promote it and continue with its parent */
+            p->balance++;
+            x = p;
+            continue;
+        }
+
+        /*
+         * p is a 0,2 node. If the inner child of x (y) is a 2-child a single
+         * rotation is enough, otherwise y is lifted to the top with a double
+         * rotation. Either way p ends up one rank lower, and the tree is
+         * valid again.
+         */
+        y = *rumati_avl_child(x, !left);
+        if (rumati_avl_rank(x) - rumati_avl_rank(y) == 2){
+            RUMATI_AVL_ROTATION(tree, insert_single);
+            rumati_avl_lift(rumati_avl_path_link(path, path->depth), left);
+        }else{
+            RUMATI_AVL_ROTATION(tree, insert_double);
+            rumati_avl_lift(rumati_avl_child(p, left), !left);
+            rumati_avl_lift(rumati_avl_path_link(path, path->depth), left);
+            y->balance++;
+            x->balance--;
+        }
+        p->balance--;
+        return;
+    }
+}
+
+/*
+ * rumati_avl_put_rb() - restores the red-black rules after a new red leaf
+ * has been inserted at the end of the path recorded in path.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      path -  the path taken down the tree to the new leaf
+ *      x -         the new leaf
+ */
+static void rumati_avl_put_rb(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_path *path,
+        struct rumati_avl_node *x)
+{
+    while (path->depth > 0){
+        struct rumati_avl_node *p;
+        struct rumati_avl_node *g;
+        struct rumati_avl_node *u;
+        bool p_left;
+        bool g_left;
+
+        p = path->node[path->depth - 1];
+        if (p->balance == RUMATI_AVL_BLACK){
+            return;
+        }
+
+        /*
+         * The root is always black, so a red parent always has a parent of
+         * its own.
+         */
+        g = path->node[path->depth - 2];
+        p_left = rumati_avl_path_left(path, path->depth - 1);
+        g_left = rumati_avl_path_left(path, path->depth - 2);
+        u = *rumati_avl_child(g, !g_left);
+
+        if (rumati_avl_is_red(u)){
+            /*
+             * Red uncle, push the blackness of the grandparent down to the
+             * parent and uncle, and continue with the grandparent.
+             */
+            p->balance = RUMATI_AVL_BLACK;
+            u->balance = RUMATI_AVL_BLACK;
+            g->balance = RUMATI_AVL_RED;
+            x = g;
+            path->depth -= 2;
+            continue;
+        }
+
+        /*
+         * Black uncle, rotate so the grandparent's place is taken by the
+         * middle of g, p and x. If x is an inner grandchild, first lift it
+         * above p.
+         */
+        if (p_left != g_left){
+            RUMATI_AVL_ROTATION(tree, insert_double);
+            rumati_avl_lift(rumati_avl_child(g, g_left), p_left);
+        }else{
+            RUMATI_AVL_ROTATION(tree, insert_single);
+        }
+        rumati_avl_lift(rumati_avl_path_link(path, path->depth - 2), g_left);
+        (*rumati_avl_path_link(path, path->depth - 2))->balance =
+                RUMATI_AVL_BLACK;
+        g->balance = RUMATI_AVL_RED;
+        return;
+    }
+
+    /* x is the root */
+    x->balance = RUMATI_AVL_BLACK;
+}
+
+/*
+ * rumati_avl_delete_wavl() - restores weak AVL rank rules after a node has
+ * been unlinked from the end of the path recorded in path.
+ *
+ * Removing a node may leave its parent as a 2,2 leaf, which is demoted, or
+ * leave a 3-child. 3-children are fixed by demoting the parent (and maybe the
+ * sibling), which moves the problem one level up, or with at most two
+ * rotations, after which the tree is valid.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      path -  the path taken down the tree to the removed node
+ *      x -         the node which took the place of the removed node, or
+ *                  NULL if the removed node was a leaf.
+ */
+static void rumati_avl_delete_wavl(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_path *path,
+        struct rumati_avl_node *x)
+{
+    if (x == NULL && path->depth > 0){
+        struct rumati_avl_node *p;
+
+        p = path->node[path->depth - 1];
+        if (p->left == NULL && p->right == NULL && p->balance == 1){
+            /* p is now a 2,2 leaf, demote it */
+            p->balance = 0;
+            x = p;
+            path->depth--;
+        }
+    }
+
+    while (path->depth > 0){
+        struct rumati_avl_node *p;
+        struct rumati_avl_node *y;
+        struct rumati_avl_node *outer;
+        struct rumati_avl_node *inner;
+        bool left;
+
+        path->depth--;
+        p = path->node[path->depth];
+        left = rumati_avl_path_left(path, path->depth);
+
+        if (rumati_avl_rank(p) - rumati_avl_rank(x) != 3){
+            return;
+        }
+
+        y = *rumati_avl_child(p, !left);
+        if (rumati_avl_rank(p) - rumati_avl_rank(y) == 2){
+            /* 3,2 node, demote and continue with the parent */
+            p->balance--;
+            x = p;
+            continue;
+        }
+
+        outer = *rumati_avl_child(y, !left);
+        inner = *rumati_avl_child(y, left);
+        if (rumati_avl_rank(y) - rumati_avl_rank(outer) == 2 &&
+                rumati_avl_rank(y) - rumati_avl_rank(inner) == 2){
+            /* 3,1 node with a 2,2 sibling, demote both */
+            p->balance--;
+            y->balance--;
+            x = p;
+            continue;
+        }
+
+        if (rumati_avl_rank(y) - rumati_avl_rank(outer) == 1){
+            /* single rotation, lifting the sibling */
+            RUMATI_AVL_ROTATION(tree, delete_single);
+            rumati_avl_lift(rumati_avl_path_link(path, path->depth), !left);
+            y->balance++;
+            p->balance--;
+            if (p->left == NULL && p->right == NULL){
+                p->balance--;
+            }
+        }else{
+            /* double rotation, lifting the sibling's inner child */
+            RUMATI_AVL_ROTATION(tree, delete_double);
+            rumati_avl_lift(rumati_avl_child(p, !left), left);
+            rumati_avl_lift(rumati_avl_path_link(path, path->depth), !left);
+            inner->balance += 2;
+            y->balance--;
+            p->balance -= 2;
+        }
+        return;
+    }
+}
+
+/*
+ * rumati_avl_delete_rb() - restores the red-black rules after a node has
+ * been unlinked from the end of the path recorded in path.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      path -  the path taken down the tree to the removed node
+ *      x -         the node which took the place of the removed node, or
+ *                  NULL if the removed node was a leaf.
+ *      removed_colour -    the colour of the removed node
+ */
+static void rumati_avl_delete_rb(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_path *path,
+        struct rumati_avl_node *x,
+        int16_t removed_colour)
+{
+    if (removed_colour == RUMATI_AVL_RED){
+        return;
+    }
+
+    /*
+     * x is "doubly black", the paths through it have one black node less
+     * than the other paths. Loop until x is red (and can be made black), x is
+     * the root, or a rotation fixes the black heights.
+     */
+    while (path->depth > 0 && !rumati_avl_is_red(x)){
+        struct rumati_avl_node **p_ptr;
+        struct rumati_avl_node *p;
+        struct rumati_avl_node *s;
+        bool left;
+
+        p_ptr = rumati_avl_path_link(path, path->depth - 1);
+        p = path->node[path->depth - 1];
+        left = rumati_avl_path_left(path, path->depth - 1);
+
+        /*
+         * The sibling subtree has a black height of at least one, so the
+         * sibling always exists.
+         */
+        s = *rumati_avl_child(p, !left);
+        if (rumati_avl_is_red(s)){
+            /*
+             * Red sibling, rotate it above p so that x gets a black sibling.
+             * p is red afterwards, so the loop ends below.
+             */
+            s->balance = RUMATI_AVL_BLACK;
+            p->balance = RUMATI_AVL_RED;
+            RUMATI_AVL_ROTATION(tree, delete_single);
+            rumati_avl_lift(p_ptr, !left);
+            p_ptr = rumati_avl_child(s, left);
+            s = *rumati_avl_child(p, !left);
+        }
+
+        if (!rumati_avl_is_red(s->left) && !rumati_avl_is_red(s->right)){
+            /*
+             * Take one black from both x and s, and push it up to p.
+             */
+            s->balance = RUMATI_AVL_RED;
+            x = p;
+            path->depth--;
+            continue;
+        }
+
+        if (!rumati_avl_is_red(*rumati_avl_child(s, !left))){
+            /* make sure the outer child of the sibling is red */
+            (*rumati_avl_child(s, left))->balance = RUMATI_AVL_BLACK;
+            s->balance = RUMATI_AVL_RED;
+            RUMATI_AVL_ROTATION(tree, delete_double);
+            rumati_avl_lift(rumati_avl_child(p, !left), left);
+            s = *rumati_avl_child(p, !left);
+        }else{
+            RUMATI_AVL_ROTATION(tree, delete_single);
+        }
+
+        /*
+         * Lift the sibling into p's place, giving x an extra black ancestor.
+         */
+        s->balance = p->balance;
+        p->balance = RUMATI_AVL_BLACK;
+        (*rumati_avl_child(s, !left))->balance = RUMATI_AVL_BLACK;
+        rumati_avl_lift(p_ptr, !left);
+        return;
+    }
+
+    if (x != NULL){
+        x->balance = RUMATI_AVL_BLACK;
+    }
+}
+
+/*
+ * rumati_avl_directions_push() - records the direction taken at the next
+ * level down the tree. AVL trees are never higher than
+ * RUMATI_AVL_MAX_HEIGHT, so the directions always fit.
+ *
+ * Parameters:
+ *      dirs -  the directions recorded so far
+ *      left -  true if the path goes to the left child, false otherwise
+ */
+static void rumati_avl_directions_push(
+        struct rumati_avl_directions *dirs,
+        bool left)
+{
+    if (dirs->count % 64 == 0){
+        dirs->left[dirs->count / 64] = 0;
+    }
+    dirs->left[dirs->count / 64] |= (uint64_t)left << (dirs->count % 64);
+    dirs->count++;
+}
+
+/*
+ * rumati_avl_directions_left() - checks the direction taken at a level of a
+ * recorded path.
+ *
+ * Returns:
+ *      true if the path went to the left child at the level, false if it
+ *      went to the right child.
+ */
+static bool rumati_avl_directions_left(
+        struct rumati_avl_directions *dirs,
+        unsigned int level)
+{
+    return (dirs->left[level / 64] >> (level % 64)) & 1;
+}
+
+/*
+ * rumati_avl_put_top_down() - inserts an entry into an AVL tree in a single
+ * pass down the tree, without recording all the ancestors of the new node.
+ *
+ * Only the deepest node on the path with a non zero balance (the "safe"
+ * node) may need a rotation: the height of its subtree does not change, so
+ * nothing above it needs updating. All nodes below it have a balance of 0,
+ * and become heavier towards the new node. So we remember just a link to
+ * the safe node and the directions taken below it, and once the new leaf is
+ * linked in, walk down from the safe node updating balances and rotate the
+ * safe node if needed. Nothing above the safe node is ever touched, so a
+ * caller using hand-over-hand locking only needs to hold locks from the
+ * safe node down.
+ *
+ * Parameters:
+ *      tree -      The tree to which to add the entry.
+ *      entry -     The entry to add to the tree.
+ *      old_value - See rumati_avl_put().
+ *      depth -     Incremented for each level descended.
+ *
+ * Returns:
+ *      See rumati_avl_put().
+ */
+static RUMATI_AVL_ERROR rumati_avl_put_top_down(
+        RUMATI_AVL_TREE *tree,
+        void *object,
+        void **old_value,
+        size_t *depth)
+{
+    struct rumati_avl_node *n = NULL;
+    struct rumati_avl_node **parent_link = &tree->root;
+    struct rumati_avl_node **safe_link = &tree->root;
+    struct rumati_avl_node *safe;
+    struct rumati_avl_directions dirs;
+    unsigned int i;
+
+    dirs.count = 0;
+
+    /* do binary search looking for an existing node with matching data */
+    while (*parent_link != NULL){
+        int cmp = rumati_avl_compare(tree, object, *parent_link);
+        if (cmp == 0){
+            /*
+             * This node matches the new node. Populate old_value and replace
+             * data. No need for rebalancing.
+             */
+            rumati_avl_replace(tree, *parent_link, object, old_value);
+            return RUMATI_AVL_OK;
+        }
+
+        if ((*parent_link)->balance != 0){
+            /* deepest safe node so far, forget the path above it */
+            safe_link = parent_link;
+            dirs.count = 0;
+        }
+
+        rumati_avl_directions_push(&dirs, cmp < 0);
+        parent_link = rumati_avl_child(*parent_link, cmp < 0);
+        (*depth)++;
+    }
+
+    /*
+     * No matching node found, so, this will be a new node, insert as leaf
+     * where our binary search ended.
+     */
+
+    n = rumati_avl_new_node(tree, object);
+    if (n == NULL){
+        return RUMATI_AVL_ENOMEM;
+    }
+
+    *parent_link = n;
+
+    if (old_value != NULL){
+        *old_value = NULL;
+    }
+
+    /*
+     * Walk down from the safe node to the new leaf. Each node is one layer
+     * heavier towards the new leaf than it was.
+     */
+    safe = *safe_link;
+    n = safe;
+    for (i = 0; i < dirs.count; i++){
+        if (rumati_avl_directions_left(&dirs, i)){
+            n->balance--;
+            n = n->left;
+        }else{
+            n->balance++;
+            n = n->right;
+        }
+    }
+
+    if (safe->balance < -1){
+        /*
+         * Tree is unbalanced. We now rotate the tree to balance this
+         * node. For each new node added to a tree, we only ever need to
+         * rebalance one node.
+         *
+         * We may need to do a double rotate, because of the situation
+         * where the right child of our left child is heavier. This
+         * would cause a simple, single rotation to leave the tree as
+         * unbalanced as it was before the rotate. An example of this
+         * behaviour below:
+         *
+         *  Figure 1  |  Figure 2   |   Figure 3    |   Figure 4
+         * -----------+-------------+---------------+---------------
+         *      F     |     B       |         F     |       D
+         *     / \    |    / \      |        / \    |      / \
+         *    /   \   |   /   \     |       /   \   |     /   \
+         *   B     G  |  A     F    |      D     G  |    B     F
+         *  / \       |       / \   |     / \       |   / \   / \
+         * A   D      |      D   G  |    B   E      |  A   C E   G
+         *    / \     |     / \     |   / \         |
+         *   C   E    |    C   E    |  A   C        |
+         *
+         * If the tree in Figure 1 is simply rotated clockwise, the
+         * result is the tree in Figure 2, which is equally unbalanced,
+         * because the previous root (F) inherits its heaviest
+         * granchild (D).
+         *
+         * The solution is to first perform an anti-clockwise rotation
+         * on B, resulting in the tree shown in Figure 3, then rotating
+         * F clockwise, resulting in a balanced tree shown in Figure 4.
+         *
+         * It is also interesting to note that, for any tree rooted at
+         * F (see Figure 1), where the tree is unbalanced towards the
+         * left subtree rooted at B, it is not possible for node B to
+         * have an even balance. If F is unbalanced, then B must be at
+         * least 1 level heavier on either side.
+         */
+        if (safe->left->balance > 0){
+            RUMATI_AVL_ROTATION(tree, insert_double);
+            rumati_avl_rotate_left(&safe->left);
+        }else{
+            RUMATI_AVL_ROTATION(tree, insert_single);
+        }
+        rumati_avl_rotate_right(safe_link);
+    }else if (safe->balance > 1){
+        /*
+         * Please see discussion above
+         */
+        if (safe->right->balance < 0){
+            RUMATI_AVL_ROTATION(tree, insert_double);
+            rumati_avl_rotate_right(&safe->right);
+        }else{
+            RUMATI_AVL_ROTATION(tree, insert_single);
+        }
+        rumati_avl_rotate_left(safe_link);
+    }
+
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_delete_safe() - checks if the height of an AVL subtree stays
+ * the same when the subtree on one side of its root loses a layer.
+ *
+ * Parameters:
+ *      n -     the root of the subtree
+ *      left -  true if the left subtree loses a layer, false for the right
+ *
+ * Returns:
+ *      true if the height of the subtree rooted at n will not change.
+ */
+static bool rumati_avl_delete_safe(struct rumati_avl_node *n, bool left)
+{
+    if (n->balance == 0){
+        /* n becomes heavier on the other side */
+        return true;
+    }
+
+    if ((n->balance > 0) == left){
+        /*
+         * n is already heavier on the other side, and must be rotated. See
+         * rumati_avl_delete_top_down(), that rotation only keeps the height
+         * if the sibling is balanced.
+         */
+        return (*rumati_avl_child(n, !left))->balance == 0;
+    }
+
+    /* n loses its heavier side */
+    return false;
+}
+
+/*
+ * rumati_avl_count_removed() - counts the entry of a node being removed
+ * against the entry after it, when changes are tracked, along with the
+ * entries already counted against the node, so that a delta skips them in
+ * the last snapshot. Nodes with two children are left to
+ * rumati_avl_move_data().
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      n -     the node being removed, which has at most one child
+ *      next -  the last node at which the search for n went left, which is
+ *              the next entry if n has no right child, or NULL
+ */
+static void rumati_avl_count_removed(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n,
+        struct rumati_avl_node *next)
+{
+    if (!tree->track_changes){
+        return;
+    }
+
+    if (n->right != NULL){
+        for (next = n->right; next->left != NULL; next = next->left){
+        }
+    }
+    rumati_avl_removed_add(tree, next, rumati_avl_removed_take(tree, n) +
+            rumati_avl_in_snapshot(tree, n));
+}
+
+/*
+ * rumati_avl_delete_top_down() - removes an entry from an AVL tree in a
+ * single pass down the tree, without recording all the ancestors of the
+ * removed node.
+ *
+ * We remember the deepest "safe" node on the path, whose height does not
+ * change when the layer is removed below it (see rumati_avl_delete_safe()),
+ * and the directions taken below it. Every node below the safe node loses a
+ * layer, which only depends on its own balance and that of the sibling of
+ * the path, so the balance updates and rotations of all of them can be done
+ * walking down from the safe node once the node has been unlinked.
+ *
+ * Parameters:
+ *      tree -      The tree from which to delete the entry.
+ *      key -       The value by which to find the entry to be deleted.
+ *      old_value - See rumati_avl_delete().
+ *      depth -     Incremented for each level descended to the entry.
+ *
+ * Returns:
+ *      See rumati_avl_delete().
+ */
+static RUMATI_AVL_ERROR rumati_avl_delete_top_down(
+        RUMATI_AVL_TREE *tree,
+        void *key,
+        void **old_value,
+        size_t *depth)
+{
+    struct rumati_avl_node **parent_link = &tree->root;
+    struct rumati_avl_node **safe_link = &tree->root;
+    struct rumati_avl_node *match;
+    struct rumati_avl_node *delnode;
+    struct rumati_avl_node *next = NULL;
+    struct rumati_avl_directions dirs;
+    unsigned int i;
+    bool left;
+
+    dirs.count = 0;
+
+    /* normal binary search descend based on key comparison */
+    while (1){
+        int cmp;
+
+        if (*parent_link == NULL){
+            /*
+             * We reached a leaf's NULL pointer child link, without finding
+             * a matching entry - none exists.
+             */
+            return RUMATI_AVL_ENOENT;
+        }
+
+        cmp = rumati_avl_compare(tree, key, *parent_link);
+        if (cmp == 0){
+            break;
+        }
+
+        if (rumati_avl_delete_safe(*parent_link, cmp < 0)){
+            safe_link = parent_link;
+            dirs.count = 0;
+        }
+        if (cmp < 0){
+            next = *parent_link;
+        }
+        rumati_avl_directions_push(&dirs, cmp < 0);
+        parent_link = rumati_avl_child(*parent_link, cmp < 0);
+        (*depth)++;
+    }
+
+    match = *parent_link;
+    if (match->left != NULL && match->right != NULL){
+        /*
+         * The node to be deleted has two children. We cannot simply
+         * delete it by replacing it with it's only child. So, we
+         * delete it by overwritting its data with that of its inner-
+         * most child on its heavier subtree, then deleting that inner
+         * most child in the heavier subtree.
+         *
+         * Consider:
+         *
+         *     E
+         *    / \
+         *   B   F
+         *  / \   \
+         * A   D   G
+         *    /
+         *   C
+         *
+         * E's content is replaced with the content from D, then D
+         * is deleted. B must inherits D's outside hild (C) if any.
+         */
+        left = match->balance < 0;
+        do {
+            if (rumati_avl_delete_safe(*parent_link, left)){
+                safe_link = parent_link;
+                dirs.count = 0;
+            }
+            rumati_avl_directions_push(&dirs, left);
+            parent_link = rumati_avl_child(*parent_link, left);
+            /* after the first step, keep to the inside */
+            left = (match->balance >= 0);
+        } while (*rumati_avl_child(*parent_link, left) != NULL);
+    }
+
+    /*
+     * Unlink the node at the end of the path, which has at most one child,
+     * by replacing it with its child.
+     */
+    delnode = *parent_link;
+
+    /*
+     * If the user has given an "out" variable for the deleted value,
+     * populate it with the deleted value.
+     */
+    if (old_value != NULL){
+        *old_value = match->data;
+    }
+    if (delnode == match){
+        rumati_avl_count_removed(tree, delnode, next);
+    }
+    /* before the unlink, which may take the moved data's node off match */
+    rumati_avl_move_data(tree, match, delnode);
+    if (delnode->left != NULL){
+        *parent_link = delnode->left;
+    }else{
+        *parent_link = delnode->right;
+    }
+    rumati_avl_free_node(tree, delnode);
+
+    /*
+     * Walk down from the safe node, updating each node for the layer lost
+     * on the side of the path.
+     */
+    parent_link = safe_link;
+    for (i = 0; i < dirs.count; i++){
+        struct rumati_avl_node **node_ptr = parent_link;
+        struct rumati_avl_node *n = *node_ptr;
+
+        left = rumati_avl_directions_left(&dirs, i);
+        /* n's child on the path stays in place through the rotations below */
+        parent_link = rumati_avl_child(n, left);
+
+        if (left){
+            /*
+             * Node deleted to the left of this node, bump balance towards
+             * the right.
+             *
+             * Effect on the parent (balance is after adjustment for the
+             * deleted descendant):
+             *  -   balance < 0:    impossible, would have had to be imbalanced
+             *                      before delete
+             *  -   balance = 0:    parent loses 1 height, as tree is now one
+             *                      layer lighter
+             *  -   balance = 1:    tree was balanced, now 1 layer heavier on
+             *                      right. No affect on parent, this can only
+             *                      be the safe node.
+             *  -   balance > 1:    tree was one heavier on right, now 2
+             *                      heavier, ie. imbalanced. A rotation is
+             *                      required to rebalance tree. This rotation
+             *                      may or may not cause the parent to be one
+             *                      layer lighter. If it does not, this is the
+             *                      safe node.
+             */
+            n->balance++;
+            if (n->balance > 1){
+                /*
+                 * Node is now imbalanced. Rebalance according to normal
+                 * AVL rules. See rumati_avl_put_top_down() for discussion.
+                 *
+                 * Double rotation required if the right child is heavier on
+                 * the left, leaving the tree lighter, eg:
+                 *
+                 *  A      A         B
+                 *   \      \       / \
+                 *    C =>   B  => A   C
+                 *   /        \
+                 *  B          C
+                 *
+                 * If the right child is balanced, a single rotation does not
+                 * change the height of the tree, eg:
+                 *
+                 * A         C
+                 *  \       / \
+                 *   C  => A   D
+                 *  / \     \
+                 * B   D     B
+                 *
+                 * Otherwise, a single rotation leaves the tree lighter, eg:
+                 *
+                 * A         B
+                 *  \       / \
+                 *   B  => A   C
+                 *    \
+                 *     C
+                 */
+                if (n->right->balance < 0){
+                    RUMATI_AVL_ROTATION(tree, delete_double);
+                    rumati_avl_rotate_right(&n->right);
+                }else{
+                    RUMATI_AVL_ROTATION(tree, delete_single);
+                }
+                rumati_avl_rotate_left(node_ptr);
+            }
+        }else{
+            /*
+             * Please see discussion above
+             */
+            n->balance--;
+            if (n->balance < -1){
+                if (n->left->balance > 0){
+                    RUMATI_AVL_ROTATION(tree, delete_double);
+                    rumati_avl_rotate_left(&n->left);
+                }else{
+                    RUMATI_AVL_ROTATION(tree, delete_single);
+                }
+                rumati_avl_rotate_right(node_ptr);
+            }
+        }
+    }
+
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_put_path() - inserts an entry into a weak AVL, red-black or
+ * relaxed tree, recording the path taken down the tree so that balance can
+ * be restored walking back up it.
+ *
+ * Parameters:
+ *      tree -      The tree to which to add the entry.
+ *      entry -     The entry to add to the tree.
+ *      old_value - See rumati_avl_put().
+ *      depth -     Incremented for each level descended.
+ *
+ * Returns:
+ *      See rumati_avl_put().
+ */
+static RUMATI_AVL_ERROR rumati_avl_put_path(
+        RUMATI_AVL_TREE *tree,
+        void *object,
+        void **old_value,
+        size_t *depth)
+{
+    struct rumati_avl_node *n = NULL;
+    struct rumati_avl_node **parent_link = &tree->root;
+    struct rumati_avl_path path;
+    RUMATI_AVL_ERROR err = RUMATI_AVL_OK;
+
+    /* relaxed mode updates need no path at all */
+    rumati_avl_path_init(&path, &tree->root);
+
+    /* do binary search looking for an existing node with matching data */
+    while (*parent_link != NULL){
+        int cmp = rumati_avl_compare(tree, object, *parent_link);
+        if (cmp == 0){
+            /*
+             * This node matches the new node. Populate old_value and replace
+             * data. No need for rebalancing.
+             */
+            rumati_avl_replace(tree, *parent_link, object, old_value);
+            goto out;
+        }
+
+        /*
+         * Add this node to the path, or in relaxed mode mark it for
+         * rumati_avl_rebalance(), and check the child on the side of the
+         * destination node.
+         */
+        if (tree->relaxed){
+            (*parent_link)->flags |= RUMATI_AVL_NODE_DIRTY;
+        }else if (rumati_avl_path_push(&path, *parent_link, cmp < 0) ==
+                false){
+            err = RUMATI_AVL_ENOMEM;
+            goto out;
+        }
+        parent_link = rumati_avl_child(*parent_link, cmp < 0);
+        (*depth)++;
+    }
+
+    /*
+     * No matching node found, so, this will be a new node, insert as leaf
+     * where our binary search ended.
+     */
+
+    n = rumati_avl_new_node(tree, object);
+    if (n == NULL){
+        err = RUMATI_AVL_ENOMEM;
+        goto out;
+    }
+
+    *parent_link = n;
+
+    if (old_value != NULL){
+        *old_value = NULL;
+    }
+
+    if (tree->relaxed){
+        /*
+         * Balance is restored later, by rumati_avl_rebalance().
+         */
+        tree->unbalanced = true;
+    }else if (tree->balance == RUMATI_AVL_BALANCE_WAVL){
+        rumati_avl_put_wavl(tree, &path, n);
+    }else{
+        rumati_avl_put_rb(tree, &path, n);
+    }
+
+out:
+    rumati_avl_path_release(&path);
+    return err;
+}
+
+/*
+ * rumati_avl_put() - inserts an entry into the tree, replacing an existing
+ * entry if one exists.
+ *
+ * Parameters:
+ *      tree -      The tree to which to add the entry.
+ *      entry -     The entry to add to the tree.
+ *      old_value - A pointer to a pointer which will be populated with the 
+ *                  the previous value for the entry if one exists, or NULL
+ *                  if there was previously no matching entry. If NULL is
+ *                  passed as old_value, then the previous value will be
+ *                  overwritten without being destroyed, which may cause a
+ *                  memory leak.
+ * 
+ * Returns:
+ *      RUMATI_AVL_OK       On success
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EROFS    If the tree is an image, see
+ *                          rumati_avl_open_image().
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_put(
+        RUMATI_AVL_TREE *tree,
+        void *object,
+        void **old_value)
+{
+    RUMATI_AVL_ERROR err;
+    size_t depth = 0;
+    size_t size = tree->size;
+#ifdef RUMATI_AVL_COUNTERS
+    unsigned long long comparisons = tree->stats.comparisons;
+#endif
+
+    RUMATI_AVL_PROBE2(put__entry, tree, object);
+
+    if (tree->image != NULL){
+        err = RUMATI_AVL_EROFS;
+    }else if (tree->balance == RUMATI_AVL_BALANCE_AVL && !tree->relaxed){
+        err = rumati_avl_put_top_down(tree, object, old_value, &depth);
+    }else{
+        err = rumati_avl_put_path(tree, object, old_value, &depth);
+    }
+
+#ifdef RUMATI_AVL_COUNTERS
+    comparisons = tree->stats.comparisons - comparisons;
+    RUMATI_AVL_COUNT(tree, puts, 1);
+    RUMATI_AVL_COUNT(tree, path_total, comparisons);
+    RUMATI_AVL_COUNT_MAX(tree, path_max, comparisons);
+    if (tree->size > size){
+        /* the new leaf is one below the last node compared */
+        RUMATI_AVL_COUNT_MAX(tree, max_height, comparisons + 1);
+    }
+#endif
+    if (RUMATI_AVL_PROBE_ENABLED(put__return)){
+        /* a replaced entry was compared once more than the levels above */
+        RUMATI_AVL_PROBE4(put__return, tree, err, depth,
+                depth + (err == RUMATI_AVL_OK && tree->size == size));
+    }
+    return err;
+}
+
+/*
+ * rumati_avl_is_tombstone() - checks if a node is a tombstone, see
+ * rumati_avl_set_lazy_delete().
+ */
+static bool rumati_avl_is_tombstone(struct rumati_avl_node *n)
+{
+    return (n->flags & RUMATI_AVL_NODE_TOMBSTONE) != 0;
+}
+
+/*
+ * rumati_avl_search() - descends from the root to the node matching key,
+ * for rumati_avl_lookup(), adding base to each link and to the data of each
+ * node, as rumati_avl_link() does. Trees which are not images are searched
+ * with a base of 0, so the compiler drops the adds from their descent.
+ *
+ * Returns:
+ *      The matching node, which may be a tombstone, or NULL if there is
+ *      none. Adds the number of levels descended to depth, and the number
+ *      of comparator calls to comparisons.
+ */
+static inline struct rumati_avl_node *rumati_avl_search(
+        RUMATI_AVL_TREE *tree,
+        void *key,
+        uintptr_t base,
+        size_t *depth,
+        size_t *comparisons)
+{
+    struct rumati_avl_node *n = tree->root;
+
+    while (n != NULL){
+        int cmp;
+
+        rumati_avl_prefetch_node(tree, n);
+        RUMATI_AVL_COUNT(tree, comparisons, 1);
+        cmp = tree->comparator(tree->udata, key,
+                (void *)((uintptr_t)n->data + base));
+        (*comparisons)++;
+        if (cmp == 0){
+            return n;
+        }
+        n = cmp > 0 ? n->right : n->left;
+        if (n != NULL){
+            n = (struct rumati_avl_node *)((uintptr_t)n + base);
+        }
+        (*depth)++;
+    }
+    return NULL;
+}
+
+/*
+ * rumati_avl_lookup() - returns the matching entry in the tree, if one
+ * exists, for rumati_avl_get(). Adds the number of levels it descended to
+ * depth, which is 0 if the index, filter or cache answered, and the number
+ * of comparator calls to comparisons.
+ */
+static void *rumati_avl_lookup(
+        RUMATI_AVL_TREE *tree,
+        void *key,
+        size_t *depth,
+        size_t *comparisons)
+{
+    struct rumati_avl_node *n;
+    struct rumati_avl_node **slot = NULL;
+    struct rumati_avl_node *cached;
+
+    if (tree->index != NULL){
+        n = rumati_avl_index_get(tree, key);
+        return (n == NULL || rumati_avl_is_tombstone(n)) ? NULL :
+                rumati_avl_data(tree, n);
+    }
+
+    if (tree->filter != NULL){
+        /* concurrent gets may lose counts, but do not race */
+        RUMATI_AVL_STORE(tree->filter_lookups,
+                RUMATI_AVL_LOAD(tree->filter_lookups) + 1);
+        if (!rumati_avl_filter_contains(tree, key)){
+            RUMATI_AVL_STORE(tree->filter_rejected,
+                    RUMATI_AVL_LOAD(tree->filter_rejected) + 1);
+            return NULL;
+        }
+    }
+
+    if (tree->cache != NULL){
+        /*
+         * A cached node is checked with the comparator, since the slot may
+         * belong to another key, or the node's data may have been replaced
+         * by a delete since it was cached. Concurrent gets may fill the
+         * slot while it is read, so it is read once.
+         */
+        slot = rumati_avl_cache_slot(tree, key);
+        cached = RUMATI_AVL_LOAD(*slot);
+        if (cached != NULL){
+            RUMATI_AVL_COUNT(tree, comparisons, 1);
+            (*comparisons)++;
+            if (tree->comparator(tree->udata, key,
+                        rumati_avl_data(tree, cached)) == 0){
+                return rumati_avl_is_tombstone(cached) ? NULL :
+                        rumati_avl_data(tree, cached);
+            }
+        }
+    }
+
+    if (tree->image == NULL){
+        n = rumati_avl_search(tree, key, 0, depth, comparisons);
+    }else{
+        n = rumati_avl_search(tree, key, (uintptr_t)tree->image, depth,
+                comparisons);
+    }
+    if (n != NULL && !rumati_avl_is_tombstone(n)){
+        if (slot != NULL){
+            RUMATI_AVL_STORE(*slot, n);
+        }
+        return rumati_avl_data(tree, n);
+    }
+
+    if (tree->filter != NULL){
+        RUMATI_AVL_STORE(tree->filter_false_positives,
+                RUMATI_AVL_LOAD(tree->filter_false_positives) + 1);
+    }
+    return NULL;
+}
+
+/*
+ * rumati_avl_get() - returns the matching entry in the tree, if one exists.
+ *
+ * Parameters:
+ *      tree -  The tree to search for a matching entry.
+ *      key -   The key with which to search for a matching entry.
+ *
+ * Returns:
+ *      The matching entry in the tree, or NULL if no matching entry was found.
+ */
+RUMATI_AVL_API
+void *rumati_avl_get(
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    void *data;
+    size_t depth = 0, comparisons = 0;
+
+    RUMATI_AVL_COUNT(tree, gets, 1);
+    RUMATI_AVL_PROBE2(get__entry, tree, key);
+
+    data = rumati_avl_lookup(tree, key, &depth, &comparisons);
+
+    if (RUMATI_AVL_PROBE_ENABLED(get__return)){
+        RUMATI_AVL_PROBE4(get__return, tree, data, depth, comparisons);
+    }
+    return data;
+}
+
+/*
+ * rumati_avl_find_greater_than_or_equal() - returns the node with the lowest
+ * key which is either greater than or equal to the given key, or NULL if
+ * there is none. The node may be a tombstone.
+ */
+static struct rumati_avl_node *rumati_avl_find_greater_than_or_equal(
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    struct rumati_avl_node *n = tree->root;
+    /*
+     * Each time we go left, keep a reference to the node at which we go left.
+     * If we fail to find any nodes greater than or equal to the search key,
+     * then this will be the first entry which is greater than the search key.
+     */
+    struct rumati_avl_node *prev = NULL;
+
+    while (n != NULL){
+        int cmp = rumati_avl_compare(tree, key, n);
+        if (cmp > 0){
+            n = rumati_avl_link(tree, n->right);
+        }else if (cmp < 0){
+            prev = n;
+            n = rumati_avl_link(tree, n->left);
+        }else{
+            return n;
+        }
+    }
+
+    return prev;
+}
+
+/*
+ * rumati_avl_find_less_than_or_equal() - returns the node with the highest
+ * key which is either less than or equal to the given key, or NULL if there
+ * is none. The node may be a tombstone.
+ */
+static struct rumati_avl_node *rumati_avl_find_less_than_or_equal(
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    struct rumati_avl_node *n = tree->root;
+    /*
+     * Each time we go right, keep a reference to the node at which we go
+     * right. If we fail to find any nodes less than or equal to the search
+     * key, then this will be the first entry which is less than the search
+     * key.
+     */
+    struct rumati_avl_node *prev = NULL;
+
+    while (n != NULL){
+        int cmp = rumati_avl_compare(tree, key, n);
+        if (cmp > 0){
+            prev = n;
+            n = rumati_avl_link(tree, n->right);
+        }else if (cmp < 0){
+            n = rumati_avl_link(tree, n->left);
+        }else{
+            return n;
+        }
+    }
+
+    return prev;
+}
+
+/*
+ * rumati_avl_find_greater_than() - returns the node with the lowest key which
+ * is strictly greater than the given key, or NULL if there is none. The node
+ * may be a tombstone.
+ */
+static struct rumati_avl_node *rumati_avl_find_greater_than(
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    struct rumati_avl_node *n = tree->root;
+    struct rumati_avl_node *prev = NULL;
+
+    while (n != NULL){
+        int cmp = rumati_avl_compare(tree, key, n);
+        if (cmp > 0){
+            n = rumati_avl_link(tree, n->right);
+        }else if (cmp < 0){
+            prev = n;
+            n = rumati_avl_link(tree, n->left);
+        }else{
+            if (n->right == NULL){
+                break;
+            }
+            n = rumati_avl_link(tree, n->right);
+            while (n->left != NULL){
+                n = rumati_avl_link(tree, n->left);
+            }
+            return n;
+        }
+    }
+
+    return prev;
+}
+
+/*
+ * rumati_avl_find_less_than() - returns the node with the highest key which
+ * is strictly less than the given key, or NULL if there is none. The node
+ * may be a tombstone.
+ */
+static struct rumati_avl_node *rumati_avl_find_less_than(
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    struct rumati_avl_node *n = tree->root;
+    struct rumati_avl_node *prev = NULL;
+
+    while (n != NULL){
+        int cmp = rumati_avl_compare(tree, key, n);
+        if (cmp > 0){
+            prev = n;
+            n = rumati_avl_link(tree, n->right);
+        }else if (cmp < 0){
+            n = rumati_avl_link(tree, n->left);
+        }else{
+            if (n->left == NULL){
+                break;
+            }
+            n = rumati_avl_link(tree, n->left);
+            while (n->right != NULL){
+                n = rumati_avl_link(tree, n->right);
+            }
+            return n;
+        }
+    }
+
+    return prev;
+}
+
+/*
+ * rumati_avl_path_to() - records the path from the root down to a node of
+ * the tree, not including the node itself.
+ *
+ * Returns:
+ *      true    On success.
+ *      false   If there was an error allocating memory.
+ */
+static bool rumati_avl_path_to(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_path *path,
+        struct rumati_avl_node *target)
+{
+    struct rumati_avl_node *n = tree->root;
+
+    while (n != target){
+        bool left = rumati_avl_compare(tree, target->data, n) < 0;
+
+        if (rumati_avl_path_push(path, n, left) == false){
+            return false;
+        }
+        n = *rumati_avl_child(n, left);
+    }
+    return true;
+}
+
+/*
+ * rumati_avl_path_next() - steps to the next node in order from n, whose
+ * ancestors are on path, and leaves the ancestors of the new node on path.
+ *
+ * Parameters:
+ *      path -  the path down to n
+ *      n -     the node to step from
+ *      up -    true for the next greater node, false for the next smaller
+ *
+ * Returns:
+ *      The next node, or NULL if there is none. If there was an error
+ *      allocating memory, ok is set to false and the path is lost.
+ */
+static struct rumati_avl_node *rumati_avl_path_next(
+        struct rumati_avl_path *path,
+        struct rumati_avl_node *n,
+        bool up,
+        bool *ok)
+{
+    if (*rumati_avl_child(n, !up) != NULL){
+        /* the nearest node of the subtree on that side */
+        if (rumati_avl_path_push(path, n, !up) == false){
+            *ok = false;
+            return NULL;
+        }
+        n = *rumati_avl_child(n, !up);
+        while (*rumati_avl_child(n, up) != NULL){
+            if (rumati_avl_path_push(path, n, up) == false){
+                *ok = false;
+                return NULL;
+            }
+            n = *rumati_avl_child(n, up);
+        }
+        return n;
+    }
+
+    /* otherwise the nearest ancestor whose subtree on that side holds n */
+    while (path->depth > 0){
+        path->depth--;
+        if (rumati_avl_path_left(path, path->depth) == up){
+            return path->node[path->depth];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * rumati_avl_skip() - skips tombstones, moving up to the next greater or
+ * down to the next smaller node until a live node is found. The nodes are
+ * visited in order from n, with the path down to n recorded once, so
+ * skipping k tombstones costs O(k + log n) rather than a search from the
+ * root for each. If the path cannot be recorded, each step searches from
+ * the root instead.
+ *
+ * Returns:
+ *      The data of the first live node from n in that direction, or NULL if
+ *      there is none.
+ */
+static void *rumati_avl_skip(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n,
+        bool up)
+{
+    struct rumati_avl_path path;
+    bool ok;
+
+    if (n == NULL || !rumati_avl_is_tombstone(n)){
+        return n == NULL ? NULL : rumati_avl_data(tree, n);
+    }
+
+    /* images have no tombstones, so their links are not followed here */
+    rumati_avl_path_init(&path, &tree->root);
+    ok = rumati_avl_path_to(tree, &path, n);
+    while (ok && n != NULL && rumati_avl_is_tombstone(n)){
+        struct rumati_avl_node *next = rumati_avl_path_next(&path, n, up, &ok);
+
+        if (ok){
+            n = next;
+        }
+    }
+    rumati_avl_path_release(&path);
+
+    while (n != NULL && rumati_avl_is_tombstone(n)){
+        n = up ? rumati_avl_find_greater_than(tree, n->data) :
+                rumati_avl_find_less_than(tree, n->data);
+    }
+
+    return n == NULL ? NULL : rumati_avl_data(tree, n);
+}
+
+/*
+ * rumati_avl_skip_up() - skips tombstones, moving up to the next greater
+ * node until a live node is found.
+ *
+ * Returns:
+ *      The data of the first live node from n upwards, or NULL if there is
+ *      none.
+ */
+static void *rumati_avl_skip_up(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n)
+{
+    return rumati_avl_skip(tree, n, true);
+}
+
+/*
+ * rumati_avl_skip_down() - skips tombstones, moving down to the next smaller
+ * node until a live node is found.
+ *
+ * Returns:
+ *      The data of the first live node from n downwards, or NULL if there is
+ *      none.
+ */
+static void *rumati_avl_skip_down(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n)
+{
+    return rumati_avl_skip(tree, n, false);
+}
+
+/*
+ * rumati_avl_get_greater_than_or_equal() - returns the lowest key which is
+ * either greater than or equal to the given key.
+ *
+ * Parameters:
+ *      tree -  The tree in which to search for a qualifying entry
+ *      key -   The key which a qualifying entry must be greater than or
+ *              equal to.
+ *
+ * Returns:
+ *      A lowest entry that is greater than or equal to key, or NULL if no
+ *      entry was found which is greater than or equal to key.
+ */
+RUMATI_AVL_API
+void *rumati_avl_get_greater_than_or_equal(
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    return rumati_avl_skip_up(tree,
+            rumati_avl_find_greater_than_or_equal(tree, key));
+}
+
+/*
+ * rumati_avl_get_less_than_or_equal() - returns the highest key which is
+ * either less than or equal to the given key.
+ *
+ * Parameters:
+ *      tree -  The tree in which to search for a qualifying entry
+ *      key -   The key which a qualifying entry must be less than or
+ *              equal to.
+ *
+ * Returns:
+ *      A highest entry that is less than or equal to key, or NULL if no
+ *      entry was found which is less than or equal to key.
+ */
+RUMATI_AVL_API
+void *rumati_avl_get_less_than_or_equal(
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    return rumati_avl_skip_down(tree,
+            rumati_avl_find_less_than_or_equal(tree, key));
+}
+
+/*
+ * rumati_avl_get_greater_than() - retrieves the lowest entry is is scrictly
+ * greater than the search key.
+ *
+ * Parameters:
+ *      tree -  The tree to search.
+ *      key -   The key which a matching entry must be greater than.
+ *
+ * Returns:
+ *      The lowest entry which is scrictly greater than the search key, or
+ *      NULL if there is no entry greater than the search key.
+ */
+RUMATI_AVL_API
+void *rumati_avl_get_greater_than(
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    return rumati_avl_skip_up(tree, rumati_avl_find_greater_than(tree, key));
+}
+
+/*
+ * rumati_avl_get_less_than() - retrieves the lowest entry is is scrictly
+ * less than the search key.
+ *
+ * Parameters:
+ *      tree -  The tree to search.
+ *      key -   The key which a matching entry must be less than.
+ *
+ * Returns:
+ *      The lowest entry which is scrictly less than the search key, or
+ *      NULL if there is no entry less than the search key.
+ */
+RUMATI_AVL_API
+void *rumati_avl_get_less_than(
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    return rumati_avl_skip_down(tree, rumati_avl_find_less_than(tree, key));
+}
+
+/*
+ * rumati_avl_delete_lazy() - turns the node matching key into a tombstone,
+ * instead of removing it from the tree. See rumati_avl_set_lazy_delete().
+ *
+ * Parameters:
+ *      tree -      The tree from which to delete the entry.
+ *      key -       The value by which to find the entry to be deleted.
+ *      old_value - See rumati_avl_delete().
+ *      depth -     Incremented for each level descended to the entry.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       If the entry was deleted successfully.
+ *      RUMATI_AVL_ENOENT   If no matching entry was found.
+ */
+static RUMATI_AVL_ERROR rumati_avl_delete_lazy(
+        RUMATI_AVL_TREE *tree,
+        void *key,
+        void **old_value,
+        size_t *depth)
+{
+    struct rumati_avl_node *n = tree->root;
+
+    while (n != NULL){
+        int cmp = rumati_avl_compare(tree, key, n);
+        if (cmp == 0){
+            break;
+        }
+        n = *rumati_avl_child(n, cmp < 0);
+        (*depth)++;
+    }
+
+    if (n == NULL || rumati_avl_is_tombstone(n)){
+        return RUMATI_AVL_ENOENT;
+    }
+
+    /*
+     * Purge before the node becomes a tombstone rather than after, so that
+     * the value handed back in old_value is not passed to the destructor
+     * before the caller sees it. The node itself survives the purge.
+     */
+    if (tree->purge_percent > 0 &&
+            (tree->tombstones + 1) * 100 >= tree->size * tree->purge_percent){
+        rumati_avl_purge(tree);
+    }
+
+    rumati_avl_touch(tree, n);
+    n->flags |= RUMATI_AVL_NODE_TOMBSTONE;
+    tree->tombstones++;
+    if (old_value != NULL){
+        *old_value = n->data;
+    }
+
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_delete_path() - removes an entry from a weak AVL, red-black or
+ * relaxed tree, recording the path taken down the tree so that balance can
+ * be restored walking back up it.
+ *
+ * Parameters:
+ *      tree -      The tree from which to delete the entry.
+ *      key -       The value by which to find the entry to be deleted.
+ *      old_value - See rumati_avl_delete().
+ *      depth -     Incremented for each level descended to the entry.
+ *
+ * Returns:
+ *      See rumati_avl_delete().
+ */
+static RUMATI_AVL_ERROR rumati_avl_delete_path(
+        RUMATI_AVL_TREE *tree,
+        void *key,
+        void **old_value,
+        size_t *depth)
+{
+    struct rumati_avl_node **parent_link = &tree->root;
+    struct rumati_avl_node *delnode;
+    struct rumati_avl_node *next = NULL;
+    struct rumati_avl_path path;
+    RUMATI_AVL_ERROR err = RUMATI_AVL_OK;
+    void *tmp_data_ptr;
+    int16_t removed_colour;
+
+    rumati_avl_path_init(&path, &tree->root);
+
+    while (1){
+        int cmp;
+
+        if (*parent_link == NULL){
+            /*
+             * We reached a leaf's NULL pointer child link, without finding
+             * a matching entry - none exists.
+             */
+            err = RUMATI_AVL_ENOENT;
+            goto out;
+        }
+
+        /* normal binary search descend based on key comparison */
+        cmp = rumati_avl_compare(tree, key, *parent_link);
+        if (cmp == 0){
+            break;
+        }
+
+        /*
+         * Node to be deleted is on the side of cmp, descend.
+         */
+        if (tree->relaxed){
+            (*parent_link)->flags |= RUMATI_AVL_NODE_DIRTY;
+        }else if (rumati_avl_path_push(&path, *parent_link, cmp < 0) ==
+                false){
+            err = RUMATI_AVL_ENOMEM;
+            goto out;
+        }
+        if (cmp < 0){
+            next = *parent_link;
+        }
+        parent_link = rumati_avl_child(*parent_link, cmp < 0);
+        (*depth)++;
+    }
+
+    /*
+     * This is the node which must be deleted
+     */
+    delnode = *parent_link;
+    tmp_data_ptr = delnode->data;
+
+    if (delnode->left != NULL && delnode->right != NULL){
+        /*
+         * The node to be deleted has two children. We cannot simply
+         * delete it by replacing it with it's only child. So, we
+         * delete it by overwritting its data with that of the left
+         * most node in its right subtree, then deleting that node.
+         * See rumati_avl_delete_top_down() for an example.
+         *
+         * Move right, then as far left as possible.
+         */
+        bool left = false;
+
+        do {
+            if (tree->relaxed){
+                (*parent_link)->flags |= RUMATI_AVL_NODE_DIRTY;
+            }else if (rumati_avl_path_push(&path, *parent_link, left) ==
+                    false){
+                err = RUMATI_AVL_ENOMEM;
+                goto out;
+            }
+            parent_link = rumati_avl_child(*parent_link, left);
+            left = true;
+        } while ((*parent_link)->left != NULL);
+
+        /*
+         * Overwrite node to be deleted with replacement node.
+         */
+        rumati_avl_move_data(tree, delnode, *parent_link);
+        delnode = *parent_link;
+    }else{
+        rumati_avl_count_removed(tree, delnode, next);
+    }
+
+    /*
+     * Delete the node in place, by replacing it with it's only child if it
+     * has one, or by making it's parent a leaf if it has no children.
+     */
+    if (delnode->right == NULL){
+        *parent_link = delnode->left;
+    }else{
+        *parent_link = delnode->right;
+    }
+
+    /*
+     * If the user has given an "out" variable for the deleted value,
+     * populate it with the deleted value.
+     */
+    if (old_value != NULL){
+        *old_value = tmp_data_ptr;
+    }
+    removed_colour = delnode->balance;
+    rumati_avl_free_node(tree, delnode);
+
+    if (tree->relaxed){
+        tree->unbalanced = true;
+    }else if (tree->balance == RUMATI_AVL_BALANCE_WAVL){
+        rumati_avl_delete_wavl(tree, &path, *parent_link);
+    }else{
+        rumati_avl_delete_rb(tree, &path, *parent_link, removed_colour);
+    }
+
+out:
+    rumati_avl_path_release(&path);
+    return err;
+}
+
+/*
+ * rumati_avl_delete() - removes an entry from a tree.
+ *
+ * Parameters:
+ *      tree -      The tree from which to delete the entry.
+ *      key -       The value by which to find the entry to be deleted.
+ *      old_value - A pointer which will be populated with a pointer to
+ *                  the deleted entry if one is found. You should then release
+ *                  the memory held by the deleted entry. You may pass NULL as
+ *                  old_value, but then you will have no opportunity to
+ *                  release the memory used by the deleted entry, which will
+ *                  be a memory leak in most uses.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       If the entry was deleted successfully.
+ *      RUMATI_AVL_ENOENT   If no matching entry was found.
+ *      RUMATI_AVL_ENOMEM   If the path down a weak AVL or red-black tree
+ *                          was too long to record without allocating memory,
+ *                          and the allocation failed. The tree is unchanged.
+ *      RUMATI_AVL_EROFS    If the tree is an image, see
+ *                          rumati_avl_open_image().
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_delete(
+        RUMATI_AVL_TREE *tree,
+        void *key,
+        void **old_value)
+{
+    RUMATI_AVL_ERROR err;
+    size_t depth = 0;
+#ifdef RUMATI_AVL_COUNTERS
+    unsigned long long comparisons = tree->stats.comparisons;
+#endif
+
+    RUMATI_AVL_PROBE2(delete__entry, tree, key);
+
+    if (tree->image != NULL){
+        err = RUMATI_AVL_EROFS;
+    }else if (tree->lazy_destructor != NULL){
+        err = rumati_avl_delete_lazy(tree, key, old_value, &depth);
+    }else if (tree->balance == RUMATI_AVL_BALANCE_AVL && !tree->relaxed){
+        err = rumati_avl_delete_top_down(tree, key, old_value, &depth);
+    }else{
+        err = rumati_avl_delete_path(tree, key, old_value, &depth);
+    }
+
+#ifdef RUMATI_AVL_COUNTERS
+    comparisons = tree->stats.comparisons - comparisons;
+    RUMATI_AVL_COUNT(tree, deletes, 1);
+    RUMATI_AVL_COUNT(tree, path_total, comparisons);
+    RUMATI_AVL_COUNT_MAX(tree, path_max, comparisons);
+#endif
+    if (RUMATI_AVL_PROBE_ENABLED(delete__return)){
+        RUMATI_AVL_PROBE4(delete__return, tree, err, depth,
+                depth + (err == RUMATI_AVL_OK));
+    }
+    return err;
+}
+
+/*
+ * rumati_avl_get_smallest() - retrieves the smallest entry in the tree.
+ *
+ * Parameters:
+ *      tree -  The tree in which to find the smallest value.
+ * 
+ * Returns:
+ *      A pointer to the smallest value in the tree, or NULL if the tree
+ *      is empty.
+ */
+RUMATI_AVL_API
+void *rumati_avl_get_smallest(RUMATI_AVL_TREE *tree)
+{
+    struct rumati_avl_node *n = tree->root;
+    
+    if (n == NULL){
+        return NULL;
+    }
+
+    while (n->left != NULL){
+        n = n->left;
+    }
+
+    return rumati_avl_skip_up(tree, n);
+}
+
+/*
+ * rumati_avl_get_greatest() - retrieves the greatest entry in the tree.
+ *
+ * Parameters:
+ *      tree -  The tree in which to find the greatest value.
+ * 
+ * Returns:
+ *      A pointer to the greatest value in the tree, or NULL if the tree
+ *      is empty.
+ */
+RUMATI_AVL_API
+void *rumati_avl_get_greatest(RUMATI_AVL_TREE *tree)
+{
+    struct rumati_avl_node *n = tree->root;
+    
+    if (n == NULL){
+        return NULL;
+    }
+
+    while (n->right != NULL){
+        n = n->right;
+    }
+
+    return rumati_avl_skip_down(tree, n);
+}
+
+/*
+ * rumati_avl_to_vine() - flattens a subtree into a "vine", a list of nodes
+ * in order, linked through their right child links. Uses rotations, so no
+ * extra memory is needed for subtrees of any height.
+ *
+ * Parameters:
+ *      node_ptr -  A pointer to the pointer to the root of the subtree. This
+ *                  will point to the first node of the vine afterwards.
+ *
+ * Returns:
+ *      The number of nodes in the vine.
+ */
+static size_t rumati_avl_to_vine(struct rumati_avl_node **node_ptr)
+{
+    size_t size = 0;
+
+    while (*node_ptr != NULL){
+        if ((*node_ptr)->left != NULL){
+            rumati_avl_lift(node_ptr, true);
+        }else{
+            size++;
+            node_ptr = &(*node_ptr)->right;
+        }
+    }
+
+    return size;
+}
+
+/*
+ * rumati_avl_build_height() - returns the height of a subtree of size nodes
+ * built by rumati_avl_build(), ie. the number of bits needed to hold size.
+ */
+static unsigned int rumati_avl_build_height(size_t size)
+{
+    unsigned int height = 0;
+
+    while (size > 0){
+        height++;
+        size >>= 1;
+    }
+
+    return height;
+}
+
+/*
+ * rumati_avl_build_balance() - returns the balance field of the root of a
+ * subtree of size nodes built by rumati_avl_build(), for a balancing scheme.
+ */
+static int16_t rumati_avl_build_balance(
+        RUMATI_AVL_BALANCE balance,
+        size_t size,
+        unsigned int depth,
+        unsigned int red_depth)
+{
+    size_t left_size = (size - 1) / 2;
+
+    switch (balance){
+    case RUMATI_AVL_BALANCE_WAVL:
+        return (int16_t)(rumati_avl_build_height(size) - 1);
+    case RUMATI_AVL_BALANCE_RB:
+        if (depth == red_depth && depth > 0){
+            return RUMATI_AVL_RED;
+        }
+        return RUMATI_AVL_BLACK;
+    default:
+        return (int16_t)(rumati_avl_build_height(size - left_size - 1) -
+                rumati_avl_build_height(left_size));
+    }
+}
+
+/*
+ * rumati_avl_build() - builds a perfectly balanced subtree from the first
+ * size nodes of a vine, and fills in the balance fields for the tree's
+ * balancing scheme. The recursion depth is the height of the new subtree.
+ *
+ * Each subtree is split around its middle node, so the heights of the left
+ * and right subtrees of any node differ by at most one, and all leaves are
+ * on the bottom two levels. Red-black trees colour the bottom level red if
+ * it is not the top level, all other nodes are black.
+ *
+ * Parameters:
+ *      tree -      the tree the nodes belong to
+ *      vine -      A pointer to the first node in the vine. This is advanced
+ *                  past the nodes used.
+ *      size -      the number of nodes to use
+ *      depth -     the depth of the new subtree's root
+ *      red_depth - the depth at which red-black nodes are coloured red
+ *
+ * Returns:
+ *      The root of the new subtree.
+ */
+static struct rumati_avl_node *rumati_avl_build(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node **vine,
+        size_t size,
+        unsigned int depth,
+        unsigned int red_depth)
+{
+    struct rumati_avl_node *left;
+    struct rumati_avl_node *n;
+    size_t left_size = (size - 1) / 2;
+
+    if (size == 0){
+        return NULL;
+    }
+
+    left = rumati_avl_build(tree, vine, left_size, depth + 1, red_depth);
+    n = *vine;
+    *vine = n->right;
+    n->left = left;
+    n->right = rumati_avl_build(tree, vine, size - left_size - 1, depth + 1,
+            red_depth);
+
+    n->balance = rumati_avl_build_balance(tree->balance, size, depth,
+            red_depth);
+    n->flags &= ~RUMATI_AVL_NODE_DIRTY;
+
+    return n;
+}
+
+/*
+ * rumati_avl_rebuild() - rebuilds a subtree as a perfectly balanced subtree.
+ *
+ * Parameters:
+ *      tree -      the tree to which the subtree belongs
+ *      node_ptr -  A pointer to the pointer to the root of the subtree.
+ *
+ * Returns:
+ *      The number of nodes in the subtree.
+ */
+static size_t rumati_avl_rebuild(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node **node_ptr)
+{
+    struct rumati_avl_node *vine;
+    size_t size;
+
+    size = rumati_avl_to_vine(node_ptr);
+    vine = *node_ptr;
+    *node_ptr = rumati_avl_build(tree, &vine, size, 0,
+            rumati_avl_build_height(size) - 1);
+    return size;
+}
+
+/*
+ * The height of a subtree visited by rumati_avl_rebalance().
+ */
+struct rumati_avl_rebalance_height {
+    /* height now, or once rebuilt if pending */
+    size_t height;
+    /* the number of nodes, if pending */
+    size_t size;
+    /* true if the subtree is to be rebuilt, but has not been yet */
+    bool pending;
+};
+
+/*
+ * A subtree being visited by rumati_avl_rebalance().
+ */
+struct rumati_avl_rebalance_frame {
+    /* the link to the root of the subtree */
+    struct rumati_avl_node **node_ptr;
+    /* 0 before the left subtree, 1 before the right, 2 when done */
+    int stage;
+    /* the left subtree, once it has been visited */
+    struct rumati_avl_rebalance_height left;
+};
+
+/*
+ * rumati_avl_clean_height() - returns the height of a subtree which no
+ * relaxed mode update has been made under, from its balance fields. For
+ * weak AVL trees this is the root's rank plus one, which may be more than
+ * the height, but is what the parent's rank is worked out from.
+ */
+static size_t rumati_avl_clean_height(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n)
+{
+    size_t height = 0;
+
+    if (n != NULL && tree->balance == RUMATI_AVL_BALANCE_WAVL){
+        return (size_t)n->balance + 1;
+    }
+
+    /* follow the higher child down */
+    while (n != NULL){
+        height++;
+        n = n->balance < 0 ? n->left : n->right;
+    }
+    return height;
+}
+
+/*
+ * rumati_avl_count() - counts the nodes of a balanced subtree.
+ */
+static size_t rumati_avl_count(struct rumati_avl_node *n)
+{
+    if (n == NULL){
+        return 0;
+    }
+    return 1 + rumati_avl_count(n->left) + rumati_avl_count(n->right);
+}
+
+/*
+ * rumati_avl_rebalance_node() - restores the balance of a marked node, once
+ * both its subtrees have been visited.
+ *
+ * A node which is out of balance is not rebuilt straight away, but left
+ * pending, with the height it will have once rebuilt, since its parent is
+ * often out of balance too (every node of a list built by sorted inserts
+ * is). Pending subtrees are rebuilt by the first parent which is in
+ * balance, or at the root, so the highest node of each run of nodes out of
+ * balance is rebuilt once, instead of every node on the way up.
+ *
+ * Parameters:
+ *      tree -      the tree
+ *      node_ptr -  the link to the node
+ *      left -      the left subtree
+ *      right -     the right subtree, replaced by the node's subtree
+ */
+static void rumati_avl_rebalance_node(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node **node_ptr,
+        struct rumati_avl_rebalance_height *left,
+        struct rumati_avl_rebalance_height *right)
+{
+    struct rumati_avl_node *n = *node_ptr;
+    size_t height;
+
+    if (left->height > right->height + 1 ||
+            right->height > left->height + 1){
+        /* the counts are made once, since a pending subtree has its size */
+        right->size = 1 +
+                (left->pending ? left->size : rumati_avl_count(n->left)) +
+                (right->pending ? right->size : rumati_avl_count(n->right));
+        right->height = rumati_avl_build_height(right->size);
+        right->pending = true;
+        return;
+    }
+
+    if (left->pending){
+        rumati_avl_rebuild(tree, &n->left);
+    }
+    if (right->pending){
+        rumati_avl_rebuild(tree, &n->right);
+    }
+
+    if (tree->balance == RUMATI_AVL_BALANCE_AVL){
+        n->balance = (int16_t)(right->height - left->height);
+    }
+    height = (left->height > right->height ? left->height : right->height) + 1;
+    if (tree->balance == RUMATI_AVL_BALANCE_WAVL){
+        n->balance = (int16_t)(height - 1);
+    }
+    n->flags &= ~RUMATI_AVL_NODE_DIRTY;
+    right->height = height;
+    right->pending = false;
+}
+
+/*
+ * rumati_avl_rebalance() - restores the balance of a tree after updates made
+ * in relaxed mode.
+ *
+ * Parameters:
+ *      tree -  the tree to rebalance
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success, or if the tree was already balanced.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory. The tree
+ *                          remains usable, but is still unbalanced.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_rebalance(RUMATI_AVL_TREE *tree)
+{
+    struct rumati_avl_rebalance_frame *stack;
+    struct rumati_avl_rebalance_height sub;
+    size_t capacity = 64;
+    size_t depth = 0;
+
+    if (!tree->unbalanced){
+        return RUMATI_AVL_OK;
+    }
+
+    if (tree->balance == RUMATI_AVL_BALANCE_RB){
+        /*
+         * A subtree cannot be rebuilt without also changing its black height,
+         * so red-black trees are always rebuilt as a whole.
+         */
+        rumati_avl_rebuild(tree, &tree->root);
+        tree->unbalanced = false;
+        return RUMATI_AVL_OK;
+    }
+
+    stack = malloc(capacity * sizeof(*stack));
+    if (stack == NULL){
+        return RUMATI_AVL_ENOMEM;
+    }
+
+    /*
+     * Walk the marked nodes in post order, working out the height of every
+     * subtree below them. Subtrees with no marked root have not changed, so
+     * their heights come from their balance fields. The stack is kept on
+     * the heap, since the tree may be arbitrarily high.
+     */
+    sub.height = rumati_avl_clean_height(tree, tree->root);
+    sub.pending = false;
+    if (tree->root != NULL && (tree->root->flags & RUMATI_AVL_NODE_DIRTY)){
+        stack[0].node_ptr = &tree->root;
+        stack[0].stage = 0;
+        depth = 1;
+    }
+
+    while (depth > 0){
+        struct rumati_avl_rebalance_frame *frame = &stack[depth - 1];
+        struct rumati_avl_node *n = *frame->node_ptr;
+        struct rumati_avl_node **child = NULL;
+
+        if (frame->stage == 0){
+            frame->stage = 1;
+            child = &n->left;
+        }else if (frame->stage == 1){
+            frame->left = sub;
+            frame->stage = 2;
+            child = &n->right;
+        }
+
+        if (child != NULL){
+            if (*child == NULL ||
+                    !((*child)->flags & RUMATI_AVL_NODE_DIRTY)){
+                sub.height = rumati_avl_clean_height(tree, *child);
+                sub.pending = false;
+                continue;
+            }
+            if (depth == capacity){
+                struct rumati_avl_rebalance_frame *bigger;
+
+                bigger = realloc(stack, capacity * 2 * sizeof(*stack));
+                if (bigger == NULL){
+                    /* every node still out of balance is still marked */
+                    free(stack);
+                    return RUMATI_AVL_ENOMEM;
+                }
+                stack = bigger;
+                capacity *= 2;
+            }
+            stack[depth].node_ptr = child;
+            stack[depth].stage = 0;
+            depth++;
+            continue;
+        }
+
+        /* both subtrees done, sub holds the right subtree */
+        rumati_avl_rebalance_node(tree, frame->node_ptr, &frame->left, &sub);
+        depth--;
+    }
+
+    if (sub.pending){
+        rumati_avl_rebuild(tree, &tree->root);
+    }
+
+    free(stack);
+    tree->unbalanced = false;
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_set_relaxed() - switches relaxed mode on or off.
+ *
+ * Parameters:
+ *      tree -      the tree
+ *      relaxed -   non-zero to switch relaxed mode on, zero to switch it off
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOMEM   If relaxed mode was being switched off, and
+ *                          rebalancing the tree failed. The tree stays in
+ *                          relaxed mode.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_set_relaxed(
+        RUMATI_AVL_TREE *tree,
+        int relaxed)
+{
+    if (!relaxed){
+        RUMATI_AVL_ERROR err = rumati_avl_rebalance(tree);
+        if (err != RUMATI_AVL_OK){
+            return err;
+        }
+    }
+
+    tree->relaxed = relaxed != 0;
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_purge() - removes all tombstones from the tree, passing their
+ * values to the destructor given to rumati_avl_set_lazy_delete(). The
+ * remaining nodes are rebuilt into a perfectly balanced tree.
+ *
+ * Parameters:
+ *      tree -  the tree to purge
+ */
+RUMATI_AVL_API
+void rumati_avl_purge(RUMATI_AVL_TREE *tree)
+{
+    struct rumati_avl_node **node_ptr = &tree->root;
+    struct rumati_avl_node *vine;
+    size_t size = 0;
+    size_t removed = 0;
+
+    if (tree->tombstones == 0){
+        return;
+    }
+
+    rumati_avl_to_vine(&tree->root);
+    while (*node_ptr != NULL){
+        struct rumati_avl_node *n = *node_ptr;
+
+        if (rumati_avl_is_tombstone(n)){
+            void *data = n->data;
+
+            /* see rumati_avl_count_removed() */
+            if (tree->track_changes){
+                removed += rumati_avl_removed_take(tree, n) +
+                        rumati_avl_in_snapshot(tree, n);
+            }
+            /* the data is needed to free the node, so destroy it after */
+            *node_ptr = n->right;
+            rumati_avl_free_node(tree, n);
+            tree->lazy_destructor(tree->udata, data);
+        }else{
+            rumati_avl_removed_add(tree, n, removed);
+            removed = 0;
+            size++;
+            node_ptr = &n->right;
+        }
+    }
+    rumati_avl_removed_add(tree, NULL, removed);
+    tree->tombstones = 0;
+
+    vine = tree->root;
+    tree->root = rumati_avl_build(tree, &vine, size, 0,
+            rumati_avl_build_height(size) - 1);
+    tree->unbalanced = false;
+}
+
+/*
+ * rumati_avl_set_lazy_delete() - switches lazy delete on or off.
+ *
+ * Parameters:
+ *      tree -          the tree
+ *      destructor -    the destructor for the values of tombstones, or NULL
+ *                      to switch lazy delete off.
+ *      purge_percent - the percentage of the nodes in the tree which may be
+ *                      tombstones before they are purged automatically, or 0
+ *                      to only purge from rumati_avl_purge().
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If purge_percent is greater than 100.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_set_lazy_delete(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_NODE_DESTRUCTOR destructor,
+        unsigned int purge_percent)
+{
+    if (purge_percent > 100){
+        return RUMATI_AVL_EINVAL;
+    }
+
+    if (destructor == NULL){
+        /* normal deletes cannot deal with tombstones */
+        rumati_avl_purge(tree);
+    }
+
+    tree->lazy_destructor = destructor;
+    tree->purge_percent = purge_percent;
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_set_cache() - sets up, resizes or removes the lookup cache.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      hash -  the hash function for keys, or NULL to remove the cache
+ *      slots - the number of slots in the cache, or 0 to remove the cache
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If slots is too large.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory. The tree
+ *                          keeps its previous cache, if any.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_set_cache(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_HASH hash,
+        size_t slots)
+{
+    struct rumati_avl_node **cache;
+    size_t size = 1;
+
+    if (hash == NULL || slots == 0){
+        free(tree->cache);
+        tree->cache_hash = NULL;
+        tree->cache = NULL;
+        tree->cache_mask = 0;
+        return RUMATI_AVL_OK;
+    }
+
+    /* round up to a power of two, so a slot is found with a mask */
+    while (size < slots){
+        if (size > ((size_t)-1 / sizeof(*cache)) / 2){
+            return RUMATI_AVL_EINVAL;
+        }
+        size *= 2;
+    }
+
+    cache = calloc(size, sizeof(*cache));
+    if (cache == NULL){
+        return RUMATI_AVL_ENOMEM;
+    }
+
+    free(tree->cache);
+    tree->cache_hash = hash;
+    tree->cache = cache;
+    tree->cache_mask = size - 1;
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * A node of rumati_avl_walk_stack(), and its depth
+ */
+struct rumati_avl_walk_frame {
+    struct rumati_avl_node *n;
+    size_t depth;
+};
+
+/*
+ * rumati_avl_walk_stack() - calls a function for every node of the tree,
+ * including tombstones, in order, with the depth of the node (0 for the
+ * root) and a caller's pointer. The way back up is kept on a stack, which
+ * grows as needed, since relaxed mode trees may be far deeper than
+ * balanced ones. Nothing in the tree is written, so pages shared
+ * copy-on-write with a forked parent stay shared, and the nodes of a read
+ * only image can be walked. The function must not change the tree.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOMEM   If the stack could not grow. Nodes after the last
+ *                          one visited are not visited.
+ */
+static RUMATI_AVL_ERROR rumati_avl_walk_stack(
+        RUMATI_AVL_TREE *tree,
+        void (*visit)(RUMATI_AVL_TREE *tree, struct rumati_avl_node *n,
+                size_t depth, void *arg),
+        void *arg)
+{
+    struct rumati_avl_walk_frame *stack;
+    struct rumati_avl_node *n = tree->root;
+    size_t capacity = 64;
+    size_t sp = 0;
+    size_t depth = 0;
+
+    stack = malloc(capacity * sizeof(*stack));
+    if (stack == NULL){
+        return RUMATI_AVL_ENOMEM;
+    }
+
+    while (n != NULL || sp > 0){
+        while (n != NULL){
+            if (sp == capacity){
+                struct rumati_avl_walk_frame *grown;
+
+                grown = realloc(stack, 2 * capacity * sizeof(*stack));
+                if (grown == NULL){
+                    free(stack);
+                    return RUMATI_AVL_ENOMEM;
+                }
+                stack = grown;
+                capacity *= 2;
+            }
+            stack[sp].n = n;
+            stack[sp].depth = depth;
+            sp++;
+            n = rumati_avl_link(tree, n->left);
+            depth++;
+        }
+        sp--;
+        visit(tree, stack[sp].n, stack[sp].depth, arg);
+        n = rumati_avl_link(tree, stack[sp].n->right);
+        depth = stack[sp].depth + 1;
+    }
+
+    free(stack);
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_index_visit() - adds a node to the hash index, for
+ * rumati_avl_walk_stack().
+ */
+static void rumati_avl_index_visit(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n,
+        size_t depth,
+        void *arg)
+{
+    (void)depth;
+    (void)arg;
+    rumati_avl_index_add(tree,
+            tree->index_hash(tree->udata, rumati_avl_data(tree, n)), n);
+}
+
+/*
+ * rumati_avl_set_index() - builds or removes the hash index.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      hash -  the hash function for keys, or NULL to remove the index
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory. The tree
+ *                          has no index.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_set_index(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_HASH hash)
+{
+    size_t capacity = 16;
+
+    free(tree->index);
+    tree->index_hash = NULL;
+    tree->index = NULL;
+    tree->index_mask = 0;
+    tree->index_count = 0;
+
+    if (hash == NULL){
+        return RUMATI_AVL_OK;
+    }
+
+    while (capacity < tree->size * 2){
+        capacity *= 2;
+    }
+    tree->index = calloc(capacity, sizeof(*tree->index));
+    if (tree->index == NULL){
+        return RUMATI_AVL_ENOMEM;
+    }
+    tree->index_hash = hash;
+    tree->index_mask = capacity - 1;
+
+    if (rumati_avl_walk_stack(tree, rumati_avl_index_visit, NULL) !=
+            RUMATI_AVL_OK){
+        rumati_avl_set_index(tree, NULL);
+        return RUMATI_AVL_ENOMEM;
+    }
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_filter_visit() - adds a node to the negative lookup filter, for
+ * rumati_avl_walk_stack().
+ */
+static void rumati_avl_filter_visit(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n,
+        size_t depth,
+        void *arg)
+{
+    (void)depth;
+    (void)arg;
+    rumati_avl_filter_update(tree, rumati_avl_data(tree, n), true);
+}
+
+/*
+ * rumati_avl_set_filter() - builds or removes the negative lookup filter.
+ *
+ * Parameters:
+ *      tree -      the tree
+ *      hash -      the hash function for keys, or NULL to remove the filter
+ *      counters -  the number of counters, or 0 to remove the filter
+ *      probes -    the number of counters per key, from 1 to 16
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If probes is out of range, or counters is too
+ *                          large.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory. The tree
+ *                          has no filter.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_set_filter(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_HASH hash,
+        size_t counters,
+        unsigned int probes)
+{
+    size_t size = 1;
+
+    if (hash != NULL && counters != 0 && (probes < 1 || probes > 16)){
+        return RUMATI_AVL_EINVAL;
+    }
+
+    free(tree->filter);
+    tree->filter_hash = NULL;
+    tree->filter = NULL;
+    tree->filter_mask = 0;
+    tree->filter_probes = 0;
+    tree->filter_lookups = 0;
+    tree->filter_rejected = 0;
+    tree->filter_false_positives = 0;
+
+    if (hash == NULL || counters == 0){
+        return RUMATI_AVL_OK;
+    }
+
+    while (size < counters){
+        if (size > (size_t)-1 / 2){
+            return RUMATI_AVL_EINVAL;
+        }
+        size *= 2;
+    }
+
+    tree->filter = calloc(size, 1);
+    if (tree->filter == NULL){
+        return RUMATI_AVL_ENOMEM;
+    }
+    tree->filter_hash = hash;
+    tree->filter_mask = size - 1;
+    tree->filter_probes = probes;
+
+    if (rumati_avl_walk_stack(tree, rumati_avl_filter_visit, NULL) !=
+            RUMATI_AVL_OK){
+        rumati_avl_set_filter(tree, NULL, 0, 0);
+        return RUMATI_AVL_ENOMEM;
+    }
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_get_filter_stats() - reports the size and effectiveness of the
+ * negative lookup filter.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      stats - populated with the statistics
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOENT   If the tree has no filter.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_get_filter_stats(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_FILTER_STATS *stats)
+{
+    size_t used = 0;
+    size_t i;
+    unsigned int p;
+
+    if (tree->filter == NULL){
+        return RUMATI_AVL_ENOENT;
+    }
+
+    for (i = 0; i <= tree->filter_mask; i++){
+        if (tree->filter[i] != 0){
+            used++;
+        }
+    }
+
+    stats->bytes = tree->filter_mask + 1;
+    stats->counters = tree->filter_mask + 1;
+    stats->probes = tree->filter_probes;
+    stats->used = used;
+    stats->lookups = tree->filter_lookups;
+    stats->rejected = tree->filter_rejected;
+    stats->false_positives = tree->filter_false_positives;
+
+    /* a missing key passes if all its probes hit used counters */
+    stats->expected_fp_rate = 1.0;
+    for (p = 0; p < tree->filter_probes; p++){
+        stats->expected_fp_rate *= (double)used / stats->counters;
+    }
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_get_stats() - reads the operation counters of a tree.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      stats - populated with the counters
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOENT   If the library was built without
+ *                          RUMATI_AVL_COUNTERS. stats is populated with
+ *                          zeros.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_get_stats(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_STATS *stats)
+{
+    *stats = tree->stats;
+#ifdef RUMATI_AVL_COUNTERS
+    return RUMATI_AVL_OK;
+#else
+    return RUMATI_AVL_ENOENT;
+#endif
+}
+
+/*
+ * rumati_avl_reset_stats() - sets all the operation counters of a tree to
+ * zero.
+ *
+ * Parameters:
+ *      tree -  the tree
+ */
+RUMATI_AVL_API
+void rumati_avl_reset_stats(RUMATI_AVL_TREE *tree)
+{
+    memset(&tree->stats, 0, sizeof(tree->stats));
+}
+
+/*
+ * rumati_avl_block_bytes() - returns the memory taken by a block allocated
+ * with malloc(), including the allocator's header and rounding.
+ *
+ * Parameters:
+ *      block - the block, or NULL if it is not allocated
+ *      size -  the size requested for the block
+ */
+static size_t rumati_avl_block_bytes(void *block, size_t size)
+{
+    size_t align = 2 * sizeof(void*);
+
+    if (block == NULL){
+        return 0;
+    }
+#ifdef __GLIBC__
+    (void)align;
+    (void)size;
+    return malloc_usable_size(block) + sizeof(size_t);
+#else
+    return (size + sizeof(size_t) + align - 1) / align * align;
+#endif
+}
+
+/*
+ * rumati_avl_memory_usage() - reports the memory used by a tree.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      usage - populated with the memory used
+ */
+RUMATI_AVL_API
+void rumati_avl_memory_usage(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_MEMORY *usage)
+{
+    size_t node_block;
+    size_t bytes;
+
+    usage->entries = tree->size - tree->tombstones;
+    usage->nodes = tree->size;
+    usage->tree_bytes = sizeof(*tree);
+    usage->node_bytes = tree->size * sizeof(struct rumati_avl_node);
+    usage->cache_bytes = tree->cache == NULL ? 0 :
+            (tree->cache_mask + 1) * sizeof(*tree->cache);
+    usage->index_bytes = tree->index == NULL ? 0 :
+            (tree->index_mask + 1) * sizeof(*tree->index);
+    usage->filter_bytes = tree->filter == NULL ? 0 :
+            (tree->filter_mask + 1) * sizeof(*tree->filter);
+
+    /*
+     * All nodes are the same size, so the root stands for them all. Nodes
+     * of an image are not allocated, and have no overhead.
+     */
+    node_block = tree->image != NULL ? sizeof(struct rumati_avl_node) :
+            rumati_avl_block_bytes(tree->root,
+                sizeof(struct rumati_avl_node));
+    bytes = rumati_avl_block_bytes(tree, sizeof(*tree)) +
+            tree->size * node_block +
+            rumati_avl_block_bytes(tree->cache, usage->cache_bytes) +
+            rumati_avl_block_bytes(tree->index, usage->index_bytes) +
+            rumati_avl_block_bytes(tree->filter, usage->filter_bytes);
+
+    usage->total_bytes = bytes;
+    usage->overhead_bytes = bytes - usage->tree_bytes - usage->node_bytes -
+            usage->cache_bytes - usage->index_bytes - usage->filter_bytes;
+    usage->slack_bytes = tree->tombstones * node_block;
+    if (tree->index != NULL){
+        usage->slack_bytes += (tree->index_mask + 1 - tree->index_count) *
+                sizeof(*tree->index);
+    }
+    usage->bytes_per_entry = usage->entries == 0 ? 0.0 :
+            (double)bytes / usage->entries;
+}
+
+/*
+ * rumati_avl_shape_visit() - adds a node to the depth histogram, for
+ * rumati_avl_walk_stack().
+ */
+static void rumati_avl_shape_visit(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n,
+        size_t depth,
+        void *arg)
+{
+    RUMATI_AVL_SHAPE *shape = arg;
+
+    (void)tree;
+    (void)n;
+
+    shape->nodes++;
+    shape->depths[depth < RUMATI_AVL_SHAPE_DEPTHS ?
+            depth : RUMATI_AVL_SHAPE_DEPTHS - 1]++;
+    shape->average_depth += depth;
+    if (depth > shape->max_depth){
+        shape->max_depth = depth;
+    }
+}
+
+/*
+ * rumati_avl_get_shape() - reports the depths of the nodes of the tree, and
+ * the expected cost of searches.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      shape - populated with the shape of the tree
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_get_shape(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_SHAPE *shape)
+{
+    size_t level = 1;
+    size_t left;
+    size_t depth;
+    double ideal = 0;
+
+    memset(shape, 0, sizeof(*shape));
+    if (rumati_avl_walk_stack(tree, rumati_avl_shape_visit, shape) !=
+            RUMATI_AVL_OK){
+        memset(shape, 0, sizeof(*shape));
+        return RUMATI_AVL_ENOMEM;
+    }
+    if (shape->nodes == 0){
+        return RUMATI_AVL_OK;
+    }
+
+    /*
+     * average_depth holds the internal path length I so far. A search for
+     * a node at depth d makes d + 1 comparisons. The n + 1 empty links have
+     * an external path length of I + 2n, and a search ending at one makes
+     * as many comparisons as its depth.
+     */
+    shape->successful_search_cost =
+            shape->average_depth / shape->nodes + 1;
+    shape->unsuccessful_search_cost =
+            (shape->average_depth + 2.0 * shape->nodes) / (shape->nodes + 1);
+    shape->average_depth /= shape->nodes;
+
+    /* a perfectly balanced tree fills every level but the last */
+    for (depth = 0, left = shape->nodes; left > 0; depth++){
+        size_t count = left < level ? left : level;
+
+        ideal += (double)count * depth;
+        left -= count;
+        level *= 2;
+    }
+    shape->ideal_average_depth = ideal / shape->nodes;
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * Summary of a checked subtree, see rumati_avl_check().
+ */
+struct rumati_avl_check_result {
+    /*
+     * Height, 0 for an empty subtree, and number of black nodes on every
+     * path down from the subtree's root, for red-black trees.
+     */
+    size_t height;
+    size_t black_height;
+    /*
+     * Nodes and tombstones in the subtree
+     */
+    size_t nodes;
+    size_t tombstones;
+    /*
+     * Smallest and greatest nodes in the subtree, NULL if it is empty
+     */
+    struct rumati_avl_node *min;
+    struct rumati_avl_node *max;
+};
+
+/*
+ * A node on the stack of rumati_avl_check_subtree(), with the summary of
+ * its left subtree once that has been checked.
+ */
+struct rumati_avl_check_frame {
+    struct rumati_avl_node *n;
+    size_t depth;
+    int stage;      /* 0 before the left subtree, 1 before the right one */
+    struct rumati_avl_check_result left;
+};
+
+/*
+ * rumati_avl_check_node() - checks a node against the summaries of its
+ * subtrees, and summarises the subtree rooted at the node.
+ *
+ * Returns:
+ *      true if the node passed all checks in flags.
+ */
+static bool rumati_avl_check_node(
+        RUMATI_AVL_TREE *tree,
+        unsigned int flags,
+        struct rumati_avl_node *n,
+        struct rumati_avl_check_result *left,
+        struct rumati_avl_check_result *right,
+        struct rumati_avl_check_result *out)
+{
+    size_t high = left->height > right->height ? left->height : right->height;
+    struct rumati_avl_node *l = rumati_avl_link(tree, n->left);
+    struct rumati_avl_node *r = rumati_avl_link(tree, n->right);
+    void *data = rumati_avl_data(tree, n);
+
+    if (flags & RUMATI_AVL_CHECK_ORDER){
+        if (left->max != NULL && tree->comparator(tree->udata,
+                    rumati_avl_data(tree, left->max), data) >= 0){
+            return false;
+        }
+        if (right->min != NULL && tree->comparator(tree->udata,
+                    data, rumati_avl_data(tree, right->min)) >= 0){
+            return false;
+        }
+    }
+
+    if ((flags & RUMATI_AVL_CHECK_BALANCE) && !tree->unbalanced){
+        int left_diff, right_diff;
+
+        switch (tree->balance){
+        case RUMATI_AVL_BALANCE_WAVL:
+            left_diff = n->balance - rumati_avl_rank(l);
+            right_diff = n->balance - rumati_avl_rank(r);
+            if (left_diff < 1 || left_diff > 2 ||
+                    right_diff < 1 || right_diff > 2 ||
+                    (l == NULL && r == NULL && n->balance != 0)){
+                return false;
+            }
+            break;
+        case RUMATI_AVL_BALANCE_RB:
+            if ((n->balance != RUMATI_AVL_RED &&
+                        n->balance != RUMATI_AVL_BLACK) ||
+                    (rumati_avl_is_red(n) && (rumati_avl_is_red(l) ||
+                        rumati_avl_is_red(r))) ||
+                    left->black_height != right->black_height){
+                return false;
+            }
+            break;
+        default:
+            if ((ptrdiff_t)left->height + n->balance !=
+                    (ptrdiff_t)right->height ||
+                    n->balance < -1 || n->balance > 1){
+                return false;
+            }
+            break;
+        }
+    }
+
+    if (flags & RUMATI_AVL_CHECK_LOOKUP){
+        if (tree->index != NULL && rumati_avl_index_find(tree,
+                    tree->index_hash(tree->udata, data), n) == NULL){
+            return false;
+        }
+        if (tree->filter != NULL && !rumati_avl_filter_contains(tree, data)){
+            return false;
+        }
+    }
+
+    out->height = high + 1;
+    out->black_height = left->black_height + !rumati_avl_is_red(n);
+    out->nodes = left->nodes + right->nodes + 1;
+    out->tombstones = left->tombstones + right->tombstones +
+            rumati_avl_is_tombstone(n);
+    out->min = left->min != NULL ? left->min : n;
+    out->max = right->max != NULL ? right->max : n;
+    return true;
+}
+
+/*
+ * rumati_avl_check_subtree() - checks a subtree in post order, with a stack
+ * on the heap.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      flags - the RUMATI_AVL_CHECK_* flags
+ *      root -  the root of the subtree
+ *      cut -   if not 0, nodes this far below root are not descended into,
+ *              and the summaries in units are used for them instead, in
+ *              order
+ *      units - summaries of the nodes at depth cut, left to right
+ *      out -   populated with the summary of the subtree
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       If the subtree passed all checks.
+ *      RUMATI_AVL_ECORRUPT If it failed a check.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ */
+static RUMATI_AVL_ERROR rumati_avl_check_subtree(
+        RUMATI_AVL_TREE *tree,
+        unsigned int flags,
+        struct rumati_avl_node *root,
+        size_t cut,
+        struct rumati_avl_check_result *units,
+        struct rumati_avl_check_result *out)
+{
+    static const struct rumati_avl_check_result empty;
+    struct rumati_avl_check_frame *stack, *f;
+    struct rumati_avl_check_result r;
+    struct rumati_avl_node *child;
+    size_t capacity = 64;
+    size_t sp = 0;
+    size_t unit = 0;
+
+    *out = empty;
+    if (root == NULL){
+        return RUMATI_AVL_OK;
+    }
+
+    stack = malloc(capacity * sizeof(*stack));
+    if (stack == NULL){
+        return RUMATI_AVL_ENOMEM;
+    }
+    stack[sp].n = root;
+    stack[sp].depth = 0;
+    stack[sp].stage = 0;
+    sp++;
+
+    while (sp > 0){
+        f = &stack[sp - 1];
+        if (f->stage < 2){
+            /* go down the left subtree, then the right one */
+            child = rumati_avl_link(tree,
+                    f->stage == 0 ? f->n->left : f->n->right);
+            f->stage++;
+            if (child == NULL){
+                r = empty;
+            }else if (cut != 0 && f->depth + 1 == cut){
+                r = units[unit++];
+            }else{
+                if (sp == capacity){
+                    struct rumati_avl_check_frame *grown;
+
+                    grown = realloc(stack, 2 * capacity * sizeof(*stack));
+                    if (grown == NULL){
+                        free(stack);
+                        return RUMATI_AVL_ENOMEM;
+                    }
+                    stack = grown;
+                    capacity *= 2;
+                    f = &stack[sp - 1];
+                }
+                stack[sp].n = child;
+                stack[sp].depth = f->depth + 1;
+                stack[sp].stage = 0;
+                sp++;
+                continue;
+            }
+            if (f->stage == 1){
+                f->left = r;
+                continue;
+            }
+        }
+
+        /* both subtrees are done, the right one's summary is in r */
+        if (!rumati_avl_check_node(tree, flags, f->n, &f->left, &r, &r)){
+            free(stack);
+            return RUMATI_AVL_ECORRUPT;
+        }
+        sp--;
+        if (sp > 0 && stack[sp - 1].stage == 1){
+            stack[sp - 1].left = r;
+        }
+    }
+
+    free(stack);
+    *out = r;
+    return RUMATI_AVL_OK;
+}
+
+#ifdef RUMATI_AVL_THREADS
+/*
+ * A thread of rumati_avl_check(), checking every threads'th subtree of
+ * units, starting with the first'th.
+ */
+struct rumati_avl_check_thread {
+    pthread_t thread;
+    RUMATI_AVL_TREE *tree;
+    unsigned int flags;
+    struct rumati_avl_node **roots;
+    struct rumati_avl_check_result *units;
+    size_t count;
+    size_t first;
+    size_t threads;
+    RUMATI_AVL_ERROR err;
+};
+
+static void *rumati_avl_check_run(void *arg)
+{
+    struct rumati_avl_check_thread *t = arg;
+    size_t i;
+
+    t->err = RUMATI_AVL_OK;
+    for (i = t->first; i < t->count && t->err == RUMATI_AVL_OK;
+            i += t->threads){
+        t->err = rumati_avl_check_subtree(t->tree, t->flags, t->roots[i],
+                0, NULL, &t->units[i]);
+    }
+    return NULL;
+}
+
+/*
+ * rumati_avl_check_parallel() - checks the subtrees a few levels below the
+ * root in threads, then the levels above them in the calling thread.
+ */
+static RUMATI_AVL_ERROR rumati_avl_check_parallel(
+        RUMATI_AVL_TREE *tree,
+        unsigned int flags,
+        size_t threads,
+        struct rumati_avl_check_result *out)
+{
+    struct rumati_avl_check_thread *t;
+    struct rumati_avl_check_result *units;
+    struct rumati_avl_node **level, **next;
+    RUMATI_AVL_ERROR err = RUMATI_AVL_OK;
+    size_t count = 1;
+    size_t cut = 0;
+    size_t started, i, j;
+
+    /* about 8 subtrees a thread, so uneven ones even out */
+    while (((size_t)1 << cut) < 8 * threads){
+        cut++;
+    }
+
+    level = malloc(((size_t)1 << cut) * sizeof(*level));
+    next = malloc(((size_t)1 << cut) * sizeof(*next));
+    units = malloc(((size_t)1 << cut) * sizeof(*units));
+    t = malloc(threads * sizeof(*t));
+    if (level == NULL || next == NULL || units == NULL || t == NULL){
+        err = RUMATI_AVL_ENOMEM;
+        goto out;
+    }
+
+    /* the nodes at depth cut, left to right */
+    level[0] = tree->root;
+    for (i = 0; i < cut; i++){
+        struct rumati_avl_node **swap;
+        size_t n = 0;
+
+        for (j = 0; j < count; j++){
+            if (level[j]->left != NULL){
+                next[n++] = rumati_avl_link(tree, level[j]->left);
+            }
+            if (level[j]->right != NULL){
+                next[n++] = rumati_avl_link(tree, level[j]->right);
+            }
+        }
+        swap = level;
+        level = next;
+        next = swap;
+        count = n;
+    }
+
+    for (started = 0; started < threads; started++){
+        t[started].tree = tree;
+        t[started].flags = flags;
+        t[started].roots = level;
+        t[started].units = units;
+        t[started].count = count;
+        t[started].first = started;
+        t[started].threads = threads;
+        if (pthread_create(&t[started].thread, NULL, rumati_avl_check_run,
+                    &t[started]) != 0){
+            err = RUMATI_AVL_ENOMEM;
+            break;
+        }
+    }
+    for (i = 0; i < started; i++){
+        pthread_join(t[i].thread, NULL);
+        if (t[i].err == RUMATI_AVL_ECORRUPT || err == RUMATI_AVL_OK){
+            err = t[i].err;
+        }
+    }
+
+    if (err == RUMATI_AVL_OK){
+        err = rumati_avl_check_subtree(tree, flags, tree->root, cut, units,
+                out);
+    }
+
+out:
+    free(t);
+    free(units);
+    free(next);
+    free(level);
+    return err;
+}
+#endif
+
+/*
+ * rumati_avl_check() - checks the consistency of a tree.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      flags - RUMATI_AVL_CHECK_* flags, ored together
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       If the tree passed all checks.
+ *      RUMATI_AVL_ECORRUPT If the tree failed a check.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory, or
+ *                          starting a thread.
+ *      RUMATI_AVL_EINVAL   If more than one thread was asked for, but the
+ *                          library was built without RUMATI_AVL_THREADS.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_check(
+        RUMATI_AVL_TREE *tree,
+        unsigned int flags)
+{
+    struct rumati_avl_check_result r;
+    RUMATI_AVL_ERROR err;
+    size_t threads = (flags >> 8) & 0xff;
+
+#ifdef RUMATI_AVL_THREADS
+    if (threads > 1 && tree->root != NULL){
+        err = rumati_avl_check_parallel(tree, flags, threads, &r);
+    }else
+#else
+    /* a health check asking for threads should not quietly run on one */
+    if (threads > 1){
+        return RUMATI_AVL_EINVAL;
+    }
+#endif
+    {
+        err = rumati_avl_check_subtree(tree, flags, tree->root, 0, NULL, &r);
+    }
+    if (err != RUMATI_AVL_OK){
+        return err;
+    }
+
+    if ((flags & RUMATI_AVL_CHECK_BALANCE) && !tree->unbalanced &&
+            tree->balance == RUMATI_AVL_BALANCE_RB &&
+            rumati_avl_is_red(tree->root)){
+        return RUMATI_AVL_ECORRUPT;
+    }
+    if ((flags & RUMATI_AVL_CHECK_COUNTS) &&
+            (r.nodes != tree->size || r.tombstones != tree->tombstones)){
+        return RUMATI_AVL_ECORRUPT;
+    }
+    if ((flags & RUMATI_AVL_CHECK_LOOKUP) && tree->index != NULL &&
+            tree->index_count != tree->size){
+        return RUMATI_AVL_ECORRUPT;
+    }
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * Snapshot format of rumati_avl_save()
+ */
+#define RUMATI_AVL_SNAPSHOT_MAGIC       "RAVLSNP1"
+#define RUMATI_AVL_SNAPSHOT_MAGIC_SIZE  8
+
+/*
+ * Size of the buffer of a stream, and of its reads and writes
+ */
+#define RUMATI_AVL_STREAM_BUFFER_SIZE   65536
+
+/*
+ * A buffered file descriptor, written by rumati_avl_save() or read by
+ * rumati_avl_load().
+ */
+struct rumati_avl_stream {
+    int fd;
+    unsigned char *buffer;
+    size_t size;
+    /* the buffered bytes, from start to end */
+    size_t start;
+    size_t end;
+    /* the first error writing, later writes are skipped */
+    RUMATI_AVL_ERROR err;
+    /* for loading, bytes of the file not yet read, or -1 if unknown */
+    off_t unread;
+    /* for saving, the serializer and a buffer for it */
+    RUMATI_AVL_VALUE_SERIALIZER serializer;
+    unsigned char *value;
+    size_t value_size;
+};
+
+/*
+ * rumati_avl_stream_write_fd() - writes bytes straight to a stream's file
+ * descriptor, retrying short and interrupted writes.
+ */
+static void rumati_avl_stream_write_fd(
+        struct rumati_avl_stream *s,
+        const unsigned char *bytes,
+        size_t length)
+{
+    while (length > 0 && s->err == RUMATI_AVL_OK){
+        ssize_t w = write(s->fd, bytes, length);
+
+        if (w < 0){
+            if (errno != EINTR){
+                s->err = RUMATI_AVL_EIO;
+            }
+            continue;
+        }
+        bytes += w;
+        length -= (size_t)w;
+    }
+}
+
+/*
+ * rumati_avl_stream_write() - writes bytes to a stream, through its buffer
+ * unless there are more than it holds.
+ */
+static void rumati_avl_stream_write(
+        struct rumati_avl_stream *s,
+        const void *bytes,
+        size_t length)
+{
+    if (length > s->size - s->end){
+        rumati_avl_stream_write_fd(s, s->buffer, s->end);
+        s->end = 0;
+    }
+    if (length >= s->size){
+        rumati_avl_stream_write_fd(s, bytes, length);
+    }else{
+        memcpy(s->buffer + s->end, bytes, length);
+        s->end += length;
+    }
+}
+
+/*
+ * rumati_avl_stream_put_varint() - writes an unsigned LEB128 varint.
+ */
+static void rumati_avl_stream_put_varint(
+        struct rumati_avl_stream *s,
+        unsigned long long v)
+{
+    unsigned char bytes[10];
+    size_t length = 0;
+
+    do {
+        bytes[length] = (unsigned char)(v & 0x7f);
+        v >>= 7;
+        if (v != 0){
+            bytes[length] |= 0x80;
+        }
+        length++;
+    } while (v != 0);
+    rumati_avl_stream_write(s, bytes, length);
+}
+
+/*
+ * rumati_avl_stream_open() - sets up a stream for reading from a file
+ * descriptor at its current offset. If it is a regular file, the bytes left
+ * in it are noted, so that lengths read from it can be checked before
+ * anything is allocated for them.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ */
+static RUMATI_AVL_ERROR rumati_avl_stream_open(
+        struct rumati_avl_stream *s,
+        int fd)
+{
+    struct stat st;
+    off_t offset;
+
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    s->unread = -1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            (offset = lseek(fd, 0, SEEK_CUR)) >= 0 &&
+            offset <= st.st_size){
+        s->unread = st.st_size - offset;
+    }
+    s->size = RUMATI_AVL_STREAM_BUFFER_SIZE;
+    s->buffer = malloc(s->size);
+    return s->buffer == NULL ? RUMATI_AVL_ENOMEM : RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_stream_fill() - reads from a stream's file descriptor until at
+ * least length bytes are buffered, growing the buffer if they do not fit.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOENT   If the file ended with no bytes buffered.
+ *      RUMATI_AVL_EINVAL   If the file ended with fewer bytes buffered.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If there was an error reading.
+ */
+static RUMATI_AVL_ERROR rumati_avl_stream_fill(
+        struct rumati_avl_stream *s,
+        size_t length)
+{
+    if (s->end - s->start >= length){
+        return RUMATI_AVL_OK;
+    }
+
+    memmove(s->buffer, s->buffer + s->start, s->end - s->start);
+    s->end -= s->start;
+    s->start = 0;
+    if (length > s->size){
+        unsigned char *buffer = realloc(s->buffer, length);
+
+        if (buffer == NULL){
+            return RUMATI_AVL_ENOMEM;
+        }
+        s->buffer = buffer;
+        s->size = length;
+    }
+
+    while (s->end < length){
+        ssize_t r = read(s->fd, s->buffer + s->end, s->size - s->end);
+
+        if (r < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return RUMATI_AVL_EIO;
+        }
+        if (r == 0){
+            return s->end == 0 ? RUMATI_AVL_ENOENT : RUMATI_AVL_EINVAL;
+        }
+        s->end += (size_t)r;
+        if (s->unread >= 0){
+            /* a file growing while it is read is no longer bounded */
+            s->unread = s->unread >= r ? s->unread - r : -1;
+        }
+    }
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_stream_get_varint() - reads an unsigned LEB128 varint which
+ * must fit in a size_t.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If the file ended inside the varint, or it is too
+ *                          long.
+ *      Any other error of rumati_avl_stream_fill().
+ */
+static RUMATI_AVL_ERROR rumati_avl_stream_get_varint(
+        struct rumati_avl_stream *s,
+        size_t *v)
+{
+    RUMATI_AVL_ERROR err;
+    unsigned int shift = 0;
+    unsigned char byte;
+
+    *v = 0;
+    do {
+        err = rumati_avl_stream_fill(s, 1);
+        if (err != RUMATI_AVL_OK){
+            return err == RUMATI_AVL_ENOENT ? RUMATI_AVL_EINVAL : err;
+        }
+        byte = s->buffer[s->start++];
+        if (shift >= sizeof(size_t) * 8 ||
+                (size_t)(byte & 0x7f) << shift >> shift != (byte & 0x7fu)){
+            return RUMATI_AVL_EINVAL;
+        }
+        *v |= (size_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return RUMATI_AVL_OK;
 }
 
 /*
- * rumati_avl_rotate_left() - rotates a subtree to the left/anti-clock wise
+ * rumati_avl_stream_get_value() - reads the length and bytes of a value.
+ * The bytes are left in the stream's buffer, until it is next filled.
  *
- * Parameters:
- *      node_ptr -  A pointer to the pointer to the root of this subtree
- *                  this will be updated to point to the new root, after
- *                  rotation.
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If the file ended first, or the length runs past
+ *                          the end of the file.
+ *      Any other error of rumati_avl_stream_fill().
  */
-static void rumati_avl_rotate_left(struct rumati_avl_node **node_ptr)
+static RUMATI_AVL_ERROR rumati_avl_stream_get_value(
+        struct rumati_avl_stream *s,
+        const unsigned char **bytes,
+        size_t *length)
 {
-    /*
-     * The implementation of this function is identical to the implementation
-     * of rumati_avl_rotate_right(), please see comments there.
-     */
-    int8_t nrb;
-    struct rumati_avl_node *old_root = *node_ptr;
+    RUMATI_AVL_ERROR err;
 
-    *node_ptr = old_root->right;
-    old_root->right = (*node_ptr)->left;
-    (*node_ptr)->left = old_root;
+    err = rumati_avl_stream_get_varint(s, length);
+    if (err == RUMATI_AVL_OK && s->unread >= 0 &&
+            *length > s->end - s->start &&
+            *length - (s->end - s->start) > (uint64_t)s->unread){
+        err = RUMATI_AVL_EINVAL;
+    }
+    if (err == RUMATI_AVL_OK){
+        err = rumati_avl_stream_fill(s, *length);
+    }
+    if (err != RUMATI_AVL_OK){
+        return err == RUMATI_AVL_ENOENT ? RUMATI_AVL_EINVAL : err;
+    }
+    *bytes = s->buffer + s->start;
+    s->start += *length;
+    return RUMATI_AVL_OK;
+}
 
-    nrb = (*node_ptr)->balance;
+/*
+ * rumati_avl_stream_put_value() - serializes a value, and writes its length
+ * and bytes.
+ */
+static void rumati_avl_stream_put_value(
+        struct rumati_avl_stream *s,
+        RUMATI_AVL_TREE *tree,
+        void *data)
+{
+    size_t length;
 
-    old_root->balance--;
-    if (nrb > 0){
-        old_root->balance -= nrb;
+    if (s->err != RUMATI_AVL_OK){
+        return;
     }
 
-    (*node_ptr)->balance--;
-    if (old_root->balance < 0){
-        (*node_ptr)->balance += old_root->balance;
+    length = s->serializer(tree->udata, data, s->value, s->value_size);
+    if (length > s->value_size){
+        unsigned char *value = realloc(s->value, length);
+
+        if (value == NULL){
+            s->err = RUMATI_AVL_ENOMEM;
+            return;
+        }
+        s->value = value;
+        s->value_size = length;
+        length = s->serializer(tree->udata, data, s->value, length);
     }
+    rumati_avl_stream_put_varint(s, length);
+    rumati_avl_stream_write(s, s->value, length);
 }
 
 /*
- * rumati_avl_add_update() - adds an update to a list of updates, checking for
- * buffer overflow.
- *
- * Parameters:
- *      updates -   the list of updates
- *      node_ptr -  a pointer to the parent nodes link to the node to be
- *                  updated.
- *      left -      was the update on the left subtree or not (not == right
- *                  subtree).
- *
- * Returns:
- *      true    On success.
- *      false   If the update list is longer than RUMATI_AVL_MAX_HEIGHT.
+ * rumati_avl_save_visit() - writes a node's value, for
+ * rumati_avl_walk_stack().
  */
-static bool rumati_avl_add_update(
-        struct rumati_avl_update_list *updates,
-        struct rumati_avl_node **node_ptr,
-        bool left)
+static void rumati_avl_save_visit(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n,
+        size_t depth,
+        void *arg)
 {
-    if (updates->number_of_updates == RUMATI_AVL_MAX_HEIGHT - 1){
-        return false;
+    (void)depth;
+    if (!rumati_avl_is_tombstone(n)){
+        rumati_avl_stream_put_value(arg, tree, rumati_avl_data(tree, n));
     }
-    updates->update[updates->number_of_updates].node_ptr = node_ptr;
-    updates->update[updates->number_of_updates].left = left;
-    updates->number_of_updates++;
-    return true;
 }
 
 /*
- * rumati_avl_put() - inserts an entry into the tree, replacing an existing
- * entry if one exists.
+ * rumati_avl_save() - writes the entries of a tree to a file descriptor, in
+ * key order. Tombstones are left out.
  *
  * Parameters:
- *      tree -      The tree to which to add the entry.
- *      entry -     The entry to add to the tree.
- *      old_value - A pointer to a pointer which will be populated with the 
- *                  the previous value for the entry if one exists, or NULL
- *                  if there was previously no matching entry. If NULL is
- *                  passed as old_value, then the previous value will be
- *                  overwritten without being destroyed, which may cause a
- *                  memory leak.
- * 
+ *      tree -          the tree to save
+ *      fd -            the file descriptor to write to, at its current offset
+ *      serializer -    the function writing the bytes of values
+ *
  * Returns:
- *      RUMATI_AVL_OK       On success
- *      RUMATI_AVL_ETOOBIG  If the tree is to big.
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If tree or serializer is NULL.
  *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If there was an error writing to fd.
  */
 RUMATI_AVL_API
-RUMATI_AVL_ERROR rumati_avl_put(
+RUMATI_AVL_ERROR rumati_avl_save(
         RUMATI_AVL_TREE *tree,
-        void *object,
-        void **old_value)
+        int fd,
+        RUMATI_AVL_VALUE_SERIALIZER serializer)
 {
-    struct rumati_avl_node *n = NULL;
-    struct rumati_avl_node **parent_link = &tree->root;
-    struct rumati_avl_update_list updates;
+    struct rumati_avl_stream s;
 
-    /* init updates */
-    updates.number_of_updates = 0;
+    if (tree == NULL || serializer == NULL){
+        return RUMATI_AVL_EINVAL;
+    }
 
-    /* do binary search looking for an existing node with matching data */
-    while (*parent_link != NULL){
-        int cmp = tree->comparator(tree->udata, object, (*parent_link)->data);
-        if (cmp == 0){
-            /*
-             * This node matches the new node. Populate old_value and replace
-             * data. No need for rebalancing.
-             */
-            if (old_value != NULL){
-                *old_value = (*parent_link)->data;
-            }
-            (*parent_link)->data = object;
-            return RUMATI_AVL_OK;
-        }else if (cmp > 0){
-            /*
-             * Destination node is to the right of this node, add this node to
-             * the list of nodes to be updates and check right child.
-             */
-            if (rumati_avl_add_update(&updates, parent_link, false) == false){
-                return RUMATI_AVL_ETOOBIG;
-            }
-            parent_link = &(*parent_link)->right;
-        }else if (cmp < 0){
-            /*
-             * Destination node is to the left of this node, add this node to
-             * the list of nodes to be updates and check left child.
-             */
-            if (rumati_avl_add_update(&updates, parent_link, true) == false){
-                return RUMATI_AVL_ETOOBIG;
-            }
-            parent_link = &(*parent_link)->left;
-        }
+    memset(&s, 0, sizeof(s));
+    s.fd = fd;
+    s.size = RUMATI_AVL_STREAM_BUFFER_SIZE;
+    s.buffer = malloc(s.size);
+    s.serializer = serializer;
+    s.value_size = 256;
+    s.value = malloc(s.value_size);
+    if (s.buffer == NULL || s.value == NULL){
+        free(s.buffer);
+        free(s.value);
+        return RUMATI_AVL_ENOMEM;
     }
 
-    /*
-     * No matching node found, so, this will be a new node, insert as leaf
-     * where our binary search ended.
-     */
+    rumati_avl_stream_write(&s, RUMATI_AVL_SNAPSHOT_MAGIC,
+            RUMATI_AVL_SNAPSHOT_MAGIC_SIZE);
+    rumati_avl_stream_put_varint(&s, tree->size - tree->tombstones);
+    /* not threaded, so a forked child saving the tree leaves it shared */
+    if (rumati_avl_walk_stack(tree, rumati_avl_save_visit, &s) !=
+            RUMATI_AVL_OK && s.err == RUMATI_AVL_OK){
+        s.err = RUMATI_AVL_ENOMEM;
+    }
+    rumati_avl_stream_write_fd(&s, s.buffer, s.end);
 
-    n = malloc(sizeof(*n));
-    if (n == NULL){
-        return RUMATI_AVL_ENOMEM;
+    free(s.buffer);
+    free(s.value);
+    if (s.err == RUMATI_AVL_OK){
+        rumati_avl_next_generation(tree);
     }
-    n->left = NULL;
-    n->right = NULL;
-    n->balance = 0;
-    n->data = object;
+    return s.err;
+}
 
-    *parent_link = n;
+/*
+ * Delta format of rumati_avl_save_delta(), and its record types
+ */
+#define RUMATI_AVL_DELTA_MAGIC          "RAVLDLT2"
+#define RUMATI_AVL_DELTA_END            0
+#define RUMATI_AVL_DELTA_VALUE          1
+#define RUMATI_AVL_DELTA_KEEP           2
+#define RUMATI_AVL_DELTA_SKIP           3
 
-    if (old_value != NULL){
-        *old_value = NULL;
+/*
+ * A delta being written. keep is the number of unchanged entries of the
+ * last snapshot to copy next, and skip the number to leave out next. At
+ * most one of them is non zero.
+ */
+struct rumati_avl_delta {
+    struct rumati_avl_stream *s;
+    size_t keep;
+    size_t skip;
+};
+
+/*
+ * rumati_avl_delta_run() - writes a record for the run of entries of the
+ * last snapshot being kept or skipped, if there is one, and ends it.
+ */
+static void rumati_avl_delta_run(struct rumati_avl_delta *d)
+{
+    unsigned char op;
+
+    if (d->keep > 0){
+        op = RUMATI_AVL_DELTA_KEEP;
+        rumati_avl_stream_write(d->s, &op, 1);
+        rumati_avl_stream_put_varint(d->s, d->keep);
+        d->keep = 0;
+    }else if (d->skip > 0){
+        op = RUMATI_AVL_DELTA_SKIP;
+        rumati_avl_stream_write(d->s, &op, 1);
+        rumati_avl_stream_put_varint(d->s, d->skip);
+        d->skip = 0;
     }
+}
 
-    /*
-     * Do updates
-     */
-    while (updates.number_of_updates > 0){
-        struct rumati_avl_update *update;
-        updates.number_of_updates--;
-        update = &updates.update[updates.number_of_updates];
-        if (update->left){
-            /*
-             * Node added to the left, so tree must be heavier to the left.
-             * In other words, decrease balance.
-             */
-            (*update->node_ptr)->balance--;
-            if ((*update->node_ptr)->balance == 0){
-                /*
-                 * If the addition of a node in this nodes left subtree left
-                 * the node balanced, then no further updates are required to
-                 * be performed on this nodes parents.
-                 */
-                break;
-            }else if ((*update->node_ptr)->balance < -1){
-                /*
-                 * Tree is unbalanced. We now rotate the tree to balance this
-                 * node, then break because, for each new node added to a
-                 * tree, we only ever need to rebalance one node.
-                 *
-                 * We may need to do a double rotate, because of the situation
-                 * where the right child of our left child is heavier. This
-                 * would cause a simple, single rotation to leave the tree as
-                 * unbalanced as it was before the rotate. An example of this
-                 * behaviour below:
-                 *
-                 *  Figure 1  |  Figure 2   |   Figure 3    |   Figure 4
-                 * -----------+-------------+---------------+---------------
-                 *      F     |     B       |         F     |       D
-                 *     / \    |    / \      |        / \    |      / \
-                 *    /   \   |   /   \     |       /   \   |     /   \
-                 *   B     G  |  A     F    |      D     G  |    B     F
-                 *  / \       |       / \   |     / \       |   / \   / \
-                 * A   D      |      D   G  |    B   E      |  A   C E   G
-                 *    / \     |     / \     |   / \         |
-                 *   C   E    |    C   E    |  A   C        |
-                 *
-                 * If the tree in Figure 1 is simply rotated clockwise, the
-                 * result is the tree in Figure 2, which is equally unbalanced,
-                 * because the previous root (F) inherits its heaviest
-                 * granchild (D).
-                 *
-                 * The solution is to first perform an anti-clockwise rotation
-                 * on B, resulting in the tree shown in Figure 3, then rotating
-                 * F clockwise, resulting in a balanced tree shown in Figure 4.
-                 *
-                 * It is also interesting to note that, for any tree rooted at
-                 * F (see Figure 1), where the tree is unbalanced towards the
-                 * left subtree rooted at B, it is not possible for node B to
-                 * have an even balance. If F is unbalanced, then B must be at
-                 * least 1 level heavier on either side.
-                 */
-                if ((*update->node_ptr)->left->balance > 0){
-                    rumati_avl_rotate_left(&(*update->node_ptr)->left);
-                }
-                rumati_avl_rotate_right(update->node_ptr);
-                break;
-            }
-        }else{
-            /*
-             * Please see discussion above
-             */
-            (*update->node_ptr)->balance++;
-            if ((*update->node_ptr)->balance == 0){
-                break;
-            }else if ((*update->node_ptr)->balance > 1){
-                if ((*update->node_ptr)->right->balance < 0){
-                    rumati_avl_rotate_right(&(*update->node_ptr)->right);
-                }
-                rumati_avl_rotate_left(update->node_ptr);
-                break;
-            }
+/*
+ * rumati_avl_delta_visit() - skips the entries of the last snapshot removed
+ * before a node, then keeps the node's entry if it is unchanged, or skips
+ * it if it was in the snapshot and writes the node's value if it has
+ * changed, for rumati_avl_walk_stack().
+ */
+static void rumati_avl_delta_visit(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n,
+        size_t depth,
+        void *arg)
+{
+    static const unsigned char value = RUMATI_AVL_DELTA_VALUE;
+    struct rumati_avl_delta *d = arg;
+    struct rumati_avl_removed_entry *e = rumati_avl_removed_find(tree, n);
+    size_t skip = e == NULL ? 0 : e->count;
+
+    (void)depth;
+    if (n->generation == tree->generation){
+        skip += rumati_avl_in_snapshot(tree, n);
+    }
+    if (skip > 0 && d->keep > 0){
+        rumati_avl_delta_run(d);
+    }
+    d->skip += skip;
+
+    if (n->generation == tree->generation){
+        if (!rumati_avl_is_tombstone(n)){
+            rumati_avl_delta_run(d);
+            rumati_avl_stream_write(d->s, &value, 1);
+            rumati_avl_stream_put_value(d->s, tree, n->data);
         }
+    }else if (!rumati_avl_is_tombstone(n)){
+        if (d->skip > 0){
+            rumati_avl_delta_run(d);
+        }
+        d->keep++;
     }
+}
 
+/*
+ * rumati_avl_track_changes() - starts tracking the entries changed since
+ * the last snapshot, for rumati_avl_save_delta().
+ *
+ * Parameters:
+ *      tree -  the tree
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EROFS    If the tree is an image.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_track_changes(RUMATI_AVL_TREE *tree)
+{
+    if (tree->image != NULL){
+        return RUMATI_AVL_EROFS;
+    }
+    tree->track_changes = true;
+    rumati_avl_next_generation(tree);
     return RUMATI_AVL_OK;
 }
 
 /*
- * rumati_avl_get() - returns the matching entry in the tree, if one exists.
+ * rumati_avl_save_delta() - writes the entries changed since the last
+ * snapshot or delta to a file descriptor, in key order, with the runs of
+ * entries of the snapshot kept or left out between them written as counts.
  *
  * Parameters:
- *      tree -  The tree to search for a matching entry.
- *      key -   The key with which to search for a matching entry.
+ *      tree -          the tree to save
+ *      fd -            the file descriptor to write to, at its current offset
+ *      serializer -    the function writing the bytes of values
  *
  * Returns:
- *      The matching entry in the tree, or NULL if no matching entry was found.
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If tree or serializer is NULL, or changes are not
+ *                          being tracked.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory, now or
+ *                          while counting removed entries.
+ *      RUMATI_AVL_EIO      If there was an error writing to fd.
  */
 RUMATI_AVL_API
-void *rumati_avl_get(
+RUMATI_AVL_ERROR rumati_avl_save_delta(
         RUMATI_AVL_TREE *tree,
-        void *key)
+        int fd,
+        RUMATI_AVL_VALUE_SERIALIZER serializer)
 {
-    struct rumati_avl_node *n = tree->root;
+    static const unsigned char end = RUMATI_AVL_DELTA_END;
+    struct rumati_avl_stream s;
+    struct rumati_avl_delta d;
 
-    while (n != NULL){
-        int cmp = tree->comparator(tree->udata, key, n->data);
-        if (cmp > 0){
-            n = n->right;
-        }else if (cmp < 0){
-            n = n->left;
-        }else{
-            return n->data;
-        }
+    if (tree == NULL || serializer == NULL || !tree->track_changes){
+        return RUMATI_AVL_EINVAL;
+    }
+    if (tree->removed_lost){
+        return RUMATI_AVL_ENOMEM;
     }
 
-    return NULL;
+    memset(&s, 0, sizeof(s));
+    s.fd = fd;
+    s.size = RUMATI_AVL_STREAM_BUFFER_SIZE;
+    s.buffer = malloc(s.size);
+    s.serializer = serializer;
+    s.value_size = 256;
+    s.value = malloc(s.value_size);
+    if (s.buffer == NULL || s.value == NULL){
+        free(s.buffer);
+        free(s.value);
+        return RUMATI_AVL_ENOMEM;
+    }
+
+    d.s = &s;
+    d.keep = d.skip = 0;
+    rumati_avl_stream_write(&s, RUMATI_AVL_DELTA_MAGIC,
+            RUMATI_AVL_SNAPSHOT_MAGIC_SIZE);
+    rumati_avl_stream_put_varint(&s, tree->size - tree->tombstones);
+    if (rumati_avl_walk_stack(tree, rumati_avl_delta_visit, &d) !=
+            RUMATI_AVL_OK && s.err == RUMATI_AVL_OK){
+        s.err = RUMATI_AVL_ENOMEM;
+    }
+    if (tree->removed_last > 0 && d.keep > 0){
+        rumati_avl_delta_run(&d);
+    }
+    d.skip += tree->removed_last;
+    rumati_avl_delta_run(&d);
+    rumati_avl_stream_write(&s, &end, 1);
+    rumati_avl_stream_write_fd(&s, s.buffer, s.end);
+
+    free(s.buffer);
+    free(s.value);
+    if (s.err == RUMATI_AVL_OK){
+        rumati_avl_next_generation(tree);
+    }
+    return s.err;
 }
 
 /*
- * rumati_avl_get_greater_than_or_equal() - returns the lowest key which is
- * either greater than or equal to the given key.
+ * rumati_avl_compact_run() - copies the next entries of a snapshot to
+ * another, or skips them.
  *
  * Parameters:
- *      tree -  The tree in which to search for a qualifying entry
- *      key -   The key which a qualifying entry must be greater than or
- *              equal to.
+ *      base -      the snapshot being read
+ *      remaining - the number of entries left in base
+ *      out -       the snapshot being written, or NULL to skip the entries
+ *      count -     the number of entries to copy or skip
+ *      written -   incremented for each entry copied
  *
  * Returns:
- *      A lowest entry that is greater than or equal to key, or NULL if no
- *      entry was found which is greater than or equal to key.
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If base has fewer than count entries left.
+ *      Any other error reading base.
  */
-RUMATI_AVL_API
-void *rumati_avl_get_greater_than_or_equal(
-        RUMATI_AVL_TREE *tree,
-        void *key)
+static RUMATI_AVL_ERROR rumati_avl_compact_run(
+        struct rumati_avl_stream *base,
+        size_t *remaining,
+        struct rumati_avl_stream *out,
+        size_t count,
+        size_t *written)
 {
-    struct rumati_avl_node *n = tree->root;
-    /*
-     * Each time we go left, keep a reference to the node at which we go left.
-     * If we fail to find any nodes greater than or equal to the search key,
-     * then this will be the first entry which is greater than the search key.
-     */
-    struct rumati_avl_node *prev = NULL;
+    const unsigned char *bytes;
+    RUMATI_AVL_ERROR err;
+    size_t length;
 
-    while (n != NULL){
-        int cmp = tree->comparator(tree->udata, key, n->data);
-        if (cmp > 0){
-            n = n->right;
-        }else if (cmp < 0){
-            prev = n;
-            n = n->left;
-        }else{
-            return n->data;
-        }
+    if (count > *remaining){
+        return RUMATI_AVL_EINVAL;
     }
+    for (; count > 0; count--){
+        err = rumati_avl_stream_get_value(base, &bytes, &length);
+        if (err != RUMATI_AVL_OK){
+            return err;
+        }
+        (*remaining)--;
 
-    if (prev != NULL){
-        return prev->data;
+        if (out != NULL){
+            rumati_avl_stream_put_varint(out, length);
+            rumati_avl_stream_write(out, bytes, length);
+            (*written)++;
+        }
     }
-
-    return NULL;
+    return RUMATI_AVL_OK;
 }
 
 /*
- * rumati_avl_get_less_than_or_equal() - returns the highest key which is
- * either less than or equal to the given key.
+ * rumati_avl_compact() - writes the snapshot a delta was saved against,
+ * with the delta applied, as a new snapshot.
  *
  * Parameters:
- *      tree -  The tree in which to search for a qualifying entry
- *      key -   The key which a qualifying entry must be less than or
- *              equal to.
+ *      base_fd -   the snapshot to read
+ *      delta_fd -  the delta to read
+ *      fd -        the file descriptor to write the new snapshot to
  *
  * Returns:
- *      A highest entry that is less than or equal to key, or NULL if no
- *      entry was found which is less than or equal to key.
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If a file is not a snapshot or delta, or the
+ *                          delta was not saved against base.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If there was an error reading or writing.
  */
 RUMATI_AVL_API
-void *rumati_avl_get_less_than_or_equal(
-        RUMATI_AVL_TREE *tree,
-        void *key)
+RUMATI_AVL_ERROR rumati_avl_compact(
+        int base_fd,
+        int delta_fd,
+        int fd)
 {
-    struct rumati_avl_node *n = tree->root;
-    /*
-     * Each time we go right, keep a reference to the node at which we go
-     * right. If we fail to find any nodes less than or equal to the search
-     * key, then this will be the first entry which is less than the search
-     * key.
-     */
-    struct rumati_avl_node *prev = NULL;
+    struct rumati_avl_stream base, delta, out;
+    RUMATI_AVL_ERROR err;
+    const unsigned char *bytes;
+    size_t remaining, count, written = 0, length, run;
 
-    while (n != NULL){
-        int cmp = tree->comparator(tree->udata, key, n->data);
-        if (cmp > 0){
-            prev = n;
-            n = n->right;
-        }else if (cmp < 0){
-            n = n->left;
+    memset(&out, 0, sizeof(out));
+    out.fd = fd;
+    out.size = RUMATI_AVL_STREAM_BUFFER_SIZE;
+    out.buffer = malloc(out.size);
+    err = rumati_avl_stream_open(&base, base_fd);
+    if (rumati_avl_stream_open(&delta, delta_fd) != RUMATI_AVL_OK ||
+            out.buffer == NULL){
+        err = RUMATI_AVL_ENOMEM;
+    }
+    if (err != RUMATI_AVL_OK){
+        goto out;
+    }
+
+    err = rumati_avl_stream_fill(&base, RUMATI_AVL_SNAPSHOT_MAGIC_SIZE);
+    if (err == RUMATI_AVL_OK){
+        err = rumati_avl_stream_fill(&delta, RUMATI_AVL_SNAPSHOT_MAGIC_SIZE);
+    }
+    if (err == RUMATI_AVL_ENOENT || (err == RUMATI_AVL_OK &&
+            (memcmp(base.buffer, RUMATI_AVL_SNAPSHOT_MAGIC,
+                RUMATI_AVL_SNAPSHOT_MAGIC_SIZE) != 0 ||
+            memcmp(delta.buffer, RUMATI_AVL_DELTA_MAGIC,
+                RUMATI_AVL_SNAPSHOT_MAGIC_SIZE) != 0))){
+        err = RUMATI_AVL_EINVAL;
+    }
+    if (err == RUMATI_AVL_OK){
+        base.start = delta.start = RUMATI_AVL_SNAPSHOT_MAGIC_SIZE;
+        err = rumati_avl_stream_get_varint(&base, &remaining);
+    }
+    if (err == RUMATI_AVL_OK){
+        err = rumati_avl_stream_get_varint(&delta, &count);
+    }
+    if (err != RUMATI_AVL_OK){
+        goto out;
+    }
+    rumati_avl_stream_write(&out, RUMATI_AVL_SNAPSHOT_MAGIC,
+            RUMATI_AVL_SNAPSHOT_MAGIC_SIZE);
+    rumati_avl_stream_put_varint(&out, count);
+
+    for (;;){
+        unsigned char op;
+
+        err = rumati_avl_stream_fill(&delta, 1);
+        if (err != RUMATI_AVL_OK){
+            break;
+        }
+        op = delta.buffer[delta.start++];
+        if (op == RUMATI_AVL_DELTA_END){
+            break;
+        }else if (op == RUMATI_AVL_DELTA_VALUE){
+            err = rumati_avl_stream_get_value(&delta, &bytes, &length);
+            if (err == RUMATI_AVL_OK){
+                rumati_avl_stream_put_varint(&out, length);
+                rumati_avl_stream_write(&out, bytes, length);
+                written++;
+            }
+        }else if (op == RUMATI_AVL_DELTA_KEEP ||
+                op == RUMATI_AVL_DELTA_SKIP){
+            err = rumati_avl_stream_get_varint(&delta, &run);
+            if (err == RUMATI_AVL_OK){
+                err = rumati_avl_compact_run(&base, &remaining,
+                        op == RUMATI_AVL_DELTA_KEEP ? &out : NULL, run,
+                        &written);
+            }
         }else{
-            return n->data;
+            err = RUMATI_AVL_EINVAL;
+        }
+        if (err != RUMATI_AVL_OK){
+            break;
         }
     }
+    /* every entry of base must be kept or skipped */
+    if (err == RUMATI_AVL_ENOENT || (err == RUMATI_AVL_OK &&
+            (written != count || remaining != 0))){
+        err = RUMATI_AVL_EINVAL;
+    }
 
-    if (prev != NULL){
-        return prev->data;
+    if (err == RUMATI_AVL_OK){
+        rumati_avl_stream_write_fd(&out, out.buffer, out.end);
+        err = out.err;
     }
 
-    return NULL;
+out:
+    free(out.buffer);
+    free(delta.buffer);
+    free(base.buffer);
+    return err;
 }
 
 /*
- * rumati_avl_get_greater_than() - retrieves the lowest entry is is scrictly
- * greater than the search key.
+ * A snapshot being written by a child process
+ */
+struct rumati_avl_background_save {
+    pid_t pid;
+};
+
+/*
+ * rumati_avl_save_background() - writes the entries of a tree to a file
+ * descriptor from a child process, which sees the tree as it was at the
+ * call.
  *
  * Parameters:
- *      tree -  The tree to search.
- *      key -   The key which a matching entry must be greater than.
+ *      tree -          the tree to save
+ *      fd -            the file descriptor to write to, at its current offset
+ *      serializer -    the function writing the bytes of values
+ *      save -          populated with the snapshot being written
  *
  * Returns:
- *      The lowest entry which is scrictly greater than the search key, or
- *      NULL if there is no entry greater than the search key.
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If any pointer is NULL.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory, or
+ *                          forking.
  */
 RUMATI_AVL_API
-void *rumati_avl_get_greater_than(
+RUMATI_AVL_ERROR rumati_avl_save_background(
         RUMATI_AVL_TREE *tree,
-        void *key)
+        int fd,
+        RUMATI_AVL_VALUE_SERIALIZER serializer,
+        RUMATI_AVL_BACKGROUND_SAVE **save)
 {
-    struct rumati_avl_node *n = tree->root;
-    struct rumati_avl_node *prev = NULL;
+    RUMATI_AVL_BACKGROUND_SAVE *retv;
 
-    while (n != NULL){
-        int cmp = tree->comparator(tree->udata, key, n->data);
-        if (cmp > 0){
-            n = n->right;
-        }else if (cmp < 0){
-            prev = n;
-            n = n->left;
-        }else{
-            if (n->right == NULL){
-                break;
-            }
-            n = n->right;
-            while (n->left != NULL){
-                n = n->left;
-            }
-            return n->data;
-        }
+    if (tree == NULL || serializer == NULL || save == NULL){
+        return RUMATI_AVL_EINVAL;
     }
 
-    if (prev != NULL){
-        return prev->data;
+    retv = malloc(sizeof(*retv));
+    if (retv == NULL){
+        return RUMATI_AVL_ENOMEM;
     }
 
-    return NULL;
+    retv->pid = fork();
+    if (retv->pid < 0){
+        free(retv);
+        return RUMATI_AVL_ENOMEM;
+    }
+    if (retv->pid == 0){
+        /* _exit(), so the parent's atexit() handlers and stdio stay put */
+        _exit((int)rumati_avl_save(tree, fd, serializer));
+    }
+    rumati_avl_next_generation(tree);
+
+    *save = retv;
+    return RUMATI_AVL_OK;
 }
 
 /*
- * rumati_avl_get_less_than() - retrieves the lowest entry is is scrictly
- * less than the search key.
- *
- * Parameters:
- *      tree -  The tree to search.
- *      key -   The key which a matching entry must be less than.
+ * rumati_avl_save_wait() - waits for a snapshot being written by a child
+ * process, and frees it.
  *
  * Returns:
- *      The lowest entry which is scrictly less than the search key, or
- *      NULL if there is no entry less than the search key.
+ *      The error returned by rumati_avl_save() in the child, or
+ *      RUMATI_AVL_EIO if it did not exit.
  */
 RUMATI_AVL_API
-void *rumati_avl_get_less_than(
-        RUMATI_AVL_TREE *tree,
-        void *key)
+RUMATI_AVL_ERROR rumati_avl_save_wait(RUMATI_AVL_BACKGROUND_SAVE *save)
 {
-    struct rumati_avl_node *n = tree->root;
-    struct rumati_avl_node *prev = NULL;
+    RUMATI_AVL_ERROR err = RUMATI_AVL_EIO;
+    int status;
 
-    while (n != NULL){
-        int cmp = tree->comparator(tree->udata, key, n->data);
-        if (cmp > 0){
-            prev = n;
-            n = n->right;
-        }else if (cmp < 0){
-            n = n->left;
-        }else{
-            if (n->left == NULL){
-                break;
-            }
-            n = n->left;
-            while (n->right != NULL){
-                n = n->right;
-            }
-            return n->data;
+    while (waitpid(save->pid, &status, 0) < 0){
+        if (errno != EINTR){
+            free(save);
+            return RUMATI_AVL_EIO;
         }
     }
-
-    if (prev != NULL){
-        return prev->data;
+    if (WIFEXITED(status)){
+        err = (RUMATI_AVL_ERROR)WEXITSTATUS(status);
     }
 
-    return NULL;
+    free(save);
+    return err;
 }
 
 /*
- * rumati_avl_delete() - removes an entry from a tree.
+ * rumati_avl_load() - reads entries written by rumati_avl_save() into an
+ * empty tree, and builds them into a perfectly balanced tree.
  *
  * Parameters:
- *      tree -      The tree from which to delete the entry.
- *      key -       The value by which to find the entry to be deleted.
- *      old_value - A pointer which will be populated with a pointer to
- *                  the deleted entry if one is found. You should then release
- *                  the memory held by the deleted entry. You may pass NULL as
- *                  old_value, but then you will have no opportunity to
- *                  release the memory used by the deleted entry, which will
- *                  be a memory leak in most uses.
+ *      tree -          the empty tree to load into
+ *      fd -            the file descriptor to read from
+ *      deserializer -  the function making values from their bytes
+ *      destructor -    the destructor for values already read, if loading
+ *                      fails
  *
  * Returns:
- *      RUMATI_AVL_OK       If the entry was deleted successfully.
- *      RUMATI_AVL_ENOENT   If no matching entry was found.
- *      RUMATI_AVL_ETOOBIG  If the tree is too large. This should never happen,
- *                          since rumati_avl_put() should fail with
- *                          RUMATI_AVL_ETOOBIG when creating a tree which is
- *                          too large.
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If any pointer is NULL, the tree is not empty, or
+ *                          the file is not a valid snapshot.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If there was an error reading from fd.
+ *      Any error returned by the deserializer.
  */
 RUMATI_AVL_API
-RUMATI_AVL_ERROR rumati_avl_delete(
+RUMATI_AVL_ERROR rumati_avl_load(
         RUMATI_AVL_TREE *tree,
-        void *key,
-        void **old_value)
+        int fd,
+        RUMATI_AVL_VALUE_DESERIALIZER deserializer,
+        RUMATI_AVL_NODE_DESTRUCTOR destructor)
 {
-    struct rumati_avl_node **parent_link = &tree->root;
-    struct rumati_avl_update_list updates;
+    struct rumati_avl_stream s;
+    struct rumati_avl_node *vine = NULL;
+    struct rumati_avl_node **tail = &vine;
+    RUMATI_AVL_ERROR err;
+    const unsigned char *bytes;
+    void *value, *prev = NULL;
+    size_t count, length, i;
 
-    /* init updates */
-    updates.number_of_updates = 0;
+    if (tree == NULL || deserializer == NULL || destructor == NULL ||
+            tree->size != 0 || tree->image != NULL){
+        return RUMATI_AVL_EINVAL;
+    }
 
-    while (1){
-        int cmp;
+    if (rumati_avl_stream_open(&s, fd) != RUMATI_AVL_OK){
+        return RUMATI_AVL_ENOMEM;
+    }
 
-        if (*parent_link == NULL){
-            /*
-             * We reached a leaf's NULL pointer child link, without finding
-             * a matching entry - none exists.
-             */
-            return RUMATI_AVL_ENOENT;
-        }
+    err = rumati_avl_stream_fill(&s, RUMATI_AVL_SNAPSHOT_MAGIC_SIZE);
+    if (err == RUMATI_AVL_ENOENT || (err == RUMATI_AVL_OK &&
+            memcmp(s.buffer, RUMATI_AVL_SNAPSHOT_MAGIC,
+                RUMATI_AVL_SNAPSHOT_MAGIC_SIZE) != 0)){
+        err = RUMATI_AVL_EINVAL;
+    }
+    if (err == RUMATI_AVL_OK){
+        s.start = RUMATI_AVL_SNAPSHOT_MAGIC_SIZE;
+        err = rumati_avl_stream_get_varint(&s, &count);
+    }
 
-        /* normal binary search descend based on key comparison */
-        cmp = tree->comparator(tree->udata, key, (*parent_link)->data);
-        if (cmp > 0){
-            /*
-             * Node to be deleted is to the right of this node, descend.
-             */
-            if (rumati_avl_add_update(&updates, parent_link, false) == false){
-                return RUMATI_AVL_ETOOBIG;
-            }
-            parent_link = &(*parent_link)->right;
-        }else if (cmp < 0){
-            /*
-             * Node to be deleted is to the left of this node, descend.
-             */
-            if (rumati_avl_add_update(&updates, parent_link, true) == false){
-                return RUMATI_AVL_ETOOBIG;
-            }
-            parent_link = &(*parent_link)->left;
-        }else if (cmp == 0){
-            struct rumati_avl_node *delnode = NULL;
-            void *tmp_data_ptr;
-            /*
-             * This is the node which must be deleted
-             */
-            delnode = *parent_link;
-            tmp_data_ptr = delnode->data;
-            /*
-             * First, try delete the node in place if it does not have 2
-             * children, by replacing it with it's only node if it have one,
-             * or by making it's parent a leaf if it has no children.
-             */
-            if ((*parent_link)->right == NULL){
-                *parent_link = (*parent_link)->left;
-            }else if ((*parent_link)->left == NULL){
-                *parent_link = (*parent_link)->right;
-            }else{
-                /*
-                 * The node to be deleted has two children. We cannot simply
-                 * delete it by replacing it with it's only child. So, we
-                 * delete it by overwritting its data with that of its inner-
-                 * most child on its heavier subtree, then deleting that inner
-                 * most child in the heavier subtree.
-                 */
-                if ((*parent_link)->balance < 0){
-                    /*
-                     * Left subtree is greater, replace the node to be deleted
-                     * with the right most node in the left subtree.
-                     *
-                     * Move left, then as far right as possible.
-                     */
-                    if (rumati_avl_add_update(&updates, parent_link, true) == false){
-                        return RUMATI_AVL_ETOOBIG;
-                    }
-                    parent_link = &(*parent_link)->left;
-                    while ((*parent_link)->right != NULL){
-                        if (rumati_avl_add_update(&updates, parent_link, false) == false){
-                            return RUMATI_AVL_ETOOBIG;
-                        }
-                        parent_link = &(*parent_link)->right;
-                    }
-                    /*
-                     * Overwrite node to be deleted with replacement node.
-                     */
-                    delnode->data = (*parent_link)->data;
-                    delnode = *parent_link;
-                    /*
-                     * Consider:
-                     *
-                     *     E
-                     *    / \
-                     *   B   F
-                     *  / \   \
-                     * A   D   G
-                     *    /
-                     *   C
-                     *
-                     * E's content is replaced with the content from D, then D
-                     * is deleted. B must inherits D's outside hild (C) if any.
-                     */
-                    *parent_link = delnode->left;
-                }else{
-                    /*
-                     * Same as block above
-                     */
-                    if (rumati_avl_add_update(&updates, parent_link, false) == false){
-                        return RUMATI_AVL_ETOOBIG;
-                    }
-                    parent_link = &(*parent_link)->right;
-                    while ((*parent_link)->left != NULL){
-                        if (rumati_avl_add_update(&updates, parent_link, true) == false){
-                            return RUMATI_AVL_ETOOBIG;
-                        }
-                        parent_link = &(*parent_link)->left;
-                    }
-                    delnode->data = (*parent_link)->data;
-                    delnode = *parent_link;
-                    *parent_link = delnode->right;
-                }
-            }
-            /*
-             * If the user has given an "out" variable for the deleted value,
-             * populate it with the deleted value.
-             */
-            if (old_value != NULL){
-                *old_value = tmp_data_ptr;
-            }
-            free(delnode);
+    /* link the nodes into a vine as they are read, in order */
+    for (i = 0; err == RUMATI_AVL_OK && i < count; i++){
+        struct rumati_avl_node *n;
+
+        err = rumati_avl_stream_get_value(&s, &bytes, &length);
+        if (err != RUMATI_AVL_OK){
+            break;
+        }
+        err = deserializer(tree->udata, bytes, length, &value);
+        if (err != RUMATI_AVL_OK){
             break;
         }
-    }
 
-    /*
-     * Do updates
-     */
-    while (updates.number_of_updates > 0){
-        struct rumati_avl_update *update;
-        updates.number_of_updates--;
-        update = &updates.update[updates.number_of_updates];
-        if (update->left){
-            /*
-             * Node deleted to the left of this node, bump balance towards
-             * the right.
-             */
-            (*update->node_ptr)->balance++;
-            /*
-             * TODO discuss affect on parent:
-             * (balance is after adjustment for deleted descendant)
-             *  -   balance < 0:    impossible, would have had to be imbalanced
-             *                      before delete
-             *  -   balance = 0:    parent loses 1 height, as tree is now one
-             *                      layer lighter
-             *  -   balance = 1:    tree was balanced, now 1 layer heavier on
-             *                      right. No affect on parent, no more updates
-             *                      required.
-             *  -   balance > 1:    tree was one heavier on right, now 2
-             *                      heavier, ie. imbalanced. This situation has
-             *                      no affect on parent, because node was
-             *                      deleted on lighter subtree. However, a
-             *                      rotation is required to rebalance tree.
-             *                      This rotation may or may not cause the
-             *                      parent to be one layer lighter. If it does,
-             *                      we must continue updating the parent. If
-             *                      not, we stop updating here.
-             */
-            if ((*update->node_ptr)->balance > 1){
-                /*
-                 * Node is now imbalanced. Rebalance according to normal
-                 * AVL rules. See rumati_avl_put() for discussion.
-                 */
-                if ((*update->node_ptr)->right->balance < 0){
-                    /*
-                     * Double rotation required, eg:
-                     *
-                     *  A      A         B
-                     *   \      \       / \
-                     *    C =>   B  => A   C
-                     *   /        \
-                     *  B          C
-                     *
-                     *  This will leave the tree lighter, so we continue to
-                     *  update parents.
-                     */
-                    rumati_avl_rotate_right(&(*update->node_ptr)->right);
-                    rumati_avl_rotate_left(update->node_ptr);
-                }else if ((*update->node_ptr)->right->balance == 0){
-                    /*
-                     * The tree is in need of rotation, but the rotation will
-                     * not change the size of the tree, so stop updating here.
-                     * There is no change in parent balance. eg:
-                     *
-                     * A         C
-                     *  \       / \
-                     *   C  => A   D
-                     *  / \     \
-                     * B   D     B
-                     */
-                    rumati_avl_rotate_left(update->node_ptr);
-                    break;
-                }else{
-                    /*
-                     * A simple left rotation which will cause the tree to be
-                     * lighter - continue updating. eg:
-                     *
-                     * A         B
-                     *  \       / \
-                     *   B  => A   C
-                     *    \
-                     *     C
-                     */
-                    rumati_avl_rotate_left(update->node_ptr);
-                }
-            }else if ((*update->node_ptr)->balance == 1){
-                break;
-            }
-        }else{
-            (*update->node_ptr)->balance--;
-            if ((*update->node_ptr)->balance < -1){
-                if ((*update->node_ptr)->left->balance > 0){
-                    rumati_avl_rotate_left(&(*update->node_ptr)->left);
-                    rumati_avl_rotate_right(update->node_ptr);
-                }else if ((*update->node_ptr)->left->balance == 0){
-                    rumati_avl_rotate_right(update->node_ptr);
-                    break;
-                }else{
-                    rumati_avl_rotate_right(update->node_ptr);
-                }
-            }else if ((*update->node_ptr)->balance == -1){
+        if (prev != NULL){
+            RUMATI_AVL_COUNT(tree, comparisons, 1);
+            if (tree->comparator(tree->udata, prev, value) >= 0){
+                destructor(tree->udata, value);
+                err = RUMATI_AVL_EINVAL;
                 break;
             }
         }
+        n = rumati_avl_new_node(tree, value);
+        if (n == NULL){
+            destructor(tree->udata, value);
+            err = RUMATI_AVL_ENOMEM;
+            break;
+        }
+        *tail = n;
+        tail = &n->right;
+        prev = value;
     }
 
+    /* the snapshot must end the file */
+    if (err == RUMATI_AVL_OK){
+        err = rumati_avl_stream_fill(&s, 1);
+        err = err == RUMATI_AVL_ENOENT ? RUMATI_AVL_OK :
+                err == RUMATI_AVL_OK ? RUMATI_AVL_EINVAL : err;
+    }
+    free(s.buffer);
+
+    if (err != RUMATI_AVL_OK){
+        /* a vine is a valid, if very high, tree to clear */
+        tree->root = vine;
+        rumati_avl_clear(tree, destructor);
+        return err;
+    }
+
+    tree->root = rumati_avl_build(tree, &vine, tree->size, 0,
+            rumati_avl_build_height(tree->size) - 1);
+    tree->unbalanced = false;
     return RUMATI_AVL_OK;
 }
 
 /*
- * rumati_avl_get_smallest() - retrieves the smallest entry in the tree.
+ * Image format of rumati_avl_write_image(). The header is followed by the
+ * values, each aligned to RUMATI_AVL_IMAGE_ALIGN bytes, then the nodes,
+ * whose links and data are offsets from the start of the file, see
+ * rumati_avl_link().
+ */
+#define RUMATI_AVL_IMAGE_MAGIC          "RAVLIMG2"
+#define RUMATI_AVL_IMAGE_ALIGN          16
+#define RUMATI_AVL_IMAGE_HEADER_SIZE    64
+
+struct rumati_avl_image_header {
+    char magic[8];
+    /* bytes in the file */
+    uint64_t size;
+    /* nodes, and the offset of the first, which is the root */
+    uint64_t count;
+    uint64_t nodes;
+    /* sizeof(struct rumati_avl_node) and RUMATI_AVL_BALANCE of the tree */
+    uint32_t node_size;
+    uint32_t balance;
+};
+
+/*
+ * A node of an image being written, in level order. It is the middle of
+ * the entries from lo up to hi, in key order.
+ */
+struct rumati_avl_image_slot {
+    size_t lo;
+    size_t hi;
+    size_t left;
+    size_t right;
+    unsigned int depth;
+    /* offset of the node's value in the file */
+    uint64_t value;
+};
+
+/*
+ * rumati_avl_image_visit() - adds a node to the list of nodes in key order,
+ * for rumati_avl_walk_stack(). Tombstones are left out.
+ */
+static void rumati_avl_image_visit(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_node *n,
+        size_t depth,
+        void *arg)
+{
+    struct rumati_avl_node ***next = arg;
+
+    (void)tree;
+    (void)depth;
+    if (!rumati_avl_is_tombstone(n)){
+        *(*next)++ = n;
+    }
+}
+
+/*
+ * rumati_avl_stream_pad() - writes zeros to a stream up to a multiple of
+ * align bytes from offset, and returns the new offset.
+ */
+static uint64_t rumati_avl_stream_pad(
+        struct rumati_avl_stream *s,
+        uint64_t offset,
+        size_t align)
+{
+    static const unsigned char zeros[RUMATI_AVL_IMAGE_HEADER_SIZE];
+    size_t pad = (size_t)((align - offset % align) % align);
+
+    rumati_avl_stream_write(s, zeros, pad);
+    return offset + pad;
+}
+
+/*
+ * rumati_avl_write_image() - writes a tree as an image file, which
+ * rumati_avl_open_image() maps into memory and queries in place.
  *
  * Parameters:
- *      tree -  The tree in which to find the smallest value.
- * 
+ *      tree -          the tree to write
+ *      fd -            a regular file, written from its start
+ *      serializer -    the function writing the bytes of values
+ *
  * Returns:
- *      A pointer to the smallest value in the tree, or NULL if the tree
- *      is empty.
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If tree or serializer is NULL.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If there was an error writing to fd.
  */
 RUMATI_AVL_API
-void *rumati_avl_get_smallest(RUMATI_AVL_TREE *tree)
+RUMATI_AVL_ERROR rumati_avl_write_image(
+        RUMATI_AVL_TREE *tree,
+        int fd,
+        RUMATI_AVL_VALUE_SERIALIZER serializer)
 {
-    struct rumati_avl_node *n = tree->root;
-    
-    if (n == NULL){
-        return NULL;
+    struct rumati_avl_image_header header;
+    struct rumati_avl_image_slot *slots;
+    struct rumati_avl_node **order, **next;
+    struct rumati_avl_stream s;
+    struct rumati_avl_node node;
+    uint64_t offset;
+    unsigned int red_depth;
+    size_t count, used, i;
+
+    if (tree == NULL || serializer == NULL){
+        return RUMATI_AVL_EINVAL;
     }
+    count = tree->size - tree->tombstones;
 
-    while (n->left != NULL){
-        n = n->left;
+    memset(&s, 0, sizeof(s));
+    s.fd = fd;
+    s.size = RUMATI_AVL_STREAM_BUFFER_SIZE;
+    s.buffer = malloc(s.size);
+    s.value_size = 256;
+    s.value = malloc(s.value_size);
+    order = malloc((count + 1) * sizeof(*order));
+    slots = malloc((count + 1) * sizeof(*slots));
+    if (s.buffer == NULL || s.value == NULL || order == NULL ||
+            slots == NULL){
+        s.err = RUMATI_AVL_ENOMEM;
+        goto out;
+    }
+
+    next = order;
+    if (rumati_avl_walk_stack(tree, rumati_avl_image_visit, &next) !=
+            RUMATI_AVL_OK){
+        s.err = RUMATI_AVL_ENOMEM;
+        goto out;
+    }
+
+    /*
+     * Lay the nodes out in level order, so that the top levels of the tree,
+     * which every lookup reads, share the first few pages of the node array.
+     * Children are numbered as they are queued, which is the order they are
+     * laid out in.
+     */
+    used = count > 0;
+    slots[0].lo = 0;
+    slots[0].hi = count;
+    slots[0].depth = 0;
+    for (i = 0; i < used; i++){
+        size_t mid = slots[i].lo + (slots[i].hi - slots[i].lo - 1) / 2;
+
+        slots[i].left = slots[i].right = SIZE_MAX;
+        if (mid > slots[i].lo){
+            slots[used].lo = slots[i].lo;
+            slots[used].hi = mid;
+            slots[used].depth = slots[i].depth + 1;
+            slots[i].left = used++;
+        }
+        if (mid + 1 < slots[i].hi){
+            slots[used].lo = mid + 1;
+            slots[used].hi = slots[i].hi;
+            slots[used].depth = slots[i].depth + 1;
+            slots[i].right = used++;
+        }
+    }
+
+    /* the header goes in last, once the offsets are known */
+    if (lseek(fd, RUMATI_AVL_IMAGE_HEADER_SIZE, SEEK_SET) < 0){
+        s.err = RUMATI_AVL_EIO;
+        goto out;
+    }
+    offset = RUMATI_AVL_IMAGE_HEADER_SIZE;
+    for (i = 0; i < count && s.err == RUMATI_AVL_OK; i++){
+        struct rumati_avl_node *n;
+        size_t length;
+
+        n = order[slots[i].lo + (slots[i].hi - slots[i].lo - 1) / 2];
+        length = serializer(tree->udata, rumati_avl_data(tree, n), s.value,
+                s.value_size);
+        if (length > s.value_size){
+            unsigned char *value = realloc(s.value, length);
+
+            if (value == NULL){
+                s.err = RUMATI_AVL_ENOMEM;
+                break;
+            }
+            s.value = value;
+            s.value_size = length;
+            length = serializer(tree->udata, rumati_avl_data(tree, n),
+                    s.value, length);
+        }
+        slots[i].value = offset;
+        rumati_avl_stream_write(&s, s.value, length);
+        offset = rumati_avl_stream_pad(&s, offset + length,
+                RUMATI_AVL_IMAGE_ALIGN);
+    }
+
+    offset = rumati_avl_stream_pad(&s, offset, RUMATI_AVL_IMAGE_HEADER_SIZE);
+    red_depth = rumati_avl_build_height(count) - 1;
+    memset(&header, 0, sizeof(header));
+    header.nodes = offset;
+    for (i = 0; i < count && s.err == RUMATI_AVL_OK; i++){
+        memset(&node, 0, sizeof(node));
+        if (slots[i].left != SIZE_MAX){
+            node.left = (struct rumati_avl_node *)(uintptr_t)
+                    (header.nodes + slots[i].left * sizeof(node));
+        }
+        if (slots[i].right != SIZE_MAX){
+            node.right = (struct rumati_avl_node *)(uintptr_t)
+                    (header.nodes + slots[i].right * sizeof(node));
+        }
+        node.data = (void *)(uintptr_t)slots[i].value;
+        node.balance = rumati_avl_build_balance(tree->balance,
+                slots[i].hi - slots[i].lo, slots[i].depth, red_depth);
+        rumati_avl_stream_write(&s, &node, sizeof(node));
+    }
+    rumati_avl_stream_write_fd(&s, s.buffer, s.end);
+
+    memcpy(header.magic, RUMATI_AVL_IMAGE_MAGIC, sizeof(header.magic));
+    header.size = header.nodes + count * sizeof(node);
+    header.count = count;
+    header.node_size = sizeof(node);
+    header.balance = tree->balance;
+    if (s.err == RUMATI_AVL_OK &&
+            (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            ftruncate(fd, (off_t)header.size) != 0)){
+        s.err = RUMATI_AVL_EIO;
     }
 
-    return n->data;
+out:
+    free(slots);
+    free(order);
+    free(s.value);
+    free(s.buffer);
+    return s.err;
 }
 
 /*
- * rumati_avl_get_greatest() - retrieves the greatest entry in the tree.
+ * rumati_avl_open_image() - maps an image file written by
+ * rumati_avl_write_image(), as a read only tree.
  *
  * Parameters:
- *      tree -  The tree in which to find the greatest value.
- * 
+ *      tree -          populated with the tree
+ *      fd -            the image file, which may be closed afterwards
+ *      comparator -    compares values, as their bytes in the image
+ *      udata -         a user defined pointer for the tree
+ *
  * Returns:
- *      A pointer to the greatest value in the tree, or NULL if the tree
- *      is empty.
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If tree or comparator is NULL, or fd is not an
+ *                          image written by this build of the library.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory, or
+ *                          mapping the file.
+ *      RUMATI_AVL_EIO      If there was an error reading fd.
  */
 RUMATI_AVL_API
-void *rumati_avl_get_greatest(RUMATI_AVL_TREE *tree)
+RUMATI_AVL_ERROR rumati_avl_open_image(
+        RUMATI_AVL_TREE **tree,
+        int fd,
+        RUMATI_AVL_COMPARATOR comparator,
+        void *udata)
 {
-    struct rumati_avl_node *n = tree->root;
-    
-    if (n == NULL){
-        return NULL;
+    struct rumati_avl_image_header header;
+    RUMATI_AVL_TREE *t;
+    RUMATI_AVL_ERROR err;
+    struct stat st;
+    void *image;
+
+    if (tree == NULL || comparator == NULL){
+        return RUMATI_AVL_EINVAL;
+    }
+    if (fstat(fd, &st) != 0 ||
+            pread(fd, &header, sizeof(header), 0) < 0){
+        return RUMATI_AVL_EIO;
+    }
+    if (st.st_size < (off_t)sizeof(header) ||
+            memcmp(header.magic, RUMATI_AVL_IMAGE_MAGIC,
+                sizeof(header.magic)) != 0 ||
+            header.node_size != sizeof(struct rumati_avl_node) ||
+            header.size != (uint64_t)st.st_size ||
+            header.size > SIZE_MAX ||
+            header.nodes > header.size ||
+            header.nodes < RUMATI_AVL_IMAGE_HEADER_SIZE ||
+            header.nodes % RUMATI_AVL_IMAGE_ALIGN != 0 ||
+            header.count > (header.size - header.nodes) / header.node_size){
+        return RUMATI_AVL_EINVAL;
     }
 
-    while (n->right != NULL){
-        n = n->right;
+    err = rumati_avl_new_balanced(&t, comparator, udata,
+            (RUMATI_AVL_BALANCE)header.balance);
+    if (err != RUMATI_AVL_OK){
+        return err;
+    }
+
+    /*
+     * The nodes hold offsets, so the image works wherever it is mapped, and
+     * is never written. Shared pages come straight from the page cache.
+     */
+    image = mmap(NULL, (size_t)header.size, PROT_READ, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED){
+        rumati_avl_destroy(t, NULL);
+        return RUMATI_AVL_ENOMEM;
     }
 
-    return n->data;
+    t->image = image;
+    t->image_size = (size_t)header.size;
+    t->size = (size_t)header.count;
+    if (header.count > 0){
+        t->root = (struct rumati_avl_node *)((char *)image + header.nodes);
+    }
+    *tree = t;
+    return RUMATI_AVL_OK;
 }
@@ -31,6 +31,8 @@
 #define RUMATI_AVL_API
 #endif
 
+#include <stddef.h>     /* for size_t */
+
 /*
  * The basic type for AVL trees. This is the opaque context passed to all
  * library methods.
@@ -45,9 +47,97 @@ typedef enum {
     RUMATI_AVL_ENOMEM,      /* malloc failure */
     RUMATI_AVL_EINVAL,      /* invalid parameter, probably NULL */
     RUMATI_AVL_ENOENT,      /* no such element */
-    RUMATI_AVL_ETOOBIG      /* tree too big */
+    RUMATI_AVL_ETOOBIG,     /* tree too big, no longer returned */
+    RUMATI_AVL_EIO,         /* error reading or writing a stream */
+    RUMATI_AVL_ECORRUPT,    /* tree failed a consistency check */
+    RUMATI_AVL_EROFS        /* tree is a read only image */
 } RUMATI_AVL_ERROR;
 
+/*
+ * Balancing schemes which may be selected when a tree is created with
+ * rumati_avl_new_balanced(). All schemes share the same node storage and the
+ * same query code, they differ only in how rumati_avl_put() and
+ * rumati_avl_delete() restore balance.
+ */
+typedef enum {
+    RUMATI_AVL_BALANCE_AVL,     /* strict AVL, the default */
+    RUMATI_AVL_BALANCE_WAVL,    /* weak AVL, O(1) amortized rotations */
+    RUMATI_AVL_BALANCE_RB       /* red-black, O(1) amortized rotations */
+} RUMATI_AVL_BALANCE;
+
+/*
+ * Statistics for the negative lookup filter, see
+ * rumati_avl_get_filter_stats().
+ */
+typedef struct {
+    size_t bytes;               /* memory used by the filter */
+    size_t counters;            /* number of counters */
+    unsigned int probes;        /* counters checked per key */
+    size_t used;                /* counters which are not zero */
+    size_t lookups;             /* rumati_avl_get() calls checking the filter */
+    size_t rejected;            /* lookups the filter answered alone */
+    size_t false_positives;     /* lookups let through which found nothing */
+    double expected_fp_rate;    /* chance a missing key is let through */
+} RUMATI_AVL_FILTER_STATS;
+
+/*
+ * Operation counters of a tree, see rumati_avl_get_stats(). Updates are
+ * counted whether they succeed or not.
+ */
+typedef struct {
+    unsigned long long comparisons;     /* comparator calls, by all calls */
+    unsigned long long gets;            /* rumati_avl_get() calls */
+    unsigned long long puts;            /* rumati_avl_put() calls */
+    unsigned long long deletes;         /* rumati_avl_delete() calls */
+    unsigned long long insert_single_rotations;
+    unsigned long long insert_double_rotations;
+    unsigned long long delete_single_rotations;
+    unsigned long long delete_double_rotations;
+    unsigned long long allocations;     /* nodes allocated */
+    unsigned long long frees;           /* nodes freed */
+    unsigned long long path_total;      /* nodes compared by all updates */
+    unsigned long long path_max;        /* most nodes compared by an update */
+    unsigned long long max_height;      /* depth of the deepest new node */
+} RUMATI_AVL_STATS;
+
+/*
+ * Memory used by a tree, see rumati_avl_memory_usage(). All sizes are in
+ * bytes.
+ */
+typedef struct {
+    size_t entries;             /* entries, not counting tombstones */
+    size_t nodes;               /* nodes, including tombstones */
+    size_t tree_bytes;          /* the tree structure */
+    size_t node_bytes;          /* nodes, as requested from malloc() */
+    size_t cache_bytes;         /* lookup cache */
+    size_t index_bytes;         /* hash index, including empty entries */
+    size_t filter_bytes;        /* negative lookup filter */
+    size_t overhead_bytes;      /* allocator headers and rounding */
+    size_t slack_bytes;         /* empty index entries and tombstones */
+    size_t total_bytes;         /* everything, slack included */
+    double bytes_per_entry;     /* total_bytes / entries */
+} RUMATI_AVL_MEMORY;
+
+/*
+ * Number of depths counted separately in RUMATI_AVL_SHAPE. Deeper nodes are
+ * counted in the last one.
+ */
+#define RUMATI_AVL_SHAPE_DEPTHS     64
+
+/*
+ * Shape of a tree, see rumati_avl_get_shape(). Depths count links from the
+ * root, which has depth 0.
+ */
+typedef struct {
+    size_t nodes;                       /* nodes, including tombstones */
+    size_t max_depth;                   /* depth of the deepest node */
+    double average_depth;               /* over all nodes */
+    double ideal_average_depth;         /* of a perfectly balanced tree */
+    double successful_search_cost;      /* comparisons to find a node */
+    double unsuccessful_search_cost;    /* comparisons to miss */
+    size_t depths[RUMATI_AVL_SHAPE_DEPTHS]; /* nodes at each depth */
+} RUMATI_AVL_SHAPE;
+
 /*
  * A function to compare node values in a tree. This function should return
  * integers less than zero if value1 is ordered before value2, zero if the
@@ -67,6 +157,41 @@ typedef void(*RUMATI_AVL_NODE_DESTRUCTOR)(
         void *udata,
         void *value);
 
+/*
+ * A function that hashes keys for the lookup cache, the hash index and the
+ * negative lookup filter. Keys which compare equal must have equal hashes.
+ */
+typedef size_t(*RUMATI_AVL_HASH)(
+        void *udata,
+        void *value);
+
+/*
+ * A function that writes the bytes of a value into buffer, for
+ * rumati_avl_save().
+ *
+ * Returns the length of the value. If that is more than size, the function
+ * is called again with a buffer of at least that size.
+ */
+typedef size_t(*RUMATI_AVL_VALUE_SERIALIZER)(
+        void *udata,
+        void *value,
+        void *buffer,
+        size_t size);
+
+/*
+ * A function that makes a value from the bytes written by a
+ * RUMATI_AVL_VALUE_SERIALIZER, for rumati_avl_load(). The buffer is only
+ * valid during the call.
+ *
+ * Returns RUMATI_AVL_OK and sets value on success, or an error which is
+ * passed on to the caller of rumati_avl_load().
+ */
+typedef RUMATI_AVL_ERROR(*RUMATI_AVL_VALUE_DESERIALIZER)(
+        void *udata,
+        const void *buffer,
+        size_t length,
+        void **value);
+
 /*
  * rumati_avl_new() - creates a new AVL tree.
  *
@@ -88,6 +213,34 @@ RUMATI_AVL_ERROR rumati_avl_new(
         RUMATI_AVL_COMPARATOR comparator,
         void *udata);
 
+/*
+ * rumati_avl_new_balanced() - creates a new tree using the given balancing
+ * scheme. Strict AVL trees are the shallowest, which makes lookups the
+ * cheapest, but a delete may rotate at every level of the tree. Weak AVL and
+ * red-black trees need at most a constant number of rotations (amortized)
+ * per update, which suits delete heavy workloads.
+ *
+ * Parameters:
+ *      tree -  a pointer to a pointer to an AVL tree. This will be populated
+ *              with a pointer to the new tree if create successfully.
+ *      comparator -    a function that compares node values, for sorting.
+ *      udata - a user defined pointer to be passed to the comparator and
+ *              other user callback functions.
+ *      balance -   the balancing scheme to use for the tree.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success
+ *      RUMATI_AVL_EINVAL   If comparator is NULL, tree is NULL, or balance is
+ *                          not a known balancing scheme.
+ *      RUMATI_AVL_ENOMEM   If there was a memory allocation error.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_new_balanced(
+        RUMATI_AVL_TREE **tree,
+        RUMATI_AVL_COMPARATOR comparator,
+        void *udata,
+        RUMATI_AVL_BALANCE balance);
+
 /*
  * rumati_avl_clear() - removes all nodes from the tree, using the destructor
  * provided.
@@ -131,8 +284,9 @@ void rumati_avl_destroy(
  * 
  * Returns:
  *      RUMATI_AVL_OK       On success
- *      RUMATI_AVL_ETOOBIG  If the tree is to big.
  *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EROFS    If the tree is an image, see
+ *                          rumati_avl_open_image().
  */
 RUMATI_AVL_API
 RUMATI_AVL_ERROR rumati_avl_put(
@@ -236,15 +390,18 @@ void *rumati_avl_get_less_than(
  *                  the memory held by the deleted entry. You may pass NULL as
  *                  old_value, but then you will have no opportunity to
  *                  release the memory used by the deleted entry, which will
- *                  be a memory leak in most uses.
+ *                  be a memory leak in most uses. With lazy delete switched
+ *                  on, the entry is still owned by the tree, and must not be
+ *                  released; see rumati_avl_set_lazy_delete().
  *
  * Returns:
  *      RUMATI_AVL_OK       If the entry was deleted successfully.
  *      RUMATI_AVL_ENOENT   If no matching entry was found.
- *      RUMATI_AVL_ETOOBIG  If the tree is too large. This should never happen,
- *                          since rumati_avl_put() should fail with
- *                          RUMATI_AVL_ETOOBIG when creating a tree which is
- *                          too large.
+ *      RUMATI_AVL_ENOMEM   If the path down a weak AVL or red-black tree
+ *                          was too long to record without allocating memory,
+ *                          and the allocation failed. The tree is unchanged.
+ *      RUMATI_AVL_EROFS    If the tree is an image, see
+ *                          rumati_avl_open_image().
  */
 RUMATI_AVL_API
 RUMATI_AVL_ERROR rumati_avl_delete(
@@ -278,4 +435,639 @@ void *rumati_avl_get_smallest(RUMATI_AVL_TREE *tree);
 RUMATI_AVL_API
 void *rumati_avl_get_greatest(RUMATI_AVL_TREE *tree);
 
+/*
+ * rumati_avl_set_relaxed() - switches relaxed mode on or off. In relaxed
+ * mode, rumati_avl_put() and rumati_avl_delete() make plain binary search
+ * tree updates, and do no rebalancing at all. This makes bulk loads cheaper,
+ * but the tree may become unbalanced (sorted inserts build a list), so
+ * lookups get slower until rumati_avl_rebalance() is called. Switching
+ * relaxed mode off rebalances the tree.
+ *
+ * Parameters:
+ *      tree -      the tree
+ *      relaxed -   non-zero to switch relaxed mode on, zero to switch it off
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOMEM   If relaxed mode was being switched off, and
+ *                          rebalancing the tree failed. The tree stays in
+ *                          relaxed mode.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_set_relaxed(
+        RUMATI_AVL_TREE *tree,
+        int relaxed);
+
+/*
+ * rumati_avl_rebalance() - restores the balance of a tree after updates made
+ * in relaxed mode. Relaxed mode updates mark the nodes on their way down,
+ * and only the marked nodes are visited, so the cost grows with the number
+ * of updates, not the size of the tree. Where marked nodes are out of
+ * balance, the highest of them is rebuilt as a perfectly balanced subtree
+ * (red-black trees are rebuilt as a whole). The tree may stay in relaxed
+ * mode, so this may be called periodically during a long bulk load, for
+ * example from a maintenance thread holding the caller's lock on the tree.
+ *
+ * Parameters:
+ *      tree -  the tree to rebalance
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success, or if the tree was already balanced.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory. The tree
+ *                          remains usable, but is still unbalanced.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_rebalance(RUMATI_AVL_TREE *tree);
+
+/*
+ * rumati_avl_set_lazy_delete() - switches lazy delete on or off. With lazy
+ * delete on, rumati_avl_delete() does not unlink the matching node, but only
+ * marks it as a tombstone, so a delete costs no more than a lookup and makes
+ * no rotations. Tombstones are invisible to all queries. A put with the key
+ * of a tombstone revives it in place.
+ *
+ * The value of a tombstone stays owned by the tree, and is passed to
+ * destructor when the tombstone is purged, cleared or revived with another
+ * value. Putting back the same value revives it without destroying it.
+ * Tombstones are purged in one batch by rumati_avl_purge(), which also
+ * rebuilds the tree perfectly balanced. Switching lazy delete off purges the
+ * tree. An automatic purge runs at the start of the delete that would take
+ * the tombstones to purge_percent, before it marks its own node, so the value
+ * a delete hands back stays valid until the next delete, purge or clear, or
+ * a put of its key.
+ *
+ * Parameters:
+ *      tree -          the tree
+ *      destructor -    the destructor for the values of tombstones, or NULL
+ *                      to switch lazy delete off.
+ *      purge_percent - the percentage of the nodes in the tree which may be
+ *                      tombstones before they are purged automatically, or 0
+ *                      to only purge from rumati_avl_purge().
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If purge_percent is greater than 100.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_set_lazy_delete(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_NODE_DESTRUCTOR destructor,
+        unsigned int purge_percent);
+
+/*
+ * rumati_avl_purge() - removes all tombstones from the tree, passing their
+ * values to the destructor given to rumati_avl_set_lazy_delete(). The
+ * remaining nodes are rebuilt into a perfectly balanced tree.
+ *
+ * Parameters:
+ *      tree -  the tree to purge
+ */
+RUMATI_AVL_API
+void rumati_avl_purge(RUMATI_AVL_TREE *tree);
+
+/*
+ * rumati_avl_set_cache() - sets up a small direct mapped cache in front of
+ * rumati_avl_get(). Each key hashes to one slot, which remembers the node
+ * last found for a key with that hash, so repeated gets of a hot key cost a
+ * hash and a single comparison instead of a descent down the tree. Deletes
+ * keep the cache correct. Only rumati_avl_get() uses the cache, and only
+ * successful lookups fill it. Slots are filled with relaxed atomic stores,
+ * so gets may still run concurrently on a tree with a cache, as long as
+ * nothing updates it.
+ *
+ * Calling this again replaces the cache with an empty one.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      hash -  the hash function for keys, or NULL to remove the cache
+ *      slots - the number of slots in the cache, rounded up to a power of
+ *              two, or 0 to remove the cache
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If slots is too large.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory. The tree
+ *                          keeps its previous cache, if any.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_set_cache(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_HASH hash,
+        size_t slots);
+
+/*
+ * rumati_avl_set_index() - builds a hash index of every entry in the tree,
+ * which put and delete keep up to date from then on. rumati_avl_get() then
+ * takes O(1) expected time, and does not use the tree or the lookup cache.
+ * All other queries still use the tree. The index costs two words per entry,
+ * up to twice over, since it is kept at most half full.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      hash -  the hash function for keys, or NULL to remove the index
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory. The tree
+ *                          has no index. rumati_avl_put() may also return
+ *                          RUMATI_AVL_ENOMEM if the index cannot grow.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_set_index(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_HASH hash);
+
+/*
+ * rumati_avl_set_filter() - builds a counting Bloom filter of every entry in
+ * the tree, which put and delete keep up to date from then on. Most calls to
+ * rumati_avl_get() for keys which are not in the tree then cost a hash and a
+ * few probes of the filter, instead of a descent down the tree. With about
+ * 10 counters per entry and 7 probes, about 1% of such calls still descend.
+ * The filter is not used when the tree has a hash index.
+ *
+ * Counters are one byte each. Calling this again rebuilds the filter, and
+ * resets its statistics.
+ *
+ * Parameters:
+ *      tree -      the tree
+ *      hash -      the hash function for keys, or NULL to remove the filter
+ *      counters -  the number of counters, rounded up to a power of two, or
+ *                  0 to remove the filter
+ *      probes -    the number of counters per key, from 1 to 16
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If probes is out of range, or counters is too
+ *                          large.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory. The tree
+ *                          has no filter.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_set_filter(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_HASH hash,
+        size_t counters,
+        unsigned int probes);
+
+/*
+ * rumati_avl_get_filter_stats() - reports the size of the negative lookup
+ * filter, how many lookups it has rejected or let through needlessly since
+ * it was built, and the false positive rate expected from how full it is.
+ * The counts are kept like the operation counters of rumati_avl_get_stats(),
+ * so gets may run concurrently, but counts they make at the same time may
+ * be lost.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      stats - populated with the statistics
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOENT   If the tree has no filter.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_get_filter_stats(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_FILTER_STATS *stats);
+
+/*
+ * rumati_avl_get_stats() - reads the operation counters of a tree: calls of
+ * the comparator, rotations made by inserts and deletes, node allocations,
+ * and the length of the paths down the tree taken by updates. The average
+ * path length is path_total / (puts + deletes).
+ *
+ * Counting costs a few instructions per comparison and per update, and is
+ * only compiled in when the library is built with RUMATI_AVL_COUNTERS
+ * defined. Counters are plain per tree fields, updated without atomic
+ * read-modify-write instructions, so counts made by concurrent readers of
+ * a shared tree may be lost.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      stats - populated with the counters
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOENT   If the library was built without
+ *                          RUMATI_AVL_COUNTERS. stats is populated with
+ *                          zeros.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_get_stats(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_STATS *stats);
+
+/*
+ * rumati_avl_reset_stats() - sets all the operation counters of a tree to
+ * zero.
+ *
+ * Parameters:
+ *      tree -  the tree
+ */
+RUMATI_AVL_API
+void rumati_avl_reset_stats(RUMATI_AVL_TREE *tree);
+
+/*
+ * rumati_avl_memory_usage() - reports the memory used by a tree: its nodes,
+ * the lookup cache, hash index and filter, and the overhead of the blocks
+ * they are allocated in. With glibc the overhead is measured with
+ * malloc_usable_size(), elsewhere it is estimated, assuming a size_t header
+ * and 2 pointer alignment for each block. Values are not counted, since the
+ * tree does not know their size.
+ *
+ * slack_bytes counts memory which is part of the total, but holds no entry:
+ * empty hash index entries, and the nodes of tombstones.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      usage - populated with the memory used
+ */
+RUMATI_AVL_API
+void rumati_avl_memory_usage(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_MEMORY *usage);
+
+/*
+ * rumati_avl_get_shape() - walks the tree once and reports a histogram of
+ * the depths of its nodes, their average and maximum depth, and the
+ * comparator calls expected for a search which finds a node, and for one
+ * which does not, assuming every node, and every gap between nodes, is
+ * searched for equally often.
+ *
+ * The cost of searches against ideal_average_depth + 1 shows what
+ * rumati_avl_rebalance() or rumati_avl_purge() could save. The higher the
+ * search costs, the more the lookup cache or hash index save on each
+ * rumati_avl_get().
+ *
+ * The walk keeps its way back up the tree on a stack allocated as it goes,
+ * and writes nothing to the nodes, so it can run on an image, see
+ * rumati_avl_open_image(), and alongside other calls only reading the tree.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      shape - populated with the shape of the tree
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory. shape is
+ *                          zeroed.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_get_shape(
+        RUMATI_AVL_TREE *tree,
+        RUMATI_AVL_SHAPE *shape);
+
+/*
+ * Flags for rumati_avl_check(), selecting what is checked.
+ */
+#define RUMATI_AVL_CHECK_ORDER      0x01    /* keys ascend in order */
+#define RUMATI_AVL_CHECK_BALANCE    0x02    /* balance, rank or colour */
+#define RUMATI_AVL_CHECK_COUNTS     0x04    /* node and tombstone counts */
+#define RUMATI_AVL_CHECK_LOOKUP     0x08    /* index and filter hold nodes */
+#define RUMATI_AVL_CHECK_ALL        0x0f
+
+/*
+ * RUMATI_AVL_CHECK_THREADS() - a flag for rumati_avl_check(), splitting the
+ * check across n threads, at most 255.
+ */
+#define RUMATI_AVL_CHECK_THREADS(n) (((unsigned int)(n) & 0xff) << 8)
+
+/*
+ * rumati_avl_check() - checks the consistency of a tree: that keys ascend
+ * in order, that every node's balance field holds the right balance factor,
+ * rank or colour for the tree's balancing scheme (skipped while relaxed
+ * mode updates have left balance fields stale), that the tree's counts of
+ * nodes and tombstones are right, and that the hash index and negative
+ * lookup filter, if present, hold every node.
+ *
+ * The check is iterative, with a stack on the heap, so it works however
+ * high the tree is. Like every walk of the tree, it writes nothing to the
+ * nodes, so concurrent readers may keep reading while it runs, but the
+ * tree must not be changed. The comparator and hash
+ * functions must be safe to call from several threads when more than one
+ * is used.
+ *
+ * With RUMATI_AVL_CHECK_THREADS(n) in flags, subtrees a few levels below
+ * the root are checked by n threads at once, then the levels above them by
+ * the calling thread. Threads need the library to be built with
+ * RUMATI_AVL_THREADS and linked with -pthread, as the Makefile builds it.
+ * Without them, asking for more than one thread is an error.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *      flags - RUMATI_AVL_CHECK_* flags, ored together
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       If the tree passed all checks.
+ *      RUMATI_AVL_ECORRUPT If the tree failed a check.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory, or
+ *                          starting a thread.
+ *      RUMATI_AVL_EINVAL   If more than one thread was asked for, but the
+ *                          library was built without RUMATI_AVL_THREADS.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_check(
+        RUMATI_AVL_TREE *tree,
+        unsigned int flags);
+
+/*
+ * rumati_avl_save() - writes the entries of a tree to a file descriptor, in
+ * key order. Tombstones are left out.
+ *
+ * The format is the 8 byte magic "RAVLSNP1", followed by the number of
+ * entries, then each value as its length and its bytes. Lengths and the
+ * number of entries are unsigned LEB128 varints. Writes are buffered in
+ * 64KiB blocks. The file is not synced, call fsync() for that.
+ *
+ * The tree is only read, with a stack of the nodes above the current one,
+ * so the serializer may read the tree too, but not change it.
+ *
+ * Parameters:
+ *      tree -          the tree to save
+ *      fd -            the file descriptor to write to, at its current offset
+ *      serializer -    the function writing the bytes of values, which is
+ *                      passed the tree's udata
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If tree or serializer is NULL.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If there was an error writing to fd. errno is
+ *                          left as write() set it.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_save(
+        RUMATI_AVL_TREE *tree,
+        int fd,
+        RUMATI_AVL_VALUE_SERIALIZER serializer);
+
+/*
+ * A snapshot being written in the background, see
+ * rumati_avl_save_background().
+ */
+typedef struct rumati_avl_background_save RUMATI_AVL_BACKGROUND_SAVE;
+
+/*
+ * rumati_avl_save_background() - writes the entries of a tree to a file
+ * descriptor as rumati_avl_save() does, from a child process, so that the
+ * tree can be updated while the snapshot is written.
+ *
+ * The child is made with fork(), which gives it a copy-on-write view of the
+ * tree as it was at the call. The caller is only stopped while fork()
+ * copies the page tables of the process, a few milliseconds per gigabyte,
+ * and the tree must not be updated during the call. The child only reads
+ * the tree, so afterwards each page the caller writes to is copied once,
+ * and memory use grows by up to the size of the pages touched while the
+ * snapshot is being written.
+ *
+ * In the child, only the calling thread runs, so the serializer must not
+ * wait on locks other threads might have held. fd shares its offset with
+ * the child, and must not be used until rumati_avl_save_wait() returns.
+ *
+ * Parameters:
+ *      tree -          the tree to save
+ *      fd -            the file descriptor to write to, at its current offset
+ *      serializer -    the function writing the bytes of values, which is
+ *                      passed the tree's udata
+ *      save -          populated with the snapshot being written, which must
+ *                      be passed to rumati_avl_save_wait()
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If any pointer is NULL.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory, or the
+ *                          child could not be made.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_save_background(
+        RUMATI_AVL_TREE *tree,
+        int fd,
+        RUMATI_AVL_VALUE_SERIALIZER serializer,
+        RUMATI_AVL_BACKGROUND_SAVE **save);
+
+/*
+ * rumati_avl_save_wait() - waits for a snapshot started by
+ * rumati_avl_save_background() to be written, and frees it. The file is not
+ * synced, call fsync() for that.
+ *
+ * Returns:
+ *      Any error of rumati_avl_save(), as returned in the child.
+ *      RUMATI_AVL_EIO      If the child was killed.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_save_wait(RUMATI_AVL_BACKGROUND_SAVE *save);
+
+/*
+ * rumati_avl_load() - reads entries written by rumati_avl_save() into an
+ * empty tree. The tree is made with rumati_avl_new_balanced() beforehand,
+ * which sets its comparator, udata and balancing scheme, and may be given a
+ * cache, index or filter, which are filled as entries are read.
+ *
+ * Since the entries are in key order, they are linked into a list as they
+ * are read, and built into a perfectly balanced tree at the end, in linear
+ * time, without comparisons or rotations. Each value is compared with the
+ * one before it, so that a file which is out of order is rejected rather
+ * than making a broken tree. When fd is a regular file, the length of each
+ * value is checked against the bytes left in the file before a buffer is
+ * grown for it, so a corrupt length is rejected too.
+ *
+ * Parameters:
+ *      tree -          the empty tree to load into
+ *      fd -            the file descriptor to read from, at its current
+ *                      offset. The snapshot must run to the end of the file.
+ *      deserializer -  the function making values from their bytes, which
+ *                      is passed the tree's udata
+ *      destructor -    the destructor for values already read, if loading
+ *                      fails
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If any pointer is NULL, the tree is not empty, or
+ *                          the file is not a snapshot, is truncated, or is
+ *                          out of order.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If there was an error reading from fd.
+ *      Any error returned by the deserializer.
+ *      On error, the tree is left empty.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_load(
+        RUMATI_AVL_TREE *tree,
+        int fd,
+        RUMATI_AVL_VALUE_DESERIALIZER deserializer,
+        RUMATI_AVL_NODE_DESTRUCTOR destructor);
+
+/*
+ * rumati_avl_track_changes() - starts tracking which entries change, so
+ * that rumati_avl_save_delta() can write only those. The tree as it is now
+ * is taken to be the last snapshot, so call this just after saving or
+ * loading it.
+ *
+ * Each node records the generation in which its value last changed, in
+ * padding the node already had, and a generation passes with each snapshot
+ * or delta written. Removing an entry counts it against the entry after it,
+ * which the delete finds on its way down the tree, in a table holding only
+ * the entries with removals before them.
+ *
+ * Parameters:
+ *      tree -  the tree
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EROFS    If the tree is an image, see
+ *                          rumati_avl_open_image().
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_track_changes(RUMATI_AVL_TREE *tree);
+
+/*
+ * rumati_avl_save_delta() - writes the changes made to a tree since the
+ * last snapshot written by rumati_avl_save() or rumati_avl_save_background(),
+ * or the last delta. rumati_avl_compact() applies a delta to the snapshot
+ * it follows, making a new snapshot, and deltas are compacted in the order
+ * they were written.
+ *
+ * The delta lists the tree in key order: each changed entry is written in
+ * full, and the entries of the snapshot between them as counts of entries
+ * to keep or leave out, so a delta of a few changes to a large tree is
+ * small. Only changed entries are serialized, so the serializer need not
+ * write the same bytes for a value each time. Finding the changes walks
+ * the whole tree without writing to it: each delta costs O(n) time in the
+ * size of the tree, however few entries changed.
+ *
+ * The format is the 8 byte magic "RAVLDLT2", followed by the number of
+ * entries in the tree, then records: 1 followed by a changed value, 2
+ * followed by the number of entries of the snapshot to copy, or 3 followed
+ * by the number to leave out, ending with 0. Values and numbers are written
+ * as by rumati_avl_save(). If a background save fails, save the tree in
+ * full before the next delta.
+ *
+ * Parameters:
+ *      tree -          the tree to save
+ *      fd -            the file descriptor to write to, at its current offset
+ *      serializer -    the function writing the bytes of values, which is
+ *                      passed the tree's udata
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If tree or serializer is NULL, or changes are not
+ *                          being tracked.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory, now or
+ *                          while counting removed entries since the last
+ *                          snapshot or delta, in which case save the tree
+ *                          in full.
+ *      RUMATI_AVL_EIO      If there was an error writing to fd. The changes
+ *                          are kept for the next delta.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_save_delta(
+        RUMATI_AVL_TREE *tree,
+        int fd,
+        RUMATI_AVL_VALUE_SERIALIZER serializer);
+
+/*
+ * rumati_avl_compact() - applies a delta written by rumati_avl_save_delta()
+ * to the snapshot it follows, and writes the result as a new snapshot,
+ * which rumati_avl_load() can read. Both files are streamed, and values are
+ * copied as bytes, so neither is loaded into a tree. The new snapshot is
+ * not synced, call fsync() for that.
+ *
+ * Parameters:
+ *      base_fd -   the snapshot, at its start
+ *      delta_fd -  the delta, at its start
+ *      fd -        the file descriptor to write the new snapshot to, at its
+ *                  current offset
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If base_fd is not a snapshot, delta_fd is not a
+ *                          delta, or the delta does not follow the snapshot:
+ *                          its counts do not cover the snapshot's entries.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If there was an error reading or writing.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_compact(
+        int base_fd,
+        int delta_fd,
+        int fd);
+
+/*
+ * rumati_avl_write_image() - writes a tree as an image file, which
+ * rumati_avl_open_image() maps into memory and queries in place, with no
+ * deserialization. Tombstones are left out.
+ *
+ * The image holds the tree's nodes, rebuilt perfectly balanced, with their
+ * links and value pointers stored as offsets from the start of the file,
+ * so that it can be mapped anywhere without changes. Nodes are laid out in
+ * level order, so that the top levels of the tree share the first pages of
+ * the node array, and the pages a lookup faults in are mostly ones other
+ * lookups fault in too. Values are stored as the bytes written by the
+ * serializer, aligned to 16 bytes, and are handed to the comparator as
+ * pointers to those bytes, so values should be types which can be copied
+ * byte for byte.
+ *
+ * The file holds native offsets and node layout, so an image is only
+ * readable by builds of the library for the same architecture.
+ *
+ * Parameters:
+ *      tree -          the tree to write
+ *      fd -            a regular file, which is written from its start and
+ *                      truncated to the image
+ *      serializer -    the function writing the bytes of values, which is
+ *                      passed the tree's udata
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If tree or serializer is NULL.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If there was an error writing to fd.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_write_image(
+        RUMATI_AVL_TREE *tree,
+        int fd,
+        RUMATI_AVL_VALUE_SERIALIZER serializer);
+
+/*
+ * rumati_avl_open_image() - maps an image file written by
+ * rumati_avl_write_image() as a read only tree, which is queried in place
+ * with the rumati_avl_get*() functions. Pages are faulted in as lookups
+ * reach them, and are shared with other processes mapping the same file
+ * through the page cache.
+ *
+ * The file is mapped shared and read only, wherever the system places it.
+ * Lookups add the address of the mapping to the offsets in the nodes as
+ * they descend, so nothing in the image is written, and no page is copied.
+ *
+ * rumati_avl_put() and rumati_avl_delete() return RUMATI_AVL_EROFS. A cache,
+ * index or filter may be added as for any tree. rumati_avl_clear() and
+ * rumati_avl_destroy() unmap the image without passing its values to the
+ * destructor, after which a cleared tree is an ordinary, empty tree.
+ *
+ * The image is trusted: its nodes are not checked when it is opened, which
+ * rumati_avl_check() can do. It must not be truncated or rewritten while it
+ * is open.
+ *
+ * Parameters:
+ *      tree -          populated with the tree
+ *      fd -            the image file, which may be closed afterwards
+ *      comparator -    compares values, as their bytes in the image
+ *      udata -         a user defined pointer for the tree
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If tree or comparator is NULL, or fd is not an
+ *                          image written by this build of the library.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory, or
+ *                          mapping the file.
+ *      RUMATI_AVL_EIO      If there was an error reading fd.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_open_image(
+        RUMATI_AVL_TREE **tree,
+        int fd,
+        RUMATI_AVL_COMPARATOR comparator,
+        void *udata);
+
 #endif /* RUMATI_AVL_H */
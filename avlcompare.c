@@ -0,0 +1,707 @@
+/*
+ * Rumati AVL comparative benchmark
+ *
+ * Runs the same workloads against this library (with each balancing
+ * scheme), glibc tsearch()/tfind()/tdelete(), std::map (the libstdc++
+ * red-black tree, see avlcompare_map.cc) and a simple B-tree, and prints
+ * the results side by side as a JSON object, one result per engine and
+ * size.
+ *
+ * For a tree of n entries, each result has:
+ *      bytes_per_entry     heap in use after n random puts, from
+ *                          mallinfo2(), divided by n
+ *      insert_ns           time per put, of n puts in random order
+ *      get_hit_ns          time per get of a random key in the tree
+ *      get_miss_ns         time per get of a random key not in the tree
+ *      churn_ns            time per delete of a random key, put straight
+ *                          back, so the tree keeps its size
+ *      get_p50_ns ...      latency percentiles of single gets of random
+ *                          keys in the tree, each timed on its own
+ *      churn_p99_ns ...    latency percentiles of single deletes and puts
+ *
+ * Every engine maps unsigned long keys to a pointer to the caller's key.
+ * Only this library and tsearch() compare keys through a callback. std::map
+ * and the B-tree keep keys in their nodes and compare them inline, which is
+ * the most they could gain over a generic void * tree.
+ *
+ * Usage: avlcompare [size ...]
+ */
+#define _GNU_SOURCE     /* for tdestroy() */
+
+#include "avl.h"
+
+#include <malloc.h>
+#include <search.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOOKUPS     (1UL << 20)
+
+/* minimum degree of the B-tree, so nodes hold 15 to 31 keys */
+#define BTREE_T     16
+#define BTREE_MAX   (2 * BTREE_T - 1)
+
+static const unsigned long default_sizes[] = { 1000, 100000, 1000000 };
+
+/*
+ * An engine under test. put() replaces an existing key.
+ */
+struct engine {
+    const char *name;
+    void *(*create)(void);
+    int (*put)(void *tree, unsigned long *key);
+    unsigned long *(*get)(void *tree, unsigned long *key);
+    int (*del)(void *tree, unsigned long *key);
+    void (*destroy)(void *tree);
+};
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+/*
+ * xorshift64, as in bench.c
+ */
+static unsigned long rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned long)rng_state;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char *message)
+{
+    fprintf(stderr, "avlcompare: %s\n", message);
+    exit(1);
+}
+
+static int ulong_comparator(void *udata, void *value1, void *value2)
+{
+    unsigned long l1 = *(unsigned long*)value1;
+    unsigned long l2 = *(unsigned long*)value2;
+
+    (void)udata;
+
+    if (l1 < l2){
+        return -1;
+    }else if (l1 > l2){
+        return 1;
+    }
+
+    return 0;
+}
+
+static void destructor(void *udata, void *value)
+{
+    (void)udata;
+    (void)value;
+}
+
+/*
+ * This library
+ */
+static void *rumati_create(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree;
+
+    if (rumati_avl_new_balanced(&tree, ulong_comparator, NULL, balance) !=
+            RUMATI_AVL_OK){
+        return NULL;
+    }
+    return tree;
+}
+
+static void *rumati_create_avl(void)
+{
+    return rumati_create(RUMATI_AVL_BALANCE_AVL);
+}
+
+static void *rumati_create_wavl(void)
+{
+    return rumati_create(RUMATI_AVL_BALANCE_WAVL);
+}
+
+static void *rumati_create_rb(void)
+{
+    return rumati_create(RUMATI_AVL_BALANCE_RB);
+}
+
+static int rumati_put(void *tree, unsigned long *key)
+{
+    return rumati_avl_put(tree, key, NULL) == RUMATI_AVL_OK ? 0 : -1;
+}
+
+static unsigned long *rumati_get(void *tree, unsigned long *key)
+{
+    return rumati_avl_get(tree, key);
+}
+
+static int rumati_delete(void *tree, unsigned long *key)
+{
+    return rumati_avl_delete(tree, key, NULL) == RUMATI_AVL_OK ? 0 : -1;
+}
+
+static void rumati_destroy(void *tree)
+{
+    rumati_avl_destroy(tree, destructor);
+}
+
+/*
+ * glibc tsearch(), a red-black tree. The tree is the root pointer.
+ */
+static int tsearch_comparator(const void *value1, const void *value2)
+{
+    return ulong_comparator(NULL, (void*)value1, (void*)value2);
+}
+
+static void *tsearch_create(void)
+{
+    return calloc(1, sizeof(void*));
+}
+
+static int tsearch_put(void *tree, unsigned long *key)
+{
+    unsigned long **node = tsearch(key, tree, tsearch_comparator);
+
+    if (node == NULL){
+        return -1;
+    }
+    *node = key;
+    return 0;
+}
+
+static unsigned long *tsearch_get(void *tree, unsigned long *key)
+{
+    unsigned long **node = tfind(key, tree, tsearch_comparator);
+
+    return node == NULL ? NULL : *node;
+}
+
+static int tsearch_delete(void *tree, unsigned long *key)
+{
+    return tdelete(key, tree, tsearch_comparator) == NULL ? -1 : 0;
+}
+
+static void tsearch_free(void *node)
+{
+    (void)node;
+}
+
+static void tsearch_destroy(void *tree)
+{
+    tdestroy(*(void**)tree, tsearch_free);
+    free(tree);
+}
+
+/*
+ * std::map, in avlcompare_map.cc
+ */
+void *map_new(void);
+int map_put(void *map, unsigned long *key);
+unsigned long *map_get(void *map, unsigned long *key);
+int map_delete(void *map, unsigned long *key);
+void map_destroy(void *map);
+
+/*
+ * A B-tree as in Cormen et al, "Introduction to Algorithms", with keys
+ * held in the nodes. Deletes restructure on the way down, so they never
+ * back up the tree.
+ */
+struct btree_node {
+    int n;
+    int leaf;
+    unsigned long key[BTREE_MAX];
+    unsigned long *value[BTREE_MAX];
+    struct btree_node *child[BTREE_MAX + 1];
+};
+
+struct btree {
+    struct btree_node *root;
+};
+
+static struct btree_node *btree_node_new(int leaf)
+{
+    struct btree_node *x = malloc(sizeof(*x));
+
+    if (x != NULL){
+        x->n = 0;
+        x->leaf = leaf;
+    }
+    return x;
+}
+
+/*
+ * Returns the index of the first key of x not less than key.
+ */
+static int btree_find(struct btree_node *x, unsigned long key)
+{
+    int i = 0;
+
+    while (i < x->n && x->key[i] < key){
+        i++;
+    }
+    return i;
+}
+
+static void *btree_create(void)
+{
+    struct btree *tree = malloc(sizeof(*tree));
+
+    if (tree == NULL){
+        return NULL;
+    }
+    tree->root = btree_node_new(1);
+    if (tree->root == NULL){
+        free(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+static unsigned long *btree_get(void *tree, unsigned long *key)
+{
+    struct btree_node *x = ((struct btree*)tree)->root;
+    int i;
+
+    for (;;){
+        i = btree_find(x, *key);
+        if (i < x->n && x->key[i] == *key){
+            return x->value[i];
+        }
+        if (x->leaf){
+            return NULL;
+        }
+        x = x->child[i];
+    }
+}
+
+/*
+ * Splits the full child i of x in two, moving its median key up into x.
+ */
+static int btree_split(struct btree_node *x, int i)
+{
+    struct btree_node *y = x->child[i];
+    struct btree_node *z = btree_node_new(y->leaf);
+
+    if (z == NULL){
+        return -1;
+    }
+    z->n = BTREE_T - 1;
+    memcpy(z->key, y->key + BTREE_T, (BTREE_T - 1) * sizeof(z->key[0]));
+    memcpy(z->value, y->value + BTREE_T,
+            (BTREE_T - 1) * sizeof(z->value[0]));
+    if (!y->leaf){
+        memcpy(z->child, y->child + BTREE_T, BTREE_T * sizeof(z->child[0]));
+    }
+    y->n = BTREE_T - 1;
+
+    memmove(x->child + i + 2, x->child + i + 1,
+            (x->n - i) * sizeof(x->child[0]));
+    memmove(x->key + i + 1, x->key + i, (x->n - i) * sizeof(x->key[0]));
+    memmove(x->value + i + 1, x->value + i,
+            (x->n - i) * sizeof(x->value[0]));
+    x->child[i + 1] = z;
+    x->key[i] = y->key[BTREE_T - 1];
+    x->value[i] = y->value[BTREE_T - 1];
+    x->n++;
+    return 0;
+}
+
+static int btree_put(void *tree, unsigned long *key)
+{
+    struct btree *t = tree;
+    struct btree_node *x = t->root, *s;
+    int i;
+
+    if (x->n == BTREE_MAX){
+        s = btree_node_new(0);
+        if (s == NULL){
+            return -1;
+        }
+        s->child[0] = x;
+        if (btree_split(s, 0) != 0){
+            free(s);
+            return -1;
+        }
+        t->root = x = s;
+    }
+
+    /* full nodes are split on the way down, so there is room for the key */
+    for (;;){
+        i = btree_find(x, *key);
+        if (i < x->n && x->key[i] == *key){
+            x->value[i] = key;
+            return 0;
+        }
+        if (x->leaf){
+            memmove(x->key + i + 1, x->key + i,
+                    (x->n - i) * sizeof(x->key[0]));
+            memmove(x->value + i + 1, x->value + i,
+                    (x->n - i) * sizeof(x->value[0]));
+            x->key[i] = *key;
+            x->value[i] = key;
+            x->n++;
+            return 0;
+        }
+        if (x->child[i]->n == BTREE_MAX){
+            if (btree_split(x, i) != 0){
+                return -1;
+            }
+            if (x->key[i] == *key){
+                x->value[i] = key;
+                return 0;
+            }
+            if (x->key[i] < *key){
+                i++;
+            }
+        }
+        x = x->child[i];
+    }
+}
+
+/*
+ * Merges child i + 1 of x, and key i of x, into child i.
+ */
+static void btree_merge(struct btree_node *x, int i)
+{
+    struct btree_node *y = x->child[i];
+    struct btree_node *z = x->child[i + 1];
+
+    y->key[y->n] = x->key[i];
+    y->value[y->n] = x->value[i];
+    memcpy(y->key + y->n + 1, z->key, z->n * sizeof(z->key[0]));
+    memcpy(y->value + y->n + 1, z->value, z->n * sizeof(z->value[0]));
+    if (!y->leaf){
+        memcpy(y->child + y->n + 1, z->child,
+                (z->n + 1) * sizeof(z->child[0]));
+    }
+    y->n += z->n + 1;
+    free(z);
+
+    memmove(x->key + i, x->key + i + 1, (x->n - i - 1) * sizeof(x->key[0]));
+    memmove(x->value + i, x->value + i + 1,
+            (x->n - i - 1) * sizeof(x->value[0]));
+    memmove(x->child + i + 1, x->child + i + 2,
+            (x->n - i - 1) * sizeof(x->child[0]));
+    x->n--;
+}
+
+/*
+ * Makes sure child i of x has at least BTREE_T keys, by taking a key from a
+ * sibling or merging with one. Returns the index of the child to descend.
+ */
+static int btree_fill(struct btree_node *x, int i)
+{
+    struct btree_node *c = x->child[i], *s;
+
+    if (c->n >= BTREE_T){
+        return i;
+    }
+    if (i > 0 && x->child[i - 1]->n >= BTREE_T){
+        s = x->child[i - 1];
+        memmove(c->key + 1, c->key, c->n * sizeof(c->key[0]));
+        memmove(c->value + 1, c->value, c->n * sizeof(c->value[0]));
+        if (!c->leaf){
+            memmove(c->child + 1, c->child, (c->n + 1) * sizeof(c->child[0]));
+            c->child[0] = s->child[s->n];
+        }
+        c->key[0] = x->key[i - 1];
+        c->value[0] = x->value[i - 1];
+        c->n++;
+        x->key[i - 1] = s->key[s->n - 1];
+        x->value[i - 1] = s->value[s->n - 1];
+        s->n--;
+        return i;
+    }
+    if (i < x->n && x->child[i + 1]->n >= BTREE_T){
+        s = x->child[i + 1];
+        c->key[c->n] = x->key[i];
+        c->value[c->n] = x->value[i];
+        if (!c->leaf){
+            c->child[c->n + 1] = s->child[0];
+            memmove(s->child, s->child + 1, s->n * sizeof(s->child[0]));
+        }
+        c->n++;
+        x->key[i] = s->key[0];
+        x->value[i] = s->value[0];
+        memmove(s->key, s->key + 1, (s->n - 1) * sizeof(s->key[0]));
+        memmove(s->value, s->value + 1, (s->n - 1) * sizeof(s->value[0]));
+        s->n--;
+        return i;
+    }
+    if (i == x->n){
+        i--;
+    }
+    btree_merge(x, i);
+    return i;
+}
+
+static int btree_delete(void *tree, unsigned long *key)
+{
+    struct btree *t = tree;
+    struct btree_node *x = t->root, *y;
+    unsigned long k = *key;
+    int i, found = 0;
+
+    for (;;){
+        i = btree_find(x, k);
+        if (i < x->n && x->key[i] == k){
+            if (x->leaf){
+                memmove(x->key + i, x->key + i + 1,
+                        (x->n - i - 1) * sizeof(x->key[0]));
+                memmove(x->value + i, x->value + i + 1,
+                        (x->n - i - 1) * sizeof(x->value[0]));
+                x->n--;
+                found = 1;
+                break;
+            }
+            if (x->child[i]->n >= BTREE_T){
+                /* replace with the predecessor, then delete that */
+                for (y = x->child[i]; !y->leaf; y = y->child[y->n]);
+                x->key[i] = k = y->key[y->n - 1];
+                x->value[i] = y->value[y->n - 1];
+                x = x->child[i];
+                continue;
+            }
+            if (x->child[i + 1]->n >= BTREE_T){
+                /* replace with the successor, then delete that */
+                for (y = x->child[i + 1]; !y->leaf; y = y->child[0]);
+                x->key[i] = k = y->key[0];
+                x->value[i] = y->value[0];
+                x = x->child[i + 1];
+                continue;
+            }
+            btree_merge(x, i);
+            y = x->child[i];
+        }else{
+            if (x->leaf){
+                break;
+            }
+            y = x->child[btree_fill(x, i)];
+        }
+        if (x->n == 0){
+            /* the root emptied into its only child */
+            t->root = y;
+            free(x);
+        }
+        x = y;
+    }
+    return found ? 0 : -1;
+}
+
+static void btree_destroy_node(struct btree_node *x)
+{
+    int i;
+
+    if (!x->leaf){
+        for (i = 0; i <= x->n; i++){
+            btree_destroy_node(x->child[i]);
+        }
+    }
+    free(x);
+}
+
+static void btree_destroy(void *tree)
+{
+    btree_destroy_node(((struct btree*)tree)->root);
+    free(tree);
+}
+
+static const struct engine engines[] = {
+    { "rumati_avl", rumati_create_avl, rumati_put, rumati_get,
+            rumati_delete, rumati_destroy },
+    { "rumati_wavl", rumati_create_wavl, rumati_put, rumati_get,
+            rumati_delete, rumati_destroy },
+    { "rumati_rb", rumati_create_rb, rumati_put, rumati_get,
+            rumati_delete, rumati_destroy },
+    { "tsearch", tsearch_create, tsearch_put, tsearch_get,
+            tsearch_delete, tsearch_destroy },
+    { "std_map", map_new, map_put, map_get, map_delete, map_destroy },
+    { "btree", btree_create, btree_put, btree_get, btree_delete,
+            btree_destroy }
+};
+
+#define ENGINES     ((int)(sizeof(engines) / sizeof(engines[0])))
+
+static int uint64_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Sorts latencies and returns the given percentile.
+ */
+static uint64_t percentile(uint64_t *ns, unsigned long n, double p)
+{
+    unsigned long rank = (unsigned long)(n * p / 100.0);
+
+    return ns[rank < n ? rank : n - 1];
+}
+
+static int results;
+
+/*
+ * Runs every workload against one engine, with trees of size entries.
+ * keys holds size even numbers, shuffled, followed by lookup keys.
+ */
+static void run(const struct engine *e, unsigned long size,
+        unsigned long *keys, unsigned long *misses, uint64_t *ns)
+{
+    unsigned long i, k, churn = size < LOOKUPS / 4 ? size : LOOKUPS / 4;
+    size_t heap;
+    uint64_t start, t, insert, hit, miss, churned;
+    void *tree;
+
+    heap = mallinfo2().uordblks;
+    tree = e->create();
+    if (tree == NULL){
+        die("out of memory");
+    }
+
+    start = now_ns();
+    for (i = 0; i < size; i++){
+        if (e->put(tree, &keys[i]) != 0){
+            die("out of memory");
+        }
+    }
+    insert = now_ns() - start;
+    heap = mallinfo2().uordblks - heap;
+
+    start = now_ns();
+    for (i = 0; i < LOOKUPS; i++){
+        k = rng() % size;
+        if (e->get(tree, &keys[k]) != &keys[k]){
+            die("get of a key in the tree failed");
+        }
+    }
+    hit = now_ns() - start;
+
+    start = now_ns();
+    for (i = 0; i < LOOKUPS; i++){
+        if (e->get(tree, &misses[rng() % size]) != NULL){
+            die("get of a key not in the tree succeeded");
+        }
+    }
+    miss = now_ns() - start;
+
+    start = now_ns();
+    for (i = 0; i < churn; i++){
+        k = rng() % size;
+        if (e->del(tree, &keys[k]) != 0 || e->put(tree, &keys[k]) != 0){
+            die("delete of a key in the tree failed");
+        }
+    }
+    churned = now_ns() - start;
+
+    printf("%s\n    {\"engine\": \"%s\", \"size\": %lu, "
+            "\"bytes_per_entry\": %.1f, \"insert_ns\": %.1f, "
+            "\"get_hit_ns\": %.1f, \"get_miss_ns\": %.1f, "
+            "\"churn_ns\": %.1f, ",
+            results++ ? "," : "", e->name, size, (double)heap / size,
+            (double)insert / size, (double)hit / LOOKUPS,
+            (double)miss / LOOKUPS, (double)churned / churn / 2);
+
+    for (i = 0; i < LOOKUPS; i++){
+        k = rng() % size;
+        t = now_ns();
+        e->get(tree, &keys[k]);
+        ns[i] = now_ns() - t;
+    }
+    qsort(ns, LOOKUPS, sizeof(*ns), uint64_compare);
+    printf("\"get_p50_ns\": %llu, \"get_p99_ns\": %llu, "
+            "\"get_p999_ns\": %llu, \"get_max_ns\": %llu, ",
+            (unsigned long long)percentile(ns, LOOKUPS, 50),
+            (unsigned long long)percentile(ns, LOOKUPS, 99),
+            (unsigned long long)percentile(ns, LOOKUPS, 99.9),
+            (unsigned long long)ns[LOOKUPS - 1]);
+
+    for (i = 0; i < churn; i++){
+        k = rng() % size;
+        t = now_ns();
+        e->del(tree, &keys[k]);
+        ns[2 * i] = now_ns() - t;
+        t = now_ns();
+        e->put(tree, &keys[k]);
+        ns[2 * i + 1] = now_ns() - t;
+    }
+    qsort(ns, 2 * churn, sizeof(*ns), uint64_compare);
+    printf("\"churn_p50_ns\": %llu, \"churn_p99_ns\": %llu, "
+            "\"churn_p999_ns\": %llu, \"churn_max_ns\": %llu}",
+            (unsigned long long)percentile(ns, 2 * churn, 50),
+            (unsigned long long)percentile(ns, 2 * churn, 99),
+            (unsigned long long)percentile(ns, 2 * churn, 99.9),
+            (unsigned long long)ns[2 * churn - 1]);
+    fflush(stdout);
+
+    e->destroy(tree);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long size, i, j, tmp, *keys, *misses;
+    uint64_t *ns;
+    int count, a, n;
+
+    count = argc - 1;
+    if (count == 0){
+        count = sizeof(default_sizes) / sizeof(default_sizes[0]);
+    }
+
+    ns = malloc(LOOKUPS * sizeof(*ns));
+    if (ns == NULL){
+        die("out of memory");
+    }
+
+    printf("{\"engines\": [");
+    for (n = 0; n < ENGINES; n++){
+        printf("%s\"%s\"", n ? ", " : "", engines[n].name);
+    }
+    printf("], \"results\": [");
+
+    for (a = 0; a < count; a++){
+        size = argc > 1 ? strtoul(argv[a + 1], NULL, 0) : default_sizes[a];
+        if (size == 0){
+            fprintf(stderr, "usage: %s [size ...]\n", argv[0]);
+            return 1;
+        }
+
+        keys = malloc(size * sizeof(*keys));
+        misses = malloc(size * sizeof(*misses));
+        if (keys == NULL || misses == NULL){
+            die("out of memory");
+        }
+        for (i = 0; i < size; i++){
+            keys[i] = 2 * i;
+            misses[i] = 2 * i + 1;
+        }
+        for (i = size - 1; i > 0; i--){
+            j = rng() % (i + 1);
+            tmp = keys[i];
+            keys[i] = keys[j];
+            keys[j] = tmp;
+        }
+
+        for (n = 0; n < ENGINES; n++){
+            run(&engines[n], size, keys, misses, ns);
+        }
+
+        free(misses);
+        free(keys);
+    }
+
+    printf("\n]}\n");
+    free(ns);
+    return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * Rumati AVL comparative benchmark, std::map engine
+ *
+ * std::map (a red-black tree in libstdc++) behind a C interface, for
+ * avlcompare.c. Keys are stored by value, mapping to the caller's key.
+ */
+#include <map>
+#include <new>
+
+typedef std::map<unsigned long, unsigned long*> map_type;
+
+extern "C" {
+
+void *map_new(void)
+{
+    return new (std::nothrow) map_type();
+}
+
+int map_put(void *map, unsigned long *key)
+{
+    try {
+        (*static_cast<map_type*>(map))[*key] = key;
+    } catch (std::bad_alloc &) {
+        return -1;
+    }
+    return 0;
+}
+
+unsigned long *map_get(void *map, unsigned long *key)
+{
+    map_type::iterator it = static_cast<map_type*>(map)->find(*key);
+
+    return it == static_cast<map_type*>(map)->end() ? 0 : it->second;
+}
+
+int map_delete(void *map, unsigned long *key)
+{
+    return static_cast<map_type*>(map)->erase(*key) == 1 ? 0 : -1;
+}
+
+void map_destroy(void *map)
+{
+    delete static_cast<map_type*>(map);
+}
+
+}
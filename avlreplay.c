@@ -0,0 +1,330 @@
+/*
+ * Rumati AVL trace replay
+ *
+ * Replays a workload trace, recorded with the rumati_avl_trace_*() wrappers
+ * (see avltrace.h), against a tree configured from the command line, and
+ * prints the time taken by each kind of operation as a JSON object. The same
+ * trace can be replayed against each balancing scheme, with and without the
+ * lookup cache, hash index or filter, and against builds with and without
+ * RUMATI_AVL_PREFETCH, to compare them on a real workload.
+ *
+ * Keys are replayed as their recorded bytes, compared with memcmp(), shorter
+ * keys first on a tie. The whole trace is read into memory before the replay
+ * starts, so reading it is not timed.
+ *
+ * By default, operations are replayed back to back. With -p, they are paced
+ * to the times at which they were recorded, which keeps idle gaps between
+ * bursts (and with them, the cache misses that a busy loop would hide).
+ *
+ * Usage: avlreplay [-b avl|wavl|rb] [-c] [-i] [-f] [-p] trace
+ *      -b  balancing scheme, avl by default
+ *      -c  use the lookup cache
+ *      -i  use the hash index
+ *      -f  use the negative lookup filter
+ *      -p  pace operations to their recorded times
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "avl.h"
+#include "avltrace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OPS     (RUMATI_AVL_TRACE_GET_GREATEST + 1)
+
+/*
+ * A key, as recorded
+ */
+struct key {
+    size_t length;
+    unsigned char bytes[];
+};
+
+/*
+ * A record of the trace, in memory
+ */
+struct op {
+    RUMATI_AVL_TRACE_OP op;
+    unsigned long long time_ns;
+    struct key *key;
+};
+
+static const char *op_names[OPS] = {
+    NULL,
+    "put",
+    "get",
+    "delete",
+    "get_greater_than_or_equal",
+    "get_less_than_or_equal",
+    "get_greater_than",
+    "get_less_than",
+    "get_smallest",
+    "get_greatest"
+};
+
+static int key_comparator(void *udata, void *a, void *b)
+{
+    struct key *ka = a, *kb = b;
+    size_t length = ka->length < kb->length ? ka->length : kb->length;
+    int c;
+
+    (void)udata;
+    c = memcmp(ka->bytes, kb->bytes, length);
+    if (c != 0){
+        return c;
+    }
+    return ka->length < kb->length ? -1 : ka->length > kb->length;
+}
+
+/*
+ * FNV-1a, good enough to spread key bytes over the cache, index and filter
+ */
+static size_t key_hash(void *udata, void *value)
+{
+    struct key *key = value;
+    unsigned long long h = 14695981039346656037ULL;
+    size_t i;
+
+    (void)udata;
+    for (i = 0; i < key->length; i++){
+        h = (h ^ key->bytes[i]) * 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+static void key_destructor(void *udata, void *value)
+{
+    (void)udata;
+    (void)value;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char *message)
+{
+    fprintf(stderr, "avlreplay: %s\n", message);
+    exit(1);
+}
+
+/*
+ * load() - reads a whole trace into memory.
+ *
+ * Returns the records, and sets count to their number and puts to the
+ * number of puts.
+ */
+static struct op *load(FILE *in, size_t *count, size_t *puts)
+{
+    RUMATI_AVL_TRACE *trace;
+    RUMATI_AVL_TRACE_RECORD record;
+    RUMATI_AVL_ERROR err;
+    struct op *ops = NULL, *grown;
+    size_t size = 0;
+
+    if (rumati_avl_trace_open(&trace, in) != RUMATI_AVL_OK){
+        die("not a trace");
+    }
+
+    *count = 0;
+    *puts = 0;
+    while ((err = rumati_avl_trace_read(trace, &record)) == RUMATI_AVL_OK){
+        if (*count == size){
+            size = size ? size * 2 : 1024;
+            grown = realloc(ops, size * sizeof(*ops));
+            if (grown == NULL){
+                die("out of memory");
+            }
+            ops = grown;
+        }
+        ops[*count].op = record.op;
+        ops[*count].time_ns = record.time_ns;
+        ops[*count].key = malloc(sizeof(struct key) + record.key_length);
+        if (ops[*count].key == NULL){
+            die("out of memory");
+        }
+        ops[*count].key->length = record.key_length;
+        memcpy(ops[*count].key->bytes, record.key, record.key_length);
+        if (record.op == RUMATI_AVL_TRACE_PUT){
+            (*puts)++;
+        }
+        (*count)++;
+    }
+    if (err != RUMATI_AVL_ENOENT){
+        die("trace is corrupt");
+    }
+    rumati_avl_trace_close(trace);
+    return ops;
+}
+
+/*
+ * pace() - waits until time_ns after start.
+ */
+static void pace(unsigned long long start, unsigned long long time_ns)
+{
+    unsigned long long t = now_ns() - start;
+    struct timespec ts;
+
+    if (t < time_ns){
+        ts.tv_sec = (time_t)((time_ns - t) / 1000000000);
+        ts.tv_nsec = (long)((time_ns - t) % 1000000000);
+        nanosleep(&ts, NULL);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    RUMATI_AVL_BALANCE balance = RUMATI_AVL_BALANCE_AVL;
+    const char *balance_name = "avl";
+    const char *path = NULL;
+    int use_cache = 0, use_index = 0, use_filter = 0, paced = 0;
+    unsigned long long counts[OPS] = {0}, times[OPS] = {0};
+    unsigned long long start, t, first;
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_ERROR err;
+    struct op *ops;
+    size_t count, puts, i;
+    FILE *in;
+    int j, last;
+
+    for (j = 1; j < argc; j++){
+        if (strcmp(argv[j], "-b") == 0 && j + 1 < argc){
+            balance_name = argv[++j];
+            if (strcmp(balance_name, "avl") == 0){
+                balance = RUMATI_AVL_BALANCE_AVL;
+            }else if (strcmp(balance_name, "wavl") == 0){
+                balance = RUMATI_AVL_BALANCE_WAVL;
+            }else if (strcmp(balance_name, "rb") == 0){
+                balance = RUMATI_AVL_BALANCE_RB;
+            }else{
+                die("unknown balancing scheme");
+            }
+        }else if (strcmp(argv[j], "-c") == 0){
+            use_cache = 1;
+        }else if (strcmp(argv[j], "-i") == 0){
+            use_index = 1;
+        }else if (strcmp(argv[j], "-f") == 0){
+            use_filter = 1;
+        }else if (strcmp(argv[j], "-p") == 0){
+            paced = 1;
+        }else if (argv[j][0] == '-' || path != NULL){
+            path = NULL;
+            break;
+        }else{
+            path = argv[j];
+        }
+    }
+    if (path == NULL){
+        fprintf(stderr, "usage: %s [-b avl|wavl|rb] [-c] [-i] [-f] [-p] "
+                "trace\n", argv[0]);
+        return 1;
+    }
+
+    in = fopen(path, "rb");
+    if (in == NULL){
+        die("cannot open trace");
+    }
+    ops = load(in, &count, &puts);
+    fclose(in);
+
+    err = rumati_avl_new_balanced(&tree, key_comparator, NULL, balance);
+    if (err == RUMATI_AVL_OK && use_cache){
+        err = rumati_avl_set_cache(tree, key_hash, 4096);
+    }
+    if (err == RUMATI_AVL_OK && use_index){
+        err = rumati_avl_set_index(tree, key_hash);
+    }
+    if (err == RUMATI_AVL_OK && use_filter){
+        /* about 1% false positives, if every put is a new key */
+        err = rumati_avl_set_filter(tree, key_hash,
+                puts > 0 ? puts * 10 : 1, 7);
+    }
+    if (err != RUMATI_AVL_OK){
+        die("out of memory");
+    }
+
+    /*
+     * The keys are owned by ops, not the tree, so replaced and deleted
+     * values need no freeing.
+     */
+    first = count > 0 ? ops[0].time_ns : 0;
+    start = now_ns();
+    for (i = 0; i < count; i++){
+        if (paced){
+            pace(start, ops[i].time_ns - first);
+        }
+        t = now_ns();
+        switch (ops[i].op){
+        case RUMATI_AVL_TRACE_PUT:
+            if (rumati_avl_put(tree, ops[i].key, NULL) != RUMATI_AVL_OK){
+                die("out of memory");
+            }
+            break;
+        case RUMATI_AVL_TRACE_GET:
+            rumati_avl_get(tree, ops[i].key);
+            break;
+        case RUMATI_AVL_TRACE_DELETE:
+            rumati_avl_delete(tree, ops[i].key, NULL);
+            break;
+        case RUMATI_AVL_TRACE_GET_GREATER_THAN_OR_EQUAL:
+            rumati_avl_get_greater_than_or_equal(tree, ops[i].key);
+            break;
+        case RUMATI_AVL_TRACE_GET_LESS_THAN_OR_EQUAL:
+            rumati_avl_get_less_than_or_equal(tree, ops[i].key);
+            break;
+        case RUMATI_AVL_TRACE_GET_GREATER_THAN:
+            rumati_avl_get_greater_than(tree, ops[i].key);
+            break;
+        case RUMATI_AVL_TRACE_GET_LESS_THAN:
+            rumati_avl_get_less_than(tree, ops[i].key);
+            break;
+        case RUMATI_AVL_TRACE_GET_SMALLEST:
+            rumati_avl_get_smallest(tree);
+            break;
+        case RUMATI_AVL_TRACE_GET_GREATEST:
+            rumati_avl_get_greatest(tree);
+            break;
+        }
+        times[ops[i].op] += now_ns() - t;
+        counts[ops[i].op]++;
+    }
+    t = now_ns() - start;
+
+    printf("{\"trace\": \"%s\", \"balance\": \"%s\", \"prefetch\": %s, "
+            "\"cache\": %s, \"index\": %s, \"filter\": %s, \"paced\": %s, "
+            "\"ops\": %lu, \"seconds\": %.6f, \"operations\": {",
+            path, balance_name,
+#ifdef RUMATI_AVL_PREFETCH
+            "true",
+#else
+            "false",
+#endif
+            use_cache ? "true" : "false",
+            use_index ? "true" : "false",
+            use_filter ? "true" : "false",
+            paced ? "true" : "false",
+            (unsigned long)count, t / 1e9);
+    for (j = 1, last = 0; j < OPS; j++){
+        if (counts[j] == 0){
+            continue;
+        }
+        printf("%s\n    \"%s\": {\"count\": %llu, \"ns_per_op\": %.1f}",
+                last++ ? "," : "", op_names[j], counts[j],
+                (double)times[j] / counts[j]);
+    }
+    printf("\n}}\n");
+
+    rumati_avl_destroy(tree, key_destructor);
+    for (i = 0; i < count; i++){
+        free(ops[i].key);
+    }
+    free(ops);
+    return 0;
+}
@@ -0,0 +1,412 @@
+/*
+ * Rumati AVL stress test and differential fuzzer
+ *
+ * Runs sequences of operations against trees in every configuration of the
+ * library, each balancing scheme with every combination of the lookup
+ * cache, hash index, negative lookup filter and lazy delete, and compares
+ * every result with a reference model: an array holding the current value
+ * of each key. Relaxed mode, rebalancing and purges are switched on and off
+ * by the operations themselves. Every few hundred operations, and at the
+ * end, rumati_avl_check() checks the tree and every key is looked up.
+ *
+ * An operation sequence is a string of bytes, 3 per operation: the
+ * operation, then the key, little endian, modulo the number of keys. The
+ * same bytes drive both uses:
+ *
+ *      avlstress [-s seed] [-n ops] [-k keys]
+ *          runs ops random operations (1000000 by default) over keys keys
+ *          (10000 by default) against each configuration, from a seeded
+ *          generator, so failures can be repeated. It prints nothing but a
+ *          summary unless a check fails. With a few hundred keys, lazy
+ *          deletes reach the automatic purge threshold between the purge
+ *          operations, so make stress also runs with -k 256.
+ *
+ *      Built with RUMATI_AVL_LIBFUZZER, LLVMFuzzerTestOneInput() runs each
+ *      input as an operation sequence over 256 keys against each
+ *      configuration, for libFuzzer:
+ *
+ *          clang -g -O1 -fsanitize=fuzzer,address,undefined \
+ *                  -DRUMATI_AVL_LIBFUZZER -o avlfuzz avlstress.c -pthread
+ *
+ * On a mismatch the configuration, operation and key are printed, and the
+ * process aborts, so that both the stress test and the fuzzer stop there.
+ */
+#define RUMATI_AVL_THREADS
+#include "avl.c"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Minimum number of operations between checks. Checks are made every keys
+ * operations if that is more, so that they take a constant share of the time.
+ */
+#define CHECK_INTERVAL  512
+
+/*
+ * Configuration features, combined with each balancing scheme
+ */
+#define USE_CACHE       0x01
+#define USE_INDEX       0x02
+#define USE_FILTER      0x04
+#define USE_LAZY        0x08
+#define CONFIGS         (3 * 16)
+
+/*
+ * Operations. The first byte of each triple is one of the operations that
+ * rebuild the tree, which take linear time, if it is RARE_OPS or more, and
+ * the first byte modulo OPS otherwise.
+ */
+enum {
+    OP_PUT,
+    OP_PUT2,            /* puts are made twice as often as other ops */
+    OP_DELETE,
+    OP_GET,
+    OP_GET_GE,
+    OP_GET_LE,
+    OP_GET_GT,
+    OP_GET_LT,
+    OP_SMALLEST,
+    OP_GREATEST,
+    OPS,
+    OP_RELAX = OPS,     /* switch relaxed mode on or off */
+    OP_REBALANCE,
+    OP_PURGE
+};
+
+#define RARE_OPS        (256 - (OP_PURGE + 1 - OPS))
+
+static const char *balance_names[] = { "avl", "wavl", "rb" };
+
+/*
+ * A value. Each key has two, so that replacements can be told apart.
+ */
+struct item {
+    unsigned int key;
+    unsigned int version;
+};
+
+/*
+ * State of a run: the tree, the model and the values
+ */
+struct run {
+    RUMATI_AVL_TREE *tree;
+    int config;
+    unsigned int keys;
+    struct item *items;         /* 2 per key */
+    struct item **model;        /* current value of each key, or NULL */
+    struct item probe;          /* search key */
+    unsigned long op;
+};
+
+static int item_comparator(void *udata, void *a, void *b)
+{
+    unsigned int k1 = ((struct item*)a)->key;
+    unsigned int k2 = ((struct item*)b)->key;
+
+    (void)udata;
+    return k1 < k2 ? -1 : k1 > k2;
+}
+
+/* a poor hash, so that the cache, index and filter see collisions */
+static size_t item_hash(void *udata, void *value)
+{
+    (void)udata;
+    return ((struct item*)value)->key * 7;
+}
+
+/*
+ * Poisons the key of a value the tree has given up, so that a value still
+ * linked into the tree or handed back after it was destroyed is noticed.
+ * Puts restore the key.
+ */
+#define DESTROYED_KEY   0xffffffffu
+
+static void item_destructor(void *udata, void *value)
+{
+    (void)udata;
+    ((struct item*)value)->key = DESTROYED_KEY;
+}
+
+static void fail(struct run *r, const char *what, unsigned int key)
+{
+    fprintf(stderr, "avlstress: %s, balance %s%s%s%s%s, operation %lu, "
+            "key %u\n", what, balance_names[r->config / 16],
+            r->config & USE_CACHE ? ", cache" : "",
+            r->config & USE_INDEX ? ", index" : "",
+            r->config & USE_FILTER ? ", filter" : "",
+            r->config & USE_LAZY ? ", lazy delete" : "",
+            r->op, key);
+    abort();
+}
+
+/*
+ * model_find() - returns the value in the model nearest to key, in the
+ * given direction, including key itself if inclusive.
+ */
+static struct item *model_find(
+        struct run *r,
+        unsigned int key,
+        int direction,
+        int inclusive)
+{
+    long k = key;
+
+    if (!inclusive){
+        k += direction;
+    }
+    for (; k >= 0 && k < (long)r->keys; k += direction){
+        if (r->model[k] != NULL){
+            return r->model[k];
+        }
+    }
+    return NULL;
+}
+
+static void check_tree(struct run *r)
+{
+    RUMATI_AVL_ERROR err;
+    unsigned int k;
+
+    err = rumati_avl_check(r->tree, RUMATI_AVL_CHECK_ALL);
+    if (err != RUMATI_AVL_OK){
+        fail(r, "rumati_avl_check() failed", err);
+    }
+    for (k = 0; k < r->keys; k++){
+        r->probe.key = k;
+        if (rumati_avl_get(r->tree, &r->probe) != r->model[k]){
+            fail(r, "tree and model differ", k);
+        }
+        if (r->model[k] != NULL && r->model[k]->key != k){
+            fail(r, "value in the tree was destroyed", k);
+        }
+    }
+}
+
+static void new_tree(struct run *r)
+{
+    RUMATI_AVL_ERROR err;
+    int features = r->config % 16;
+
+    err = rumati_avl_new_balanced(&r->tree, item_comparator, NULL,
+            (RUMATI_AVL_BALANCE)(r->config / 16));
+    if (err == RUMATI_AVL_OK && (features & USE_CACHE)){
+        err = rumati_avl_set_cache(r->tree, item_hash, 64);
+    }
+    if (err == RUMATI_AVL_OK && (features & USE_INDEX)){
+        err = rumati_avl_set_index(r->tree, item_hash);
+    }
+    if (err == RUMATI_AVL_OK && (features & USE_FILTER)){
+        err = rumati_avl_set_filter(r->tree, item_hash, 4 * r->keys, 3);
+    }
+    if (err == RUMATI_AVL_OK && (features & USE_LAZY)){
+        err = rumati_avl_set_lazy_delete(r->tree, item_destructor, 25);
+    }
+    if (err != RUMATI_AVL_OK){
+        fail(r, "cannot create tree", err);
+    }
+}
+
+/*
+ * run_ops() - runs an operation sequence against one configuration.
+ */
+static void run_ops(
+        struct run *r,
+        const uint8_t *data,
+        size_t size)
+{
+    struct item *expected, *item;
+    void *old;
+    RUMATI_AVL_ERROR err;
+    unsigned int key;
+    unsigned long interval;
+    size_t i;
+    int op;
+
+    interval = r->keys > CHECK_INTERVAL ? r->keys : CHECK_INTERVAL;
+    memset(r->model, 0, r->keys * sizeof(*r->model));
+    new_tree(r);
+
+    for (i = 0, r->op = 0; i + 3 <= size; i += 3, r->op++){
+        key = (data[i + 1] | (unsigned int)data[i + 2] << 8) % r->keys;
+        r->probe.key = key;
+
+        op = data[i] >= RARE_OPS ? OPS + data[i] - RARE_OPS : data[i] % OPS;
+        switch (op){
+        case OP_PUT:
+        case OP_PUT2:
+            item = &r->items[2 * key + (r->model[key] == &r->items[2 * key])];
+            item->key = key;
+            old = NULL;
+            err = rumati_avl_put(r->tree, item, &old);
+            /* a revived tombstone's old value went to the destructor */
+            if (err != RUMATI_AVL_OK || old != r->model[key]){
+                fail(r, "put", key);
+            }
+            r->model[key] = item;
+            break;
+        case OP_DELETE:
+            old = NULL;
+            err = rumati_avl_delete(r->tree, &r->probe, &old);
+            if (err != (r->model[key] ? RUMATI_AVL_OK : RUMATI_AVL_ENOENT) ||
+                    old != r->model[key]){
+                fail(r, "delete", key);
+            }
+            if (old != NULL && ((struct item*)old)->key != key){
+                fail(r, "delete handed back a destroyed value", key);
+            }
+            r->model[key] = NULL;
+            break;
+        case OP_GET:
+            if (rumati_avl_get(r->tree, &r->probe) != r->model[key]){
+                fail(r, "get", key);
+            }
+            break;
+        case OP_GET_GE:
+            expected = model_find(r, key, 1, 1);
+            if (rumati_avl_get_greater_than_or_equal(r->tree, &r->probe) !=
+                    expected){
+                fail(r, "get_greater_than_or_equal", key);
+            }
+            break;
+        case OP_GET_LE:
+            expected = model_find(r, key, -1, 1);
+            if (rumati_avl_get_less_than_or_equal(r->tree, &r->probe) !=
+                    expected){
+                fail(r, "get_less_than_or_equal", key);
+            }
+            break;
+        case OP_GET_GT:
+            expected = model_find(r, key, 1, 0);
+            if (rumati_avl_get_greater_than(r->tree, &r->probe) != expected){
+                fail(r, "get_greater_than", key);
+            }
+            break;
+        case OP_GET_LT:
+            expected = model_find(r, key, -1, 0);
+            if (rumati_avl_get_less_than(r->tree, &r->probe) != expected){
+                fail(r, "get_less_than", key);
+            }
+            break;
+        case OP_SMALLEST:
+            if (rumati_avl_get_smallest(r->tree) != model_find(r, 0, 1, 1)){
+                fail(r, "get_smallest", key);
+            }
+            break;
+        case OP_GREATEST:
+            if (rumati_avl_get_greatest(r->tree) !=
+                    model_find(r, r->keys - 1, -1, 1)){
+                fail(r, "get_greatest", key);
+            }
+            break;
+        case OP_RELAX:
+            if (rumati_avl_set_relaxed(r->tree, !r->tree->relaxed) !=
+                    RUMATI_AVL_OK){
+                fail(r, "set_relaxed", key);
+            }
+            break;
+        case OP_REBALANCE:
+            if (rumati_avl_rebalance(r->tree) != RUMATI_AVL_OK){
+                fail(r, "rebalance", key);
+            }
+            break;
+        case OP_PURGE:
+            rumati_avl_purge(r->tree);
+            break;
+        }
+
+        if (r->op % interval == interval - 1){
+            check_tree(r);
+        }
+    }
+
+    check_tree(r);
+    rumati_avl_destroy(r->tree, item_destructor);
+}
+
+/*
+ * run_all() - runs an operation sequence against every configuration.
+ */
+static void run_all(const uint8_t *data, size_t size, unsigned int keys)
+{
+    struct run r;
+    unsigned int k;
+
+    r.keys = keys;
+    r.items = malloc(2 * keys * sizeof(*r.items));
+    r.model = malloc(keys * sizeof(*r.model));
+    if (r.items == NULL || r.model == NULL){
+        fprintf(stderr, "avlstress: out of memory\n");
+        abort();
+    }
+    for (r.config = 0; r.config < CONFIGS; r.config++){
+        /* the previous run's destroy poisoned the keys */
+        for (k = 0; k < keys; k++){
+            r.items[2 * k].key = r.items[2 * k + 1].key = k;
+            r.items[2 * k].version = 0;
+            r.items[2 * k + 1].version = 1;
+        }
+        run_ops(&r, data, size);
+    }
+
+    free(r.model);
+    free(r.items);
+}
+
+#ifdef RUMATI_AVL_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    run_all(data, size, 256);
+    return 0;
+}
+#else
+int main(int argc, char *argv[])
+{
+    unsigned long long seed = 1;
+    unsigned long ops = 1000000;
+    unsigned long keys = 10000;
+    uint8_t *data;
+    size_t i;
+    int j;
+
+    for (j = 1; j < argc; j++){
+        if (strcmp(argv[j], "-s") == 0 && j + 1 < argc){
+            seed = strtoull(argv[++j], NULL, 0);
+        }else if (strcmp(argv[j], "-n") == 0 && j + 1 < argc){
+            ops = strtoul(argv[++j], NULL, 0);
+        }else if (strcmp(argv[j], "-k") == 0 && j + 1 < argc &&
+                (keys = strtoul(argv[j + 1], NULL, 0)) > 0 &&
+                keys <= 65536){
+            j++;
+        }else{
+            fprintf(stderr, "usage: %s [-s seed] [-n ops] [-k keys]\n"
+                    "    keys is at most 65536\n", argv[0]);
+            return 1;
+        }
+    }
+
+    data = malloc(3 * ops);
+    if (data == NULL && ops > 0){
+        fprintf(stderr, "avlstress: out of memory\n");
+        return 1;
+    }
+
+    /* xorshift64, as in bench.c, which must not start at 0 */
+    seed = seed * 0x9e3779b97f4a7c15ULL | 1;
+    for (i = 0; i < 3 * ops; i++){
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        data[i] = (uint8_t)(seed >> 32);
+    }
+
+    run_all(data, 3 * ops, (unsigned int)keys);
+    printf("avlstress: %lu operations over %lu keys in %d configurations "
+            "passed\n", ops, keys, CONFIGS);
+
+    free(data);
+    return 0;
+}
+#endif
@@ -1,4 +1,8 @@
+#define RUMATI_AVL_COUNTERS
+#define RUMATI_AVL_THREADS
 #include "avl.c"
+#include "avltrace.c"
+#include "avlwal.c"
 
 static int int_comparator(void *udata, void *ip1, void *ip2)
 {
@@ -16,12 +20,41 @@ static int int_comparator(void *udata, void *ip1, void *ip2)
     return 0;
 }
 
+/*
+ * A comparator counting its calls in the int udata points to.
+ */
+static int counting_comparator(void *udata, void *ip1, void *ip2)
+{
+    (*(int*)udata)++;
+    return int_comparator(NULL, ip1, ip2);
+}
+
 static void destructor(void *udata, void *node)
 {
     (void)udata;
     (void)node;
 }
 
+/*
+ * A destructor overwriting the int it is given with -1, so that a value
+ * still used after it was destroyed is noticed.
+ */
+static void poison_destructor(void *udata, void *node)
+{
+    (void)udata;
+    *(int*)node = -1;
+}
+
+/*
+ * A destructor for values allocated with malloc(), counting the values it
+ * frees in the int udata points to.
+ */
+static void free_destructor(void *udata, void *node)
+{
+    (*(int*)udata)++;
+    free(node);
+}
+
 #include <stdio.h>
 
 #define MAX_TEST_NUMBER 10000
@@ -56,6 +89,70 @@ static int verify_node_height(struct rumati_avl_node *n)
     }
 }
 
+static int verify_node_rank(struct rumati_avl_node *n)
+{
+    int left_diff = n->balance - rumati_avl_rank(n->left);
+    int right_diff = n->balance - rumati_avl_rank(n->right);
+
+    if (n->left != NULL && verify_node_rank(n->left) < 0){
+        return -1;
+    }
+
+    if (n->right != NULL && verify_node_rank(n->right) < 0){
+        return -1;
+    }
+
+    if (left_diff < 1 || left_diff > 2 || right_diff < 1 || right_diff > 2){
+        printf("Error, node %d has rank %d, but its children have ranks %d and %d\n",
+                *(int*)n->data, n->balance, rumati_avl_rank(n->left),
+                rumati_avl_rank(n->right));
+        return -1;
+    }
+
+    if (n->left == NULL && n->right == NULL && n->balance != 0){
+        printf("Error, leaf node %d has rank %d\n", *(int*)n->data, n->balance);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int verify_node_black_height(struct rumati_avl_node *n)
+{
+    int left_height = 0;
+    int right_height = 0;
+
+    if (n->left != NULL){
+        left_height = verify_node_black_height(n->left);
+    }
+
+    if (n->right != NULL){
+        right_height = verify_node_black_height(n->right);
+    }
+
+    if (left_height < 0 || right_height < 0){
+        return -1;
+    }
+
+    if (left_height != right_height){
+        printf("Error, node %d has black height %d on the left and %d on the right\n",
+                *(int*)n->data, left_height, right_height);
+        return -1;
+    }
+
+    if (rumati_avl_is_red(n) &&
+            (rumati_avl_is_red(n->left) || rumati_avl_is_red(n->right))){
+        printf("Error, red node %d has a red child\n", *(int*)n->data);
+        return -1;
+    }
+
+    if (rumati_avl_is_red(n)){
+        return left_height;
+    }else{
+        return left_height + 1;
+    }
+}
+
 static bool verify_tree(RUMATI_AVL_TREE *tree, bool in_tree[])
 {
     int i;
@@ -80,35 +177,76 @@ static bool verify_tree(RUMATI_AVL_TREE *tree, bool in_tree[])
         }
     }
 
-    if (tree->root != NULL && verify_node_height(tree->root) < 0){
-        return false;
+    /* the links of images are offsets, which rumati_avl_check() follows */
+    if (tree->root == NULL || tree->image != NULL){
+        return true;
+    }
+
+    switch (tree->balance){
+    case RUMATI_AVL_BALANCE_WAVL:
+        if (verify_node_rank(tree->root) < 0){
+            return false;
+        }
+        break;
+    case RUMATI_AVL_BALANCE_RB:
+        if (rumati_avl_is_red(tree->root)){
+            printf("Error, root node is red\n");
+            return false;
+        }
+        if (verify_node_black_height(tree->root) < 0){
+            return false;
+        }
+        break;
+    default:
+        if (verify_node_height(tree->root) < 0){
+            return false;
+        }
+        break;
     }
 
     return true;
 }
 
-int main (int argc, char *argv[])
+/*
+ * Creates an empty tree using the given balancing scheme for a test, fills
+ * num with the keys 0 to MAX_TEST_NUMBER - 1 and marks none of them as in
+ * the tree.
+ *
+ * Returns: 0 on success, or 1 after printing an error
+ */
+static int new_test_tree(RUMATI_AVL_TREE **tree, RUMATI_AVL_BALANCE balance,
+        int num[], bool in_tree[])
 {
-    RUMATI_AVL_TREE *tree;
     RUMATI_AVL_ERROR err;
-    bool in_tree[MAX_TEST_NUMBER];
-    int num[MAX_TEST_NUMBER];
-    int i, n, retv;
-
-    (void)argc; (void)argv;
+    int i;
 
-    if ((err = rumati_avl_new(&tree, int_comparator, NULL)) != RUMATI_AVL_OK){
+    if ((err = rumati_avl_new_balanced(tree, int_comparator, NULL, balance)) != RUMATI_AVL_OK){
         printf("Error creating avl tree: %d\n", err);
         return 1;
     }
 
-    retv = 0;
-
     for (i = 0; i < MAX_TEST_NUMBER; i++){
         in_tree[i] = false;
         num[i] = i;
     }
 
+    return 0;
+}
+
+static int test_tree(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_ERROR err;
+    bool in_tree[MAX_TEST_NUMBER];
+    int num[MAX_TEST_NUMBER];
+    int i, n, retv;
+
+    if (new_test_tree(&tree, balance, num, in_tree) != 0){
+        return 1;
+    }
+
+    retv = 0;
+
     if (verify_tree(tree, in_tree) == false){
         retv = 1;
         goto out1;
@@ -157,9 +295,1679 @@ int main (int argc, char *argv[])
         }
     }
     
-    printf("OK! Tests passed successfully!\n");
+out1:
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+/*
+ * Counts the nodes marked by relaxed mode updates in a subtree.
+ */
+static int count_dirty(struct rumati_avl_node *n)
+{
+    if (n == NULL){
+        return 0;
+    }
+    return ((n->flags & RUMATI_AVL_NODE_DIRTY) != 0) +
+            count_dirty(n->left) + count_dirty(n->right);
+}
+
+static int test_relaxed(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_ERROR err;
+    bool in_tree[MAX_TEST_NUMBER];
+    int num[MAX_TEST_NUMBER];
+    int i, n, retv;
+
+    if (new_test_tree(&tree, balance, num, in_tree) != 0){
+        return 1;
+    }
+
+    retv = 1;
+
+    rumati_avl_set_relaxed(tree, 1);
+
+    /* sorted inserts, which build a list in relaxed mode */
+    for (i = 0; i < MAX_TEST_NUMBER; i += 2){
+        in_tree[i] = true;
+        if ((err = rumati_avl_put(tree, &num[i], NULL)) != RUMATI_AVL_OK){
+            printf("Error adding %d to relaxed tree: %d\n", i, err);
+            goto out1;
+        }
+    }
+
+    for (i = 0; i < 2000; i++){
+        n = random() % MAX_TEST_NUMBER;
+        printf("RELAXED DELETE: %d\n", n);
+        rumati_avl_delete(tree, &num[n], NULL);
+        in_tree[n] = false;
+    }
+
+    if ((err = rumati_avl_set_relaxed(tree, 0)) != RUMATI_AVL_OK){
+        printf("Error rebalancing tree: %d\n", err);
+        goto out1;
+    }
+
+    if (verify_tree(tree, in_tree) == false){
+        goto out1;
+    }
+
+    /*
+     * A few relaxed inserts only mark the nodes on their paths, and
+     * rebalancing clears the marks.
+     */
+    rumati_avl_set_relaxed(tree, 1);
+    for (i = 1; i < 40; i += 2){
+        in_tree[i] = true;
+        rumati_avl_put(tree, &num[i], NULL);
+    }
+    n = count_dirty(tree->root);
+    if (n == 0 || n > 20 * 32){
+        printf("Error, %d nodes were marked by 20 relaxed inserts\n", n);
+        goto out1;
+    }
+    if ((err = rumati_avl_set_relaxed(tree, 0)) != RUMATI_AVL_OK){
+        printf("Error rebalancing tree: %d\n", err);
+        goto out1;
+    }
+    if ((n = count_dirty(tree->root)) != 0){
+        printf("Error, %d nodes are still marked after rebalancing\n", n);
+        goto out1;
+    }
+
+    if (verify_tree(tree, in_tree) == false){
+        goto out1;
+    }
+
+    for (i = 0; i < 1000; i++){
+        n = random() % MAX_TEST_NUMBER;
+        printf("INSERT: %d\n", n);
+        in_tree[n] = true;
+        if ((err = rumati_avl_put(tree, &num[n], NULL)) != RUMATI_AVL_OK){
+            printf("Error adding %d to tree: %d\n", n, err);
+            goto out1;
+        }
+    }
+
+    if (verify_tree(tree, in_tree) == false){
+        goto out1;
+    }
+
+    retv = 0;
+
+out1:
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+static int test_lazy_delete(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree, *owned;
+    RUMATI_AVL_ERROR err;
+    bool in_tree[MAX_TEST_NUMBER];
+    int num[MAX_TEST_NUMBER];
+    int i, n, retv, frees;
+    int *ip, *values[2];
+
+    if (new_test_tree(&tree, balance, num, in_tree) != 0){
+        return 1;
+    }
+
+    retv = 1;
+
+    if (rumati_avl_set_lazy_delete(tree, destructor, 101) != RUMATI_AVL_EINVAL){
+        printf("Error, purge percentage over 100 was accepted\n");
+        goto out1;
+    }
+    rumati_avl_set_lazy_delete(tree, destructor, 0);
+
+    for (i = 0; i < MAX_TEST_NUMBER; i++){
+        in_tree[i] = true;
+        rumati_avl_put(tree, &num[i], NULL);
+    }
+
+    /* every other number from 100 up to 200 becomes a tombstone */
+    for (i = 100; i < 200; i += 2){
+        in_tree[i] = false;
+        if ((err = rumati_avl_delete(tree, &num[i], NULL)) != RUMATI_AVL_OK){
+            printf("Error lazily deleting %d: %d\n", i, err);
+            goto out1;
+        }
+        if (rumati_avl_delete(tree, &num[i], NULL) != RUMATI_AVL_ENOENT){
+            printf("Error, tombstone %d was deleted twice\n", i);
+            goto out1;
+        }
+    }
+    for (i = 0; i < 100; i++){
+        in_tree[i] = false;
+        rumati_avl_delete(tree, &num[i], NULL);
+    }
+
+    if (verify_tree(tree, in_tree) == false){
+        goto out1;
+    }
+
+    n = 150;
+    ip = rumati_avl_get_greater_than_or_equal(tree, &n);
+    if (ip == NULL || *ip != 151){
+        printf("Error, range query did not skip tombstone %d\n", n);
+        goto out1;
+    }
+    ip = rumati_avl_get_less_than(tree, &n);
+    if (ip == NULL || *ip != 149){
+        printf("Error, range query did not skip tombstone %d\n", n - 2);
+        goto out1;
+    }
+    ip = rumati_avl_get_smallest(tree);
+    if (ip == NULL || *ip != 101){
+        printf("Error, smallest entry is not 101\n");
+        goto out1;
+    }
+
+    /* skipping the run of 100 tombstones below 100 walks it in order */
+    tree->comparator = counting_comparator;
+    tree->udata = &frees;
+    frees = 0;
+    n = 100;
+    ip = rumati_avl_get_less_than(tree, &n);
+    tree->comparator = int_comparator;
+    tree->udata = NULL;
+    if (ip != NULL || frees > 64){
+        printf("Error, skipping 100 tombstones took %d comparisons\n", frees);
+        goto out1;
+    }
+
+    /* revive a tombstone */
+    in_tree[n] = true;
+    rumati_avl_put(tree, &num[n], (void**)&ip);
+    if (ip != NULL){
+        printf("Error, reviving tombstone %d returned an old value\n", n);
+        goto out1;
+    }
+
+    rumati_avl_purge(tree);
+    if (tree->tombstones != 0 || tree->size != MAX_TEST_NUMBER - 149){
+        printf("Error, purge left %lu nodes and %lu tombstones\n",
+                (unsigned long)tree->size, (unsigned long)tree->tombstones);
+        goto out1;
+    }
+
+    if (verify_tree(tree, in_tree) == false){
+        goto out1;
+    }
+
+    /*
+     * Putting back the value a tombstone still holds revives it without
+     * destroying it, and putting another destroys the one it held.
+     */
+    if ((err = rumati_avl_new_balanced(&owned, int_comparator, &frees, balance)) != RUMATI_AVL_OK){
+        printf("Error creating avl tree: %d\n", err);
+        goto out1;
+    }
+    rumati_avl_set_lazy_delete(owned, free_destructor, 0);
+    frees = 0;
+    for (i = 0; i < 2; i++){
+        values[i] = malloc(sizeof(int));
+        *values[i] = 7;
+    }
+    rumati_avl_put(owned, values[0], NULL);
+    rumati_avl_delete(owned, values[0], NULL);
+    rumati_avl_put(owned, values[0], NULL);
+    ip = rumati_avl_get(owned, values[0]);
+    if (frees != 0 || ip != values[0] || *ip != 7){
+        printf("Error, reviving a tombstone with its own value freed it\n");
+        rumati_avl_destroy(owned, free_destructor);
+        free(values[1]);
+        goto out1;
+    }
+    rumati_avl_delete(owned, values[0], NULL);
+    rumati_avl_put(owned, values[1], NULL);
+    n = 7;
+    if (frees != 1 || rumati_avl_get(owned, &n) != values[1]){
+        printf("Error, reviving a tombstone with another value kept it\n");
+        rumati_avl_destroy(owned, free_destructor);
+        goto out1;
+    }
+    rumati_avl_destroy(owned, free_destructor);
+    if (frees != 2){
+        printf("Error, destroying the tree freed %d values\n", frees);
+        goto out1;
+    }
+
+    /*
+     * With automatic purging, the tree never holds too many tombstones, and
+     * the value a delete hands back is not destroyed by the purge it makes.
+     */
+    rumati_avl_set_lazy_delete(tree, poison_destructor, 25);
+    for (i = 0; i < 5000; i++){
+        n = random() % MAX_TEST_NUMBER;
+        if (!in_tree[n]){
+            continue;
+        }
+        ip = NULL;
+        rumati_avl_delete(tree, &num[n], (void**)&ip);
+        in_tree[n] = false;
+        if (ip != &num[n] || *ip != n){
+            printf("Error, deleting %d handed back a destroyed value\n", n);
+            goto out1;
+        }
+        if (tree->tombstones * 4 > tree->size){
+            printf("Error, tree has %lu tombstones in %lu nodes\n",
+                    (unsigned long)tree->tombstones, (unsigned long)tree->size);
+            goto out1;
+        }
+    }
+
+    rumati_avl_set_lazy_delete(tree, NULL, 0);
+    if (tree->tombstones != 0 || verify_tree(tree, in_tree) == false){
+        goto out1;
+    }
+
+    retv = 0;
 
 out1:
     rumati_avl_destroy(tree, destructor);
     return retv;
 }
+
+static size_t int_hash(void *udata, void *ip)
+{
+    (void)udata;
+
+    return (size_t)*(int*)ip;
+}
+
+static int test_cache(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_ERROR err;
+    bool in_tree[MAX_TEST_NUMBER];
+    int num[MAX_TEST_NUMBER];
+    int i, n, retv;
+
+    if (new_test_tree(&tree, balance, num, in_tree) != 0){
+        return 1;
+    }
+
+    retv = 1;
+
+    /* a small cache, so that many keys share each slot */
+    if ((err = rumati_avl_set_cache(tree, int_hash, 100)) != RUMATI_AVL_OK ||
+            tree->cache_mask != 127){
+        printf("Error creating lookup cache: %d\n", err);
+        goto out1;
+    }
+
+    /*
+     * A cached node whose data is replaced by a two child delete must not
+     * stay in the deleted key's slot, where it would outlive being freed.
+     */
+    for (i = 1; i <= 3; i++){
+        rumati_avl_put(tree, &num[i], NULL);
+    }
+    rumati_avl_get(tree, &num[2]);
+    for (i = 2; i <= 3; i++){
+        rumati_avl_delete(tree, &num[i], NULL);
+    }
+    rumati_avl_delete(tree, &num[1], NULL);
+    if (rumati_avl_get(tree, &num[2]) != NULL || tree->size != 0){
+        printf("Error, lookup cache kept a deleted node\n");
+        goto out1;
+    }
+
+    for (i = 0; i < 8000; i++){
+        n = random() % MAX_TEST_NUMBER;
+        in_tree[n] = true;
+        if ((err = rumati_avl_put(tree, &num[n], NULL)) != RUMATI_AVL_OK){
+            printf("Error adding %d to tree: %d\n", n, err);
+            goto out1;
+        }
+    }
+
+    /* every delete must be seen by gets of cached keys */
+    for (i = 0; i < 5000; i++){
+        if (i == 2500){
+            rumati_avl_set_lazy_delete(tree, destructor, 10);
+        }
+        n = random() % MAX_TEST_NUMBER;
+        rumati_avl_delete(tree, &num[n], NULL);
+        in_tree[n] = false;
+        if (i % 100 == 0 && verify_tree(tree, in_tree) == false){
+            goto out1;
+        }
+    }
+
+    rumati_avl_set_lazy_delete(tree, NULL, 0);
+    if (verify_tree(tree, in_tree) == false){
+        goto out1;
+    }
+
+    rumati_avl_set_cache(tree, NULL, 0);
+    if (tree->cache != NULL || verify_tree(tree, in_tree) == false){
+        goto out1;
+    }
+
+    retv = 0;
+
+out1:
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+static int test_index(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_ERROR err;
+    bool in_tree[MAX_TEST_NUMBER];
+    int num[MAX_TEST_NUMBER];
+    int i, n, retv;
+
+    if (new_test_tree(&tree, balance, num, in_tree) != 0){
+        return 1;
+    }
+
+    retv = 1;
+
+    /* half the entries are added before the index is built */
+    for (i = 0; i < 8000; i++){
+        if (i == 4000 &&
+                (err = rumati_avl_set_index(tree, int_hash)) != RUMATI_AVL_OK){
+            printf("Error building hash index: %d\n", err);
+            goto out1;
+        }
+        n = random() % MAX_TEST_NUMBER;
+        in_tree[n] = true;
+        if ((err = rumati_avl_put(tree, &num[n], NULL)) != RUMATI_AVL_OK){
+            printf("Error adding %d to tree: %d\n", n, err);
+            goto out1;
+        }
+    }
+
+    for (i = 0; i < 5000; i++){
+        if (i == 2000){
+            rumati_avl_set_relaxed(tree, 1);
+        }else if (i == 3000){
+            rumati_avl_set_relaxed(tree, 0);
+            rumati_avl_set_lazy_delete(tree, destructor, 10);
+        }
+        n = random() % MAX_TEST_NUMBER;
+        rumati_avl_delete(tree, &num[n], NULL);
+        in_tree[n] = false;
+        if (tree->index_count != tree->size){
+            printf("Error, hash index has %lu entries for %lu nodes\n",
+                    (unsigned long)tree->index_count, (unsigned long)tree->size);
+            goto out1;
+        }
+    }
+
+    rumati_avl_set_lazy_delete(tree, NULL, 0);
+    if (tree->index_count != tree->size || verify_tree(tree, in_tree) == false){
+        goto out1;
+    }
+
+    rumati_avl_set_index(tree, NULL);
+    if (tree->index != NULL || verify_tree(tree, in_tree) == false){
+        goto out1;
+    }
+
+    retv = 0;
+
+out1:
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+static int test_filter(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_ERROR err;
+    RUMATI_AVL_FILTER_STATS stats;
+    bool in_tree[MAX_TEST_NUMBER];
+    int num[MAX_TEST_NUMBER];
+    int i, n, retv;
+
+    if (new_test_tree(&tree, balance, num, in_tree) != 0){
+        return 1;
+    }
+
+    retv = 1;
+
+    if (rumati_avl_set_filter(tree, int_hash, 1024, 17) != RUMATI_AVL_EINVAL ||
+            rumati_avl_get_filter_stats(tree, &stats) != RUMATI_AVL_ENOENT){
+        printf("Error, filter with 17 probes was accepted\n");
+        goto out1;
+    }
+
+    /* half the entries are added before the filter is built */
+    for (i = 0; i < MAX_TEST_NUMBER / 2; i++){
+        if (i == MAX_TEST_NUMBER / 4 &&
+                (err = rumati_avl_set_filter(tree, int_hash, MAX_TEST_NUMBER * 10, 7)) != RUMATI_AVL_OK){
+            printf("Error building filter: %d\n", err);
+            goto out1;
+        }
+        n = random() % MAX_TEST_NUMBER;
+        in_tree[n] = true;
+        rumati_avl_put(tree, &num[n], NULL);
+    }
+
+    /* deleted keys must leave the filter, moved ones must stay in it */
+    for (i = 0; i < 2000; i++){
+        n = random() % MAX_TEST_NUMBER;
+        rumati_avl_delete(tree, &num[n], NULL);
+        in_tree[n] = false;
+    }
+
+    if (verify_tree(tree, in_tree) == false){
+        goto out1;
+    }
+
+    rumati_avl_get_filter_stats(tree, &stats);
+    n = 0;
+    for (i = 0; i < MAX_TEST_NUMBER; i++){
+        if (in_tree[i] == false){
+            n++;
+        }
+    }
+    if (stats.lookups != MAX_TEST_NUMBER ||
+            stats.rejected + stats.false_positives != (size_t)n ||
+            stats.false_positives * 10 > (size_t)n){
+        printf("Error, filter let %lu of %d missing keys through\n",
+                (unsigned long)stats.false_positives, n);
+        goto out1;
+    }
+
+    retv = 0;
+
+out1:
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+static int test_stats(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_ERROR err;
+    RUMATI_AVL_STATS stats;
+    int num[MAX_TEST_NUMBER];
+    int i, retv;
+
+    if ((err = rumati_avl_new_balanced(&tree, int_comparator, NULL, balance)) != RUMATI_AVL_OK){
+        printf("Error creating avl tree: %d\n", err);
+        return 1;
+    }
+
+    retv = 1;
+
+    /* sorted inserts and deletes, which need many rotations */
+    for (i = 0; i < MAX_TEST_NUMBER; i++){
+        num[i] = i;
+        rumati_avl_put(tree, &num[i], NULL);
+    }
+    for (i = 0; i < MAX_TEST_NUMBER; i += 2){
+        rumati_avl_delete(tree, &num[i], NULL);
+    }
+    rumati_avl_delete(tree, &num[0], NULL);
+    rumati_avl_get(tree, &num[1]);
+
+    if ((err = rumati_avl_get_stats(tree, &stats)) != RUMATI_AVL_OK){
+        printf("Error reading stats: %d\n", err);
+        goto out1;
+    }
+    if (stats.puts != MAX_TEST_NUMBER ||
+            stats.deletes != MAX_TEST_NUMBER / 2 + 1 ||
+            stats.gets != 1 ||
+            stats.allocations != MAX_TEST_NUMBER ||
+            stats.frees != MAX_TEST_NUMBER / 2 ||
+            stats.allocations - stats.frees != tree->size){
+        printf("Error, stats counted %llu puts, %llu deletes, %llu gets, "
+                "%llu allocations, %llu frees\n", stats.puts, stats.deletes,
+                stats.gets, stats.allocations, stats.frees);
+        goto out1;
+    }
+    if (stats.insert_single_rotations == 0 ||
+            stats.delete_single_rotations + stats.delete_double_rotations == 0){
+        printf("Error, stats counted no rotations\n");
+        goto out1;
+    }
+    /* no balanced tree of 10000 nodes is more than 28 high */
+    if (stats.max_height < 14 || stats.max_height > 28 ||
+            stats.path_max < stats.max_height - 1 ||
+            stats.comparisons <= stats.path_total){
+        printf("Error, stats counted height %llu, longest path %llu, "
+                "%llu comparisons\n", stats.max_height, stats.path_max,
+                stats.comparisons);
+        goto out1;
+    }
+
+    rumati_avl_reset_stats(tree);
+    rumati_avl_get_stats(tree, &stats);
+    if (stats.comparisons != 0 || stats.puts != 0){
+        printf("Error, stats were not reset\n");
+        goto out1;
+    }
+
+    retv = 0;
+
+out1:
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+static size_t int_serializer(void *udata, void *ip, void *buffer,
+        size_t size)
+{
+    (void)udata;
+
+    if (size >= sizeof(int)){
+        memcpy(buffer, ip, sizeof(int));
+    }
+    return sizeof(int);
+}
+
+static int test_trace(RUMATI_AVL_BALANCE balance)
+{
+    static const RUMATI_AVL_TRACE_OP expected[] = {
+        RUMATI_AVL_TRACE_PUT,
+        RUMATI_AVL_TRACE_GET,
+        RUMATI_AVL_TRACE_GET_GREATER_THAN,
+        RUMATI_AVL_TRACE_DELETE,
+        RUMATI_AVL_TRACE_GET_SMALLEST
+    };
+    /* a get with a key 2^62 bytes long */
+    static const unsigned char corrupt[] = {RUMATI_AVL_TRACE_GET, 0,
+            0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x40, 0};
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_TRACE *trace;
+    RUMATI_AVL_TRACE_RECORD record;
+    RUMATI_AVL_ERROR err;
+    FILE *f;
+    int num[MAX_TEST_NUMBER];
+    int i, n, retv;
+
+    if ((err = rumati_avl_new_balanced(&tree, int_comparator, NULL, balance)) != RUMATI_AVL_OK){
+        printf("Error creating avl tree: %d\n", err);
+        return 1;
+    }
+
+    retv = 1;
+
+    if ((f = tmpfile()) == NULL){
+        printf("Error creating trace file\n");
+        goto out1;
+    }
+    if ((err = rumati_avl_trace_new(&trace, f, int_serializer, NULL)) != RUMATI_AVL_OK){
+        printf("Error creating trace: %d\n", err);
+        goto out2;
+    }
+    for (i = 0; i < MAX_TEST_NUMBER; i++){
+        num[i] = i;
+        rumati_avl_trace_put(trace, tree, &num[i], NULL);
+        if (rumati_avl_trace_get(trace, tree, &num[i]) != &num[i]){
+            printf("Error, traced get of %d failed\n", i);
+            rumati_avl_trace_close(trace);
+            goto out2;
+        }
+        rumati_avl_trace_get_greater_than(trace, tree, &num[i]);
+        rumati_avl_trace_delete(trace, tree, &num[i], NULL);
+        rumati_avl_trace_get_smallest(trace, tree);
+    }
+    if ((err = rumati_avl_trace_close(trace)) != RUMATI_AVL_OK){
+        printf("Error writing trace: %d\n", err);
+        goto out2;
+    }
+
+    rewind(f);
+    if ((err = rumati_avl_trace_open(&trace, f)) != RUMATI_AVL_OK){
+        printf("Error opening trace: %d\n", err);
+        goto out2;
+    }
+    for (n = 0; (err = rumati_avl_trace_read(trace, &record)) == RUMATI_AVL_OK; n++){
+        i = n / 5;
+        if (record.op != expected[n % 5] ||
+                record.key_length != (record.op ==
+                    RUMATI_AVL_TRACE_GET_SMALLEST ? 0 : sizeof(int)) ||
+                (record.key_length != 0 &&
+                    memcmp(record.key, &num[i], sizeof(int)) != 0)){
+            printf("Error, trace record %d is wrong\n", n);
+            rumati_avl_trace_close(trace);
+            goto out2;
+        }
+    }
+    rumati_avl_trace_close(trace);
+    if (err != RUMATI_AVL_ENOENT || n != MAX_TEST_NUMBER * 5){
+        printf("Error, read %d trace records, ending with %d\n", n, err);
+        goto out2;
+    }
+
+    /* a key length past the end of the file is found before it is read */
+    if (fwrite(corrupt, sizeof(corrupt), 1, f) != 1){
+        printf("Error writing trace file\n");
+        goto out2;
+    }
+    rewind(f);
+    if ((err = rumati_avl_trace_open(&trace, f)) != RUMATI_AVL_OK){
+        printf("Error opening trace: %d\n", err);
+        goto out2;
+    }
+    while ((err = rumati_avl_trace_read(trace, &record)) == RUMATI_AVL_OK){
+    }
+    rumati_avl_trace_close(trace);
+    if (err != RUMATI_AVL_EINVAL){
+        printf("Error, trace key with a corrupt length read: %d\n", err);
+        goto out2;
+    }
+
+    retv = 0;
+
+out2:
+    fclose(f);
+out1:
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+static int test_memory(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_ERROR err;
+    RUMATI_AVL_MEMORY usage;
+    int num[MAX_TEST_NUMBER];
+    int i, retv;
+
+    if ((err = rumati_avl_new_balanced(&tree, int_comparator, NULL, balance)) != RUMATI_AVL_OK){
+        printf("Error creating avl tree: %d\n", err);
+        return 1;
+    }
+
+    retv = 1;
+
+    rumati_avl_memory_usage(tree, &usage);
+    if (usage.entries != 0 || usage.node_bytes != 0 ||
+            usage.total_bytes < sizeof(*tree) || usage.bytes_per_entry != 0){
+        printf("Error, empty tree uses %lu bytes\n",
+                (unsigned long)usage.total_bytes);
+        goto out1;
+    }
+
+    if ((err = rumati_avl_set_index(tree, int_hash)) != RUMATI_AVL_OK){
+        printf("Error setting index: %d\n", err);
+        goto out1;
+    }
+    for (i = 0; i < MAX_TEST_NUMBER; i++){
+        num[i] = i;
+        rumati_avl_put(tree, &num[i], NULL);
+    }
+    rumati_avl_set_lazy_delete(tree, destructor, 0);
+    for (i = 0; i < MAX_TEST_NUMBER; i += 2){
+        rumati_avl_delete(tree, &num[i], NULL);
+    }
+
+    rumati_avl_memory_usage(tree, &usage);
+    if (usage.entries != MAX_TEST_NUMBER / 2 ||
+            usage.nodes != MAX_TEST_NUMBER ||
+            usage.node_bytes !=
+                MAX_TEST_NUMBER * sizeof(struct rumati_avl_node) ||
+            usage.index_bytes < MAX_TEST_NUMBER *
+                sizeof(struct rumati_avl_index_entry) ||
+            usage.overhead_bytes == 0 ||
+            usage.slack_bytes < MAX_TEST_NUMBER / 2 *
+                sizeof(struct rumati_avl_node) ||
+            usage.total_bytes != usage.tree_bytes + usage.node_bytes +
+                usage.cache_bytes + usage.index_bytes +
+                usage.filter_bytes + usage.overhead_bytes ||
+            usage.bytes_per_entry <
+                (double)usage.total_bytes / usage.entries - 0.5){
+        printf("Error, memory usage of %lu entries is wrong: %lu node, "
+                "%lu index, %lu overhead, %lu slack, %lu total bytes\n",
+                (unsigned long)usage.entries,
+                (unsigned long)usage.node_bytes,
+                (unsigned long)usage.index_bytes,
+                (unsigned long)usage.overhead_bytes,
+                (unsigned long)usage.slack_bytes,
+                (unsigned long)usage.total_bytes);
+        goto out1;
+    }
+
+    retv = 0;
+
+out1:
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+static void add_depths(struct rumati_avl_node *n, size_t depth,
+        size_t depths[], size_t *max_depth)
+{
+    while (n != NULL){
+        depths[depth < RUMATI_AVL_SHAPE_DEPTHS ?
+                depth : RUMATI_AVL_SHAPE_DEPTHS - 1]++;
+        if (depth > *max_depth){
+            *max_depth = depth;
+        }
+        add_depths(n->left, depth + 1, depths, max_depth);
+        n = n->right;
+        depth++;
+    }
+}
+
+static int test_shape(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_ERROR err;
+    RUMATI_AVL_SHAPE shape;
+    bool in_tree[MAX_TEST_NUMBER];
+    int num[MAX_TEST_NUMBER];
+    size_t depths[RUMATI_AVL_SHAPE_DEPTHS];
+    size_t max_depth;
+    int i, pass, retv;
+
+    if ((err = rumati_avl_new_balanced(&tree, int_comparator, NULL, balance)) != RUMATI_AVL_OK){
+        printf("Error creating avl tree: %d\n", err);
+        return 1;
+    }
+
+    retv = 1;
+
+    if (rumati_avl_get_shape(tree, &shape) != RUMATI_AVL_OK ||
+            shape.nodes != 0 || shape.successful_search_cost != 0){
+        printf("Error, empty tree has a shape\n");
+        goto out1;
+    }
+
+    /*
+     * A random balanced tree, then a relaxed tree of a left leaning list
+     * under a right leaning one, deeper than the histogram.
+     */
+    for (pass = 0; pass < 2; pass++){
+        for (i = 0; i < MAX_TEST_NUMBER; i++){
+            num[i] = i;
+            in_tree[i] = false;
+        }
+        rumati_avl_clear(tree, destructor);
+        if (pass == 0){
+            for (i = 0; i < MAX_TEST_NUMBER; i++){
+                int j = random() % MAX_TEST_NUMBER;
+                rumati_avl_put(tree, &num[j], NULL);
+                in_tree[j] = true;
+            }
+        }else{
+            rumati_avl_set_relaxed(tree, true);
+            for (i = MAX_TEST_NUMBER / 2; i < MAX_TEST_NUMBER; i++){
+                rumati_avl_put(tree, &num[i], NULL);
+                in_tree[i] = true;
+            }
+            for (i = MAX_TEST_NUMBER / 2 - 1; i >= 0; i -= 3){
+                rumati_avl_put(tree, &num[i], NULL);
+                in_tree[i] = true;
+            }
+        }
+
+        memset(depths, 0, sizeof(depths));
+        max_depth = 0;
+        add_depths(tree->root, 0, depths, &max_depth);
+
+        if (rumati_avl_get_shape(tree, &shape) != RUMATI_AVL_OK ||
+                shape.nodes != tree->size || shape.max_depth != max_depth ||
+                memcmp(shape.depths, depths, sizeof(depths)) != 0){
+            printf("Error, shape of %lu nodes, %lu deep, does not match "
+                    "the tree\n", (unsigned long)shape.nodes,
+                    (unsigned long)shape.max_depth);
+            goto out1;
+        }
+        if (shape.average_depth < shape.ideal_average_depth ||
+                shape.successful_search_cost !=
+                    shape.average_depth + 1 ||
+                shape.unsuccessful_search_cost <
+                    shape.ideal_average_depth + 1){
+            printf("Error, average depth %f, ideal %f, search costs %f "
+                    "and %f\n", shape.average_depth,
+                    shape.ideal_average_depth,
+                    shape.successful_search_cost,
+                    shape.unsuccessful_search_cost);
+            goto out1;
+        }
+        if (pass == 1){
+            rumati_avl_set_relaxed(tree, false);
+        }
+        if (!verify_tree(tree, in_tree)){
+            printf("Error, tree broken by shape walk\n");
+            goto out1;
+        }
+    }
+
+    retv = 0;
+
+out1:
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+static int test_check(RUMATI_AVL_BALANCE balance)
+{
+    static const unsigned int flags[] = {
+        RUMATI_AVL_CHECK_ALL,
+        RUMATI_AVL_CHECK_ALL | RUMATI_AVL_CHECK_THREADS(4)
+    };
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_ERROR err;
+    struct rumati_avl_node *n;
+    int num[MAX_TEST_NUMBER];
+    int16_t b;
+    void *data;
+    int i, f, retv;
+
+    if ((err = rumati_avl_new_balanced(&tree, int_comparator, NULL, balance)) != RUMATI_AVL_OK){
+        printf("Error creating avl tree: %d\n", err);
+        return 1;
+    }
+
+    retv = 1;
+
+    if ((err = rumati_avl_check(tree, flags[1])) != RUMATI_AVL_OK){
+        printf("Error, empty tree failed check: %d\n", err);
+        goto out1;
+    }
+
+    rumati_avl_set_index(tree, int_hash);
+    rumati_avl_set_filter(tree, int_hash, 4 * MAX_TEST_NUMBER, 3);
+    for (i = 0; i < MAX_TEST_NUMBER; i++){
+        num[i] = i;
+    }
+    for (i = 0; i < MAX_TEST_NUMBER; i++){
+        rumati_avl_put(tree, &num[random() % MAX_TEST_NUMBER], NULL);
+    }
+
+    for (f = 0; f < 2; f++){
+        if ((err = rumati_avl_check(tree, flags[f])) != RUMATI_AVL_OK){
+            printf("Error, tree failed check %x: %d\n", flags[f], err);
+            goto out1;
+        }
+
+        /* swap the data of the root and its successor */
+        for (n = tree->root->right; n->left != NULL; n = n->left);
+        data = n->data;
+        n->data = tree->root->data;
+        tree->root->data = data;
+        err = rumati_avl_check(tree, flags[f] & ~RUMATI_AVL_CHECK_LOOKUP);
+        tree->root->data = n->data;
+        n->data = data;
+        if (err != RUMATI_AVL_ECORRUPT){
+            printf("Error, check %x missed keys out of order: %d\n",
+                    flags[f], err);
+            goto out1;
+        }
+
+        /* a deep node with the wrong balance */
+        for (n = tree->root; n->left != NULL; n = n->left);
+        b = n->balance;
+        n->balance = balance == RUMATI_AVL_BALANCE_RB ? 2 : b + 1;
+        err = rumati_avl_check(tree, flags[f]);
+        n->balance = b;
+        if (err != RUMATI_AVL_ECORRUPT){
+            printf("Error, check %x missed a wrong balance: %d\n",
+                    flags[f], err);
+            goto out1;
+        }
+
+        tree->size++;
+        err = rumati_avl_check(tree, flags[f]);
+        tree->size--;
+        if (err != RUMATI_AVL_ECORRUPT){
+            printf("Error, check %x missed a wrong size: %d\n",
+                    flags[f], err);
+            goto out1;
+        }
+    }
+
+    /* a list, far higher than the stack starts */
+    rumati_avl_clear(tree, destructor);
+    rumati_avl_set_relaxed(tree, true);
+    for (i = 0; i < MAX_TEST_NUMBER; i++){
+        rumati_avl_put(tree, &num[i], NULL);
+    }
+    if ((err = rumati_avl_check(tree, flags[1])) != RUMATI_AVL_OK){
+        printf("Error, relaxed tree failed check: %d\n", err);
+        goto out1;
+    }
+
+    retv = 0;
+
+out1:
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+static RUMATI_AVL_ERROR int_deserializer(void *udata, const void *buffer,
+        size_t length, void **value)
+{
+    int i;
+
+    if (length != sizeof(int)){
+        return RUMATI_AVL_EINVAL;
+    }
+    memcpy(&i, buffer, sizeof(int));
+    if (i < 0 || i >= MAX_TEST_NUMBER){
+        return RUMATI_AVL_EINVAL;
+    }
+    *value = (int*)udata + i;
+    return RUMATI_AVL_OK;
+}
+
+static int test_save(RUMATI_AVL_BALANCE balance)
+{
+    /* one entry, 2^62 bytes long */
+    static const unsigned char corrupt[] = {1,
+            0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x40, 0};
+    RUMATI_AVL_TREE *tree, *loaded;
+    RUMATI_AVL_ERROR err;
+    bool in_tree[MAX_TEST_NUMBER];
+    int num[MAX_TEST_NUMBER];
+    off_t size;
+    FILE *f;
+    int i, n, fd, retv;
+
+    if (new_test_tree(&tree, balance, num, in_tree) != 0){
+        return 1;
+    }
+    if ((err = rumati_avl_new_balanced(&loaded, int_comparator, num, balance)) != RUMATI_AVL_OK){
+        printf("Error creating avl tree: %d\n", err);
+        rumati_avl_destroy(tree, destructor);
+        return 1;
+    }
+
+    retv = 1;
+
+    /* tombstones must not be saved */
+    rumati_avl_set_lazy_delete(tree, destructor, 0);
+    for (i = 0; i < 8000; i++){
+        n = random() % MAX_TEST_NUMBER;
+        in_tree[n] = true;
+        rumati_avl_put(tree, &num[n], NULL);
+    }
+    for (i = 0; i < 2000; i++){
+        n = random() % MAX_TEST_NUMBER;
+        in_tree[n] = false;
+        rumati_avl_delete(tree, &num[n], NULL);
+    }
+
+    if ((f = tmpfile()) == NULL){
+        printf("Error creating snapshot file\n");
+        goto out1;
+    }
+    fd = fileno(f);
+    if ((err = rumati_avl_save(tree, fd, int_serializer)) != RUMATI_AVL_OK){
+        printf("Error saving tree: %d\n", err);
+        goto out2;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    rumati_avl_set_index(loaded, int_hash);
+    if ((err = rumati_avl_load(loaded, fd, int_deserializer, destructor)) != RUMATI_AVL_OK){
+        printf("Error loading tree: %d\n", err);
+        goto out2;
+    }
+    if (loaded->size != tree->size - tree->tombstones ||
+            verify_tree(loaded, in_tree) == false ||
+            rumati_avl_check(loaded, RUMATI_AVL_CHECK_ALL) != RUMATI_AVL_OK){
+        printf("Error, loaded tree differs from the saved tree\n");
+        goto out2;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    if (rumati_avl_load(loaded, fd, int_deserializer, destructor) != RUMATI_AVL_EINVAL){
+        printf("Error, loaded into a tree which was not empty\n");
+        goto out2;
+    }
+
+    /* a truncated snapshot leaves the tree empty */
+    rumati_avl_clear(loaded, destructor);
+    size = lseek(fd, 0, SEEK_END);
+    if (ftruncate(fd, size - 1) != 0){
+        printf("Error truncating snapshot file\n");
+        goto out2;
+    }
+    lseek(fd, 0, SEEK_SET);
+    err = rumati_avl_load(loaded, fd, int_deserializer, destructor);
+    if (err != RUMATI_AVL_EINVAL || loaded->size != 0 ||
+            loaded->index_count != 0){
+        printf("Error, truncated snapshot loaded: %d\n", err);
+        goto out2;
+    }
+
+    /* as does a length running past the end, before it is allocated */
+    lseek(fd, RUMATI_AVL_SNAPSHOT_MAGIC_SIZE, SEEK_SET);
+    if (write(fd, corrupt, sizeof(corrupt)) != sizeof(corrupt)){
+        printf("Error writing snapshot file\n");
+        goto out2;
+    }
+    lseek(fd, 0, SEEK_SET);
+    err = rumati_avl_load(loaded, fd, int_deserializer, destructor);
+    if (err != RUMATI_AVL_EINVAL || loaded->size != 0){
+        printf("Error, snapshot with a corrupt length loaded: %d\n", err);
+        goto out2;
+    }
+
+    retv = 0;
+
+out2:
+    fclose(f);
+out1:
+    rumati_avl_destroy(loaded, destructor);
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+static int test_save_background(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree, *loaded, *image;
+    RUMATI_AVL_BACKGROUND_SAVE *save;
+    RUMATI_AVL_ERROR err;
+    bool in_tree[MAX_TEST_NUMBER];
+    int num[MAX_TEST_NUMBER];
+    FILE *f, *image_file;
+    int i, n, retv;
+
+    if (new_test_tree(&tree, balance, num, in_tree) != 0){
+        return 1;
+    }
+    if ((err = rumati_avl_new_balanced(&loaded, int_comparator, num, balance)) != RUMATI_AVL_OK){
+        printf("Error creating avl tree: %d\n", err);
+        rumati_avl_destroy(tree, destructor);
+        return 1;
+    }
+
+    retv = 1;
+
+    for (i = 0; i < 8000; i++){
+        n = random() % MAX_TEST_NUMBER;
+        in_tree[n] = true;
+        rumati_avl_put(tree, &num[n], NULL);
+    }
+
+    if ((f = tmpfile()) == NULL){
+        printf("Error creating snapshot file\n");
+        goto out1;
+    }
+    if ((err = rumati_avl_save_background(tree, fileno(f), int_serializer, &save)) != RUMATI_AVL_OK){
+        printf("Error starting background save: %d\n", err);
+        goto out2;
+    }
+
+    /* updates made while the snapshot is written must not appear in it */
+    for (i = 0; i < MAX_TEST_NUMBER; i++){
+        if (in_tree[i]){
+            rumati_avl_delete(tree, &num[i], NULL);
+        }else{
+            rumati_avl_put(tree, &num[i], NULL);
+        }
+    }
+
+    if ((err = rumati_avl_save_wait(save)) != RUMATI_AVL_OK){
+        printf("Error saving tree in the background: %d\n", err);
+        goto out2;
+    }
+    lseek(fileno(f), 0, SEEK_SET);
+    if ((err = rumati_avl_load(loaded, fileno(f), int_deserializer, destructor)) != RUMATI_AVL_OK){
+        printf("Error loading tree: %d\n", err);
+        goto out2;
+    }
+    if (loaded->size + tree->size != MAX_TEST_NUMBER ||
+            verify_tree(loaded, in_tree) == false){
+        printf("Error, background snapshot saw later updates\n");
+        goto out2;
+    }
+
+    /*
+     * The child must only read the tree, or it would copy the pages it
+     * shares with the parent. Images are mapped read only, so saving one
+     * kills the child if it writes to any node.
+     */
+    if ((image_file = tmpfile()) == NULL){
+        printf("Error creating image file\n");
+        goto out2;
+    }
+    if ((err = rumati_avl_write_image(loaded, fileno(image_file), int_serializer)) != RUMATI_AVL_OK ||
+            (err = rumati_avl_open_image(&image, fileno(image_file), int_comparator, NULL)) != RUMATI_AVL_OK){
+        printf("Error writing and opening image: %d\n", err);
+        fclose(image_file);
+        goto out2;
+    }
+    fclose(image_file);
+    ftruncate(fileno(f), 0);
+    lseek(fileno(f), 0, SEEK_SET);
+    err = rumati_avl_save_background(image, fileno(f), int_serializer, &save);
+    if (err == RUMATI_AVL_OK){
+        err = rumati_avl_save_wait(save);
+    }
+    rumati_avl_destroy(image, destructor);
+    if (err != RUMATI_AVL_OK){
+        printf("Error, background save wrote to the tree: %d\n", err);
+        goto out2;
+    }
+
+    retv = 0;
+
+out2:
+    fclose(f);
+out1:
+    rumati_avl_destroy(loaded, destructor);
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+/*
+ * The byte stamped_serializer() writes after each value, which changes with
+ * each delta, as stamps of a time or a version would.
+ */
+static unsigned char save_stamp;
+
+static size_t stamped_serializer(void *udata, void *ip, void *buffer,
+        size_t size)
+{
+    (void)udata;
+
+    if (size >= sizeof(int) + 1){
+        memcpy(buffer, ip, sizeof(int));
+        ((unsigned char*)buffer)[sizeof(int)] = save_stamp;
+    }
+    return sizeof(int) + 1;
+}
+
+static RUMATI_AVL_ERROR stamped_deserializer(void *udata, const void *buffer,
+        size_t length, void **value)
+{
+    if (length == sizeof(int) + 1){
+        length = sizeof(int);
+    }
+    return int_deserializer(udata, buffer, length, value);
+}
+
+/*
+ * delta_round() - makes changes to a tree, saves them as a delta, and
+ * compacts it into the snapshot in base, leaving the new snapshot in base.
+ */
+static int delta_round(RUMATI_AVL_TREE *tree, FILE **base, bool in_tree[],
+        int num[], int changes, RUMATI_AVL_VALUE_SERIALIZER serializer)
+{
+    RUMATI_AVL_TREE *loaded;
+    RUMATI_AVL_ERROR err;
+    FILE *delta, *compacted;
+    off_t delta_size, base_size;
+    int i, n, retv = 1;
+
+    for (i = 0; i < changes; i++){
+        n = random() % MAX_TEST_NUMBER;
+        if (i % 3 == 0){
+            in_tree[n] = false;
+            rumati_avl_delete(tree, &num[n], NULL);
+        }else{
+            in_tree[n] = true;
+            rumati_avl_put(tree, &num[n], NULL);
+        }
+    }
+
+    if ((delta = tmpfile()) == NULL){
+        printf("Error creating delta file\n");
+        return 1;
+    }
+    if ((compacted = tmpfile()) == NULL){
+        printf("Error creating snapshot file\n");
+        fclose(delta);
+        return 1;
+    }
+    save_stamp++;
+    if ((err = rumati_avl_save_delta(tree, fileno(delta), serializer)) != RUMATI_AVL_OK){
+        printf("Error saving delta: %d\n", err);
+        goto out;
+    }
+    delta_size = lseek(fileno(delta), 0, SEEK_END);
+    base_size = lseek(fileno(*base), 0, SEEK_END);
+    if (changes < 100 && delta_size * 4 > base_size){
+        printf("Error, delta of %d changes is %ld bytes, snapshot is %ld\n",
+                changes, (long)delta_size, (long)base_size);
+        goto out;
+    }
+
+    lseek(fileno(delta), 0, SEEK_SET);
+    lseek(fileno(*base), 0, SEEK_SET);
+    if ((err = rumati_avl_compact(fileno(*base), fileno(delta), fileno(compacted))) != RUMATI_AVL_OK){
+        printf("Error compacting delta: %d\n", err);
+        goto out;
+    }
+
+    if ((err = rumati_avl_new_balanced(&loaded, int_comparator, num, tree->balance)) != RUMATI_AVL_OK){
+        printf("Error creating avl tree: %d\n", err);
+        goto out;
+    }
+    lseek(fileno(compacted), 0, SEEK_SET);
+    err = rumati_avl_load(loaded, fileno(compacted), stamped_deserializer, destructor);
+    if (err != RUMATI_AVL_OK ||
+            loaded->size != tree->size - tree->tombstones ||
+            verify_tree(loaded, in_tree) == false){
+        printf("Error, compacted snapshot differs from the tree: %d\n", err);
+        rumati_avl_destroy(loaded, destructor);
+        goto out;
+    }
+    rumati_avl_destroy(loaded, destructor);
+
+    fclose(*base);
+    *base = compacted;
+    compacted = NULL;
+    retv = 0;
+
+out:
+    if (compacted != NULL){
+        fclose(compacted);
+    }
+    fclose(delta);
+    return retv;
+}
+
+static int test_delta(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_ERROR err;
+    bool in_tree[MAX_TEST_NUMBER];
+    int num[MAX_TEST_NUMBER];
+    FILE *base, *f;
+    int i, n, retv;
+
+    if (new_test_tree(&tree, balance, num, in_tree) != 0){
+        return 1;
+    }
+
+    retv = 1;
+
+    for (i = 0; i < 8000; i++){
+        n = random() % MAX_TEST_NUMBER;
+        in_tree[n] = true;
+        rumati_avl_put(tree, &num[n], NULL);
+    }
+
+    if ((f = tmpfile()) == NULL){
+        printf("Error creating delta file\n");
+        goto out1;
+    }
+    if (rumati_avl_save_delta(tree, fileno(f), int_serializer) != RUMATI_AVL_EINVAL){
+        printf("Error, delta saved without tracking changes\n");
+        fclose(f);
+        goto out1;
+    }
+    fclose(f);
+
+    if ((base = tmpfile()) == NULL){
+        printf("Error creating snapshot file\n");
+        goto out1;
+    }
+    rumati_avl_track_changes(tree);
+    if ((err = rumati_avl_save(tree, fileno(base), int_serializer)) != RUMATI_AVL_OK){
+        printf("Error saving tree: %d\n", err);
+        goto out2;
+    }
+
+    /* a few changes, many, then tombstones, some purged */
+    if (delta_round(tree, &base, in_tree, num, 30, int_serializer) != 0 ||
+            delta_round(tree, &base, in_tree, num, 0, int_serializer) != 0 ||
+            delta_round(tree, &base, in_tree, num, 5000, int_serializer) != 0){
+        goto out2;
+    }
+
+    /* values serialized differently each time are only written if changed */
+    for (i = 0; i < 2; i++){
+        if (delta_round(tree, &base, in_tree, num, 30,
+                stamped_serializer) != 0){
+            goto out2;
+        }
+    }
+
+    /* a run of removed entries, and the last entries, are only counted */
+    for (n = 100; n < 400; n++){
+        in_tree[n] = false;
+        rumati_avl_delete(tree, &num[n], NULL);
+    }
+    for (n = MAX_TEST_NUMBER - 300; n < MAX_TEST_NUMBER; n++){
+        in_tree[n] = false;
+        rumati_avl_delete(tree, &num[n], NULL);
+    }
+    if (delta_round(tree, &base, in_tree, num, 0, int_serializer) != 0){
+        goto out2;
+    }
+
+    rumati_avl_set_lazy_delete(tree, destructor, 0);
+    if (delta_round(tree, &base, in_tree, num, 300, int_serializer) != 0){
+        goto out2;
+    }
+    for (i = 0; i < 300; i++){
+        n = random() % MAX_TEST_NUMBER;
+        in_tree[n] = false;
+        rumati_avl_delete(tree, &num[n], NULL);
+    }
+    rumati_avl_purge(tree);
+    if (delta_round(tree, &base, in_tree, num, 30, int_serializer) != 0){
+        goto out2;
+    }
+
+    retv = 0;
+
+out2:
+    fclose(base);
+out1:
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+static int test_image(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree, *image[2];
+    RUMATI_AVL_ERROR err;
+    RUMATI_AVL_MEMORY usage;
+    RUMATI_AVL_SHAPE shape;
+    struct rumati_avl_image_header header;
+    uint64_t nodes;
+    bool in_tree[MAX_TEST_NUMBER];
+    int num[MAX_TEST_NUMBER];
+    FILE *f;
+    int i, n, fd, retv;
+
+    if (new_test_tree(&tree, balance, num, in_tree) != 0){
+        return 1;
+    }
+
+    retv = 1;
+    image[0] = image[1] = NULL;
+
+    rumati_avl_set_lazy_delete(tree, destructor, 0);
+    for (i = 0; i < 8000; i++){
+        n = random() % MAX_TEST_NUMBER;
+        in_tree[n] = true;
+        rumati_avl_put(tree, &num[n], NULL);
+    }
+    for (i = 0; i < 2000; i++){
+        n = random() % MAX_TEST_NUMBER;
+        in_tree[n] = false;
+        rumati_avl_delete(tree, &num[n], NULL);
+    }
+
+    if ((f = tmpfile()) == NULL){
+        printf("Error creating image file\n");
+        goto out1;
+    }
+    fd = fileno(f);
+    if ((err = rumati_avl_write_image(tree, fd, int_serializer)) != RUMATI_AVL_OK){
+        printf("Error writing image: %d\n", err);
+        goto out2;
+    }
+
+    /* each is mapped at its own address, with nothing to relocate */
+    for (i = 0; i < 2; i++){
+        if ((err = rumati_avl_open_image(&image[i], fd, int_comparator, NULL)) != RUMATI_AVL_OK){
+            printf("Error opening image: %d\n", err);
+            goto out2;
+        }
+        if (image[i]->size != tree->size - tree->tombstones ||
+                verify_tree(image[i], in_tree) == false ||
+                rumati_avl_check(image[i], RUMATI_AVL_CHECK_ALL) != RUMATI_AVL_OK){
+            printf("Error, image %d differs from the tree\n", i);
+            goto out2;
+        }
+    }
+    if (image[1]->image == image[0]->image){
+        printf("Error, images mapped at %p and %p\n", image[0]->image,
+                image[1]->image);
+        goto out2;
+    }
+
+    if (rumati_avl_put(image[0], &num[0], NULL) != RUMATI_AVL_EROFS ||
+            rumati_avl_delete(image[0], &num[0], NULL) != RUMATI_AVL_EROFS){
+        printf("Error, image was changed\n");
+        goto out2;
+    }
+
+    /*
+     * Walks only read the nodes, so building the index and filter and
+     * measuring the shape work on the read only mapping.
+     */
+    if ((err = rumati_avl_set_index(image[0], int_hash)) != RUMATI_AVL_OK ||
+            (err = rumati_avl_set_filter(image[0], int_hash, 4 * MAX_TEST_NUMBER, 3)) != RUMATI_AVL_OK ||
+            (err = rumati_avl_get_shape(image[0], &shape)) != RUMATI_AVL_OK){
+        printf("Error walking read only image: %d\n", err);
+        goto out2;
+    }
+    rumati_avl_memory_usage(image[0], &usage);
+    if (verify_tree(image[0], in_tree) == false ||
+            usage.nodes != image[0]->size ||
+            shape.nodes != image[0]->size){
+        printf("Error, read only image differs from the tree\n");
+        goto out2;
+    }
+
+    /* a cleared image is an ordinary tree */
+    rumati_avl_clear(image[1], destructor);
+    if (image[1]->image != NULL ||
+            rumati_avl_put(image[1], &num[0], NULL) != RUMATI_AVL_OK){
+        printf("Error, cleared image cannot be changed\n");
+        goto out2;
+    }
+
+    /* nodes inside the header, or not aligned, are rejected */
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)){
+        printf("Error reading image header\n");
+        goto out2;
+    }
+    for (i = 0; i < 2; i++){
+        nodes = header.nodes;
+        header.nodes = i == 0 ? 0 : nodes + 1;
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+                rumati_avl_open_image(&image[1], fd, int_comparator, NULL) != RUMATI_AVL_EINVAL){
+            printf("Error, image with nodes at %lu opened\n", (unsigned long)header.nodes);
+            goto out2;
+        }
+        header.nodes = nodes;
+    }
+
+    /* not an image */
+    if (ftruncate(fd, 1000) != 0 ||
+            rumati_avl_open_image(&image[1], fd, int_comparator, NULL) == RUMATI_AVL_OK){
+        printf("Error, truncated image opened\n");
+        goto out2;
+    }
+
+    retv = 0;
+
+out2:
+    fclose(f);
+    for (i = 0; i < 2; i++){
+        if (image[i] != NULL){
+            rumati_avl_destroy(image[i], destructor);
+        }
+    }
+out1:
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+static int test_wal(RUMATI_AVL_BALANCE balance)
+{
+    RUMATI_AVL_TREE *tree, *replayed;
+    RUMATI_AVL_WAL *wal;
+    RUMATI_AVL_ERROR err;
+    bool in_tree[MAX_TEST_NUMBER];
+    int num[MAX_TEST_NUMBER];
+    static const unsigned char torn[] = {RUMATI_AVL_WAL_PUT, 4, 0};
+    /* lengths of 2^28 - 1 bytes, past the end of the file, and of 2^62 */
+    static const unsigned char past_end[] = {RUMATI_AVL_WAL_PUT,
+            0xff, 0xff, 0xff, 0x7f, 0};
+    static const unsigned char too_long[] = {RUMATI_AVL_WAL_PUT,
+            0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x40, 0};
+    const unsigned char *corrupt[2];
+    size_t records;
+    off_t size;
+    FILE *snapshot, *log;
+    int i, n, retv, pass;
+
+    if (new_test_tree(&tree, balance, num, in_tree) != 0){
+        return 1;
+    }
+    if ((err = rumati_avl_new_balanced(&replayed, int_comparator, num, balance)) != RUMATI_AVL_OK){
+        printf("Error creating avl tree: %d\n", err);
+        rumati_avl_destroy(tree, destructor);
+        return 1;
+    }
+
+    retv = 1;
+    snapshot = log = NULL;
+
+    if ((snapshot = tmpfile()) == NULL || (log = tmpfile()) == NULL){
+        printf("Error creating snapshot or log file\n");
+        goto out;
+    }
+
+    /*
+     * The first pass syncs every record and ends with a checkpoint, the
+     * second writes groups from the background thread.
+     */
+    for (pass = 0; pass < 2; pass++){
+        if ((err = rumati_avl_wal_new(&wal, fileno(log), int_serializer, NULL, pass == 0 ? 0 : 2)) != RUMATI_AVL_OK){
+            printf("Error creating log: %d\n", err);
+            goto out;
+        }
+        for (i = 0; i < 4000; i++){
+            n = random() % MAX_TEST_NUMBER;
+            if (i % 3 == 2){
+                in_tree[n] = false;
+                err = rumati_avl_wal_delete(wal, tree, &num[n], NULL);
+                err = err == RUMATI_AVL_ENOENT ? RUMATI_AVL_OK : err;
+            }else{
+                in_tree[n] = true;
+                err = rumati_avl_wal_put(wal, tree, &num[n], NULL);
+            }
+            if (err != RUMATI_AVL_OK){
+                printf("Error, logged update failed: %d\n", err);
+                rumati_avl_wal_close(wal);
+                goto out;
+            }
+        }
+        if (pass == 0 && ((err = rumati_avl_save(tree, fileno(snapshot), int_serializer)) != RUMATI_AVL_OK ||
+                    (err = rumati_avl_wal_reset(wal)) != RUMATI_AVL_OK)){
+            printf("Error checkpointing: %d\n", err);
+            rumati_avl_wal_close(wal);
+            goto out;
+        }
+        if ((err = rumati_avl_wal_close(wal)) != RUMATI_AVL_OK){
+            printf("Error closing log: %d\n", err);
+            goto out;
+        }
+    }
+
+    /* recover, then replay again, which must change nothing */
+    lseek(fileno(snapshot), 0, SEEK_SET);
+    if ((err = rumati_avl_load(replayed, fileno(snapshot), int_deserializer, destructor)) != RUMATI_AVL_OK){
+        printf("Error loading snapshot: %d\n", err);
+        goto out;
+    }
+    for (pass = 0; pass < 2; pass++){
+        err = rumati_avl_wal_replay(replayed, fileno(log), int_comparator, int_deserializer, destructor, num, &records);
+        if (err != RUMATI_AVL_OK || records == 0 ||
+                replayed->size != tree->size ||
+                verify_tree(replayed, in_tree) == false ||
+                rumati_avl_check(replayed, RUMATI_AVL_CHECK_ALL) != RUMATI_AVL_OK){
+            printf("Error, replayed tree differs from the logged tree: %d\n", err);
+            goto out;
+        }
+    }
+
+    /* a torn record is cut off, and appends follow the last good one */
+    size = lseek(fileno(log), 0, SEEK_END);
+    if (write(fileno(log), torn, sizeof(torn)) != sizeof(torn)){
+        printf("Error writing log file\n");
+        goto out;
+    }
+    err = rumati_avl_wal_replay(replayed, fileno(log), int_comparator, int_deserializer, destructor, num, NULL);
+    if (err != RUMATI_AVL_OK || lseek(fileno(log), 0, SEEK_CUR) != size ||
+            lseek(fileno(log), 0, SEEK_END) != size ||
+            verify_tree(replayed, in_tree) == false){
+        printf("Error, torn log record replayed: %d\n", err);
+        goto out;
+    }
+
+    /* and so is a record whose length was corrupted, without reading it */
+    corrupt[0] = past_end;
+    corrupt[1] = too_long;
+    for (i = 0; i < 2; i++){
+        n = i == 0 ? sizeof(past_end) : sizeof(too_long);
+        if (write(fileno(log), corrupt[i], n) != n){
+            printf("Error writing log file\n");
+            goto out;
+        }
+        err = rumati_avl_wal_replay(replayed, fileno(log), int_comparator, int_deserializer, destructor, num, NULL);
+        if (err != RUMATI_AVL_OK || lseek(fileno(log), 0, SEEK_END) != size ||
+                verify_tree(replayed, in_tree) == false){
+            printf("Error, log record with a corrupt length replayed: %d\n", err);
+            goto out;
+        }
+    }
+
+    /* a snapshot is not a log */
+    if (rumati_avl_wal_replay(replayed, fileno(snapshot), int_comparator, int_deserializer, destructor, num, NULL) != RUMATI_AVL_EINVAL ||
+            rumati_avl_wal_new(&wal, fileno(snapshot), int_serializer, NULL, 0) != RUMATI_AVL_EINVAL){
+        printf("Error, snapshot accepted as a log\n");
+        goto out;
+    }
+
+    retv = 0;
+
+out:
+    if (log != NULL){
+        fclose(log);
+    }
+    if (snapshot != NULL){
+        fclose(snapshot);
+    }
+    rumati_avl_destroy(replayed, destructor);
+    rumati_avl_destroy(tree, destructor);
+    return retv;
+}
+
+/*
+ * Runs a test once for each balancing scheme.
+ *
+ * Returns: 0 if every run passed, or 1 after the first failing run
+ */
+static int run_test(int (*test)(RUMATI_AVL_BALANCE))
+{
+    if (test(RUMATI_AVL_BALANCE_AVL) != 0 ||
+            test(RUMATI_AVL_BALANCE_WAVL) != 0 ||
+            test(RUMATI_AVL_BALANCE_RB) != 0){
+        return 1;
+    }
+
+    return 0;
+}
+
+int main (int argc, char *argv[])
+{
+    (void)argc; (void)argv;
+
+    if (run_test(test_tree) != 0 ||
+            run_test(test_relaxed) != 0 ||
+            run_test(test_lazy_delete) != 0 ||
+            run_test(test_cache) != 0 ||
+            run_test(test_index) != 0 ||
+            run_test(test_filter) != 0 ||
+            run_test(test_stats) != 0 ||
+            run_test(test_trace) != 0 ||
+            run_test(test_memory) != 0 ||
+            run_test(test_shape) != 0 ||
+            run_test(test_check) != 0 ||
+            run_test(test_save) != 0 ||
+            run_test(test_save_background) != 0 ||
+            run_test(test_delta) != 0 ||
+            run_test(test_image) != 0 ||
+            run_test(test_wal) != 0){
+        return 1;
+    }
+
+    printf("OK! Tests passed successfully!\n");
+    return 0;
+}
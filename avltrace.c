@@ -0,0 +1,447 @@
+/*
+ * Rumati AVL
+ * Copyright (c) 2010 Jesse Long <jpl@unknown.za.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "avltrace.h"
+
+#include <stdlib.h>     /* for malloc(), free() */
+#include <string.h>     /* for memcmp() */
+#include <stdbool.h>    /* for bool */
+#include <time.h>       /* for clock_gettime() */
+#include <sys/stat.h>   /* for fstat() */
+
+#define RUMATI_AVL_TRACE_MAGIC      "RAVLTRC1"
+#define RUMATI_AVL_TRACE_MAGIC_LEN  8
+
+/*
+ * Longest key a record may hold. Longer keys are not recorded, and longer
+ * lengths read back are taken as corruption, when a stream is not a file
+ * whose size can bound them.
+ */
+#define RUMATI_AVL_TRACE_MAX_KEY    ((size_t)1 << 30)
+
+/*
+ * Trace type
+ */
+struct rumati_avl_trace {
+    /*
+     * The stream the trace is written to or read from
+     */
+    FILE *stream;
+    /*
+     * Function writing key bytes, and its user pointer. NULL for traces
+     * being read.
+     */
+    RUMATI_AVL_KEY_SERIALIZER serializer;
+    void *udata;
+    /*
+     * Time of the previous record, in nanoseconds. When recording, this is
+     * on the monotonic clock, when reading, it is since the start of the
+     * trace.
+     */
+    unsigned long long time_ns;
+    /*
+     * true if a record could not be written
+     */
+    bool error;
+    /*
+     * Buffer for key bytes
+     */
+    unsigned char *buffer;
+    size_t buffer_size;
+};
+
+/*
+ * rumati_avl_trace_now() - returns the monotonic clock, in nanoseconds.
+ */
+static unsigned long long rumati_avl_trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * rumati_avl_trace_alloc() - allocates a trace for a stream.
+ */
+static RUMATI_AVL_TRACE *rumati_avl_trace_alloc(FILE *stream)
+{
+    RUMATI_AVL_TRACE *trace = malloc(sizeof(*trace));
+
+    if (trace == NULL){
+        return NULL;
+    }
+    trace->stream = stream;
+    trace->serializer = NULL;
+    trace->udata = NULL;
+    trace->time_ns = 0;
+    trace->error = false;
+    trace->buffer_size = 64;
+    trace->buffer = malloc(trace->buffer_size);
+    if (trace->buffer == NULL){
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+/*
+ * rumati_avl_trace_reserve() - makes sure the key buffer of a trace holds
+ * at least size bytes.
+ *
+ * Returns:
+ *      true on success, or false if there was an error allocating memory.
+ */
+static bool rumati_avl_trace_reserve(RUMATI_AVL_TRACE *trace, size_t size)
+{
+    unsigned char *buffer;
+
+    if (size <= trace->buffer_size){
+        return true;
+    }
+    buffer = realloc(trace->buffer, size);
+    if (buffer == NULL){
+        return false;
+    }
+    trace->buffer = buffer;
+    trace->buffer_size = size;
+    return true;
+}
+
+/*
+ * rumati_avl_trace_fits() - checks that a key length read from a trace
+ * could be followed by that many bytes, before the key buffer is grown for
+ * it.
+ *
+ * Returns:
+ *      true if the stream is a regular file with at least length bytes left
+ *      in it, or is something else and length is at most
+ *      RUMATI_AVL_TRACE_MAX_KEY.
+ */
+static bool rumati_avl_trace_fits(RUMATI_AVL_TRACE *trace, size_t length)
+{
+    struct stat st;
+    long offset;
+
+    if (fstat(fileno(trace->stream), &st) != 0 || !S_ISREG(st.st_mode) ||
+            (offset = ftell(trace->stream)) < 0){
+        return length <= RUMATI_AVL_TRACE_MAX_KEY;
+    }
+    return offset <= st.st_size &&
+            (unsigned long long)length <=
+                (unsigned long long)(st.st_size - offset);
+}
+
+/*
+ * rumati_avl_trace_put_varint() - writes an unsigned LEB128 varint.
+ */
+static void rumati_avl_trace_put_varint(
+        RUMATI_AVL_TRACE *trace,
+        unsigned long long v)
+{
+    while (v >= 0x80){
+        putc((int)(v & 0x7f) | 0x80, trace->stream);
+        v >>= 7;
+    }
+    putc((int)v, trace->stream);
+}
+
+/*
+ * rumati_avl_trace_get_varint() - reads an unsigned LEB128 varint.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOENT   If the stream ended before the varint.
+ *      RUMATI_AVL_EINVAL   If the stream ended inside the varint, or it is
+ *                          too long.
+ */
+static RUMATI_AVL_ERROR rumati_avl_trace_get_varint(
+        RUMATI_AVL_TRACE *trace,
+        unsigned long long *v)
+{
+    unsigned int shift = 0;
+    int c;
+
+    *v = 0;
+    do {
+        c = getc(trace->stream);
+        if (c == EOF){
+            return shift == 0 ? RUMATI_AVL_ENOENT : RUMATI_AVL_EINVAL;
+        }
+        if (shift > 63){
+            return RUMATI_AVL_EINVAL;
+        }
+        *v |= (unsigned long long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_trace_record() - writes a record to a trace.
+ *
+ * Parameters:
+ *      trace - the trace
+ *      op -    the operation
+ *      key -   the key, or NULL for operations without a key
+ */
+static void rumati_avl_trace_record(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TRACE_OP op,
+        void *key)
+{
+    unsigned long long now = rumati_avl_trace_now();
+    size_t length = 0;
+
+    if (key != NULL){
+        length = trace->serializer(trace->udata, key,
+                trace->buffer, trace->buffer_size);
+        if (length > RUMATI_AVL_TRACE_MAX_KEY){
+            trace->error = true;
+            return;
+        }
+        if (length > trace->buffer_size){
+            if (!rumati_avl_trace_reserve(trace, length)){
+                trace->error = true;
+                return;
+            }
+            trace->serializer(trace->udata, key,
+                    trace->buffer, trace->buffer_size);
+        }
+    }
+
+    putc((int)op, trace->stream);
+    rumati_avl_trace_put_varint(trace, now - trace->time_ns);
+    rumati_avl_trace_put_varint(trace, length);
+    if (length > 0 && fwrite(trace->buffer, length, 1, trace->stream) != 1){
+        trace->error = true;
+    }
+    trace->time_ns = now;
+}
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_trace_new(
+        RUMATI_AVL_TRACE **trace,
+        FILE *out,
+        RUMATI_AVL_KEY_SERIALIZER serializer,
+        void *udata)
+{
+    RUMATI_AVL_TRACE *retv;
+
+    if (trace == NULL || out == NULL || serializer == NULL){
+        return RUMATI_AVL_EINVAL;
+    }
+
+    retv = rumati_avl_trace_alloc(out);
+    if (retv == NULL){
+        return RUMATI_AVL_ENOMEM;
+    }
+    retv->serializer = serializer;
+    retv->udata = udata;
+    retv->time_ns = rumati_avl_trace_now();
+
+    if (fwrite(RUMATI_AVL_TRACE_MAGIC, RUMATI_AVL_TRACE_MAGIC_LEN, 1,
+                out) != 1){
+        free(retv->buffer);
+        free(retv);
+        return RUMATI_AVL_EIO;
+    }
+
+    *trace = retv;
+    return RUMATI_AVL_OK;
+}
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_trace_open(
+        RUMATI_AVL_TRACE **trace,
+        FILE *in)
+{
+    RUMATI_AVL_TRACE *retv;
+    char magic[RUMATI_AVL_TRACE_MAGIC_LEN];
+
+    if (trace == NULL || in == NULL){
+        return RUMATI_AVL_EINVAL;
+    }
+
+    if (fread(magic, sizeof(magic), 1, in) != 1 ||
+            memcmp(magic, RUMATI_AVL_TRACE_MAGIC, sizeof(magic)) != 0){
+        return RUMATI_AVL_EINVAL;
+    }
+
+    retv = rumati_avl_trace_alloc(in);
+    if (retv == NULL){
+        return RUMATI_AVL_ENOMEM;
+    }
+
+    *trace = retv;
+    return RUMATI_AVL_OK;
+}
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_trace_read(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TRACE_RECORD *record)
+{
+    unsigned long long delta, length;
+    int op = getc(trace->stream);
+
+    if (op == EOF){
+        return RUMATI_AVL_ENOENT;
+    }
+    if (op < RUMATI_AVL_TRACE_PUT || op > RUMATI_AVL_TRACE_GET_GREATEST){
+        return RUMATI_AVL_EINVAL;
+    }
+
+    /* the end of the trace is only allowed between records */
+    if (rumati_avl_trace_get_varint(trace, &delta) != RUMATI_AVL_OK ||
+            rumati_avl_trace_get_varint(trace, &length) != RUMATI_AVL_OK ||
+            (size_t)length != length){
+        return RUMATI_AVL_EINVAL;
+    }
+    /* only checked when the buffer must grow, which is rare */
+    if (length > trace->buffer_size &&
+            !rumati_avl_trace_fits(trace, (size_t)length)){
+        return RUMATI_AVL_EINVAL;
+    }
+    if (!rumati_avl_trace_reserve(trace, (size_t)length)){
+        return RUMATI_AVL_ENOMEM;
+    }
+    if (length > 0 &&
+            fread(trace->buffer, (size_t)length, 1, trace->stream) != 1){
+        return RUMATI_AVL_EINVAL;
+    }
+
+    trace->time_ns += delta;
+    record->op = (RUMATI_AVL_TRACE_OP)op;
+    record->time_ns = trace->time_ns;
+    record->key_length = (size_t)length;
+    record->key = trace->buffer;
+    return RUMATI_AVL_OK;
+}
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_trace_close(RUMATI_AVL_TRACE *trace)
+{
+    bool error = trace->error;
+
+    if (trace->serializer != NULL && fflush(trace->stream) != 0){
+        error = true;
+    }
+    free(trace->buffer);
+    free(trace);
+    return error ? RUMATI_AVL_EIO : RUMATI_AVL_OK;
+}
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_trace_put(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *object,
+        void **old_value)
+{
+    rumati_avl_trace_record(trace, RUMATI_AVL_TRACE_PUT, object);
+    return rumati_avl_put(tree, object, old_value);
+}
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    rumati_avl_trace_record(trace, RUMATI_AVL_TRACE_GET, key);
+    return rumati_avl_get(tree, key);
+}
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_trace_delete(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *key,
+        void **old_value)
+{
+    rumati_avl_trace_record(trace, RUMATI_AVL_TRACE_DELETE, key);
+    return rumati_avl_delete(tree, key, old_value);
+}
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get_greater_than_or_equal(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    rumati_avl_trace_record(trace,
+            RUMATI_AVL_TRACE_GET_GREATER_THAN_OR_EQUAL, key);
+    return rumati_avl_get_greater_than_or_equal(tree, key);
+}
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get_less_than_or_equal(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    rumati_avl_trace_record(trace,
+            RUMATI_AVL_TRACE_GET_LESS_THAN_OR_EQUAL, key);
+    return rumati_avl_get_less_than_or_equal(tree, key);
+}
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get_greater_than(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    rumati_avl_trace_record(trace, RUMATI_AVL_TRACE_GET_GREATER_THAN, key);
+    return rumati_avl_get_greater_than(tree, key);
+}
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get_less_than(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *key)
+{
+    rumati_avl_trace_record(trace, RUMATI_AVL_TRACE_GET_LESS_THAN, key);
+    return rumati_avl_get_less_than(tree, key);
+}
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get_smallest(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree)
+{
+    rumati_avl_trace_record(trace, RUMATI_AVL_TRACE_GET_SMALLEST, NULL);
+    return rumati_avl_get_smallest(tree);
+}
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get_greatest(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree)
+{
+    rumati_avl_trace_record(trace, RUMATI_AVL_TRACE_GET_GREATEST, NULL);
+    return rumati_avl_get_greatest(tree);
+}
@@ -0,0 +1,223 @@
+/*
+ * Rumati AVL
+ * Copyright (c) 2010 Jesse Long <jpl@unknown.za.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef RUMATI_AVL_TRACE_H
+#define RUMATI_AVL_TRACE_H 1
+
+/*
+ * Workload traces. A trace records a stream of operations on trees, with
+ * the bytes of each key and the time of each operation, so that the stream
+ * can be replayed offline against any configuration of the library (see
+ * avlreplay.c).
+ *
+ * Operations are recorded by calling the rumati_avl_trace_*() wrappers in
+ * place of the rumati_avl_*() functions they wrap. Each wrapper records the
+ * operation, then makes the call.
+ *
+ * The trace format is the 8 byte magic "RAVLTRC1", followed by one record
+ * per operation: a byte holding the RUMATI_AVL_TRACE_OP, the time in
+ * nanoseconds since the previous record, and the length of the key, both as
+ * unsigned LEB128 varints, then the key bytes.
+ */
+
+#include "avl.h"
+
+#include <stdio.h>      /* for FILE */
+
+/*
+ * A trace being recorded or read.
+ */
+typedef struct rumati_avl_trace RUMATI_AVL_TRACE;
+
+/*
+ * Operations recorded in traces
+ */
+typedef enum {
+    RUMATI_AVL_TRACE_PUT = 1,
+    RUMATI_AVL_TRACE_GET,
+    RUMATI_AVL_TRACE_DELETE,
+    RUMATI_AVL_TRACE_GET_GREATER_THAN_OR_EQUAL,
+    RUMATI_AVL_TRACE_GET_LESS_THAN_OR_EQUAL,
+    RUMATI_AVL_TRACE_GET_GREATER_THAN,
+    RUMATI_AVL_TRACE_GET_LESS_THAN,
+    RUMATI_AVL_TRACE_GET_SMALLEST,  /* recorded with an empty key */
+    RUMATI_AVL_TRACE_GET_GREATEST   /* recorded with an empty key */
+} RUMATI_AVL_TRACE_OP;
+
+/*
+ * A function that writes the bytes of a key into buffer, for the trace.
+ * Keys which compare equal should have the same bytes, and the order of the
+ * bytes (compared with memcmp(), shorter keys first on a tie) should match
+ * the order of the keys, so that replays take the same paths down the tree.
+ *
+ * Returns the length of the key. If that is more than size, the function is
+ * called again with a buffer of at least that size.
+ */
+typedef size_t(*RUMATI_AVL_KEY_SERIALIZER)(
+        void *udata,
+        void *key,
+        void *buffer,
+        size_t size);
+
+/*
+ * A record read from a trace. key is valid until the next call to
+ * rumati_avl_trace_read().
+ */
+typedef struct {
+    RUMATI_AVL_TRACE_OP op;
+    unsigned long long time_ns;     /* since the start of the trace */
+    size_t key_length;
+    unsigned char *key;
+} RUMATI_AVL_TRACE_RECORD;
+
+/*
+ * rumati_avl_trace_new() - starts recording a trace. The header is written
+ * straight away.
+ *
+ * Parameters:
+ *      trace -         populated with the new trace
+ *      out -           the stream to write the trace to, which stays owned by
+ *                      the caller. stdio buffering keeps recording cheap.
+ *      serializer -    the function writing the bytes of keys
+ *      udata -         a user defined pointer passed to serializer
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If any pointer is NULL.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If the header could not be written.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_trace_new(
+        RUMATI_AVL_TRACE **trace,
+        FILE *out,
+        RUMATI_AVL_KEY_SERIALIZER serializer,
+        void *udata);
+
+/*
+ * rumati_avl_trace_open() - starts reading a trace, checking its header.
+ *
+ * Parameters:
+ *      trace - populated with the trace
+ *      in -    the stream to read the trace from, which stays owned by the
+ *              caller
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If in is not a trace.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_trace_open(
+        RUMATI_AVL_TRACE **trace,
+        FILE *in);
+
+/*
+ * rumati_avl_trace_read() - reads the next record of a trace opened with
+ * rumati_avl_trace_open().
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOENT   At the end of the trace.
+ *      RUMATI_AVL_EINVAL   If the trace is truncated or corrupt, including
+ *                          a key length running past the end of the file,
+ *                          which is found before memory is allocated for
+ *                          it.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_trace_read(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TRACE_RECORD *record);
+
+/*
+ * rumati_avl_trace_close() - flushes and frees a trace. The stream is not
+ * closed.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EIO      If any record of a trace being recorded could not
+ *                          be written, or had a key over 1 GiB. Operations
+ *                          were still made.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_trace_close(RUMATI_AVL_TRACE *trace);
+
+/*
+ * Wrappers recording an operation in a trace, then calling the matching
+ * rumati_avl_*() function with the remaining arguments.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_trace_put(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *object,
+        void **old_value);
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *key);
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_trace_delete(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *key,
+        void **old_value);
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get_greater_than_or_equal(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *key);
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get_less_than_or_equal(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *key);
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get_greater_than(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *key);
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get_less_than(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree,
+        void *key);
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get_smallest(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree);
+
+RUMATI_AVL_API
+void *rumati_avl_trace_get_greatest(
+        RUMATI_AVL_TRACE *trace,
+        RUMATI_AVL_TREE *tree);
+
+#endif /* RUMATI_AVL_TRACE_H */
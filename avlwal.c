@@ -0,0 +1,913 @@
+/*
+ * Rumati AVL
+ * Copyright (c) 2010 Jesse Long <jpl@unknown.za.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "avlwal.h"
+
+#include <stdlib.h>     /* for malloc(), free() */
+#include <string.h>     /* for memcpy(), memcmp() */
+#include <stdbool.h>    /* for bool */
+#include <stdint.h>     /* for uint32_t */
+#include <errno.h>      /* for errno, EINTR */
+#include <time.h>       /* for clock_gettime() */
+#include <unistd.h>     /* for write(), read(), fdatasync(), ftruncate() */
+#include <sys/stat.h>   /* for fstat() */
+#ifdef RUMATI_AVL_THREADS
+#include <pthread.h>    /* for the background thread */
+#endif
+
+#define RUMATI_AVL_WAL_MAGIC        "RAVLWAL1"
+#define RUMATI_AVL_WAL_MAGIC_LEN    8
+
+/*
+ * Record types
+ */
+#define RUMATI_AVL_WAL_PUT          1
+#define RUMATI_AVL_WAL_DELETE       2
+
+/*
+ * Bytes of records which are written straight away, without waiting for
+ * the sync interval, and the size of reads during replay
+ */
+#define RUMATI_AVL_WAL_BUFFER_SIZE  65536
+
+/*
+ * Most bytes a record adds to its value: the type, the varint length and
+ * the CRC
+ */
+#define RUMATI_AVL_WAL_RECORD_OVERHEAD  (1 + 10 + 4)
+
+/*
+ * Longest value a record may hold. Replay takes a longer length as a
+ * corrupt record rather than allocating a buffer for it.
+ */
+#define RUMATI_AVL_WAL_MAX_VALUE    ((size_t)1 << 30)
+
+#ifdef RUMATI_AVL_THREADS
+#define RUMATI_AVL_WAL_LOCK(wal)    pthread_mutex_lock(&(wal)->lock)
+#define RUMATI_AVL_WAL_UNLOCK(wal)  pthread_mutex_unlock(&(wal)->lock)
+#else
+#define RUMATI_AVL_WAL_LOCK(wal)    ((void)(wal))
+#define RUMATI_AVL_WAL_UNLOCK(wal)  ((void)(wal))
+#endif
+
+/*
+ * Log type
+ */
+struct rumati_avl_wal {
+    /*
+     * The log file
+     */
+    int fd;
+    /*
+     * Function writing value bytes, and its user pointer
+     */
+    RUMATI_AVL_VALUE_SERIALIZER serializer;
+    void *udata;
+    /*
+     * Longest time records wait to be written, or 0 to write each one
+     * straight away
+     */
+    unsigned int sync_interval_ms;
+    /*
+     * Records not yet written
+     */
+    unsigned char *buffer;
+    size_t used;
+    size_t size;
+    /*
+     * Buffer for value bytes
+     */
+    unsigned char *value;
+    size_t value_size;
+    /*
+     * RUMATI_AVL_EIO once a write or sync has failed
+     */
+    RUMATI_AVL_ERROR err;
+    /*
+     * Time of the last write, on the monotonic clock, in nanoseconds
+     */
+    unsigned long long written_ns;
+#ifdef RUMATI_AVL_THREADS
+    /*
+     * lock protects the records and err, io_lock keeps writes in order. A
+     * write swaps the records with spare, so that new records can be
+     * logged while the old ones are being written.
+     */
+    pthread_mutex_t lock;
+    pthread_mutex_t io_lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    bool threaded;
+    bool stop;
+    unsigned char *spare;
+    size_t spare_size;
+#endif
+};
+
+/*
+ * A record of a batch being replayed
+ */
+struct rumati_avl_wal_entry {
+    int op;
+    void *value;
+};
+
+/*
+ * The log file being replayed, read through a buffer
+ */
+struct rumati_avl_wal_reader {
+    int fd;
+    unsigned char *buffer;
+    size_t size;
+    /* the buffered bytes, from start to end */
+    size_t start;
+    size_t end;
+    /* file offset of the first buffered byte */
+    off_t offset;
+    /* size of the file when replay started, or -1 if not a regular file */
+    off_t file_size;
+};
+
+/*
+ * rumati_avl_wal_now() - returns the monotonic clock, in nanoseconds.
+ */
+static unsigned long long rumati_avl_wal_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * rumati_avl_wal_crc32() - updates a CRC-32 (as used by zlib) with bytes,
+ * four bits at a time from a small table.
+ */
+static uint32_t rumati_avl_wal_crc32(
+        uint32_t crc,
+        const unsigned char *bytes,
+        size_t length)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    size_t i;
+
+    crc = ~crc;
+    for (i = 0; i < length; i++){
+        crc = (crc >> 4) ^ table[(crc ^ bytes[i]) & 0x0f];
+        crc = (crc >> 4) ^ table[(crc ^ (bytes[i] >> 4)) & 0x0f];
+    }
+    return ~crc;
+}
+
+/*
+ * rumati_avl_wal_write_all() - writes bytes to a file, retrying short and
+ * interrupted writes.
+ */
+static RUMATI_AVL_ERROR rumati_avl_wal_write_all(
+        int fd,
+        const unsigned char *bytes,
+        size_t length)
+{
+    while (length > 0){
+        ssize_t w = write(fd, bytes, length);
+
+        if (w < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return RUMATI_AVL_EIO;
+        }
+        bytes += w;
+        length -= (size_t)w;
+    }
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_wal_flush() - writes and syncs the records logged so far, as
+ * one group.
+ */
+static RUMATI_AVL_ERROR rumati_avl_wal_flush(RUMATI_AVL_WAL *wal)
+{
+    RUMATI_AVL_ERROR err;
+    unsigned char *bytes;
+    size_t length;
+
+#ifdef RUMATI_AVL_THREADS
+    pthread_mutex_lock(&wal->io_lock);
+    pthread_mutex_lock(&wal->lock);
+    bytes = wal->buffer;
+    length = wal->used;
+    wal->buffer = wal->spare;
+    wal->spare = bytes;
+    wal->used = wal->spare_size;
+    wal->spare_size = wal->size;
+    wal->size = wal->used;
+    wal->used = 0;
+    err = wal->err;
+    pthread_mutex_unlock(&wal->lock);
+#else
+    bytes = wal->buffer;
+    length = wal->used;
+    wal->used = 0;
+    err = wal->err;
+#endif
+
+    if (err == RUMATI_AVL_OK && length > 0){
+        err = rumati_avl_wal_write_all(wal->fd, bytes, length);
+        if (err == RUMATI_AVL_OK && fdatasync(wal->fd) != 0){
+            err = RUMATI_AVL_EIO;
+        }
+    }
+
+    RUMATI_AVL_WAL_LOCK(wal);
+    wal->written_ns = rumati_avl_wal_now();
+    if (err != RUMATI_AVL_OK){
+        wal->err = err;
+    }
+    RUMATI_AVL_WAL_UNLOCK(wal);
+#ifdef RUMATI_AVL_THREADS
+    pthread_mutex_unlock(&wal->io_lock);
+#endif
+    return err;
+}
+
+#ifdef RUMATI_AVL_THREADS
+/*
+ * rumati_avl_wal_thread() - writes a group of records every sync interval,
+ * or as soon as a group fills the buffer.
+ */
+static void *rumati_avl_wal_thread(void *arg)
+{
+    RUMATI_AVL_WAL *wal = arg;
+    struct timespec deadline;
+    unsigned long long ns;
+
+    pthread_mutex_lock(&wal->lock);
+    while (!wal->stop){
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        ns = (unsigned long long)deadline.tv_nsec +
+                wal->sync_interval_ms * 1000000ULL;
+        deadline.tv_sec += (time_t)(ns / 1000000000);
+        deadline.tv_nsec = (long)(ns % 1000000000);
+        while (!wal->stop && wal->used < RUMATI_AVL_WAL_BUFFER_SIZE &&
+                pthread_cond_timedwait(&wal->wake, &wal->lock,
+                    &deadline) == 0);
+        pthread_mutex_unlock(&wal->lock);
+        rumati_avl_wal_flush(wal);
+        pthread_mutex_lock(&wal->lock);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+/*
+ * rumati_avl_wal_start() - starts the background thread of a log.
+ *
+ * Returns:
+ *      true on success, or false if the thread could not be started.
+ */
+static bool rumati_avl_wal_start(RUMATI_AVL_WAL *wal)
+{
+    pthread_condattr_t attr;
+
+    wal->spare_size = RUMATI_AVL_WAL_BUFFER_SIZE;
+    wal->spare = malloc(wal->spare_size);
+    if (wal->spare == NULL){
+        return false;
+    }
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_mutex_init(&wal->io_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wal->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    wal->stop = false;
+    wal->threaded = wal->sync_interval_ms > 0 &&
+            pthread_create(&wal->thread, NULL, rumati_avl_wal_thread,
+                wal) == 0;
+    if (wal->sync_interval_ms > 0 && !wal->threaded){
+        pthread_cond_destroy(&wal->wake);
+        pthread_mutex_destroy(&wal->io_lock);
+        pthread_mutex_destroy(&wal->lock);
+        free(wal->spare);
+        return false;
+    }
+    return true;
+}
+#endif
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_new(
+        RUMATI_AVL_WAL **wal,
+        int fd,
+        RUMATI_AVL_VALUE_SERIALIZER serializer,
+        void *udata,
+        unsigned int sync_interval_ms)
+{
+    RUMATI_AVL_WAL *retv;
+    char magic[RUMATI_AVL_WAL_MAGIC_LEN];
+    off_t end;
+
+    if (wal == NULL || serializer == NULL){
+        return RUMATI_AVL_EINVAL;
+    }
+
+    end = lseek(fd, 0, SEEK_END);
+    if (end < 0){
+        return RUMATI_AVL_EIO;
+    }
+    if (end == 0){
+        if (rumati_avl_wal_write_all(fd,
+                    (const unsigned char *)RUMATI_AVL_WAL_MAGIC,
+                    RUMATI_AVL_WAL_MAGIC_LEN) != RUMATI_AVL_OK ||
+                fdatasync(fd) != 0){
+            return RUMATI_AVL_EIO;
+        }
+    }else if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+            memcmp(magic, RUMATI_AVL_WAL_MAGIC, sizeof(magic)) != 0){
+        return RUMATI_AVL_EINVAL;
+    }
+
+    retv = malloc(sizeof(*retv));
+    if (retv == NULL){
+        return RUMATI_AVL_ENOMEM;
+    }
+    retv->fd = fd;
+    retv->serializer = serializer;
+    retv->udata = udata;
+    retv->sync_interval_ms = sync_interval_ms;
+    retv->used = 0;
+    retv->size = RUMATI_AVL_WAL_BUFFER_SIZE;
+    retv->buffer = malloc(retv->size);
+    retv->value_size = 256;
+    retv->value = malloc(retv->value_size);
+    retv->err = RUMATI_AVL_OK;
+    retv->written_ns = rumati_avl_wal_now();
+    if (retv->buffer == NULL || retv->value == NULL){
+        free(retv->buffer);
+        free(retv->value);
+        free(retv);
+        return RUMATI_AVL_ENOMEM;
+    }
+#ifdef RUMATI_AVL_THREADS
+    if (!rumati_avl_wal_start(retv)){
+        free(retv->buffer);
+        free(retv->value);
+        free(retv);
+        return RUMATI_AVL_ENOMEM;
+    }
+#endif
+
+    *wal = retv;
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_wal_append() - adds a record to the records not yet written.
+ * The caller holds the lock.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If the value is longer than
+ *                          RUMATI_AVL_WAL_MAX_VALUE bytes.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ */
+static RUMATI_AVL_ERROR rumati_avl_wal_append(
+        RUMATI_AVL_WAL *wal,
+        int op,
+        void *object)
+{
+    unsigned char *record;
+    size_t length, v, i;
+    uint32_t crc;
+
+    length = wal->serializer(wal->udata, object, wal->value,
+            wal->value_size);
+    if (length > RUMATI_AVL_WAL_MAX_VALUE){
+        return RUMATI_AVL_EINVAL;
+    }
+    if (length > wal->value_size){
+        unsigned char *value = realloc(wal->value, length);
+
+        if (value == NULL){
+            return RUMATI_AVL_ENOMEM;
+        }
+        wal->value = value;
+        wal->value_size = length;
+        length = wal->serializer(wal->udata, object, wal->value, length);
+    }
+    if (wal->size - wal->used < length + RUMATI_AVL_WAL_RECORD_OVERHEAD){
+        size_t size = wal->used + length + RUMATI_AVL_WAL_RECORD_OVERHEAD;
+        unsigned char *buffer;
+
+        size = size > wal->size * 2 ? size : wal->size * 2;
+        buffer = realloc(wal->buffer, size);
+        if (buffer == NULL){
+            return RUMATI_AVL_ENOMEM;
+        }
+        wal->buffer = buffer;
+        wal->size = size;
+    }
+
+    record = wal->buffer + wal->used;
+    i = 0;
+    record[i++] = (unsigned char)op;
+    for (v = length; v >= 0x80; v >>= 7){
+        record[i++] = (unsigned char)((v & 0x7f) | 0x80);
+    }
+    record[i++] = (unsigned char)v;
+    memcpy(record + i, wal->value, length);
+    i += length;
+    crc = rumati_avl_wal_crc32(0, record, i);
+    record[i++] = (unsigned char)crc;
+    record[i++] = (unsigned char)(crc >> 8);
+    record[i++] = (unsigned char)(crc >> 16);
+    record[i++] = (unsigned char)(crc >> 24);
+    wal->used += i;
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_wal_update() - logs a put or delete, and makes it. The record
+ * is taken back out if the update fails, before any write can see it.
+ */
+static RUMATI_AVL_ERROR rumati_avl_wal_update(
+        RUMATI_AVL_WAL *wal,
+        RUMATI_AVL_TREE *tree,
+        int op,
+        void *object,
+        void **old_value)
+{
+    RUMATI_AVL_ERROR err;
+    bool flush = false;
+    size_t mark;
+
+    RUMATI_AVL_WAL_LOCK(wal);
+    err = wal->err;
+    mark = wal->used;
+    if (err == RUMATI_AVL_OK){
+        err = rumati_avl_wal_append(wal, op, object);
+    }
+    if (err == RUMATI_AVL_OK){
+        if (op == RUMATI_AVL_WAL_PUT){
+            err = rumati_avl_put(tree, object, old_value);
+        }else{
+            err = rumati_avl_delete(tree, object, old_value);
+        }
+        if (err != RUMATI_AVL_OK){
+            wal->used = mark;
+        }
+    }
+    if (err == RUMATI_AVL_OK){
+#ifdef RUMATI_AVL_THREADS
+        if (wal->threaded){
+            if (wal->used >= RUMATI_AVL_WAL_BUFFER_SIZE){
+                pthread_cond_signal(&wal->wake);
+            }
+        }else
+#endif
+        {
+            flush = wal->sync_interval_ms == 0 ||
+                    wal->used >= RUMATI_AVL_WAL_BUFFER_SIZE ||
+                    rumati_avl_wal_now() - wal->written_ns >=
+                        wal->sync_interval_ms * 1000000ULL;
+        }
+    }
+    RUMATI_AVL_WAL_UNLOCK(wal);
+
+    if (flush){
+        err = rumati_avl_wal_flush(wal);
+    }
+    return err;
+}
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_put(
+        RUMATI_AVL_WAL *wal,
+        RUMATI_AVL_TREE *tree,
+        void *object,
+        void **old_value)
+{
+    return rumati_avl_wal_update(wal, tree, RUMATI_AVL_WAL_PUT, object,
+            old_value);
+}
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_delete(
+        RUMATI_AVL_WAL *wal,
+        RUMATI_AVL_TREE *tree,
+        void *key,
+        void **old_value)
+{
+    return rumati_avl_wal_update(wal, tree, RUMATI_AVL_WAL_DELETE, key,
+            old_value);
+}
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_sync(RUMATI_AVL_WAL *wal)
+{
+    return rumati_avl_wal_flush(wal);
+}
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_reset(RUMATI_AVL_WAL *wal)
+{
+    RUMATI_AVL_ERROR err = RUMATI_AVL_OK;
+
+#ifdef RUMATI_AVL_THREADS
+    pthread_mutex_lock(&wal->io_lock);
+#endif
+    RUMATI_AVL_WAL_LOCK(wal);
+    wal->used = 0;
+    RUMATI_AVL_WAL_UNLOCK(wal);
+
+    /* without O_APPEND, the offset must be moved back to the new end */
+    if (ftruncate(wal->fd, RUMATI_AVL_WAL_MAGIC_LEN) != 0 ||
+            lseek(wal->fd, 0, SEEK_END) < 0 ||
+            fdatasync(wal->fd) != 0){
+        err = RUMATI_AVL_EIO;
+    }
+#ifdef RUMATI_AVL_THREADS
+    pthread_mutex_unlock(&wal->io_lock);
+#endif
+    return err;
+}
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_close(RUMATI_AVL_WAL *wal)
+{
+    RUMATI_AVL_ERROR err;
+
+#ifdef RUMATI_AVL_THREADS
+    if (wal->threaded){
+        pthread_mutex_lock(&wal->lock);
+        wal->stop = true;
+        pthread_cond_signal(&wal->wake);
+        pthread_mutex_unlock(&wal->lock);
+        pthread_join(wal->thread, NULL);
+    }
+#endif
+    err = rumati_avl_wal_flush(wal);
+#ifdef RUMATI_AVL_THREADS
+    pthread_cond_destroy(&wal->wake);
+    pthread_mutex_destroy(&wal->io_lock);
+    pthread_mutex_destroy(&wal->lock);
+    free(wal->spare);
+#endif
+    free(wal->buffer);
+    free(wal->value);
+    free(wal);
+    return err;
+}
+
+/*
+ * rumati_avl_wal_fill() - reads from a log until at least length bytes are
+ * buffered, growing the buffer if they do not fit.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_ENOENT   If the file ended first.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If there was an error reading.
+ */
+static RUMATI_AVL_ERROR rumati_avl_wal_fill(
+        struct rumati_avl_wal_reader *r,
+        size_t length)
+{
+    if (r->end - r->start >= length){
+        return RUMATI_AVL_OK;
+    }
+
+    memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+    r->offset += (off_t)r->start;
+    r->end -= r->start;
+    r->start = 0;
+    if (length > r->size){
+        unsigned char *buffer = realloc(r->buffer, length);
+
+        if (buffer == NULL){
+            return RUMATI_AVL_ENOMEM;
+        }
+        r->buffer = buffer;
+        r->size = length;
+    }
+
+    while (r->end < length){
+        ssize_t n = read(r->fd, r->buffer + r->end, r->size - r->end);
+
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return RUMATI_AVL_EIO;
+        }
+        if (n == 0){
+            return RUMATI_AVL_ENOENT;
+        }
+        r->end += (size_t)n;
+    }
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_wal_read() - reads the next record of a log, which is left
+ * buffered at the reader's start, and moves start past it.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success, with op, bytes and length set.
+ *      RUMATI_AVL_ENOENT   At the end of the log, or at a torn or corrupt
+ *                          record.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If there was an error reading.
+ */
+static RUMATI_AVL_ERROR rumati_avl_wal_read(
+        struct rumati_avl_wal_reader *r,
+        int *op,
+        const unsigned char **bytes,
+        size_t *length)
+{
+    RUMATI_AVL_ERROR err;
+    const unsigned char *record;
+    unsigned int shift = 0;
+    size_t header = 1;
+    uint32_t crc;
+
+    /* the type, and the length, a byte at a time */
+    *length = 0;
+    do {
+        err = rumati_avl_wal_fill(r, header + 1);
+        if (err != RUMATI_AVL_OK){
+            return err;
+        }
+        if (header > 1){
+            if (shift >= sizeof(size_t) * 8 - 7){
+                return RUMATI_AVL_ENOENT;
+            }
+            *length |= (size_t)(r->buffer[r->start + header - 1] & 0x7f)
+                    << shift;
+            shift += 7;
+        }
+        header++;
+    } while (header == 2 || (r->buffer[r->start + header - 2] & 0x80));
+    header--;
+
+    /*
+     * The length is not covered by the CRC until the whole record is read,
+     * so one that is too long for the log is taken as corruption before
+     * buffering that many bytes
+     */
+    if (*length > RUMATI_AVL_WAL_MAX_VALUE || (r->file_size >= 0 &&
+            (off_t)(header + *length + 4) >
+                r->file_size - r->offset - (off_t)r->start)){
+        return RUMATI_AVL_ENOENT;
+    }
+    err = rumati_avl_wal_fill(r, header + *length + 4);
+    if (err != RUMATI_AVL_OK){
+        return err;
+    }
+
+    record = r->buffer + r->start;
+    crc = (uint32_t)record[header + *length] |
+            (uint32_t)record[header + *length + 1] << 8 |
+            (uint32_t)record[header + *length + 2] << 16 |
+            (uint32_t)record[header + *length + 3] << 24;
+    if ((record[0] != RUMATI_AVL_WAL_PUT &&
+                record[0] != RUMATI_AVL_WAL_DELETE) ||
+            rumati_avl_wal_crc32(0, record, header + *length) != crc){
+        return RUMATI_AVL_ENOENT;
+    }
+
+    *op = record[0];
+    *bytes = record + header;
+    r->start += header + *length + 4;
+    return RUMATI_AVL_OK;
+}
+
+/*
+ * rumati_avl_wal_sort() - sorts the records of a batch by key, keeping
+ * records for the same key in the order they were logged. A bottom up
+ * merge sort, through tmp.
+ */
+static void rumati_avl_wal_sort(
+        struct rumati_avl_wal_entry *batch,
+        struct rumati_avl_wal_entry *tmp,
+        size_t count,
+        RUMATI_AVL_COMPARATOR comparator,
+        void *udata)
+{
+    struct rumati_avl_wal_entry *from = batch, *to = tmp, *swap;
+    size_t width, lo, mid, hi, i, j, k;
+
+    for (width = 1; width < count; width *= 2){
+        for (lo = 0; lo < count; lo += 2 * width){
+            mid = lo + width < count ? lo + width : count;
+            hi = mid + width < count ? mid + width : count;
+            for (i = lo, j = mid, k = lo; k < hi; k++){
+                if (i < mid && (j >= hi || comparator(udata,
+                        from[i].value, from[j].value) <= 0)){
+                    to[k] = from[i++];
+                }else{
+                    to[k] = from[j++];
+                }
+            }
+        }
+        swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != batch){
+        memcpy(batch, from, count * sizeof(*batch));
+    }
+}
+
+/*
+ * rumati_avl_wal_apply() - sorts a batch of records, and applies the last
+ * record for each key to the tree. Every value and key of the batch is
+ * either taken by the tree or passed to the destructor.
+ */
+static RUMATI_AVL_ERROR rumati_avl_wal_apply(
+        RUMATI_AVL_TREE *tree,
+        struct rumati_avl_wal_entry *batch,
+        struct rumati_avl_wal_entry *tmp,
+        size_t count,
+        RUMATI_AVL_COMPARATOR comparator,
+        RUMATI_AVL_NODE_DESTRUCTOR destructor,
+        void *udata)
+{
+    RUMATI_AVL_ERROR err = RUMATI_AVL_OK;
+    void *old;
+    size_t i;
+
+    rumati_avl_wal_sort(batch, tmp, count, comparator, udata);
+
+    for (i = 0; i < count; i++){
+        if (err != RUMATI_AVL_OK || (i + 1 < count &&
+                comparator(udata, batch[i].value, batch[i + 1].value) == 0)){
+            destructor(udata, batch[i].value);
+            continue;
+        }
+
+        old = NULL;
+        if (batch[i].op == RUMATI_AVL_WAL_PUT){
+            err = rumati_avl_put(tree, batch[i].value, &old);
+            if (err != RUMATI_AVL_OK){
+                destructor(udata, batch[i].value);
+            }
+        }else{
+            if (rumati_avl_delete(tree, batch[i].value, &old) ==
+                    RUMATI_AVL_ENOMEM){
+                err = RUMATI_AVL_ENOMEM;
+            }
+            destructor(udata, batch[i].value);
+        }
+        if (old != NULL){
+            destructor(udata, old);
+        }
+    }
+    return err;
+}
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_replay(
+        RUMATI_AVL_TREE *tree,
+        int fd,
+        RUMATI_AVL_COMPARATOR comparator,
+        RUMATI_AVL_VALUE_DESERIALIZER deserializer,
+        RUMATI_AVL_NODE_DESTRUCTOR destructor,
+        void *udata,
+        size_t *records)
+{
+    struct rumati_avl_wal_reader r;
+    struct rumati_avl_wal_entry *batch, *tmp;
+    struct stat st;
+    RUMATI_AVL_ERROR err;
+    const unsigned char *bytes;
+    size_t count = 0, total = 0, length, i;
+    off_t good;
+    int op;
+
+    if (tree == NULL || comparator == NULL || deserializer == NULL ||
+            destructor == NULL){
+        return RUMATI_AVL_EINVAL;
+    }
+    if (records != NULL){
+        *records = 0;
+    }
+
+    r.fd = fd;
+    r.size = RUMATI_AVL_WAL_BUFFER_SIZE;
+    r.start = r.end = 0;
+    r.offset = 0;
+    r.file_size = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ?
+            st.st_size : -1;
+    r.buffer = malloc(r.size);
+    batch = malloc(RUMATI_AVL_WAL_REPLAY_BATCH * sizeof(*batch));
+    tmp = malloc(RUMATI_AVL_WAL_REPLAY_BATCH * sizeof(*tmp));
+    if (r.buffer == NULL || batch == NULL || tmp == NULL){
+        err = RUMATI_AVL_ENOMEM;
+        goto out;
+    }
+
+    if (lseek(fd, 0, SEEK_SET) < 0){
+        err = RUMATI_AVL_EIO;
+        goto out;
+    }
+    err = rumati_avl_wal_fill(&r, RUMATI_AVL_WAL_MAGIC_LEN);
+    if (err == RUMATI_AVL_ENOENT && memcmp(r.buffer, RUMATI_AVL_WAL_MAGIC,
+                r.end) == 0){
+        /* empty, or torn while the header was being written */
+        good = 0;
+        err = RUMATI_AVL_OK;
+        goto truncate;
+    }
+    if (err == RUMATI_AVL_OK && memcmp(r.buffer, RUMATI_AVL_WAL_MAGIC,
+                RUMATI_AVL_WAL_MAGIC_LEN) != 0){
+        err = RUMATI_AVL_EINVAL;
+    }
+    if (err != RUMATI_AVL_OK){
+        err = err == RUMATI_AVL_ENOENT ? RUMATI_AVL_EINVAL : err;
+        goto out;
+    }
+    r.start = RUMATI_AVL_WAL_MAGIC_LEN;
+
+    for (;;){
+        err = rumati_avl_wal_read(&r, &op, &bytes, &length);
+        if (err == RUMATI_AVL_OK){
+            err = deserializer(udata, bytes, length, &batch[count].value);
+            if (err != RUMATI_AVL_OK){
+                break;
+            }
+            batch[count++].op = op;
+            total++;
+        }else if (err != RUMATI_AVL_ENOENT){
+            break;
+        }
+        if (count == RUMATI_AVL_WAL_REPLAY_BATCH ||
+                (err == RUMATI_AVL_ENOENT && count > 0)){
+            RUMATI_AVL_ERROR e = rumati_avl_wal_apply(tree, batch, tmp,
+                    count, comparator, destructor, udata);
+
+            count = 0;
+            if (e != RUMATI_AVL_OK){
+                err = e;
+                break;
+            }
+        }
+        if (err == RUMATI_AVL_ENOENT){
+            err = RUMATI_AVL_OK;
+            break;
+        }
+    }
+    for (i = 0; i < count; i++){
+        destructor(udata, batch[i].value);
+    }
+    if (err != RUMATI_AVL_OK){
+        goto out;
+    }
+    if (records != NULL){
+        *records = total;
+    }
+    good = r.offset + (off_t)r.start;
+
+truncate:
+    /* cut off a torn record, so appends follow the last good one */
+    if (lseek(fd, 0, SEEK_END) != good &&
+            (ftruncate(fd, good) != 0 || fdatasync(fd) != 0)){
+        err = RUMATI_AVL_EIO;
+    }else if (lseek(fd, good, SEEK_SET) < 0){
+        err = RUMATI_AVL_EIO;
+    }
+
+out:
+    free(tmp);
+    free(batch);
+    free(r.buffer);
+    return err;
+}
@@ -0,0 +1,213 @@
+/*
+ * Rumati AVL
+ * Copyright (c) 2010 Jesse Long <jpl@unknown.za.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef RUMATI_AVL_WAL_H
+#define RUMATI_AVL_WAL_H 1
+
+/*
+ * Write-ahead logs. A log makes the updates of a tree durable between
+ * snapshots written by rumati_avl_save(): updates are made through the
+ * rumati_avl_wal_*() wrappers, which append a record of each successful
+ * put or delete to the log, and after a crash the tree is rebuilt by
+ * loading the last snapshot with rumati_avl_load(), then replaying the log
+ * with rumati_avl_wal_replay().
+ *
+ * Records are written and synced in groups (group commit). With a sync
+ * interval of 0, each wrapper writes and syncs its record before it
+ * returns. Otherwise records are gathered in memory and written with one
+ * write() and fdatasync() per interval, so an update is durable at most
+ * the interval after it is made, or as soon as rumati_avl_wal_sync()
+ * returns. With RUMATI_AVL_THREADS, which the Makefile builds the library
+ * with, a background thread writes each group, so the interval holds
+ * however long the tree is idle and the wrappers never wait for the disk.
+ * Without it, a group is written by the first wrapper called after the
+ * interval has passed.
+ *
+ * To checkpoint, save the tree to a new snapshot file with rumati_avl_save()
+ * and fsync() it, rename() it over the last snapshot, then empty the log
+ * with rumati_avl_wal_reset(), with no updates in between. Replay is
+ * idempotent, so a crash anywhere in between recovers the same tree: from
+ * the old snapshot and the whole log, or the new snapshot and records it
+ * already holds.
+ *
+ * The log format is the 8 byte magic "RAVLWAL1", followed by one record
+ * per update: a byte holding 1 for a put or 2 for a delete, the length of
+ * the value or key as an unsigned LEB128 varint, its bytes, then the
+ * CRC-32 of all of these, little endian. A record cut short by a crash, or
+ * which fails its CRC, ends the log.
+ */
+
+#include "avl.h"
+
+/*
+ * A write-ahead log being appended to.
+ */
+typedef struct rumati_avl_wal RUMATI_AVL_WAL;
+
+/*
+ * rumati_avl_wal_new() - starts appending to a log. A new, empty file is
+ * given the header, an existing log is appended to. Logs with records must
+ * be replayed with rumati_avl_wal_replay() first, which also cuts off any
+ * torn record at the end.
+ *
+ * Parameters:
+ *      wal -           populated with the new log
+ *      fd -            the log file, which stays owned by the caller
+ *      serializer -    the function writing the bytes of values, and of the
+ *                      keys of deletes
+ *      udata -         a user defined pointer passed to serializer
+ *      sync_interval_ms -  the longest time records wait to be written and
+ *                      synced, or 0 to sync each one before returning
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EINVAL   If wal or serializer is NULL, or fd holds
+ *                          something other than a log.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory, or
+ *                          starting the background thread.
+ *      RUMATI_AVL_EIO      If the header could not be written.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_new(
+        RUMATI_AVL_WAL **wal,
+        int fd,
+        RUMATI_AVL_VALUE_SERIALIZER serializer,
+        void *udata,
+        unsigned int sync_interval_ms);
+
+/*
+ * rumati_avl_wal_put() and rumati_avl_wal_delete() - call rumati_avl_put()
+ * or rumati_avl_delete(), and log the update if it succeeds. Deletes of
+ * missing keys are not logged.
+ *
+ * Returns:
+ *      Any error of the wrapped function, in which case nothing is logged.
+ *      RUMATI_AVL_EINVAL   If the serialized value or key is longer than
+ *                          1 GiB. The tree is unchanged.
+ *      RUMATI_AVL_ENOMEM   If the record could not be buffered. The tree
+ *                          is unchanged.
+ *      RUMATI_AVL_EIO      If an earlier group could not be written, or
+ *                          this record could not be written and synced.
+ *                          Once a write has failed, every later call
+ *                          returns this without changing the tree.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_put(
+        RUMATI_AVL_WAL *wal,
+        RUMATI_AVL_TREE *tree,
+        void *object,
+        void **old_value);
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_delete(
+        RUMATI_AVL_WAL *wal,
+        RUMATI_AVL_TREE *tree,
+        void *key,
+        void **old_value);
+
+/*
+ * rumati_avl_wal_sync() - writes and syncs every record logged so far.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EIO      If a write or sync has failed.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_sync(RUMATI_AVL_WAL *wal);
+
+/*
+ * rumati_avl_wal_reset() - empties the log, once a snapshot holding every
+ * update logged so far is durable. Records not yet written are dropped.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EIO      If the log could not be truncated and synced.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_reset(RUMATI_AVL_WAL *wal);
+
+/*
+ * rumati_avl_wal_close() - syncs and frees a log. The file is not closed.
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success.
+ *      RUMATI_AVL_EIO      If a write or sync has failed.
+ */
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_close(RUMATI_AVL_WAL *wal);
+
+/*
+ * rumati_avl_wal_replay() - applies the records of a log to a tree, in
+ * batches of up to RUMATI_AVL_WAL_REPLAY_BATCH records.
+ *
+ * Each batch is sorted by key, keeping only the last record for each key,
+ * which is all that decides its final value. The survivors are applied in
+ * key order, so that each update walks much the same path down the tree
+ * as the one before it, and finds it in cache. (Relaxed mode would chain
+ * sorted inserts landing between the same two keys, and rebalancing walks
+ * the whole tree, so batches are applied with ordinary updates.)
+ *
+ * Replayed puts replace existing values, and replayed deletes of missing
+ * keys do nothing, so replaying records the tree already holds changes
+ * nothing. Values replaced or deleted by the replay, and values and keys
+ * of records superseded within a batch, are passed to destructor. Lazy
+ * delete should be switched on after replay, since tombstones keep their
+ * values.
+ *
+ * A torn or corrupt record ends the log: the file is truncated before it,
+ * so that appends follow the last good record. That includes a record
+ * whose length runs past the end of the file, which is found before
+ * anything is allocated for it. The file offset is left at
+ * the end of the log.
+ *
+ * Parameters:
+ *      tree -          the tree, usually just loaded from a snapshot
+ *      fd -            the log file
+ *      comparator -    the tree's comparator, to sort batches
+ *      deserializer -  the function making values and keys from bytes
+ *      destructor -    the destructor for values and keys left over
+ *      udata -         a user defined pointer passed to all three functions
+ *      records -       populated with the number of records replayed, or
+ *                      NULL
+ *
+ * Returns:
+ *      RUMATI_AVL_OK       On success, including for an empty file.
+ *      RUMATI_AVL_EINVAL   If a pointer is NULL, or fd holds something
+ *                          other than a log.
+ *      RUMATI_AVL_ENOMEM   If there was an error allocating memory.
+ *      RUMATI_AVL_EIO      If there was an error reading or truncating fd.
+ *      Any error returned by the deserializer or the tree. Batches before
+ *      the one failing have been applied.
+ */
+#define RUMATI_AVL_WAL_REPLAY_BATCH     65536
+
+RUMATI_AVL_API
+RUMATI_AVL_ERROR rumati_avl_wal_replay(
+        RUMATI_AVL_TREE *tree,
+        int fd,
+        RUMATI_AVL_COMPARATOR comparator,
+        RUMATI_AVL_VALUE_DESERIALIZER deserializer,
+        RUMATI_AVL_NODE_DESTRUCTOR destructor,
+        void *udata,
+        size_t *records);
+
+#endif /* RUMATI_AVL_WAL_H */
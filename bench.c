@@ -0,0 +1,1007 @@
+/*
+ * Rumati AVL benchmark
+ *
+ * Runs a set of workloads against trees of each of the given sizes, and
+ * prints the results as a JSON object: the time per operation, operations
+ * per second, and the peak resident set size of the process so far.
+ *
+ * Workloads, for a tree of n entries:
+ *      insert_sequential   n puts of keys in ascending order
+ *      insert_random       n puts of the same keys, shuffled
+ *      insert_zipfian      n puts of keys drawn from a zipfian distribution,
+ *                          so most are replacements of a few hot keys
+ *      get_hit             gets of random keys in the tree
+ *      get_miss            gets of random keys not in the tree
+ *      get_zipfian         gets of keys drawn from a zipfian distribution
+ *      range               get_greater_than_or_equal of a random key, then
+ *                          RANGE_LENGTH steps with get_greater_than
+ *      delete_churn        deletes of random keys, each put back straight
+ *                          away, so the tree keeps its size
+ *      mixed               a random mix of gets, puts, deletes and range
+ *                          queries, each timed on its own, reporting the
+ *                          latency percentiles of each kind of operation
+ *      save                rumati_avl_save() of the tree to a temporary file,
+ *                          per entry
+ *      load                rumati_avl_load() of that file into a new tree,
+ *                          per entry, to compare with insert_sequential
+ *      save_background     the time rumati_avl_save_background() stops the
+ *                          caller for, per entry, to compare with save
+ *      save_delta          rumati_avl_save_delta() after replacing 1% of the
+ *                          entries, per entry, to compare with save
+ *      teardown            rumati_avl_destroy() of the tree, per entry
+ *      memory              n puts into a new tree, reporting
+ *                          rumati_avl_memory_usage() of the full tree, and
+ *                          the resident set size of the process as the tree
+ *                          grows. Runs first, but memory freed by the runs
+ *                          for smaller sizes may still be reused.
+ *
+ * With -t, the mixed workload runs in several threads at once, each with a
+ * tree of its own (trees are not thread safe), so that they compete for the
+ * caches, memory bandwidth and the allocator. Latencies from all threads are
+ * reported together.
+ *
+ * On Linux, each workload is also measured with hardware performance
+ * counters (cycles, instructions, L1 data cache, last level cache and data
+ * TLB misses, and branch mispredicts), reported per operation. Counters the
+ * kernel does not permit (see /proc/sys/kernel/perf_event_paranoid), or the
+ * CPU does not have, are left out of the report.
+ *
+ * Trees much larger than the last level cache show the cost of cache misses
+ * on the way down the tree. "make bench" runs builds with and without
+ * RUMATI_AVL_PREFETCH. Its largest tree, of 1000000 entries, takes about
+ * 40MB, so "make bench-large" runs both builds with 16000000 entries, a
+ * tree of some 700MB, well past the last level cache of most machines. The
+ * process peaks at about 3GB, while load builds a second tree. Pass a
+ * larger size to avlbench for a larger cache, with memory to spare.
+ *
+ * Usage: avlbench [-b avl|wavl|rb] [-c] [-i] [-f] [-t threads] [size ...]
+ *      -b  balancing scheme, avl by default
+ *      -c  use the lookup cache
+ *      -i  use the hash index
+ *      -f  use the negative lookup filter
+ *      -t  number of threads running the mixed workload, 1 by default
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE     /* for syscall() */
+
+#include "avl.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define MIN_LOOKUPS     (1UL << 20)
+#define MAX_LOOKUPS     (1UL << 22)
+#define RANGE_LENGTH    10
+#define ZIPF_THETA      0.99
+
+/*
+ * Latency histograms have 2^HIST_SUB_BITS linear buckets for every power of
+ * two, so a recorded latency is within about 3% of the real one, as in
+ * HdrHistogram. Values below 2^(HIST_SUB_BITS + 1) ns are exact.
+ */
+#define HIST_SUB_BITS   5
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS) * HIST_SUB + HIST_SUB)
+
+/* percentages of gets, puts and deletes in the mixed workload, rest range */
+#define MIX_GET         60
+#define MIX_PUT         15
+#define MIX_DELETE      15
+
+static const unsigned long default_sizes[] = { 1000, 100000, 1000000 };
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+/*
+ * xorshift64, so runs are repeatable and cheap compared to a lookup
+ */
+static unsigned long rng_r(unsigned long long *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (unsigned long)*state;
+}
+
+static unsigned long rng(void)
+{
+    return rng_r(&rng_state);
+}
+
+/*
+ * Zipfian distribution over 0 .. n - 1, where 0 is the most popular item.
+ * Uses the method of Gray et al, "Quickly Generating Billion-Record
+ * Synthetic Databases", as YCSB does.
+ */
+struct zipf {
+    unsigned long n;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+static double zeta(unsigned long n, double theta)
+{
+    double sum = 0;
+    unsigned long i;
+
+    for (i = 1; i <= n; i++){
+        sum += 1.0 / pow((double)i, theta);
+    }
+    return sum;
+}
+
+static void zipf_init(struct zipf *z, unsigned long n)
+{
+    double zeta2 = zeta(2, ZIPF_THETA);
+
+    z->n = n;
+    z->alpha = 1.0 / (1.0 - ZIPF_THETA);
+    z->zetan = zeta(n, ZIPF_THETA);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - ZIPF_THETA)) / (1.0 - zeta2 / z->zetan);
+}
+
+static unsigned long zipf_next(struct zipf *z)
+{
+    double u = (double)(rng() >> 11) / (double)(1ULL << 53);
+    double uz = u * z->zetan;
+    unsigned long v;
+
+    if (uz < 1.0){
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, ZIPF_THETA)){
+        return 1;
+    }
+    v = (unsigned long)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return v < z->n ? v : z->n - 1;
+}
+
+static int ulong_comparator(void *udata, void *value1, void *value2)
+{
+    unsigned long l1 = *(unsigned long*)value1;
+    unsigned long l2 = *(unsigned long*)value2;
+
+    (void)udata;
+
+    if (l1 < l2){
+        return -1;
+    }else if (l1 > l2){
+        return 1;
+    }
+
+    return 0;
+}
+
+static size_t ulong_hash(void *udata, void *value)
+{
+    (void)udata;
+
+    return (size_t)*(unsigned long*)value;
+}
+
+static void destructor(void *udata, void *value)
+{
+    (void)udata;
+    (void)value;
+}
+
+static size_t ulong_serializer(
+        void *udata,
+        void *value,
+        void *buffer,
+        size_t size)
+{
+    (void)udata;
+
+    if (size >= sizeof(unsigned long)){
+        memcpy(buffer, value, sizeof(unsigned long));
+    }
+    return sizeof(unsigned long);
+}
+
+/* where ulong_deserializer() puts the next value it reads */
+static unsigned long *load_next;
+
+static RUMATI_AVL_ERROR ulong_deserializer(
+        void *udata,
+        const void *buffer,
+        size_t length,
+        void **value)
+{
+    (void)udata;
+
+    if (length != sizeof(unsigned long)){
+        return RUMATI_AVL_EINVAL;
+    }
+    memcpy(load_next, buffer, length);
+    *value = load_next++;
+    return RUMATI_AVL_OK;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Log bucketed latency histogram, in nanoseconds
+ */
+struct hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+static void hist_record(struct hist *h, uint64_t ns)
+{
+    unsigned int shift = 0;
+    int msb = 63;
+
+    if (ns != 0){
+        while (!(ns >> msb)){
+            msb--;
+        }
+    }
+    if (msb > HIST_SUB_BITS){
+        shift = msb - HIST_SUB_BITS;
+    }
+    h->bucket[shift * HIST_SUB + (ns >> shift)]++;
+    h->count++;
+    if (ns > h->max){
+        h->max = ns;
+    }
+}
+
+static void hist_merge(struct hist *to, struct hist *from)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++){
+        to->bucket[i] += from->bucket[i];
+    }
+    to->count += from->count;
+    if (from->max > to->max){
+        to->max = from->max;
+    }
+}
+
+/*
+ * Returns the highest latency in the bucket holding the given percentile.
+ */
+static uint64_t hist_percentile(struct hist *h, double percentile)
+{
+    uint64_t rank = (uint64_t)(h->count * percentile / 100.0);
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++){
+        seen += h->bucket[i];
+        if (seen > rank){
+            unsigned int shift = 0;
+            uint64_t high;
+
+            if (i >= 2 * HIST_SUB){
+                shift = i / HIST_SUB - 1;
+            }
+            high = ((uint64_t)(i - shift * HIST_SUB + 1) << shift) - 1;
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * Hardware performance counters, counting user space only, in the thread
+ * which opened them. A counter which could not be opened has an fd of -1,
+ * and a counter which could not be read has a value of -1.
+ */
+struct event {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+#ifdef __linux__
+#define CACHE_READ_MISS(cache) \
+        ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct event events[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "l1d_misses", PERF_TYPE_HW_CACHE,
+            CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    { "llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "dtlb_misses", PERF_TYPE_HW_CACHE,
+            CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+};
+
+#define EVENTS      ((int)(sizeof(events) / sizeof(events[0])))
+#else
+static const struct event events[1];
+
+#define EVENTS      0
+#endif
+
+struct counters {
+    int fd[EVENTS + 1];
+    double value[EVENTS + 1];
+};
+
+static void counters_open(struct counters *c)
+{
+    int i;
+
+    for (i = 0; i < EVENTS; i++){
+#ifdef __linux__
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                PERF_FORMAT_TOTAL_TIME_RUNNING;
+        c->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+        c->value[i] = -1;
+    }
+}
+
+static void counters_close(struct counters *c)
+{
+    int i;
+
+    for (i = 0; i < EVENTS; i++){
+#ifdef __linux__
+        if (c->fd[i] >= 0){
+            close(c->fd[i]);
+        }
+#endif
+    }
+    (void)c;
+}
+
+static void counters_start(struct counters *c)
+{
+    int i;
+
+    for (i = 0; i < EVENTS; i++){
+#ifdef __linux__
+        if (c->fd[i] >= 0){
+            ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+    (void)c;
+}
+
+/*
+ * Stops the counters and reads them. Counts are scaled up if the kernel had
+ * to multiplex the counters.
+ */
+static void counters_stop(struct counters *c)
+{
+    int i;
+
+    for (i = 0; i < EVENTS; i++){
+#ifdef __linux__
+        uint64_t v[3];
+
+        c->value[i] = -1;
+        if (c->fd[i] < 0){
+            continue;
+        }
+        ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(c->fd[i], v, sizeof(v)) == sizeof(v) && v[2] != 0){
+            c->value[i] = (double)v[0] * v[1] / v[2];
+        }
+#endif
+    }
+    (void)c;
+}
+
+/*
+ * Adds the counts of another thread, counters read by only one of the
+ * threads are dropped.
+ */
+static void counters_add(struct counters *to, struct counters *from)
+{
+    int i;
+
+    for (i = 0; i < EVENTS; i++){
+        if (to->value[i] < 0 || from->value[i] < 0){
+            to->value[i] = -1;
+        }else{
+            to->value[i] += from->value[i];
+        }
+    }
+}
+
+/*
+ * Prints counts per operation, as a JSON object member.
+ */
+static void report_counters(struct counters *c, unsigned long ops)
+{
+    const char *sep = "";
+    int i;
+
+    printf("\"counters\": {");
+    for (i = 0; i < EVENTS; i++){
+        if (c->value[i] >= 0){
+            printf("%s\"%s_per_op\": %.2f", sep, events[i].name,
+                    c->value[i] / ops);
+            sep = ", ";
+        }
+    }
+    printf("}");
+}
+
+/* counters of the main thread */
+static struct counters main_counters;
+
+/*
+ * Starts timing and counting a workload, see report().
+ */
+static double phase_begin(void)
+{
+    counters_start(&main_counters);
+    return now();
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) != 0){
+        return -1;
+    }
+    return ru.ru_maxrss;
+}
+
+/*
+ * Returns the current resident set size of the process, or -1 if it is not
+ * known.
+ */
+static long rss_kb(void)
+{
+    long pages = -1;
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f == NULL){
+        return -1;
+    }
+    if (fscanf(f, "%*s %ld", &pages) != 1){
+        pages = -1;
+    }
+    fclose(f);
+    if (pages >= 0){
+        return pages * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+#endif
+    return pages;
+}
+
+/*
+ * Benchmark configuration, from the command line
+ */
+static RUMATI_AVL_BALANCE balance = RUMATI_AVL_BALANCE_AVL;
+static const char *balance_name = "avl";
+static int use_cache;
+static int use_index;
+static int use_filter;
+static int threads = 1;
+
+static int results;
+
+static void report(
+        const char *workload,
+        unsigned long size,
+        unsigned long ops,
+        double seconds)
+{
+    counters_stop(&main_counters);
+    printf("%s\n    {\"workload\": \"%s\", \"size\": %lu, \"ops\": %lu, "
+            "\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, "
+            "\"peak_rss_kb\": %ld, ",
+            results++ ? "," : "", workload, size, ops,
+            seconds * 1e9 / ops, ops / seconds, peak_rss_kb());
+    report_counters(&main_counters, ops);
+    printf("}");
+    fflush(stdout);
+}
+
+static void report_hist(const char *operation, struct hist *h, int last)
+{
+    printf("\n        \"%s\": {\"count\": %llu, \"p50_ns\": %llu, "
+            "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}%s",
+            operation, (unsigned long long)h->count,
+            (unsigned long long)hist_percentile(h, 50),
+            (unsigned long long)hist_percentile(h, 99),
+            (unsigned long long)hist_percentile(h, 99.9),
+            (unsigned long long)h->max, last ? "" : ",");
+}
+
+static void die(const char *message)
+{
+    fprintf(stderr, "avlbench: %s\n", message);
+    exit(1);
+}
+
+static RUMATI_AVL_TREE *new_tree(unsigned long size)
+{
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_ERROR err;
+
+    err = rumati_avl_new_balanced(&tree, ulong_comparator, NULL, balance);
+    if (err == RUMATI_AVL_OK && use_cache){
+        err = rumati_avl_set_cache(tree, ulong_hash, 4096);
+    }
+    if (err == RUMATI_AVL_OK && use_index){
+        err = rumati_avl_set_index(tree, ulong_hash);
+    }
+    if (err == RUMATI_AVL_OK && use_filter){
+        /* about 1% false positives */
+        err = rumati_avl_set_filter(tree, ulong_hash, size * 10, 7);
+    }
+    if (err != RUMATI_AVL_OK){
+        die("out of memory");
+    }
+    return tree;
+}
+
+static void put_all(RUMATI_AVL_TREE *tree, unsigned long *keys, unsigned long n)
+{
+    unsigned long i;
+
+    for (i = 0; i < n; i++){
+        if (rumati_avl_put(tree, &keys[i], NULL) != RUMATI_AVL_OK){
+            die("out of memory");
+        }
+    }
+}
+
+#define RSS_SAMPLES     16
+
+static void run_memory(unsigned long *keys, unsigned long size)
+{
+    RUMATI_AVL_TREE *tree;
+    RUMATI_AVL_MEMORY usage;
+    unsigned long entries[RSS_SAMPLES + 1];
+    long rss[RSS_SAMPLES + 1];
+    unsigned long i, next;
+    int samples = 0;
+
+    rss[0] = rss_kb();
+    entries[0] = 0;
+    tree = new_tree(size);
+    for (i = 0; i < size; i = next){
+        next = size / RSS_SAMPLES * (samples + 1);
+        if (next <= i || samples == RSS_SAMPLES - 1){
+            next = size;
+        }
+        put_all(tree, keys + i, next - i);
+        samples++;
+        entries[samples] = next;
+        rss[samples] = rss_kb();
+    }
+    rumati_avl_memory_usage(tree, &usage);
+
+    printf("%s\n    {\"workload\": \"memory\", \"size\": %lu, "
+            "\"bytes_per_entry\": %.1f, \"total_bytes\": %lu, "
+            "\"node_bytes\": %lu, \"cache_bytes\": %lu, "
+            "\"index_bytes\": %lu, \"filter_bytes\": %lu, "
+            "\"overhead_bytes\": %lu, \"slack_bytes\": %lu, ",
+            results++ ? "," : "", size, usage.bytes_per_entry,
+            (unsigned long)usage.total_bytes,
+            (unsigned long)usage.node_bytes,
+            (unsigned long)usage.cache_bytes,
+            (unsigned long)usage.index_bytes,
+            (unsigned long)usage.filter_bytes,
+            (unsigned long)usage.overhead_bytes,
+            (unsigned long)usage.slack_bytes);
+    if (rss[0] >= 0){
+        printf("\"rss_bytes_per_entry\": %.1f, ",
+                (rss[samples] - rss[0]) * 1024.0 / size);
+    }
+    printf("\"rss_kb\": [");
+    for (i = 0; i <= (unsigned long)samples; i++){
+        printf("%s[%lu, %ld]", i ? ", " : "", entries[i], rss[i]);
+    }
+    printf("]}");
+    fflush(stdout);
+
+    rumati_avl_destroy(tree, destructor);
+}
+
+/*
+ * One thread of the mixed workload
+ */
+struct mixed {
+    pthread_t thread;
+    unsigned long *keys;
+    unsigned long size;
+    unsigned long ops;
+    unsigned long long rng_state;
+    struct counters counters;
+    struct hist get;
+    struct hist put;
+    struct hist del;
+    struct hist range;
+};
+
+static void *run_mixed_thread(void *arg)
+{
+    struct mixed *m = arg;
+    RUMATI_AVL_TREE *tree = new_tree(m->size);
+    unsigned long i;
+
+    put_all(tree, m->keys, m->size);
+
+    counters_open(&m->counters);
+    counters_start(&m->counters);
+
+    for (i = 0; i < m->ops; i++){
+        unsigned long op = rng_r(&m->rng_state) % 100;
+        unsigned long *key = &m->keys[rng_r(&m->rng_state) % m->size];
+        uint64_t start = now_ns();
+
+        if (op < MIX_GET){
+            rumati_avl_get(tree, key);
+            hist_record(&m->get, now_ns() - start);
+        }else if (op < MIX_GET + MIX_PUT){
+            if (rumati_avl_put(tree, key, NULL) != RUMATI_AVL_OK){
+                die("out of memory");
+            }
+            hist_record(&m->put, now_ns() - start);
+        }else if (op < MIX_GET + MIX_PUT + MIX_DELETE){
+            rumati_avl_delete(tree, key, NULL);
+            hist_record(&m->del, now_ns() - start);
+        }else{
+            unsigned long *p = rumati_avl_get_greater_than_or_equal(tree, key);
+            int j;
+
+            for (j = 0; j < RANGE_LENGTH && p != NULL; j++){
+                p = rumati_avl_get_greater_than(tree, p);
+            }
+            hist_record(&m->range, now_ns() - start);
+        }
+    }
+
+    counters_stop(&m->counters);
+    counters_close(&m->counters);
+
+    rumati_avl_destroy(tree, destructor);
+    return NULL;
+}
+
+static void run_mixed(
+        unsigned long *keys,
+        unsigned long size,
+        unsigned long ops)
+{
+    struct mixed *m = calloc(threads, sizeof(*m));
+    int i;
+
+    if (m == NULL){
+        die("out of memory");
+    }
+
+    for (i = 0; i < threads; i++){
+        m[i].keys = keys;
+        m[i].size = size;
+        m[i].ops = ops;
+        m[i].rng_state = rng() | 1;
+        if (pthread_create(&m[i].thread, NULL, run_mixed_thread, &m[i]) != 0){
+            die("cannot create thread");
+        }
+    }
+    for (i = 0; i < threads; i++){
+        pthread_join(m[i].thread, NULL);
+        if (i > 0){
+            hist_merge(&m[0].get, &m[i].get);
+            hist_merge(&m[0].put, &m[i].put);
+            hist_merge(&m[0].del, &m[i].del);
+            hist_merge(&m[0].range, &m[i].range);
+            counters_add(&m[0].counters, &m[i].counters);
+        }
+    }
+
+    printf("%s\n    {\"workload\": \"mixed\", \"size\": %lu, "
+            "\"threads\": %d, \"ops\": %lu, \"peak_rss_kb\": %ld, ",
+            results++ ? "," : "", size, threads, ops * threads,
+            peak_rss_kb());
+    report_counters(&m[0].counters, ops * threads);
+    printf(", \"latency\": {");
+    report_hist("get", &m[0].get, 0);
+    report_hist("put", &m[0].put, 0);
+    report_hist("delete", &m[0].del, 0);
+    report_hist("range", &m[0].range, 1);
+    printf("\n    }}");
+    fflush(stdout);
+
+    free(m);
+}
+
+static void run_snapshot(
+        RUMATI_AVL_TREE *tree,
+        unsigned long *keys,
+        unsigned long size)
+{
+    RUMATI_AVL_TREE *loaded;
+    RUMATI_AVL_BACKGROUND_SAVE *save;
+    unsigned long *values, i;
+    double start;
+    FILE *f;
+
+    values = malloc(size * sizeof(*values));
+    f = tmpfile();
+    if (values == NULL || f == NULL){
+        die("cannot create snapshot");
+    }
+
+    rumati_avl_track_changes(tree);
+    start = phase_begin();
+    if (rumati_avl_save(tree, fileno(f), ulong_serializer) != RUMATI_AVL_OK){
+        die("save failed");
+    }
+    report("save", size, size, now() - start);
+
+    lseek(fileno(f), 0, SEEK_SET);
+    loaded = new_tree(size);
+    load_next = values;
+    start = phase_begin();
+    if (rumati_avl_load(loaded, fileno(f), ulong_deserializer,
+            destructor) != RUMATI_AVL_OK){
+        die("load failed");
+    }
+    report("load", size, size, now() - start);
+    rumati_avl_destroy(loaded, destructor);
+
+    lseek(fileno(f), 0, SEEK_SET);
+    start = phase_begin();
+    if (rumati_avl_save_background(tree, fileno(f), ulong_serializer,
+            &save) != RUMATI_AVL_OK){
+        die("background save failed");
+    }
+    report("save_background", size, size, now() - start);
+    if (rumati_avl_save_wait(save) != RUMATI_AVL_OK){
+        die("background save failed");
+    }
+
+    for (i = 0; i < size / 100; i++){
+        rumati_avl_put(tree, &keys[rng() % size], NULL);
+    }
+    lseek(fileno(f), 0, SEEK_SET);
+    start = phase_begin();
+    if (rumati_avl_save_delta(tree, fileno(f), ulong_serializer) !=
+            RUMATI_AVL_OK){
+        die("delta save failed");
+    }
+    report("save_delta", size, size, now() - start);
+
+    fclose(f);
+    free(values);
+}
+
+static void run(unsigned long size)
+{
+    RUMATI_AVL_TREE *tree;
+    unsigned long *keys, *zkeys;
+    unsigned long lookups = size;
+    unsigned long i, found;
+    struct zipf z;
+    double start;
+
+    if (lookups < MIN_LOOKUPS){
+        lookups = MIN_LOOKUPS;
+    }else if (lookups > MAX_LOOKUPS){
+        lookups = MAX_LOOKUPS;
+    }
+
+    /* keys in the tree are even, so odd keys miss */
+    keys = malloc(size * sizeof(*keys));
+    zkeys = malloc(size * sizeof(*zkeys));
+    if (keys == NULL || zkeys == NULL){
+        die("out of memory");
+    }
+    for (i = 0; i < size; i++){
+        keys[i] = i * 2;
+    }
+    zipf_init(&z, size);
+
+    /* first, before freed trees leave memory for the next one to reuse */
+    run_memory(keys, size);
+
+    tree = new_tree(size);
+    start = phase_begin();
+    put_all(tree, keys, size);
+    report("insert_sequential", size, size, now() - start);
+    rumati_avl_destroy(tree, destructor);
+
+    /* shuffle the keys, so that neighbouring nodes are far apart in memory */
+    for (i = size - 1; i > 0; i--){
+        unsigned long j = rng() % (i + 1);
+        unsigned long t = keys[i];
+        keys[i] = keys[j];
+        keys[j] = t;
+    }
+
+    for (i = 0; i < size; i++){
+        zkeys[i] = zipf_next(&z) * 2;
+    }
+    tree = new_tree(size);
+    start = phase_begin();
+    put_all(tree, zkeys, size);
+    report("insert_zipfian", size, size, now() - start);
+    rumati_avl_destroy(tree, destructor);
+
+    tree = new_tree(size);
+    start = phase_begin();
+    put_all(tree, keys, size);
+    report("insert_random", size, size, now() - start);
+
+    found = 0;
+    start = phase_begin();
+    for (i = 0; i < lookups; i++){
+        unsigned long key = (rng() % size) * 2;
+        found += rumati_avl_get(tree, &key) != NULL;
+    }
+    report("get_hit", size, lookups, now() - start);
+    if (found != lookups){
+        die("lookup of a key in the tree failed");
+    }
+
+    found = 0;
+    start = phase_begin();
+    for (i = 0; i < lookups; i++){
+        unsigned long key = (rng() % size) * 2 + 1;
+        found += rumati_avl_get(tree, &key) != NULL;
+    }
+    report("get_miss", size, lookups, now() - start);
+    if (found != 0){
+        die("lookup of a key not in the tree succeeded");
+    }
+
+    start = phase_begin();
+    for (i = 0; i < lookups; i++){
+        unsigned long key = zipf_next(&z) * 2;
+        found += rumati_avl_get(tree, &key) != NULL;
+    }
+    report("get_zipfian", size, lookups, now() - start);
+
+    start = phase_begin();
+    for (i = 0; i < lookups / RANGE_LENGTH; i++){
+        unsigned long key = rng() % (size * 2);
+        unsigned long *p = rumati_avl_get_greater_than_or_equal(tree, &key);
+        int j;
+
+        for (j = 0; j < RANGE_LENGTH && p != NULL; j++){
+            p = rumati_avl_get_greater_than(tree, p);
+        }
+    }
+    report("range", size, lookups / RANGE_LENGTH, now() - start);
+
+    start = phase_begin();
+    for (i = 0; i < lookups; i++){
+        unsigned long *key = &keys[rng() % size];
+        if (rumati_avl_delete(tree, key, NULL) != RUMATI_AVL_OK ||
+                rumati_avl_put(tree, key, NULL) != RUMATI_AVL_OK){
+            die("delete and put back failed");
+        }
+    }
+    report("delete_churn", size, lookups, now() - start);
+
+    run_mixed(keys, size, lookups);
+
+    run_snapshot(tree, keys, size);
+
+    start = phase_begin();
+    rumati_avl_destroy(tree, destructor);
+    report("teardown", size, size, now() - start);
+
+    free(zkeys);
+    free(keys);
+}
+
+int main(int argc, char *argv[])
+{
+    const int defaults = sizeof(default_sizes) / sizeof(default_sizes[0]);
+    unsigned long *sizes;
+    int count = 0;
+    int i;
+
+    /* room for every argument to be a size, or for the defaults */
+    sizes = malloc((argc > defaults ? argc : defaults) * sizeof(*sizes));
+    if (sizes == NULL){
+        die("out of memory");
+    }
+
+    for (i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc){
+            balance_name = argv[++i];
+            if (strcmp(balance_name, "avl") == 0){
+                balance = RUMATI_AVL_BALANCE_AVL;
+            }else if (strcmp(balance_name, "wavl") == 0){
+                balance = RUMATI_AVL_BALANCE_WAVL;
+            }else if (strcmp(balance_name, "rb") == 0){
+                balance = RUMATI_AVL_BALANCE_RB;
+            }else{
+                die("unknown balancing scheme");
+            }
+        }else if (strcmp(argv[i], "-c") == 0){
+            use_cache = 1;
+        }else if (strcmp(argv[i], "-i") == 0){
+            use_index = 1;
+        }else if (strcmp(argv[i], "-f") == 0){
+            use_filter = 1;
+        }else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc &&
+                (threads = atoi(argv[i + 1])) > 0){
+            i++;
+        }else if (argv[i][0] == '-' ||
+                (sizes[count++] = strtoul(argv[i], NULL, 0)) == 0){
+            fprintf(stderr, "usage: %s [-b avl|wavl|rb] [-c] [-i] [-f] "
+                    "[-t threads] [size ...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (count == 0){
+        count = defaults;
+        for (i = 0; i < count; i++){
+            sizes[i] = default_sizes[i];
+        }
+    }
+
+    counters_open(&main_counters);
+
+    printf("{\"balance\": \"%s\", \"prefetch\": %s, \"cache\": %s, "
+            "\"index\": %s, \"filter\": %s, \"results\": [",
+            balance_name,
+#ifdef RUMATI_AVL_PREFETCH
+            "true",
+#else
+            "false",
+#endif
+            use_cache ? "true" : "false",
+            use_index ? "true" : "false",
+            use_filter ? "true" : "false");
+
+    for (i = 0; i < count; i++){
+        run(sizes[i]);
+    }
+
+    printf("\n]}\n");
+    free(sizes);
+    return 0;
+}